@@ -57,8 +57,14 @@ extern const __declspec(selectany) GUID FspFsvrtDeviceClassGuid =
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'T', METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define FSP_FSCTL_TRANSACT_BATCH        \
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 't', METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+#define FSP_FSCTL_TRANSACT_RING         \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'R', METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 #define FSP_FSCTL_STOP                  \
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'S', METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSP_FSCTL_REGISTER_IO_BUFFERS   \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'B', METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSP_FSCTL_REQUEST_STATS         \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'Q', METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 #define FSP_FSCTL_VOLUME_PARAMS_PREFIX  "\\VolumeParams="
 
@@ -78,6 +84,9 @@ FSP_FSCTL_STATIC_ASSERT(FSP_FSCTL_VOLUME_NAME_SIZEMAX <= 260 * sizeof(WCHAR),
 #define FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN 16384
 #define FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN       FSP_FSCTL_TRANSACT_REQ_SIZEMAX
 
+#define FSP_FSCTL_IO_BUFFERS_SLOTSIZE_MAX       (1024 * 1024)
+#define FSP_FSCTL_IO_BUFFERS_SIZE_MAX           (64 * 1024 * 1024)
+
 #define FSP_FSCTL_TRANSACT_USERCONTEXT(s,i)     (((PUINT64)&(s).UserContext)[i])
 
 /* marshalling */
@@ -106,6 +115,8 @@ enum
     FspFsctlTransactLockControlKind,
     FspFsctlTransactQuerySecurityKind,
     FspFsctlTransactSetSecurityKind,
+    FspFsctlTransactCloseBatchKind,
+    FspFsctlTransactQueryOpenKind,
     FspFsctlTransactKindCount,
 };
 enum
@@ -120,10 +131,26 @@ enum
     FspFsctlIrpCapacityMinimum = 100,
     FspFsctlIrpCapacityMaximum = 1000,
     FspFsctlIrpCapacityDefault = 1000,
+    FspFsctlIrpCreditMaximum = 16384,   /* upper bound for credit-based IRP capacity */
+    FspFsctlSplitIoChunkSizeMinimum = 65536,
+    FspFsctlSplitIoFanOutMaximum = 64,
+    FspFsctlSplitIoFanOutDefault = 8,
+    FspFsctlCloseBatchSizeMaximum = 128,
+    FspFsctlWorkerThreadCountMaximum = 16,
+};
+enum
+{
+    FspFsctlIrpPriorityPaging = 0,      /* paging I/O from the memory manager */
+    FspFsctlIrpPriorityMetadata,        /* create, cleanup, close, information, directory, etc. */
+    FspFsctlIrpPriorityBulk,            /* non-paging read/write and everything else */
+    FspFsctlIrpPriorityCount,
+    FspFsctlIrpPriorityWeightPagingDefault = 8,
+    FspFsctlIrpPriorityWeightMetadataDefault = 4,
+    FspFsctlIrpPriorityWeightBulkDefault = 1,
 };
 typedef struct
 {
-    UINT16 Version;                     /* set to 0 */
+    UINT16 Version;                     /* set to 0 or sizeof(FSP_FSCTL_VOLUME_PARAMS) */
     /* volume information */
     UINT16 SectorSize;
     UINT16 SectorsPerAllocationUnit;
@@ -148,13 +175,29 @@ typedef struct
     UINT32 ReadOnlyVolume:1;
     /* kernel-mode flags */
     UINT32 PostCleanupOnDeleteOnly:1;   /* post Cleanup when deleting a file only */
-    UINT32 KmReservedFlags:5;
+    UINT32 CacheValidation:1;           /* cached I/O with finite FileInfoTimeout (revalidate cache) */
+    UINT32 QueryOpen:1;                 /* answer attribute-only opens with QueryOpen requests */
+    UINT32 PatchDirInfo:1;              /* patch cached DirInfo on create/delete/rename (sorted DirInfo) */
+    UINT32 KmReservedFlags:2;
     /* user-mode flags */
     UINT32 UmFileNodeIsUserContext2:1;  /* user mode: FileNode parameter is UserContext2 */
     UINT32 UmReservedFlags:15;
     WCHAR Prefix[FSP_FSCTL_VOLUME_PREFIX_SIZE / sizeof(WCHAR)]; /* UNC prefix (\Server\Share) */
     WCHAR FileSystemName[FSP_FSCTL_VOLUME_FSNAME_SIZE / sizeof(WCHAR)];
+    /* fields below are used only when Version is sizeof(FSP_FSCTL_VOLUME_PARAMS) */
+    /* pending IRP priority lanes */
+    UINT8 IrpPriorityWeights[FspFsctlIrpPriorityCount]; /* dequeue weight per lane (0: default) */
+    /* negative name lookup cache */
+    UINT32 NegativeLookupTimeout;       /* "file not found" result timeout (millis; 0: no caching) */
+    /* parallel split of large non-cached transfers */
+    UINT32 SplitIoChunkSize;            /* non-cached read/write chunk size (bytes; 0: no splitting) */
+    UINT32 SplitIoFanOut;               /* maximum chunks in flight per transfer (0: default) */
+    /* close batching */
+    UINT32 CloseBatchSize;              /* maximum closes per CloseBatch request (0: no batching) */
+    /* per-volume worker threads */
+    UINT32 WorkerThreadCount;           /* IRP work item threads (0: system work queue) */
 } FSP_FSCTL_VOLUME_PARAMS;
+#define FSP_FSCTL_VOLUME_PARAMS_V0_SIZE FIELD_OFFSET(FSP_FSCTL_VOLUME_PARAMS, IrpPriorityWeights)
 typedef struct
 {
     UINT64 TotalSize;
@@ -178,7 +221,7 @@ typedef struct
 {
     UINT16 Size;
     FSP_FSCTL_FILE_INFO FileInfo;
-    UINT64 NextOffset;
+    UINT64 NextOffset;                  /* opaque cursor: passed back as QueryDirectory.Offset */
     UINT8 Padding[24];
         /* make struct as big as FILE_ID_BOTH_DIR_INFORMATION; allows for in-place copying */
     WCHAR FileNameBuf[];
@@ -189,6 +232,11 @@ typedef struct
     UINT16 Size;
 } FSP_FSCTL_TRANSACT_BUF;
 typedef struct
+{
+    UINT64 UserContext;
+    UINT64 UserContext2;
+} FSP_FSCTL_CLOSE_BATCH_ITEM;
+typedef struct
 {
     UINT16 Version;
     UINT16 Size;
@@ -210,7 +258,7 @@ typedef struct
             UINT32 HasTraversePrivilege:1;  /* requestor has TOKEN_HAS_TRAVERSE_PRIVILEGE */
             UINT32 OpenTargetDirectory:1;   /* open target dir and report FILE_{EXISTS,DOES_NOT_EXIST} */
             UINT32 CaseSensitive:1;         /* FileName comparisons should be case-sensitive */
-        } Create;
+        } Create;                       /* also used by QueryOpen */
         struct
         {
             UINT64 UserContext;
@@ -230,6 +278,10 @@ typedef struct
             UINT64 UserContext2;
         } Close;
         struct
+        {
+            UINT32 Count;               /* number of FSP_FSCTL_CLOSE_BATCH_ITEM's in Buffer */
+        } CloseBatch;
+        struct
         {
             UINT64 UserContext;
             UINT64 UserContext2;
@@ -237,6 +289,8 @@ typedef struct
             UINT64 Offset;
             UINT32 Length;
             UINT32 Key;
+            UINT64 ReadAheadOffset;     /* predicted next read (sequential access) */
+            UINT32 ReadAheadLength;     /* 0: no prediction */
         } Read;
         struct
         {
@@ -401,10 +455,17 @@ typedef struct
         {
             FSP_FSCTL_TRANSACT_BUF SecurityDescriptor;  /* Size==0 means no security descriptor returned */
         } SetSecurity;
+        struct
+        {
+            FSP_FSCTL_FILE_INFO FileInfo;
+        } QueryOpen;
     } Rsp;
     FSP_FSCTL_DECLSPEC_ALIGN UINT8 Buffer[];
 } FSP_FSCTL_TRANSACT_RSP;
 #pragma warning(pop)
+FSP_FSCTL_STATIC_ASSERT(FspFsctlCloseBatchSizeMaximum * sizeof(FSP_FSCTL_CLOSE_BATCH_ITEM) <=
+    FSP_FSCTL_TRANSACT_REQ_BUFFER_SIZEMAX,
+    "A maximum size CloseBatch request must fit in FSP_FSCTL_TRANSACT_REQ_SIZEMAX.");
 static inline BOOLEAN FspFsctlTransactCanProduceRequest(
     FSP_FSCTL_TRANSACT_REQ *Request, PVOID RequestBufEnd)
 {
@@ -436,6 +497,21 @@ static inline FSP_FSCTL_TRANSACT_RSP *FspFsctlTransactProduceResponse(
     PVOID NextResponse = (PUINT8)Response + FSP_FSCTL_DEFAULT_ALIGN_UP(ResponseSize);
     return (FSP_FSCTL_TRANSACT_RSP *)NextResponse;
 }
+static inline FSP_FSCTL_TRANSACT_RSP *FspFsctlTransactProduceCreditResponse(
+    FSP_FSCTL_TRANSACT_RSP *Response, UINT32 IrpCredits)
+{
+    /*
+     * A credit response has a zero Hint and advertises the number of IRP's that
+     * the user-mode file system is prepared to accept (IoStatus.Information).
+     * The FSD uses it to adjust the capacity of its pending queue.
+     */
+    RtlZeroMemory(Response, sizeof *Response);
+    Response->Size = sizeof *Response;
+    Response->Kind = FspFsctlTransactReservedKind;
+    Response->Hint = 0;
+    Response->IoStatus.Information = IrpCredits;
+    return FspFsctlTransactProduceResponse(Response, Response->Size);
+}
 static inline FSP_FSCTL_TRANSACT_RSP *FspFsctlTransactConsumeResponse(
     FSP_FSCTL_TRANSACT_RSP *Response, PVOID ResponseBufEnd)
 {
@@ -446,6 +522,183 @@ static inline FSP_FSCTL_TRANSACT_RSP *FspFsctlTransactConsumeResponse(
     return NextResponse <= ResponseBufEnd ? (FSP_FSCTL_TRANSACT_RSP *)NextResponse : 0;
 }
 
+/*
+ * Shared memory transact ring.
+ *
+ * A transact ring is a bounded queue of fixed size slots that lives in memory shared between
+ * the FSD and the user mode file system. Every slot carries a sequence number that tells
+ * producers and consumers whether the slot is free or full; this allows any number of
+ * producers and consumers to operate on the ring concurrently without locks.
+ *
+ * The FSP_FSCTL_TRANSACT_RING transport uses two rings that are placed back to back in a single
+ * buffer: a request ring where the FSD produces requests for the dispatcher threads and a
+ * response ring where the dispatcher threads produce responses for the FSD. The FSD captures
+ * the SlotCount of the request ring when the transport starts and uses it for both rings.
+ *
+ * When the FSD is about to wait for responses it sets the Waiting field of the response ring;
+ * a producer that finds Waiting set must clear it and signal the ResponseEvent. The FSD signals
+ * the RequestEvent after it has produced one or more requests.
+ *
+ * A producer that finds the response ring full may set the ProducerWaiting field of the
+ * response ring, signal the ResponseEvent and wait on the SpaceEvent; the FSD clears
+ * ProducerWaiting and signals the SpaceEvent after it has consumed responses.
+ */
+#define FSP_FSCTL_TRANSACT_RING_SLOT_SIZE       4096
+#define FSP_FSCTL_TRANSACT_RING_SLOTCOUNT_MAX   256
+#define FSP_FSCTL_TRANSACT_RING_RETRY_MAX       1024
+typedef struct
+{
+    volatile LONG64 Sequence;
+    UINT8 Padding[56];
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 Buffer[FSP_FSCTL_TRANSACT_RING_SLOT_SIZE - 64];
+} FSP_FSCTL_TRANSACT_RING_SLOT;
+FSP_FSCTL_STATIC_ASSERT(FSP_FSCTL_TRANSACT_REQ_SIZEMAX <= FSP_FSCTL_TRANSACT_RING_SLOT_SIZE - 64,
+    "FSP_FSCTL_TRANSACT_RING_SLOT::Buffer must fit a maximum size request.");
+FSP_FSCTL_STATIC_ASSERT(FSP_FSCTL_TRANSACT_RSP_SIZEMAX <= FSP_FSCTL_TRANSACT_RING_SLOT_SIZE - 64,
+    "FSP_FSCTL_TRANSACT_RING_SLOT::Buffer must fit a maximum size response.");
+typedef struct
+{
+    UINT32 Version;                     /* set to 0 */
+    UINT32 SlotCount;                   /* power of 2 */
+    UINT8 Padding0[56];
+    volatile LONG64 Head;               /* next position to consume */
+    UINT8 Padding1[56];
+    volatile LONG64 Tail;               /* next position to produce */
+    UINT8 Padding2[56];
+    volatile LONG Waiting;              /* consumer is waiting on the ring event */
+    volatile LONG ProducerWaiting;      /* producer is waiting for a free slot */
+    UINT8 Padding3[56];
+    FSP_FSCTL_TRANSACT_RING_SLOT Slots[];
+} FSP_FSCTL_TRANSACT_RING;
+typedef struct
+{
+    UINT64 RequestEvent;                /* event HANDLE: signaled when requests are produced */
+    UINT64 ResponseEvent;               /* event HANDLE: signaled when responses are produced */
+    UINT64 SpaceEvent;                  /* event HANDLE: signaled when responses are consumed */
+} FSP_FSCTL_TRANSACT_RING_PARAMS;
+
+/*
+ * Preregistered I/O buffers: a page aligned region of SlotCount * SlotSize bytes in the
+ * file system process. Read, Write and QueryDirectory requests that fit in a slot receive
+ * the address of a slot in their Address field instead of a per-request mapping of the
+ * originating buffer. Registration is once per volume and lasts until the volume is deleted;
+ * the region must remain valid until then.
+ */
+typedef struct
+{
+    UINT64 Address;                     /* region address; page aligned */
+    UINT32 SlotSize;                    /* page multiple; FSP_FSCTL_IO_BUFFERS_SLOTSIZE_MAX max */
+    UINT32 SlotCount;
+} FSP_FSCTL_IO_BUFFERS_PARAMS;
+
+/*
+ * Request allocation statistics (driver wide). Requests are allocated from per size class
+ * lookaside lists; Hits counts allocations satisfied by a lookaside list and Misses counts
+ * allocations that went to pool. Requests too large for any class are counted in
+ * PoolAllocates. The lookaside list counts are approximate.
+ */
+#define FSP_FSCTL_REQUEST_CLASS_COUNT   3
+typedef struct
+{
+    UINT32 Size;                        /* class allocation size */
+    UINT32 Reserved;
+    UINT64 Hits;
+    UINT64 Misses;
+} FSP_FSCTL_REQUEST_CLASS_STATS;
+typedef struct
+{
+    FSP_FSCTL_REQUEST_CLASS_STATS Class[FSP_FSCTL_REQUEST_CLASS_COUNT];
+    UINT64 PoolAllocates;
+} FSP_FSCTL_REQUEST_STATS;
+
+static inline SIZE_T FspFsctlTransactRingSize(ULONG SlotCount)
+{
+    return sizeof(FSP_FSCTL_TRANSACT_RING) + SlotCount * sizeof(FSP_FSCTL_TRANSACT_RING_SLOT);
+}
+static inline VOID FspFsctlTransactRingInitialize(FSP_FSCTL_TRANSACT_RING *Ring, ULONG SlotCount)
+{
+    RtlZeroMemory(Ring, sizeof *Ring);
+    Ring->SlotCount = SlotCount;
+    for (ULONG Index = 0; SlotCount > Index; Index++)
+        Ring->Slots[Index].Sequence = Index;
+}
+static inline BOOLEAN FspFsctlTransactRingCanProduce(
+    FSP_FSCTL_TRANSACT_RING *Ring, ULONG SlotCount)
+{
+    LONG64 Position = Ring->Tail;
+    return Ring->Slots[Position & (SlotCount - 1)].Sequence == Position;
+}
+static inline BOOLEAN FspFsctlTransactRingCanConsume(
+    FSP_FSCTL_TRANSACT_RING *Ring, ULONG SlotCount)
+{
+    LONG64 Position = Ring->Head;
+    return Ring->Slots[Position & (SlotCount - 1)].Sequence == Position + 1;
+}
+static inline PVOID FspFsctlTransactRingProduceBegin(
+    FSP_FSCTL_TRANSACT_RING *Ring, ULONG SlotCount, PLONG64 PPosition)
+{
+    LONG64 Position = Ring->Tail, Difference;
+    FSP_FSCTL_TRANSACT_RING_SLOT *Slot;
+    /* bounded retries: the FSD must make progress even if the ring is scribbled over */
+    for (ULONG Retry = 0; FSP_FSCTL_TRANSACT_RING_RETRY_MAX > Retry; Retry++)
+    {
+        Slot = &Ring->Slots[Position & (SlotCount - 1)];
+        Difference = Slot->Sequence - Position;
+        if (0 == Difference)
+        {
+            LONG64 PrevPosition = InterlockedCompareExchange64(&Ring->Tail, Position + 1, Position);
+            if (PrevPosition == Position)
+            {
+                *PPosition = Position;
+                return Slot->Buffer;
+            }
+            Position = PrevPosition;
+        }
+        else if (0 > Difference)
+            return 0; /* ring is full */
+        else
+            Position = Ring->Tail;
+    }
+    return 0;
+}
+static inline VOID FspFsctlTransactRingProduceEnd(
+    FSP_FSCTL_TRANSACT_RING *Ring, ULONG SlotCount, LONG64 Position)
+{
+    InterlockedExchange64(&Ring->Slots[Position & (SlotCount - 1)].Sequence, Position + 1);
+}
+static inline PVOID FspFsctlTransactRingConsumeBegin(
+    FSP_FSCTL_TRANSACT_RING *Ring, ULONG SlotCount, PLONG64 PPosition)
+{
+    LONG64 Position = Ring->Head, Difference;
+    FSP_FSCTL_TRANSACT_RING_SLOT *Slot;
+    /* bounded retries: the FSD must make progress even if the ring is scribbled over */
+    for (ULONG Retry = 0; FSP_FSCTL_TRANSACT_RING_RETRY_MAX > Retry; Retry++)
+    {
+        Slot = &Ring->Slots[Position & (SlotCount - 1)];
+        Difference = Slot->Sequence - (Position + 1);
+        if (0 == Difference)
+        {
+            LONG64 PrevPosition = InterlockedCompareExchange64(&Ring->Head, Position + 1, Position);
+            if (PrevPosition == Position)
+            {
+                *PPosition = Position;
+                return Slot->Buffer;
+            }
+            Position = PrevPosition;
+        }
+        else if (0 > Difference)
+            return 0; /* ring is empty */
+        else
+            Position = Ring->Head;
+    }
+    return 0;
+}
+static inline VOID FspFsctlTransactRingConsumeEnd(
+    FSP_FSCTL_TRANSACT_RING *Ring, ULONG SlotCount, LONG64 Position)
+{
+    InterlockedExchange64(&Ring->Slots[Position & (SlotCount - 1)].Sequence, Position + SlotCount);
+}
+
 #if !defined(WINFSP_SYS_INTERNAL)
 FSP_API NTSTATUS FspFsctlCreateVolume(PWSTR DevicePath,
     const FSP_FSCTL_VOLUME_PARAMS *VolumeParams,
@@ -455,9 +708,16 @@ FSP_API NTSTATUS FspFsctlTransact(HANDLE VolumeHandle,
     PVOID ResponseBuf, SIZE_T ResponseBufSize,
     PVOID RequestBuf, SIZE_T *PRequestBufSize,
     BOOLEAN Batch);
+FSP_API NTSTATUS FspFsctlTransactRing(HANDLE VolumeHandle,
+    const FSP_FSCTL_TRANSACT_RING_PARAMS *RingParams,
+    PVOID RingBuf, SIZE_T RingBufSize);
+FSP_API NTSTATUS FspFsctlRegisterIoBuffers(HANDLE VolumeHandle,
+    PVOID Buffer, UINT32 SlotSize, UINT32 SlotCount);
 FSP_API NTSTATUS FspFsctlStop(HANDLE VolumeHandle);
 FSP_API NTSTATUS FspFsctlGetVolumeList(PWSTR DevicePath,
     PWCHAR VolumeListBuf, PSIZE_T PVolumeListSize);
+FSP_API NTSTATUS FspFsctlGetRequestStats(PWSTR DevicePath,
+    FSP_FSCTL_REQUEST_STATS *Stats);
 FSP_API NTSTATUS FspFsctlPreflight(PWSTR DevicePath);
 #endif
 
@@ -122,6 +122,20 @@ typedef enum
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE = 0,
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE,
 } FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY;
+/**
+ * I/O vector segment.
+ *
+ * Describes one part of the buffer of a ReadEx or WriteEx operation.
+ *
+ * @see
+ *     FspFileSystemSetIoVecChunkSize
+ */
+typedef struct _FSP_FILE_SYSTEM_IOVEC
+{
+    PVOID Buffer;                       /* segment data */
+    ULONG Length;                       /* segment length */
+    UINT64 Offset;                      /* file offset of segment */
+} FSP_FILE_SYSTEM_IOVEC;
 /**
  * @class FSP_FILE_SYSTEM
  * File system interface.
@@ -637,6 +651,18 @@ typedef struct _FSP_FILE_SYSTEM_INTERFACE
      *     which is used solely by the file system to locate directory entries. However the
      *     special value 0 indicates that the read should start from the first entries. The first
      *     two entries returned by ReadDirectory should always be the "." and ".." entries.
+     *
+     *     A non-zero Offset is always the NextOffset of a directory entry previously returned
+     *     by ReadDirectory; the read should continue with the entry that follows it. File systems
+     *     should treat this value as an opaque cursor that allows them to seek to that entry
+     *     directly (for example a key or index number), rather than scan the directory for it;
+     *     otherwise listing a large directory page by page takes quadratic time.
+     *
+     *     If the volume sets the PatchDirInfo parameter the FSD patches its cached directory
+     *     listings when files are created, deleted or renamed. In this case ReadDirectory must
+     *     return all entries other than "." and ".." sorted by file name in ordinal order (as
+     *     RtlCompareUnicodeString; when CaseSensitiveSearch is not set names are compared after
+     *     conversion to upper case) and must use the IndexNumber of every entry as its NextOffset.
      * @param Length
      *     Length of data to read.
      * @param Pattern
@@ -773,15 +799,179 @@ typedef struct _FSP_FILE_SYSTEM_INTERFACE
         FSP_FSCTL_TRANSACT_REQ *Request,
         PVOID FileNode,
         PWSTR FileName, PVOID Buffer, SIZE_T Size);
+    /**
+     * Read a file using an I/O vector.
+     *
+     * When present this operation is used instead of Read. The read buffer is described
+     * by an array of segments; segment boundaries fall on file offsets that are multiples
+     * of the file system's I/O vector chunk size (see FspFileSystemSetIoVecChunkSize).
+     * This allows a file system that stores file data in fixed size chunks to transfer
+     * each chunk directly into its segment without staging it in an intermediate buffer.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param Request
+     *     The request posted by the kernel mode FSD. This is the completion context of the
+     *     operation: when the operation returns STATUS_PENDING, it must be completed by sending
+     *     a response for this request with FspFileSystemSendResponse.
+     * @param FileNode
+     *     The file node of the file to be read.
+     * @param IoVec
+     *     Array of segments that together make up the read buffer, in file offset order. The
+     *     array is only valid during this call; the segment buffers remain valid until the
+     *     request is completed.
+     * @param IoVecCount
+     *     Number of segments in the IoVec array.
+     * @param PBytesTransferred [out]
+     *     Pointer to a memory location that will receive the actual number of bytes read.
+     * @return
+     *     STATUS_SUCCESS or error code. STATUS_PENDING is supported allowing for asynchronous
+     *     operation.
+     * @see
+     *     Read
+     */
+    NTSTATUS (*ReadEx)(FSP_FILE_SYSTEM *FileSystem,
+        FSP_FSCTL_TRANSACT_REQ *Request,
+        PVOID FileNode, FSP_FILE_SYSTEM_IOVEC *IoVec, ULONG IoVecCount,
+        PULONG PBytesTransferred);
+    /**
+     * Write a file using an I/O vector.
+     *
+     * When present this operation is used instead of Write. The segments are laid out
+     * as for ReadEx.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param Request
+     *     The request posted by the kernel mode FSD. This is the completion context of the
+     *     operation: when the operation returns STATUS_PENDING, it must be completed by sending
+     *     a response for this request with FspFileSystemSendResponse.
+     * @param FileNode
+     *     The file node of the file to be written.
+     * @param IoVec
+     *     Array of segments that together make up the data to write, in file offset order. The
+     *     array is only valid during this call; the segment buffers remain valid until the
+     *     request is completed.
+     * @param IoVecCount
+     *     Number of segments in the IoVec array.
+     * @param WriteToEndOfFile
+     *     When TRUE the file system must write to the current end of file. In this case there
+     *     is a single segment and its Offset is -1.
+     * @param ConstrainedIo
+     *     When TRUE the file system must not extend the file (i.e. change the file size).
+     * @param PBytesTransferred [out]
+     *     Pointer to a memory location that will receive the actual number of bytes written.
+     * @param FileInfo [out]
+     *     Pointer to a structure that will receive the file information on successful return
+     *     from this call. This information includes file attributes, file times, etc.
+     * @return
+     *     STATUS_SUCCESS or error code. STATUS_PENDING is supported allowing for asynchronous
+     *     operation.
+     * @see
+     *     Write
+     */
+    NTSTATUS (*WriteEx)(FSP_FILE_SYSTEM *FileSystem,
+        FSP_FSCTL_TRANSACT_REQ *Request,
+        PVOID FileNode, FSP_FILE_SYSTEM_IOVEC *IoVec, ULONG IoVecCount,
+        BOOLEAN WriteToEndOfFile, BOOLEAN ConstrainedIo,
+        PULONG PBytesTransferred, FSP_FSCTL_FILE_INFO *FileInfo);
+    /**
+     * Hint that a file is being read sequentially.
+     *
+     * The FSD tracks the reads on every open handle. When a non-cached read continues a
+     * sequential run, this operation is called just before the Read (or ReadEx) for that
+     * request with the range that is expected to be read next. A file system may use this
+     * to start fetching the range in the background (e.g. from a network or object store).
+     *
+     * This operation is advisory: the predicted range may never be read, it may extend
+     * beyond the end of file and the file system is free to ignore it. It should not
+     * block.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param FileNode
+     *     The file node of the file being read.
+     * @param Offset
+     *     Offset within the file of the range expected to be read next.
+     * @param Length
+     *     Length of the range expected to be read next.
+     * @return
+     *     STATUS_SUCCESS or error code. The return value is ignored.
+     * @see
+     *     Read
+     */
+    NTSTATUS (*ReadAhead)(FSP_FILE_SYSTEM *FileSystem,
+        PVOID FileNode, UINT64 Offset, ULONG Length);
+    /**
+     * Close multiple files.
+     *
+     * This operation is only used when the file system has set VolumeParams.CloseBatchSize.
+     * In this case the FSD accumulates closes and delivers up to CloseBatchSize of them in
+     * a single request. If this operation is not present, Close is called for every file
+     * node in the batch instead.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param Request
+     *     The request posted by the kernel mode FSD.
+     * @param FileNodes
+     *     Array of file nodes of the files or directories to be closed. A file node may
+     *     appear more than once (once for every closed handle).
+     * @param Count
+     *     Number of file nodes in the FileNodes array.
+     * @see
+     *     Close
+     */
+    VOID (*CloseBatch)(FSP_FILE_SYSTEM *FileSystem,
+        FSP_FSCTL_TRANSACT_REQ *Request,
+        PVOID *FileNodes, ULONG Count);
+    /**
+     * Get file or directory information given a file name.
+     *
+     * This operation is only used when the file system has set VolumeParams.QueryOpen.
+     * In this case opens that only query file attributes (e.g. GetFileAttributes) are
+     * answered by this operation, without an Open/Close pair. The FSD has already checked
+     * FILE_READ_ATTRIBUTES access using GetSecurityByName. If this operation is not present,
+     * such opens go through Open and Close as usual.
+     *
+     * @param FileSystem
+     *     The file system on which this request is posted.
+     * @param FileName
+     *     The name of the file or directory to get information for.
+     * @param FileInfo [out]
+     *     Pointer to a structure that will receive the file information on successful return
+     *     from this call. This information includes file attributes, file times, etc.
+     * @return
+     *     STATUS_SUCCESS, STATUS_REPARSE or error code.
+     * @see
+     *     GetSecurityByName
+     */
+    NTSTATUS (*GetFileInfoByName)(FSP_FILE_SYSTEM *FileSystem,
+        PWSTR FileName, FSP_FSCTL_FILE_INFO *FileInfo);
 
     /*
      * This ensures that this interface will always contain 64 function pointers.
      * Please update when changing the interface as it is important for future compatibility.
      */
-    NTSTATUS (*Reserved[41])();
+    NTSTATUS (*Reserved[36])();
 } FSP_FILE_SYSTEM_INTERFACE;
 FSP_FSCTL_STATIC_ASSERT(sizeof(FSP_FILE_SYSTEM_INTERFACE) == 64 * sizeof(NTSTATUS (*)()),
     "FSP_FILE_SYSTEM_INTERFACE must have 64 entries.");
+/**
+ * File system dispatcher parameters.
+ *
+ * @see FspFileSystemStartDispatcherEx
+ */
+typedef struct _FSP_FILE_SYSTEM_DISPATCHER_PARAMS
+{
+    ULONG ThreadCount;                  /* number of dispatcher threads (0 for default) */
+    ULONG BatchCount;                   /* requests per transact (0/1: no batching) */
+    ULONG RingSlotCount;                /* shared memory transact ring slots (0: no ring) */
+    ULONG ThreadCountMax;               /* elastic pool maximum threads (0: fixed pool) */
+    ULONG ThreadIdleTimeout;            /* elastic pool idle thread timeout (millis) */
+    ULONG IrpCredits;                   /* credit-based IRP capacity (0: fixed IrpCapacity) */
+    ULONG Reserved[10];
+} FSP_FILE_SYSTEM_DISPATCHER_PARAMS;
 typedef struct _FSP_FILE_SYSTEM
 {
     UINT16 Version;
@@ -800,6 +990,12 @@ typedef struct _FSP_FILE_SYSTEM
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY OpGuardStrategy;
     SRWLOCK OpGuardLock;
     BOOLEAN UmFileNodeIsUserContext2;
+    ULONG DispatcherBatchCount;
+    PVOID DispatcherRing;
+    PVOID DispatcherPool;
+    ULONG DispatcherIrpCredits;
+    PVOID DispatcherPending;
+    ULONG IoVecChunkSize;
 } FSP_FILE_SYSTEM;
 /**
  * Create a file system object.
@@ -867,6 +1063,43 @@ FSP_API VOID FspFileSystemRemoveMountPoint(FSP_FILE_SYSTEM *FileSystem);
  *     STATUS_SUCCESS or error code.
  */
 FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount);
+/**
+ * Start the file system dispatcher using extended parameters.
+ *
+ * This call is similar to FspFileSystemStartDispatcher, but allows the dispatcher to be further
+ * configured. In particular when DispatcherParams->BatchCount is greater than 1, each dispatcher
+ * thread uses the FSP_FSCTL_TRANSACT_BATCH mode: it receives multiple requests from the FSD in a
+ * single transact call and returns all their responses together in its next transact call. This
+ * reduces the number of kernel-user transitions when the file system is under load.
+ *
+ * When DispatcherParams->RingSlotCount is not 0, the dispatcher uses the FSP_FSCTL_TRANSACT_RING
+ * transport instead. A single thread services the shared memory request and response rings in
+ * the FSD, while the dispatcher threads consume requests from and produce responses to the rings
+ * without issuing a transact call per request. The RingSlotCount is rounded up to a power of 2
+ * and limited to FSP_FSCTL_TRANSACT_RING_SLOTCOUNT_MAX. The BatchCount is ignored in this mode.
+ *
+ * When DispatcherParams->ThreadCountMax is greater than the ThreadCount, the dispatcher uses an
+ * elastic thread pool (except in ring mode). The pool starts with ThreadCount threads, which
+ * are never retired. Whenever a thread receives requests and finds that no other thread is left
+ * waiting for new requests, the pool grows by one thread up to ThreadCountMax. Threads beyond
+ * ThreadCount exit after being idle for ThreadIdleTimeout milliseconds.
+ *
+ * When DispatcherParams->IrpCredits is non-zero (except in ring mode), every transact advertises
+ * to the FSD how many IRP's the file system can accept: IrpCredits less the number of operations
+ * that have returned STATUS_PENDING and have not yet been completed with FspFileSystemSendResponse.
+ * The FSD uses this value as the capacity of its pending queue (within FspFsctlIrpCapacityMinimum
+ * and FspFsctlIrpCreditMaximum), so that a file system that falls behind receives fewer requests.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param DispatcherParams
+ *     Dispatcher parameters. A value of NULL is equivalent to FspFileSystemStartDispatcher with a
+ *     ThreadCount of 0.
+ * @return
+ *     STATUS_SUCCESS or error code.
+ */
+FSP_API NTSTATUS FspFileSystemStartDispatcherEx(FSP_FILE_SYSTEM *FileSystem,
+    const FSP_FILE_SYSTEM_DISPATCHER_PARAMS *DispatcherParams);
 /**
  * Stop the file system dispatcher.
  *
@@ -927,6 +1160,24 @@ VOID FspFileSystemSetOperationGuard(FSP_FILE_SYSTEM *FileSystem,
     FileSystem->EnterOperation = EnterOperation;
     FileSystem->LeaveOperation = LeaveOperation;
 }
+/**
+ * Set the I/O vector chunk size.
+ *
+ * ReadEx and WriteEx buffers are split into segments at file offsets that are multiples of
+ * the chunk size. The default chunk size of 0 describes every buffer with a single segment.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param ChunkSize
+ *     The chunk size in bytes.
+ * @see
+ *     FSP_FILE_SYSTEM_IOVEC
+ */
+static inline
+VOID FspFileSystemSetIoVecChunkSize(FSP_FILE_SYSTEM *FileSystem, ULONG ChunkSize)
+{
+    FileSystem->IoVecChunkSize = ChunkSize;
+}
 /**
  * Set file system locking strategy.
  *
@@ -988,6 +1239,10 @@ FSP_API NTSTATUS FspFileSystemOpCleanup(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
 FSP_API NTSTATUS FspFileSystemOpClose(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
+FSP_API NTSTATUS FspFileSystemOpCloseBatch(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
+FSP_API NTSTATUS FspFileSystemOpQueryOpen(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
 FSP_API NTSTATUS FspFileSystemOpRead(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
 FSP_API NTSTATUS FspFileSystemOpWrite(FSP_FILE_SYSTEM *FileSystem,
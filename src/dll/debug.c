@@ -341,6 +341,23 @@ FSP_API VOID FspDebugLogRequest(FSP_FSCTL_TRANSACT_REQ *Request)
                 Request->Req.Close.UserContext, Request->Req.Close.UserContext2,
                 UserContextBuf));
         break;
+    case FspFsctlTransactCloseBatchKind:
+        FspDebugLog("%S[TID=%04lx]: %p: >>CloseBatch Count=%lu\n",
+            FspDiagIdent(), GetCurrentThreadId(), Request->Hint,
+            Request->Req.CloseBatch.Count);
+        break;
+    case FspFsctlTransactQueryOpenKind:
+        FspDebugLog("%S[TID=%04lx]: %p: >>QueryOpen [%c%c-%c] \"%S\", "
+            "CreateOptions=%lx, AccessToken=%p, DesiredAccess=%lx\n",
+            FspDiagIdent(), GetCurrentThreadId(), Request->Hint,
+            Request->Req.Create.UserMode ? 'U' : 'K',
+            Request->Req.Create.HasTraversePrivilege ? 'T' : '-',
+            Request->Req.Create.CaseSensitive ? 'C' : '-',
+            (PWSTR)Request->Buffer,
+            Request->Req.Create.CreateOptions & 0xffffff,
+            (PVOID)Request->Req.Create.AccessToken,
+            Request->Req.Create.DesiredAccess);
+        break;
     case FspFsctlTransactReadKind:
         FspDebugLog("%S[TID=%04lx]: %p: >>Read %s%S%s%s, "
             "Address=%p, Offset=%lx:%lx, Length=%ld, Key=%lx\n",
@@ -672,6 +689,19 @@ FSP_API VOID FspDebugLogResponse(FSP_FSCTL_TRANSACT_RSP *Response)
     case FspFsctlTransactCloseKind:
         FspDebugLogResponseStatus(Response, "Close");
         break;
+    case FspFsctlTransactCloseBatchKind:
+        FspDebugLogResponseStatus(Response, "CloseBatch");
+        break;
+    case FspFsctlTransactQueryOpenKind:
+        if (!NT_SUCCESS(Response->IoStatus.Status))
+            FspDebugLogResponseStatus(Response, "QueryOpen");
+        else
+            FspDebugLog("%S[TID=%04lx]: %p: <<QueryOpen IoStatus=%lx[%ld] "
+                "FileInfo=%s\n",
+                FspDiagIdent(), GetCurrentThreadId(), Response->Hint,
+                Response->IoStatus.Status, Response->IoStatus.Information,
+                FspDebugLogFileInfoString(&Response->Rsp.QueryOpen.FileInfo, InfoBuf));
+        break;
     case FspFsctlTransactReadKind:
         FspDebugLogResponseStatus(Response, "Read");
         break;
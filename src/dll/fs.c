@@ -20,8 +20,49 @@
 enum
 {
     FspFileSystemDispatcherThreadCountMin = 2,
+    FspFileSystemDispatcherBatchCountMax = 64,
+    FspFileSystemDispatcherThreadIdleTimeoutDefault = 30000,
+    FspFileSystemDispatcherRingSpinCount = 64,
+    FspFileSystemDispatcherRingSpaceTimeout = 100,
+    FspFileSystemDispatcherPendingBucketCount = 64,
 };
 
+typedef struct _FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY
+{
+    struct _FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY *Next;
+    UINT64 Hint;
+    BOOLEAN Counted;
+} FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY;
+
+typedef struct
+{
+    SRWLOCK Lock;
+    LONG Count;
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY *Buckets[FspFileSystemDispatcherPendingBucketCount];
+} FSP_FILE_SYSTEM_DISPATCHER_PENDING;
+
+typedef struct
+{
+    FSP_FSCTL_TRANSACT_RING_PARAMS RingParams;
+    HANDLE RequestEvent, ResponseEvent, SpaceEvent;
+    ULONG SlotCount;
+    SIZE_T RingBufSize;
+    FSP_FSCTL_TRANSACT_RING *RequestRing, *ResponseRing;
+    LONG SpaceWaiterCount;
+    LONG Stopped;
+} FSP_FILE_SYSTEM_DISPATCHER_RING;
+
+typedef struct
+{
+    SRWLOCK Lock;
+    ULONG ThreadCount, ThreadCountMax;
+    ULONG ElasticThreadCount;
+    ULONG ThreadIdleTimeout;
+    HANDLE ElasticExitEvent;
+    BOOLEAN Stopped;
+    LONG IdleThreadCount;
+} FSP_FILE_SYSTEM_DISPATCHER_POOL;
+
 static FSP_FILE_SYSTEM_INTERFACE FspFileSystemNullInterface;
 
 static INIT_ONCE FspFileSystemInitOnce = INIT_ONCE_STATIC_INIT;
@@ -55,6 +96,8 @@ static BOOL WINAPI FspFileSystemInitialize(
     return TRUE;
 }
 
+static VOID FspFileSystemDeleteDispatcherPending(FSP_FILE_SYSTEM_DISPATCHER_PENDING *Pending);
+
 FSP_API NTSTATUS FspFileSystemCreate(PWSTR DevicePath,
     const FSP_FSCTL_VOLUME_PARAMS *VolumeParams,
     const FSP_FILE_SYSTEM_INTERFACE *Interface,
@@ -99,6 +142,8 @@ FSP_API NTSTATUS FspFileSystemCreate(PWSTR DevicePath,
     FileSystem->Operations[FspFsctlTransactFileSystemControlKind] = FspFileSystemOpFileSystemControl;
     FileSystem->Operations[FspFsctlTransactQuerySecurityKind] = FspFileSystemOpQuerySecurity;
     FileSystem->Operations[FspFsctlTransactSetSecurityKind] = FspFileSystemOpSetSecurity;
+    FileSystem->Operations[FspFsctlTransactCloseBatchKind] = FspFileSystemOpCloseBatch;
+    FileSystem->Operations[FspFsctlTransactQueryOpenKind] = FspFileSystemOpQueryOpen;
     FileSystem->Interface = Interface;
 
     FileSystem->OpGuardStrategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE;
@@ -117,6 +162,7 @@ FSP_API VOID FspFileSystemDelete(FSP_FILE_SYSTEM *FileSystem)
 {
     FspFileSystemRemoveMountPoint(FileSystem);
     CloseHandle(FileSystem->VolumeHandle);
+    FspFileSystemDeleteDispatcherPending(FileSystem->DispatcherPending);
     MemFree(FileSystem);
 }
 
@@ -238,16 +284,610 @@ FSP_API VOID FspFileSystemRemoveMountPoint(FSP_FILE_SYSTEM *FileSystem)
     }
 }
 
+static NTSTATUS FspFileSystemCreateDispatcherPending(FSP_FILE_SYSTEM_DISPATCHER_PENDING **PPending)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING *Pending;
+
+    *PPending = 0;
+
+    Pending = MemAlloc(sizeof *Pending);
+    if (0 == Pending)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    memset(Pending, 0, sizeof *Pending);
+
+    InitializeSRWLock(&Pending->Lock);
+
+    *PPending = Pending;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FspFileSystemDeleteDispatcherPending(FSP_FILE_SYSTEM_DISPATCHER_PENDING *Pending)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY *Entry, *NextEntry;
+
+    if (0 == Pending)
+        return;
+
+    for (ULONG Index = 0; FspFileSystemDispatcherPendingBucketCount > Index; Index++)
+        for (Entry = Pending->Buckets[Index]; 0 != Entry; Entry = NextEntry)
+        {
+            NextEntry = Entry->Next;
+            if (Entry->Counted)
+                MemFree(Entry);
+        }
+
+    MemFree(Pending);
+}
+
+static inline ULONG FspFileSystemDispatcherPendingIndex(UINT64 Hint)
+{
+    /* hints are FSD IRP addresses; drop the low bits that are the same for all of them */
+    return (ULONG)((Hint >> 6) ^ (Hint >> 16)) % FspFileSystemDispatcherPendingBucketCount;
+}
+
+static FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY *FspFileSystemDispatcherPendingUnlink(
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING *Pending, UINT64 Hint,
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY *Match)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY **P, *Entry;
+
+    for (P = &Pending->Buckets[FspFileSystemDispatcherPendingIndex(Hint)]; 0 != (Entry = *P);
+        P = &Entry->Next)
+        if (0 != Match ? Match == Entry : Hint == Entry->Hint)
+        {
+            *P = Entry->Next;
+            return Entry;
+        }
+
+    return 0;
+}
+
+/*
+ * IRP credits count only the requests that the dispatcher has seen returning STATUS_PENDING
+ * and that have not been answered yet. Every request is entered before it is dispatched (in
+ * a stack entry) so that a response sent from another thread before the operation returns is
+ * matched; the entry is replaced by a counted heap entry only if the operation returns
+ * STATUS_PENDING and the response has not been sent yet.
+ */
+static VOID FspFileSystemDispatcherPendingEnter(FSP_FILE_SYSTEM_DISPATCHER_PENDING *Pending,
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY *Entry, UINT64 Hint)
+{
+    ULONG Index = FspFileSystemDispatcherPendingIndex(Hint);
+
+    Entry->Hint = Hint;
+    Entry->Counted = FALSE;
+
+    AcquireSRWLockExclusive(&Pending->Lock);
+    Entry->Next = Pending->Buckets[Index];
+    Pending->Buckets[Index] = Entry;
+    ReleaseSRWLockExclusive(&Pending->Lock);
+}
+
+static VOID FspFileSystemDispatcherPendingLeave(FSP_FILE_SYSTEM_DISPATCHER_PENDING *Pending,
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY *Entry, BOOLEAN Pended)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY *NewEntry = 0;
+    ULONG Index;
+
+    if (Pended)
+    {
+        /* if allocation fails the request is simply not counted */
+        NewEntry = MemAlloc(sizeof *NewEntry);
+        if (0 != NewEntry)
+        {
+            NewEntry->Hint = Entry->Hint;
+            NewEntry->Counted = TRUE;
+        }
+    }
+
+    AcquireSRWLockExclusive(&Pending->Lock);
+    if (0 != FspFileSystemDispatcherPendingUnlink(Pending, Entry->Hint, Entry) && 0 != NewEntry)
+    {
+        Index = FspFileSystemDispatcherPendingIndex(NewEntry->Hint);
+        NewEntry->Next = Pending->Buckets[Index];
+        Pending->Buckets[Index] = NewEntry;
+        Pending->Count++;
+        NewEntry = 0;
+    }
+    ReleaseSRWLockExclusive(&Pending->Lock);
+
+    /* the response has already been sent or the entry could not be counted */
+    MemFree(NewEntry);
+}
+
+static VOID FspFileSystemDispatcherPendingRemove(FSP_FILE_SYSTEM_DISPATCHER_PENDING *Pending,
+    UINT64 Hint)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY *Entry;
+
+    AcquireSRWLockExclusive(&Pending->Lock);
+    Entry = FspFileSystemDispatcherPendingUnlink(Pending, Hint, 0);
+    if (0 != Entry && Entry->Counted)
+        Pending->Count--;
+    else
+        Entry = 0;
+    ReleaseSRWLockExclusive(&Pending->Lock);
+
+    MemFree(Entry);
+}
+
+static VOID FspFileSystemDispatchRequest(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING *Pending =
+        0 != FileSystem->DispatcherIrpCredits ? FileSystem->DispatcherPending : 0;
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING_ENTRY PendingEntry;
+    SIZE_T ResponseSize;
+
+    if (FileSystem->DebugLog)
+    {
+        if (FspFsctlTransactKindCount <= Request->Kind ||
+            (FileSystem->DebugLog & (1 << Request->Kind)))
+            FspDebugLogRequest(Request);
+    }
+
+    memset(Response, 0, sizeof *Response);
+    Response->Size = sizeof *Response;
+    Response->Kind = Request->Kind;
+    Response->Hint = Request->Hint;
+    if (0 != Pending)
+        FspFileSystemDispatcherPendingEnter(Pending, &PendingEntry, Request->Hint);
+    if (FspFsctlTransactKindCount > Request->Kind && 0 != FileSystem->Operations[Request->Kind])
+    {
+        Response->IoStatus.Status =
+            FspFileSystemEnterOperation(FileSystem, Request, Response);
+        if (NT_SUCCESS(Response->IoStatus.Status))
+        {
+            Response->IoStatus.Status =
+                FileSystem->Operations[Request->Kind](FileSystem, Request, Response);
+            FspFileSystemLeaveOperation(FileSystem, Request, Response);
+        }
+    }
+    else
+        Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+
+    if (0 != Pending)
+        FspFileSystemDispatcherPendingLeave(Pending, &PendingEntry,
+            STATUS_PENDING == Response->IoStatus.Status);
+
+    if (FileSystem->DebugLog)
+    {
+        if (FspFsctlTransactKindCount <= Response->Kind ||
+            (FileSystem->DebugLog & (1 << Response->Kind)))
+            FspDebugLogResponse(Response);
+    }
+
+    ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
+    if (FSP_FSCTL_TRANSACT_RSP_SIZEMAX < ResponseSize/* should NOT happen */)
+    {
+        memset(Response, 0, sizeof *Response);
+        Response->Size = sizeof *Response;
+        Response->Kind = Request->Kind;
+        Response->Hint = Request->Hint;
+        Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+    }
+    else if (STATUS_PENDING == Response->IoStatus.Status)
+        memset(Response, 0, sizeof *Response);
+    else
+    {
+        memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
+        Response->Size = (UINT16)ResponseSize;
+    }
+}
+
+static VOID FspFileSystemDispatcherPoolGrow(FSP_FILE_SYSTEM *FileSystem);
+static VOID FspFileSystemDispatcherPoolExit(FSP_FILE_SYSTEM *FileSystem);
+
+static FSP_FSCTL_TRANSACT_RSP *FspFileSystemDispatcherProduceCredits(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING *Pending = FileSystem->DispatcherPending;
+    ULONG PendingCount = (ULONG)*(volatile LONG *)&Pending->Count;
+    ULONG IrpCredits = FileSystem->DispatcherIrpCredits;
+
+    IrpCredits = PendingCount < IrpCredits ? IrpCredits - PendingCount : 0;
+
+    return FspFsctlTransactProduceCreditResponse(Response, IrpCredits);
+}
+
+static NTSTATUS FspFileSystemDispatcherLoop(FSP_FILE_SYSTEM *FileSystem, BOOLEAN Elastic)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = FileSystem->DispatcherPool;
+    NTSTATUS Result;
+    BOOLEAN Batch = 1 < FileSystem->DispatcherBatchCount;
+    SIZE_T RequestBufSize, ResponseBufSize, RequestSize;
+    PVOID RequestBuf = 0, ResponseBuf = 0;
+    PUINT8 RequestBufEnd, ResponseBufEnd;
+    FSP_FSCTL_TRANSACT_REQ *Request, *NextRequest;
+    FSP_FSCTL_TRANSACT_RSP *Response;
+    LONG IdleThreadCount;
+    DWORD BusyTickCount;
+
+    if (Batch)
+    {
+        /*
+         * In batch mode the FSD fills the request buffer with as many requests as will fit.
+         * Size the request buffer so that it can hold at least BatchCount maximum size requests.
+         * The response buffer is sized similarly, but if the requests in a batch produce more
+         * responses than will fit, the responses are flushed early (see below).
+         */
+        RequestBufSize = FileSystem->DispatcherBatchCount * FSP_FSCTL_TRANSACT_REQ_SIZEMAX;
+        if (FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN > RequestBufSize)
+            RequestBufSize = FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN;
+        ResponseBufSize = FileSystem->DispatcherBatchCount * FSP_FSCTL_TRANSACT_RSP_SIZEMAX;
+    }
+    else
+    {
+        RequestBufSize = FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN;
+        ResponseBufSize = FSP_FSCTL_TRANSACT_RSP_SIZEMAX;
+    }
+
+    RequestBuf = MemAlloc(RequestBufSize);
+    ResponseBuf = MemAlloc(ResponseBufSize +
+        FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof(FSP_FSCTL_TRANSACT_RSP))); /* room for credit response */
+    if (0 == RequestBuf || 0 == ResponseBuf)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+    ResponseBufEnd = (PUINT8)ResponseBuf + ResponseBufSize;
+
+    BusyTickCount = GetTickCount();
+    Response = ResponseBuf;
+    for (;;)
+    {
+        if (0 != Pool)
+            InterlockedIncrement(&Pool->IdleThreadCount);
+
+        if (0 != FileSystem->DispatcherIrpCredits)
+            Response = FspFileSystemDispatcherProduceCredits(FileSystem, Response);
+
+        RequestSize = RequestBufSize;
+        Result = FspFsctlTransact(FileSystem->VolumeHandle,
+            ResponseBuf, (PUINT8)Response - (PUINT8)ResponseBuf, RequestBuf, &RequestSize, Batch);
+
+        IdleThreadCount = 0 != Pool ? InterlockedDecrement(&Pool->IdleThreadCount) : 1;
+
+        if (!NT_SUCCESS(Result))
+            goto exit;
+
+        Response = ResponseBuf;
+        if (0 == RequestSize)
+        {
+            /* transact timed out; elastic threads exit when idle for long enough */
+            if (Elastic && GetTickCount() - BusyTickCount >= Pool->ThreadIdleTimeout)
+            {
+                Result = STATUS_SUCCESS;
+                goto exit;
+            }
+            continue;
+        }
+
+        /* grow the pool if there is no thread left waiting for new requests */
+        BusyTickCount = GetTickCount();
+        if (0 == IdleThreadCount)
+            FspFileSystemDispatcherPoolGrow(FileSystem);
+
+        RequestBufEnd = (PUINT8)RequestBuf + RequestSize;
+        for (Request = RequestBuf;
+            0 != (NextRequest = FspFsctlTransactConsumeRequest(Request, RequestBufEnd));
+            Request = NextRequest)
+        {
+            if (!FspFsctlTransactCanProduceResponse(Response, ResponseBufEnd))
+            {
+                /* no room for another response; send the ones we have without waiting */
+                Result = FspFsctlTransact(FileSystem->VolumeHandle,
+                    ResponseBuf, (PUINT8)Response - (PUINT8)ResponseBuf, 0, 0, Batch);
+                if (!NT_SUCCESS(Result))
+                    goto exit;
+
+                Response = ResponseBuf;
+            }
+
+            FspFileSystemDispatchRequest(FileSystem, Request, Response);
+            if (0 != Response->Size)
+                Response = FspFsctlTransactProduceResponse(Response, Response->Size);
+        }
+    }
+
+exit:
+    MemFree(ResponseBuf);
+    MemFree(RequestBuf);
+
+    return Result;
+}
+
 static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
 {
     FSP_FILE_SYSTEM *FileSystem = FileSystem0;
     NTSTATUS Result;
-    SIZE_T RequestSize, ResponseSize;
-    FSP_FSCTL_TRANSACT_REQ *Request = 0;
+    HANDLE DispatcherThread = 0;
+
+    if (1 < FileSystem->DispatcherThreadCount)
+    {
+        FileSystem->DispatcherThreadCount--;
+        DispatcherThread = CreateThread(0, 0, FspFileSystemDispatcherThread, FileSystem, 0, 0);
+        if (0 == DispatcherThread)
+        {
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
+        }
+    }
+
+    Result = FspFileSystemDispatcherLoop(FileSystem, FALSE);
+
+exit:
+    FspFileSystemSetDispatcherResult(FileSystem, Result);
+
+    FspFsctlStop(FileSystem->VolumeHandle);
+
+    if (0 != DispatcherThread)
+    {
+        WaitForSingleObject(DispatcherThread, INFINITE);
+        CloseHandle(DispatcherThread);
+    }
+
+    if (0 != FileSystem->DispatcherPool)
+    {
+        FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = FileSystem->DispatcherPool;
+        BOOLEAN Wait;
+
+        /* no more elastic threads after this point; wait for the ones that are running */
+        AcquireSRWLockExclusive(&Pool->Lock);
+        Pool->Stopped = TRUE;
+        Wait = 0 != Pool->ElasticThreadCount;
+        ReleaseSRWLockExclusive(&Pool->Lock);
+
+        if (Wait)
+            WaitForSingleObject(Pool->ElasticExitEvent, INFINITE);
+    }
+
+    return Result;
+}
+
+static DWORD WINAPI FspFileSystemDispatcherElasticThread(PVOID FileSystem0)
+{
+    FSP_FILE_SYSTEM *FileSystem = FileSystem0;
+    NTSTATUS Result;
+
+    Result = FspFileSystemDispatcherLoop(FileSystem, TRUE);
+    if (!NT_SUCCESS(Result))
+    {
+        FspFileSystemSetDispatcherResult(FileSystem, Result);
+
+        FspFsctlStop(FileSystem->VolumeHandle);
+    }
+
+    FspFileSystemDispatcherPoolExit(FileSystem);
+
+    return Result;
+}
+
+static VOID FspFileSystemDispatcherPoolGrow(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = FileSystem->DispatcherPool;
+    HANDLE DispatcherThread;
+
+    if (0 == Pool)
+        return;
+
+    AcquireSRWLockExclusive(&Pool->Lock);
+    if (!Pool->Stopped && Pool->ThreadCountMax > Pool->ThreadCount)
+    {
+        DispatcherThread = CreateThread(0, 0,
+            FspFileSystemDispatcherElasticThread, FileSystem, 0, 0);
+        if (0 != DispatcherThread)
+        {
+            CloseHandle(DispatcherThread);
+            Pool->ElasticThreadCount++;
+            Pool->ThreadCount++;
+        }
+    }
+    ReleaseSRWLockExclusive(&Pool->Lock);
+}
+
+static VOID FspFileSystemDispatcherPoolExit(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = FileSystem->DispatcherPool;
+    HANDLE ElasticExitEvent;
+    BOOLEAN Signal;
+
+    AcquireSRWLockExclusive(&Pool->Lock);
+    Pool->ThreadCount--;
+    Signal = 0 == --Pool->ElasticThreadCount && Pool->Stopped;
+    ElasticExitEvent = Pool->ElasticExitEvent;
+    ReleaseSRWLockExclusive(&Pool->Lock);
+
+    /*
+     * The pool may be freed as soon as the event is signaled, so signal it only after
+     * the lock has been released and do not touch the pool afterwards. No new elastic
+     * threads are created once the pool is stopped, so the event needs no resetting.
+     */
+    if (Signal)
+        SetEvent(ElasticExitEvent);
+}
+
+static NTSTATUS FspFileSystemCreateDispatcherPool(ULONG ThreadCount, ULONG ThreadCountMax,
+    ULONG ThreadIdleTimeout,
+    FSP_FILE_SYSTEM_DISPATCHER_POOL **PPool)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool;
+
+    *PPool = 0;
+
+    Pool = MemAlloc(sizeof *Pool);
+    if (0 == Pool)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    memset(Pool, 0, sizeof *Pool);
+
+    InitializeSRWLock(&Pool->Lock);
+    Pool->ElasticExitEvent = CreateEventW(0, TRUE, FALSE, 0);
+    if (0 == Pool->ElasticExitEvent)
+    {
+        MemFree(Pool);
+        return FspNtStatusFromWin32(GetLastError());
+    }
+    Pool->ThreadCount = ThreadCount;
+    Pool->ThreadCountMax = ThreadCountMax;
+    Pool->ThreadIdleTimeout = ThreadIdleTimeout;
+
+    *PPool = Pool;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FspFileSystemDeleteDispatcherPool(FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool)
+{
+    CloseHandle(Pool->ElasticExitEvent);
+    MemFree(Pool);
+}
+
+static NTSTATUS FspFileSystemCreateDispatcherRing(ULONG SlotCount,
+    FSP_FILE_SYSTEM_DISPATCHER_RING **PRing)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_RING *Ring;
+    NTSTATUS Result;
+
+    *PRing = 0;
+
+    Ring = MemAlloc(sizeof *Ring);
+    if (0 == Ring)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    memset(Ring, 0, sizeof *Ring);
+
+    Ring->SlotCount = SlotCount;
+    Ring->RingBufSize = FspFsctlTransactRingSize(SlotCount) * 2;
+
+    Ring->RequestEvent = CreateEventW(0, FALSE, FALSE, 0);
+    Ring->ResponseEvent = CreateEventW(0, FALSE, FALSE, 0);
+    Ring->SpaceEvent = CreateEventW(0, FALSE, FALSE, 0);
+    if (0 == Ring->RequestEvent || 0 == Ring->ResponseEvent || 0 == Ring->SpaceEvent)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    Ring->RequestRing = VirtualAlloc(0, Ring->RingBufSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (0 == Ring->RequestRing)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+    Ring->ResponseRing = (PVOID)((PUINT8)Ring->RequestRing + FspFsctlTransactRingSize(SlotCount));
+    FspFsctlTransactRingInitialize(Ring->RequestRing, SlotCount);
+    FspFsctlTransactRingInitialize(Ring->ResponseRing, SlotCount);
+
+    Ring->RingParams.RequestEvent = (UINT64)(UINT_PTR)Ring->RequestEvent;
+    Ring->RingParams.ResponseEvent = (UINT64)(UINT_PTR)Ring->ResponseEvent;
+    Ring->RingParams.SpaceEvent = (UINT64)(UINT_PTR)Ring->SpaceEvent;
+
+    *PRing = Ring;
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (!NT_SUCCESS(Result))
+    {
+        if (0 != Ring->SpaceEvent)
+            CloseHandle(Ring->SpaceEvent);
+        if (0 != Ring->ResponseEvent)
+            CloseHandle(Ring->ResponseEvent);
+        if (0 != Ring->RequestEvent)
+            CloseHandle(Ring->RequestEvent);
+        MemFree(Ring);
+    }
+
+    return Result;
+}
+
+static VOID FspFileSystemDeleteDispatcherRing(FSP_FILE_SYSTEM_DISPATCHER_RING *Ring)
+{
+    VirtualFree(Ring->RequestRing, 0, MEM_RELEASE);
+    CloseHandle(Ring->SpaceEvent);
+    CloseHandle(Ring->ResponseEvent);
+    CloseHandle(Ring->RequestEvent);
+    MemFree(Ring);
+}
+
+static FSP_FSCTL_TRANSACT_RSP *FspFileSystemDispatcherRingProduceBegin(
+    FSP_FILE_SYSTEM_DISPATCHER_RING *Ring, PLONG64 PPosition)
+{
+    FSP_FSCTL_TRANSACT_RSP *SlotResponse;
+    ULONG SpinCount = 0;
+
+    for (;;)
+    {
+        SlotResponse = FspFsctlTransactRingProduceBegin(
+            Ring->ResponseRing, Ring->SlotCount, PPosition);
+        if (0 != SlotResponse || Ring->Stopped)
+            return SlotResponse;
+
+        /* response ring is full; make sure that the FSD is draining it */
+        if (0 == SpinCount)
+            SetEvent(Ring->ResponseEvent);
+        if (FspFileSystemDispatcherRingSpinCount > SpinCount++)
+        {
+            SwitchToThread();
+            continue;
+        }
+
+        /*
+         * Still full: ask the FSD to signal the SpaceEvent after it consumes responses.
+         * The wait is bounded, because another waiter may set ProducerWaiting again
+         * after the FSD has cleared it and the wakeup is given to only one thread.
+         */
+        InterlockedIncrement(&Ring->SpaceWaiterCount);
+        InterlockedExchange(&Ring->ResponseRing->ProducerWaiting, 1);
+        if (!FspFsctlTransactRingCanProduce(Ring->ResponseRing, Ring->SlotCount) &&
+            !Ring->Stopped)
+        {
+            SetEvent(Ring->ResponseEvent);
+            WaitForSingleObject(Ring->SpaceEvent, FspFileSystemDispatcherRingSpaceTimeout);
+        }
+        InterlockedDecrement(&Ring->SpaceWaiterCount);
+    }
+}
+
+static BOOLEAN FspFileSystemDispatcherRingSendResponse(
+    FSP_FILE_SYSTEM_DISPATCHER_RING *Ring, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    FSP_FSCTL_TRANSACT_RSP *SlotResponse;
+    LONG64 Position;
+
+    SlotResponse = FspFileSystemDispatcherRingProduceBegin(Ring, &Position);
+    if (0 == SlotResponse)
+        return FALSE;
+    memcpy(SlotResponse, Response, Response->Size);
+    FspFsctlTransactRingProduceEnd(Ring->ResponseRing, Ring->SlotCount, Position);
+
+    /* pass the wakeup along to other producers waiting for a free slot */
+    if (0 != Ring->SpaceWaiterCount)
+    {
+        if (FspFsctlTransactRingCanProduce(Ring->ResponseRing, Ring->SlotCount))
+            SetEvent(Ring->SpaceEvent);
+        else
+            InterlockedExchange(&Ring->ResponseRing->ProducerWaiting, 1);
+    }
+
+    if (InterlockedExchange(&Ring->ResponseRing->Waiting, 0))
+        SetEvent(Ring->ResponseEvent);
+
+    return TRUE;
+}
+
+static DWORD WINAPI FspFileSystemDispatcherRingThread(PVOID FileSystem0)
+{
+    FSP_FILE_SYSTEM *FileSystem = FileSystem0;
+    FSP_FILE_SYSTEM_DISPATCHER_RING *Ring = FileSystem->DispatcherRing;
+    NTSTATUS Result = STATUS_SUCCESS;
+    FSP_FSCTL_TRANSACT_REQ *Request = 0, *SlotRequest;
     FSP_FSCTL_TRANSACT_RSP *Response = 0;
+    LONG64 Position;
+    UINT16 Size;
+    BOOLEAN Woken = FALSE;
     HANDLE DispatcherThread = 0;
 
-    Request = MemAlloc(FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN);
+    Request = MemAlloc(FSP_FSCTL_TRANSACT_REQ_SIZEMAX);
     Response = MemAlloc(FSP_FSCTL_TRANSACT_RSP_SIZEMAX);
     if (0 == Request || 0 == Response)
     {
@@ -258,7 +898,7 @@ static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
     if (1 < FileSystem->DispatcherThreadCount)
     {
         FileSystem->DispatcherThreadCount--;
-        DispatcherThread = CreateThread(0, 0, FspFileSystemDispatcherThread, FileSystem, 0, 0);
+        DispatcherThread = CreateThread(0, 0, FspFileSystemDispatcherRingThread, FileSystem, 0, 0);
         if (0 == DispatcherThread)
         {
             Result = FspNtStatusFromWin32(GetLastError());
@@ -266,66 +906,60 @@ static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
         }
     }
 
-    memset(Response, 0, sizeof *Response);
     for (;;)
     {
-        RequestSize = FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN;
-        Result = FspFsctlTransact(FileSystem->VolumeHandle,
-            Response, Response->Size, Request, &RequestSize, FALSE);
-        if (!NT_SUCCESS(Result))
-            goto exit;
+        SlotRequest = FspFsctlTransactRingConsumeBegin(Ring->RequestRing, Ring->SlotCount, &Position);
+        if (0 == SlotRequest)
+        {
+            if (Ring->Stopped)
+                break;
 
-        memset(Response, 0, sizeof *Response);
-        if (0 == RequestSize)
+            WaitForSingleObject(Ring->RequestEvent, INFINITE);
+            Woken = TRUE;
             continue;
-
-        if (FileSystem->DebugLog)
-        {
-            if (FspFsctlTransactKindCount <= Request->Kind ||
-                (FileSystem->DebugLog & (1 << Request->Kind)))
-                FspDebugLogRequest(Request);
         }
 
-        Response->Size = sizeof *Response;
-        Response->Kind = Request->Kind;
-        Response->Hint = Request->Hint;
-        if (FspFsctlTransactKindCount > Request->Kind && 0 != FileSystem->Operations[Request->Kind])
+        Size = SlotRequest->Size;
+        if (sizeof(FSP_FSCTL_TRANSACT_REQ) <= Size && FSP_FSCTL_TRANSACT_REQ_SIZEMAX >= Size)
         {
-            Response->IoStatus.Status =
-                FspFileSystemEnterOperation(FileSystem, Request, Response);
-            if (NT_SUCCESS(Response->IoStatus.Status))
-            {
-                Response->IoStatus.Status =
-                    FileSystem->Operations[Request->Kind](FileSystem, Request, Response);
-                FspFileSystemLeaveOperation(FileSystem, Request, Response);
-            }
+            memcpy(Request, SlotRequest, Size);
+            Request->Size = Size;
         }
         else
-            Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+        {
+            /* slot headers are always readable; keep Kind and Hint to fail the IRP below */
+            memset(Request, 0, sizeof *Request);
+            Request->Kind = SlotRequest->Kind;
+            Request->Hint = SlotRequest->Hint;
+        }
+        FspFsctlTransactRingConsumeEnd(Ring->RequestRing, Ring->SlotCount, Position);
 
-        if (FileSystem->DebugLog)
+        /* the FSD signals the event once per batch; pass the wakeup along if there is more */
+        if (Woken)
         {
-            if (FspFsctlTransactKindCount <= Response->Kind ||
-                (FileSystem->DebugLog & (1 << Response->Kind)))
-                FspDebugLogResponse(Response);
+            Woken = FALSE;
+            if (FspFsctlTransactRingCanConsume(Ring->RequestRing, Ring->SlotCount))
+                SetEvent(Ring->RequestEvent);
         }
 
-        ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
-        if (FSP_FSCTL_TRANSACT_RSP_SIZEMAX < ResponseSize/* should NOT happen */)
+        if (0 != Request->Size)
+        {
+            FspFileSystemDispatchRequest(FileSystem, Request, Response);
+            if (0 == Response->Size)
+                continue;
+        }
+        else
         {
+            /* do not leave the IRP pending forever; complete it with an error instead */
             memset(Response, 0, sizeof *Response);
             Response->Size = sizeof *Response;
             Response->Kind = Request->Kind;
             Response->Hint = Request->Hint;
             Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
         }
-        else if (STATUS_PENDING == Response->IoStatus.Status)
-            memset(Response, 0, sizeof *Response);
-        else
-        {
-            memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
-            Response->Size = (UINT16)ResponseSize;
-        }
+
+        if (!FspFileSystemDispatcherRingSendResponse(Ring, Response))
+            goto exit;
     }
 
 exit:
@@ -334,22 +968,95 @@ exit:
 
     FspFileSystemSetDispatcherResult(FileSystem, Result);
 
+    /* wake up the next dispatcher thread so that it can notice that we are stopping */
+    InterlockedExchange(&Ring->Stopped, 1);
+    SetEvent(Ring->RequestEvent);
+    SetEvent(Ring->SpaceEvent);
+
+    if (0 != DispatcherThread)
+    {
+        WaitForSingleObject(DispatcherThread, INFINITE);
+        CloseHandle(DispatcherThread);
+    }
+
+    return Result;
+}
+
+static DWORD WINAPI FspFileSystemDispatcherRingPumpThread(PVOID FileSystem0)
+{
+    FSP_FILE_SYSTEM *FileSystem = FileSystem0;
+    FSP_FILE_SYSTEM_DISPATCHER_RING *Ring = FileSystem->DispatcherRing;
+    NTSTATUS Result;
+    HANDLE DispatcherThread = 0;
+
+    DispatcherThread = CreateThread(0, 0, FspFileSystemDispatcherRingThread, FileSystem, 0, 0);
+    if (0 == DispatcherThread)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    /*
+     * The FSD services the rings for as long as the transact ring call is in progress and
+     * returns periodically when idle. There is no per request transact call in this mode.
+     */
+    for (;;)
+    {
+        Result = FspFsctlTransactRing(FileSystem->VolumeHandle,
+            &Ring->RingParams, Ring->RequestRing, Ring->RingBufSize);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+    }
+
+exit:
+    FspFileSystemSetDispatcherResult(FileSystem, Result);
+
     FspFsctlStop(FileSystem->VolumeHandle);
 
+    InterlockedExchange(&Ring->Stopped, 1);
+    SetEvent(Ring->RequestEvent);
+    SetEvent(Ring->SpaceEvent);
+
     if (0 != DispatcherThread)
     {
         WaitForSingleObject(DispatcherThread, INFINITE);
         CloseHandle(DispatcherThread);
     }
 
+    /* the ring is deleted by FspFileSystemStopDispatcher; FspFileSystemSendResponse may use it */
+
     return Result;
 }
 
 FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount)
 {
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS DispatcherParams;
+
+    memset(&DispatcherParams, 0, sizeof DispatcherParams);
+    DispatcherParams.ThreadCount = ThreadCount;
+
+    return FspFileSystemStartDispatcherEx(FileSystem, &DispatcherParams);
+}
+
+FSP_API NTSTATUS FspFileSystemStartDispatcherEx(FSP_FILE_SYSTEM *FileSystem,
+    const FSP_FILE_SYSTEM_DISPATCHER_PARAMS *DispatcherParams)
+{
+    ULONG ThreadCount, ThreadCountMax, ThreadIdleTimeout, BatchCount, RingSlotCount, IrpCredits;
+    FSP_FILE_SYSTEM_DISPATCHER_PENDING *Pending = 0;
+    FSP_FILE_SYSTEM_DISPATCHER_POOL *Pool = 0;
+    FSP_FILE_SYSTEM_DISPATCHER_RING *Ring = 0;
+    NTSTATUS Result;
+
     if (0 != FileSystem->DispatcherThread)
         return STATUS_INVALID_PARAMETER;
 
+    ThreadCount = 0 != DispatcherParams ? DispatcherParams->ThreadCount : 0;
+    BatchCount = 0 != DispatcherParams ? DispatcherParams->BatchCount : 0;
+    RingSlotCount = 0 != DispatcherParams ? DispatcherParams->RingSlotCount : 0;
+    ThreadCountMax = 0 != DispatcherParams ? DispatcherParams->ThreadCountMax : 0;
+    ThreadIdleTimeout = 0 != DispatcherParams ? DispatcherParams->ThreadIdleTimeout : 0;
+    IrpCredits = 0 != DispatcherParams ? DispatcherParams->IrpCredits : 0;
+
     if (0 == ThreadCount)
     {
         DWORD_PTR ProcessMask, SystemMask;
@@ -364,11 +1071,68 @@ FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG
     if (ThreadCount < FspFileSystemDispatcherThreadCountMin)
         ThreadCount = FspFileSystemDispatcherThreadCountMin;
 
+    if (BatchCount > FspFileSystemDispatcherBatchCountMax)
+        BatchCount = FspFileSystemDispatcherBatchCountMax;
+
+    /* IRP credits are advertised in transact calls; there are no such calls in ring mode */
+    if (0 != RingSlotCount)
+        IrpCredits = 0;
+
+    if (0 != IrpCredits && 0 == FileSystem->DispatcherPending)
+    {
+        Result = FspFileSystemCreateDispatcherPending(&Pending);
+        if (!NT_SUCCESS(Result))
+            return Result;
+        FileSystem->DispatcherPending = Pending;
+    }
+
+    if (0 != RingSlotCount)
+    {
+        ULONG SlotCount;
+
+        for (SlotCount = 1;
+            SlotCount < RingSlotCount && FSP_FSCTL_TRANSACT_RING_SLOTCOUNT_MAX > SlotCount;
+            SlotCount <<= 1)
+            ;
+
+        Result = FspFileSystemCreateDispatcherRing(SlotCount, &Ring);
+        if (!NT_SUCCESS(Result))
+            return Result;
+    }
+    else if (ThreadCountMax > ThreadCount)
+    {
+        if (0 == ThreadIdleTimeout)
+            ThreadIdleTimeout = FspFileSystemDispatcherThreadIdleTimeoutDefault;
+
+        Result = FspFileSystemCreateDispatcherPool(ThreadCount, ThreadCountMax, ThreadIdleTimeout,
+            &Pool);
+        if (!NT_SUCCESS(Result))
+            return Result;
+    }
+
     FileSystem->DispatcherThreadCount = ThreadCount;
+    FileSystem->DispatcherBatchCount = BatchCount;
+    FileSystem->DispatcherIrpCredits = IrpCredits;
+    FileSystem->DispatcherRing = Ring;
+    FileSystem->DispatcherPool = Pool;
     FileSystem->DispatcherThread = CreateThread(0, 0,
-        FspFileSystemDispatcherThread, FileSystem, 0, 0);
+        0 != Ring ? FspFileSystemDispatcherRingPumpThread : FspFileSystemDispatcherThread,
+        FileSystem, 0, 0);
     if (0 == FileSystem->DispatcherThread)
-        return FspNtStatusFromWin32(GetLastError());
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        if (0 != Ring)
+        {
+            FileSystem->DispatcherRing = 0;
+            FspFileSystemDeleteDispatcherRing(Ring);
+        }
+        if (0 != Pool)
+        {
+            FileSystem->DispatcherPool = 0;
+            FspFileSystemDeleteDispatcherPool(Pool);
+        }
+        return Result;
+    }
 
     return STATUS_SUCCESS;
 }
@@ -383,6 +1147,18 @@ FSP_API VOID FspFileSystemStopDispatcher(FSP_FILE_SYSTEM *FileSystem)
     WaitForSingleObject(FileSystem->DispatcherThread, INFINITE);
     CloseHandle(FileSystem->DispatcherThread);
     FileSystem->DispatcherThread = 0;
+
+    if (0 != FileSystem->DispatcherPool)
+    {
+        FspFileSystemDeleteDispatcherPool(FileSystem->DispatcherPool);
+        FileSystem->DispatcherPool = 0;
+    }
+
+    if (0 != FileSystem->DispatcherRing)
+    {
+        FspFileSystemDeleteDispatcherRing(FileSystem->DispatcherRing);
+        FileSystem->DispatcherRing = 0;
+    }
 }
 
 FSP_API VOID FspFileSystemSendResponse(FSP_FILE_SYSTEM *FileSystem,
@@ -397,6 +1173,14 @@ FSP_API VOID FspFileSystemSendResponse(FSP_FILE_SYSTEM *FileSystem,
             FspDebugLogResponse(Response);
     }
 
+    if (0 != FileSystem->DispatcherIrpCredits)
+        FspFileSystemDispatcherPendingRemove(FileSystem->DispatcherPending, Response->Hint);
+
+    /* in ring mode responses go through the response ring while it is running */
+    if (0 != FileSystem->DispatcherRing &&
+        FspFileSystemDispatcherRingSendResponse(FileSystem->DispatcherRing, Response))
+        return;
+
     Result = FspFsctlTransact(FileSystem->VolumeHandle,
         Response, Response->Size, 0, 0, FALSE);
     if (!NT_SUCCESS(Result))
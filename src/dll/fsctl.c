@@ -22,6 +22,7 @@
 #define PREFIXW                         L"" FSP_FSCTL_VOLUME_PARAMS_PREFIX
 #define PREFIXW_SIZE                    (sizeof PREFIXW - sizeof(WCHAR))
 
+static NTSTATUS FspFsctlOpenDevice(PWSTR DevicePath, PHANDLE PDeviceHandle);
 static NTSTATUS FspFsctlStartService(VOID);
 
 FSP_API NTSTATUS FspFsctlCreateVolume(PWSTR DevicePath,
@@ -31,7 +32,7 @@ FSP_API NTSTATUS FspFsctlCreateVolume(PWSTR DevicePath,
 {
     NTSTATUS Result;
     PWSTR DeviceRoot;
-    SIZE_T DeviceRootSize, DevicePathSize;
+    SIZE_T DeviceRootSize, DevicePathSize, VolumeParamsSize;
     WCHAR DevicePathBuf[MAX_PATH + sizeof *VolumeParams], *DevicePathPtr, *DevicePathEnd;
     HANDLE VolumeHandle = INVALID_HANDLE_VALUE;
     DWORD Bytes;
@@ -40,12 +41,16 @@ FSP_API NTSTATUS FspFsctlCreateVolume(PWSTR DevicePath,
         VolumeNameBuf[0] = L'\0';
     *PVolumeHandle = INVALID_HANDLE_VALUE;
 
+    /* a file system built against an older fsctl.h passes a shorter VolumeParams */
+    VolumeParamsSize = sizeof *VolumeParams == VolumeParams->Version ?
+        sizeof *VolumeParams : FSP_FSCTL_VOLUME_PARAMS_V0_SIZE;
+
     /* check lengths; everything (including encoded volume params) must fit within DevicePathBuf */
     DeviceRoot = L'\\' == DevicePath[0] ? GLOBALROOT : GLOBALROOT "\\Device\\";
     DeviceRootSize = lstrlenW(DeviceRoot) * sizeof(WCHAR);
     DevicePathSize = lstrlenW(DevicePath) * sizeof(WCHAR);
     if (DeviceRootSize + DevicePathSize + PREFIXW_SIZE +
-        sizeof *VolumeParams * sizeof(WCHAR) + sizeof(WCHAR) > sizeof DevicePathBuf)
+        VolumeParamsSize * sizeof(WCHAR) + sizeof(WCHAR) > sizeof DevicePathBuf)
         return STATUS_INVALID_PARAMETER;
 
     /* prepare the device path to be opened; encode the volume params in the Unicode private area */
@@ -56,7 +61,7 @@ FSP_API NTSTATUS FspFsctlCreateVolume(PWSTR DevicePath,
     DevicePathPtr = (PVOID)((PUINT8)DevicePathPtr + DevicePathSize);
     memcpy(DevicePathPtr, PREFIXW, PREFIXW_SIZE);
     DevicePathPtr = (PVOID)((PUINT8)DevicePathPtr + PREFIXW_SIZE);
-    DevicePathEnd = (PVOID)((PUINT8)DevicePathPtr + sizeof *VolumeParams * sizeof(WCHAR));
+    DevicePathEnd = (PVOID)((PUINT8)DevicePathPtr + VolumeParamsSize * sizeof(WCHAR));
     for (PUINT8 VolumeParamsPtr = (PVOID)VolumeParams;
         DevicePathEnd > DevicePathPtr; DevicePathPtr++, VolumeParamsPtr++)
     {
@@ -130,6 +135,42 @@ exit:
     return Result;
 }
 
+FSP_API NTSTATUS FspFsctlTransactRing(HANDLE VolumeHandle,
+    const FSP_FSCTL_TRANSACT_RING_PARAMS *RingParams,
+    PVOID RingBuf, SIZE_T RingBufSize)
+{
+    NTSTATUS Result = STATUS_SUCCESS;
+    DWORD Bytes;
+
+    if (!DeviceIoControl(VolumeHandle, FSP_FSCTL_TRANSACT_RING,
+        (PVOID)RingParams, sizeof *RingParams, RingBuf, (DWORD)RingBufSize,
+        &Bytes, 0))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+exit:
+    return Result;
+}
+
+FSP_API NTSTATUS FspFsctlRegisterIoBuffers(HANDLE VolumeHandle,
+    PVOID Buffer, UINT32 SlotSize, UINT32 SlotCount)
+{
+    FSP_FSCTL_IO_BUFFERS_PARAMS IoBuffersParams;
+    DWORD Bytes;
+
+    IoBuffersParams.Address = (UINT64)(UINT_PTR)Buffer;
+    IoBuffersParams.SlotSize = SlotSize;
+    IoBuffersParams.SlotCount = SlotCount;
+
+    if (!DeviceIoControl(VolumeHandle, FSP_FSCTL_REGISTER_IO_BUFFERS,
+        &IoBuffersParams, sizeof IoBuffersParams, 0, 0, &Bytes, 0))
+        return FspNtStatusFromWin32(GetLastError());
+
+    return STATUS_SUCCESS;
+}
+
 FSP_API NTSTATUS FspFsctlStop(HANDLE VolumeHandle)
 {
     DWORD Bytes;
@@ -140,15 +181,15 @@ FSP_API NTSTATUS FspFsctlStop(HANDLE VolumeHandle)
     return STATUS_SUCCESS;
 }
 
-FSP_API NTSTATUS FspFsctlGetVolumeList(PWSTR DevicePath,
-    PWCHAR VolumeListBuf, PSIZE_T PVolumeListSize)
+static NTSTATUS FspFsctlOpenDevice(PWSTR DevicePath, PHANDLE PDeviceHandle)
 {
     NTSTATUS Result;
     PWSTR DeviceRoot;
     SIZE_T DeviceRootSize, DevicePathSize;
     WCHAR DevicePathBuf[MAX_PATH], *DevicePathPtr;
-    HANDLE VolumeHandle = INVALID_HANDLE_VALUE;
-    DWORD Bytes;
+    HANDLE DeviceHandle;
+
+    *PDeviceHandle = INVALID_HANDLE_VALUE;
 
     /* check lengths; everything must fit within MAX_PATH */
     DeviceRoot = L'\\' == DevicePath[0] ? GLOBALROOT : GLOBALROOT "\\Device\\";
@@ -165,17 +206,32 @@ FSP_API NTSTATUS FspFsctlGetVolumeList(PWSTR DevicePath,
     DevicePathPtr = (PVOID)((PUINT8)DevicePathPtr + DevicePathSize);
     *DevicePathPtr = L'\0';
 
-    VolumeHandle = CreateFileW(DevicePathBuf,
+    DeviceHandle = CreateFileW(DevicePathBuf,
         0, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
-    if (INVALID_HANDLE_VALUE == VolumeHandle)
+    if (INVALID_HANDLE_VALUE == DeviceHandle)
     {
         Result = FspNtStatusFromWin32(GetLastError());
         if (STATUS_OBJECT_PATH_NOT_FOUND == Result ||
             STATUS_OBJECT_NAME_NOT_FOUND == Result)
             Result = STATUS_NO_SUCH_DEVICE;
-        goto exit;
+        return Result;
     }
 
+    *PDeviceHandle = DeviceHandle;
+    return STATUS_SUCCESS;
+}
+
+FSP_API NTSTATUS FspFsctlGetVolumeList(PWSTR DevicePath,
+    PWCHAR VolumeListBuf, PSIZE_T PVolumeListSize)
+{
+    NTSTATUS Result;
+    HANDLE VolumeHandle = INVALID_HANDLE_VALUE;
+    DWORD Bytes;
+
+    Result = FspFsctlOpenDevice(DevicePath, &VolumeHandle);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
     if (!DeviceIoControl(VolumeHandle, FSP_FSCTL_VOLUME_LIST,
         0, 0,
         VolumeListBuf, (DWORD)*PVolumeListSize,
@@ -195,6 +251,35 @@ exit:
     return Result;
 }
 
+FSP_API NTSTATUS FspFsctlGetRequestStats(PWSTR DevicePath,
+    FSP_FSCTL_REQUEST_STATS *Stats)
+{
+    NTSTATUS Result;
+    HANDLE DeviceHandle = INVALID_HANDLE_VALUE;
+    DWORD Bytes;
+
+    Result = FspFsctlOpenDevice(DevicePath, &DeviceHandle);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    if (!DeviceIoControl(DeviceHandle, FSP_FSCTL_REQUEST_STATS,
+        0, 0,
+        Stats, sizeof *Stats,
+        &Bytes, 0))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (INVALID_HANDLE_VALUE != DeviceHandle)
+        CloseHandle(DeviceHandle);
+
+    return Result;
+}
+
 FSP_API NTSTATUS FspFsctlPreflight(PWSTR DevicePath)
 {
     NTSTATUS Result;
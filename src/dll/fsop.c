@@ -41,6 +41,7 @@ FSP_API NTSTATUS FspFileSystemOpEnter(FSP_FILE_SYSTEM *FileSystem,
         }
         else
         if (FspFsctlTransactCreateKind == Request->Kind ||
+            FspFsctlTransactQueryOpenKind == Request->Kind ||
             (FspFsctlTransactSetInformationKind == Request->Kind &&
                 13/*FileDispositionInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
             FspFsctlTransactQueryDirectoryKind == Request->Kind ||
@@ -79,6 +80,7 @@ FSP_API NTSTATUS FspFileSystemOpLeave(FSP_FILE_SYSTEM *FileSystem,
         }
         else
         if (FspFsctlTransactCreateKind == Request->Kind ||
+            FspFsctlTransactQueryOpenKind == Request->Kind ||
             (FspFsctlTransactSetInformationKind == Request->Kind &&
                 13/*FileDispositionInformation*/ == Request->Req.SetInformation.FileInformationClass) ||
             FspFsctlTransactQueryDirectoryKind == Request->Kind ||
@@ -647,22 +649,159 @@ FSP_API NTSTATUS FspFileSystemOpClose(FSP_FILE_SYSTEM *FileSystem,
     return STATUS_SUCCESS;
 }
 
+FSP_API NTSTATUS FspFileSystemOpCloseBatch(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    FSP_FSCTL_CLOSE_BATCH_ITEM *Items = (PVOID)Request->Buffer;
+    ULONG Count = Request->Req.CloseBatch.Count;
+    PVOID FileNodes[FspFsctlCloseBatchSizeMaximum];
+
+    if (FspFsctlCloseBatchSizeMaximum < Count ||
+        Request->Size < sizeof *Request + Count * sizeof *Items)
+        return STATUS_INVALID_PARAMETER;
+
+    if (0 != FileSystem->Interface->CloseBatch)
+    {
+        for (ULONG I = 0; Count > I; I++)
+            FileNodes[I] = (PVOID)USERCONTEXT(Items[I]);
+        FileSystem->Interface->CloseBatch(FileSystem, Request, FileNodes, Count);
+    }
+    else if (0 != FileSystem->Interface->Close)
+    {
+        for (ULONG I = 0; Count > I; I++)
+            FileSystem->Interface->Close(FileSystem, Request,
+                (PVOID)USERCONTEXT(Items[I]));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+FSP_API NTSTATUS FspFileSystemOpQueryOpen(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    NTSTATUS Result;
+    UINT32 GrantedAccess;
+    FSP_FSCTL_FILE_INFO FileInfo;
+
+    if (0 == FileSystem->Interface->GetFileInfoByName)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    /* STATUS_REPARSE is returned as is; the FSD resolves it with a regular create */
+    Result = FspAccessCheck(FileSystem, Request, FALSE, TRUE,
+        Request->Req.Create.DesiredAccess, &GrantedAccess);
+    if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
+        return Result;
+
+    memset(&FileInfo, 0, sizeof FileInfo);
+    Result = FileSystem->Interface->GetFileInfoByName(FileSystem,
+        (PWSTR)Request->Buffer, &FileInfo);
+    if (!NT_SUCCESS(Result) || STATUS_REPARSE == Result)
+        return Result;
+
+    memcpy(&Response->Rsp.QueryOpen.FileInfo, &FileInfo, sizeof FileInfo);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS FspFileSystemIoVecCreate(FSP_FILE_SYSTEM *FileSystem,
+    PVOID Buffer, UINT64 Offset, ULONG Length,
+    FSP_FILE_SYSTEM_IOVEC *IoVecBuf, ULONG IoVecBufCount,
+    FSP_FILE_SYSTEM_IOVEC **PIoVec, PULONG PIoVecCount)
+{
+    ULONG ChunkSize = FileSystem->IoVecChunkSize;
+    FSP_FILE_SYSTEM_IOVEC *IoVec;
+    ULONG IoVecCount, SegmentLength;
+
+    if (0 == ChunkSize || (UINT64)-1LL == Offset)
+        IoVecCount = 1;
+    else
+        IoVecCount = (ULONG)((Offset % ChunkSize + (UINT64)Length + ChunkSize - 1) / ChunkSize);
+    if (0 == IoVecCount)
+        IoVecCount = 1;
+
+    if (IoVecBufCount >= IoVecCount)
+        IoVec = IoVecBuf;
+    else
+    {
+        IoVec = MemAlloc(IoVecCount * sizeof *IoVec);
+        if (0 == IoVec)
+            return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (1 == IoVecCount)
+    {
+        IoVec[0].Buffer = Buffer;
+        IoVec[0].Length = Length;
+        IoVec[0].Offset = Offset;
+    }
+    else
+        for (ULONG Index = 0; IoVecCount > Index; Index++)
+        {
+            SegmentLength = ChunkSize - (ULONG)(Offset % ChunkSize);
+            if (SegmentLength > Length)
+                SegmentLength = Length;
+            IoVec[Index].Buffer = Buffer;
+            IoVec[Index].Length = SegmentLength;
+            IoVec[Index].Offset = Offset;
+            Buffer = (PUINT8)Buffer + SegmentLength;
+            Offset += SegmentLength;
+            Length -= SegmentLength;
+        }
+
+    *PIoVec = IoVec;
+    *PIoVecCount = IoVecCount;
+
+    return STATUS_SUCCESS;
+}
+
+static inline VOID FspFileSystemIoVecDelete(FSP_FILE_SYSTEM_IOVEC *IoVec,
+    FSP_FILE_SYSTEM_IOVEC *IoVecBuf)
+{
+    if (IoVecBuf != IoVec)
+        MemFree(IoVec);
+}
+
 FSP_API NTSTATUS FspFileSystemOpRead(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
     NTSTATUS Result;
     ULONG BytesTransferred;
+    FSP_FILE_SYSTEM_IOVEC IoVecBuf[32], *IoVec;
+    ULONG IoVecCount;
 
-    if (0 == FileSystem->Interface->Read)
+    if (0 == FileSystem->Interface->Read && 0 == FileSystem->Interface->ReadEx)
         return STATUS_INVALID_DEVICE_REQUEST;
 
+    if (0 != Request->Req.Read.ReadAheadLength && 0 != FileSystem->Interface->ReadAhead)
+        FileSystem->Interface->ReadAhead(FileSystem,
+            (PVOID)USERCONTEXT(Request->Req.Read),
+            Request->Req.Read.ReadAheadOffset,
+            Request->Req.Read.ReadAheadLength);
+
     BytesTransferred = 0;
-    Result = FileSystem->Interface->Read(FileSystem, Request,
-        (PVOID)USERCONTEXT(Request->Req.Read),
-        (PVOID)Request->Req.Read.Address,
-        Request->Req.Read.Offset,
-        Request->Req.Read.Length,
-        &BytesTransferred);
+    if (0 != FileSystem->Interface->ReadEx)
+    {
+        Result = FspFileSystemIoVecCreate(FileSystem,
+            (PVOID)Request->Req.Read.Address,
+            Request->Req.Read.Offset,
+            Request->Req.Read.Length,
+            IoVecBuf, sizeof IoVecBuf / sizeof IoVecBuf[0], &IoVec, &IoVecCount);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        Result = FileSystem->Interface->ReadEx(FileSystem, Request,
+            (PVOID)USERCONTEXT(Request->Req.Read),
+            IoVec, IoVecCount,
+            &BytesTransferred);
+
+        FspFileSystemIoVecDelete(IoVec, IoVecBuf);
+    }
+    else
+        Result = FileSystem->Interface->Read(FileSystem, Request,
+            (PVOID)USERCONTEXT(Request->Req.Read),
+            (PVOID)Request->Req.Read.Address,
+            Request->Req.Read.Offset,
+            Request->Req.Read.Length,
+            &BytesTransferred);
     if (!NT_SUCCESS(Result))
         return Result;
 
@@ -678,20 +817,43 @@ FSP_API NTSTATUS FspFileSystemOpWrite(FSP_FILE_SYSTEM *FileSystem,
     NTSTATUS Result;
     ULONG BytesTransferred;
     FSP_FSCTL_FILE_INFO FileInfo;
+    FSP_FILE_SYSTEM_IOVEC IoVecBuf[32], *IoVec;
+    ULONG IoVecCount;
 
-    if (0 == FileSystem->Interface->Write)
+    if (0 == FileSystem->Interface->Write && 0 == FileSystem->Interface->WriteEx)
         return STATUS_INVALID_DEVICE_REQUEST;
 
     BytesTransferred = 0;
-    Result = FileSystem->Interface->Write(FileSystem, Request,
-        (PVOID)USERCONTEXT(Request->Req.Write),
-        (PVOID)Request->Req.Write.Address,
-        Request->Req.Write.Offset,
-        Request->Req.Write.Length,
-        (UINT64)-1LL == Request->Req.Write.Offset,
-        0 != Request->Req.Write.ConstrainedIo,
-        &BytesTransferred,
-        &FileInfo);
+    if (0 != FileSystem->Interface->WriteEx)
+    {
+        Result = FspFileSystemIoVecCreate(FileSystem,
+            (PVOID)Request->Req.Write.Address,
+            Request->Req.Write.Offset,
+            Request->Req.Write.Length,
+            IoVecBuf, sizeof IoVecBuf / sizeof IoVecBuf[0], &IoVec, &IoVecCount);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        Result = FileSystem->Interface->WriteEx(FileSystem, Request,
+            (PVOID)USERCONTEXT(Request->Req.Write),
+            IoVec, IoVecCount,
+            (UINT64)-1LL == Request->Req.Write.Offset,
+            0 != Request->Req.Write.ConstrainedIo,
+            &BytesTransferred,
+            &FileInfo);
+
+        FspFileSystemIoVecDelete(IoVec, IoVecBuf);
+    }
+    else
+        Result = FileSystem->Interface->Write(FileSystem, Request,
+            (PVOID)USERCONTEXT(Request->Req.Write),
+            (PVOID)Request->Req.Write.Address,
+            Request->Req.Write.Offset,
+            Request->Req.Write.Length,
+            (UINT64)-1LL == Request->Req.Write.Offset,
+            0 != Request->Req.Write.ConstrainedIo,
+            &BytesTransferred,
+            &FileInfo);
     if (!NT_SUCCESS(Result))
         return Result;
 
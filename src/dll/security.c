@@ -71,7 +71,8 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
     if (0 != PSecurityDescriptor)
         *PSecurityDescriptor = 0;
 
-    if (FspFsctlTransactCreateKind != Request->Kind)
+    if (FspFsctlTransactCreateKind != Request->Kind &&
+        FspFsctlTransactQueryOpenKind != Request->Kind)
         return STATUS_INVALID_PARAMETER;
 
     if (CheckParentDirectory &&
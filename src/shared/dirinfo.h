@@ -0,0 +1,178 @@
+/**
+ * @file shared/dirinfo.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_DIRINFO_H_INCLUDED
+#define WINFSP_SHARED_DIRINFO_H_INCLUDED
+
+/*
+ * DirInfo buffer patching.
+ *
+ * A DirInfo buffer is a sequence of FSP_FSCTL_DIR_INFO entries as produced by
+ * FspFileSystemAddDirInfo: every entry is aligned to FSP_FSCTL_DEFAULT_ALIGNMENT and
+ * the buffer may end with an EOF marker (an entry with a Size smaller than that of
+ * FSP_FSCTL_DIR_INFO). A buffer without an EOF marker holds only the first part of
+ * a directory listing.
+ *
+ * These routines insert or remove a single entry of a buffer whose entries (other
+ * than "." and "..") are sorted by file name. They copy the patched buffer into a
+ * new buffer, because DirInfo buffers are shared and immutable once published.
+ *
+ * They depend only on fsctl.h and are used by both the FSD and the tests.
+ */
+
+typedef INT FSP_DIR_INFO_COMPARE(
+    PCWSTR FileName0, ULONG FileNameLength0, PCWSTR FileName1, ULONG FileNameLength1,
+    BOOLEAN CaseInsensitive);
+
+static inline BOOLEAN FspDirInfoIsDotEntry(const FSP_FSCTL_DIR_INFO *DirInfo)
+{
+    ULONG FileNameLength = DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO);
+    return
+        (1 * sizeof(WCHAR) == FileNameLength && L'.' == DirInfo->FileNameBuf[0]) ||
+        (2 * sizeof(WCHAR) == FileNameLength && L'.' == DirInfo->FileNameBuf[0] &&
+            L'.' == DirInfo->FileNameBuf[1]);
+}
+
+/*
+ * Find the position of FileName in a DirInfo buffer: the offset of the first entry whose
+ * name is not less than FileName, or of the EOF marker. *PComparison receives 0 if the
+ * entry at that position has the same name and a positive value otherwise. If the buffer
+ * has no EOF marker and all its names are less than FileName, *POffset receives Size
+ * (the position lies beyond the cached part of the listing). Returns FALSE if the buffer
+ * is malformed.
+ */
+static inline BOOLEAN FspDirInfoBufferSeek(PVOID Buffer, ULONG Size,
+    PCWSTR FileName, ULONG FileNameLength,
+    FSP_DIR_INFO_COMPARE *Compare, BOOLEAN CaseInsensitive,
+    PULONG POffset, PINT PComparison)
+{
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    ULONG Offset;
+    INT Comparison;
+
+    *POffset = Size;
+    *PComparison = 1;
+
+    for (Offset = 0; Offset + sizeof(DirInfo->Size) <= Size;
+        Offset += FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size))
+    {
+        DirInfo = (PVOID)((PUINT8)Buffer + Offset);
+
+        if (sizeof(FSP_FSCTL_DIR_INFO) > DirInfo->Size)
+        {
+            /* EOF marker */
+            *POffset = Offset;
+            return TRUE;
+        }
+
+        if (Offset + DirInfo->Size > Size)
+            return FALSE;
+
+        if (FspDirInfoIsDotEntry(DirInfo))
+            continue;
+
+        Comparison = Compare(
+            DirInfo->FileNameBuf, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO),
+            FileName, FileNameLength,
+            CaseInsensitive);
+        if (0 <= Comparison)
+        {
+            *POffset = Offset;
+            *PComparison = Comparison;
+            return TRUE;
+        }
+    }
+
+    return Offset == Size;
+}
+
+/*
+ * Insert DirInfo into a sorted DirInfo buffer. NewBuffer must have room for
+ * Size + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size) bytes. On success *PNewSize receives
+ * the size of the patched buffer, or 0 if the entry falls beyond the cached part of the
+ * listing (the buffer needs no change). Returns FALSE if the buffer is malformed or
+ * already has an entry with the same name.
+ */
+static inline BOOLEAN FspDirInfoBufferInsert(PVOID Buffer, ULONG Size,
+    const FSP_FSCTL_DIR_INFO *DirInfo,
+    FSP_DIR_INFO_COMPARE *Compare, BOOLEAN CaseInsensitive,
+    PVOID NewBuffer, PULONG PNewSize)
+{
+    ULONG Offset, DirInfoSize;
+    INT Comparison;
+
+    *PNewSize = 0;
+
+    if (!FspDirInfoBufferSeek(Buffer, Size,
+        DirInfo->FileNameBuf, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO),
+        Compare, CaseInsensitive,
+        &Offset, &Comparison))
+        return FALSE;
+    if (0 == Comparison)
+        return FALSE;
+    if (Offset == Size)
+        return TRUE;
+
+    DirInfoSize = FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size);
+    RtlCopyMemory(NewBuffer, Buffer, Offset);
+    RtlCopyMemory((PUINT8)NewBuffer + Offset, DirInfo, DirInfo->Size);
+    RtlZeroMemory((PUINT8)NewBuffer + Offset + DirInfo->Size, DirInfoSize - DirInfo->Size);
+    RtlCopyMemory((PUINT8)NewBuffer + Offset + DirInfoSize, (PUINT8)Buffer + Offset, Size - Offset);
+    *PNewSize = Size + DirInfoSize;
+
+    return TRUE;
+}
+
+/*
+ * Remove the entry named FileName from a sorted DirInfo buffer. NewBuffer must have room
+ * for Size bytes. On success *PNewSize receives the size of the patched buffer, or 0 if
+ * the entry falls beyond the cached part of the listing (the buffer needs no change).
+ * Returns FALSE if the buffer is malformed or if FileName falls within the cached part
+ * of the listing but has no entry there; such a buffer does not match the directory.
+ */
+static inline BOOLEAN FspDirInfoBufferRemove(PVOID Buffer, ULONG Size,
+    PCWSTR FileName, ULONG FileNameLength,
+    FSP_DIR_INFO_COMPARE *Compare, BOOLEAN CaseInsensitive,
+    PVOID NewBuffer, PULONG PNewSize)
+{
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    ULONG Offset, DirInfoSize;
+    INT Comparison;
+
+    *PNewSize = 0;
+
+    if (!FspDirInfoBufferSeek(Buffer, Size,
+        FileName, FileNameLength,
+        Compare, CaseInsensitive,
+        &Offset, &Comparison))
+        return FALSE;
+    if (0 != Comparison)
+        return Offset == Size;
+
+    DirInfo = (PVOID)((PUINT8)Buffer + Offset);
+    DirInfoSize = FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size);
+    if (Offset + DirInfoSize > Size)
+        DirInfoSize = Size - Offset;
+    RtlCopyMemory(NewBuffer, Buffer, Offset);
+    RtlCopyMemory((PUINT8)NewBuffer + Offset,
+        (PUINT8)Buffer + Offset + DirInfoSize, Size - Offset - DirInfoSize);
+    *PNewSize = Size - DirInfoSize;
+
+    return TRUE;
+}
+
+#endif
@@ -62,11 +62,48 @@ BOOLEAN FspFastIoCheckIfPossible(
     PIO_STATUS_BLOCK IoStatus,
     PDEVICE_OBJECT DeviceObject)
 {
+    /* Callers:
+     *     FsRtlCopyRead, FsRtlCopyWrite, FsRtlMdlReadDev, FsRtlPrepareMdlWriteDev
+     *     (with the FileNode Main resource already acquired)
+     */
+
     FSP_ENTER_BOOL(PAGED_CODE());
 
+    FSP_FILE_NODE *FileNode = FileObject->FsContext;
+    LARGE_INTEGER Length64;
+
     Result = FALSE;
 
-    FSP_LEAVE_BOOL("FileObject=%p", FileObject);
+    /* only regular files opened for cached I/O */
+    if (!FspFileNodeIsValid(FileNode) || FileNode->IsDirectory ||
+        !FlagOn(FileObject->Flags, FO_CACHE_SUPPORTED))
+        FSP_RETURN();
+
+    /* expired info or a stale cache requires revalidation; see FspFileNodeRevalidateCache */
+    if (!FspFileNodeCacheValid(FileNode))
+        FSP_RETURN();
+
+    Length64.QuadPart = Length;
+
+    if (CheckForReadOperation)
+        Result = FsRtlFastCheckLockForRead(&FileNode->FileLock,
+            FileOffset, &Length64, LockKey, FileObject, PsGetCurrentProcess());
+    else
+    {
+        /*
+         * Writes that extend the file must go through the IRP path,
+         * because the user mode file system must be told about the new file size.
+         */
+        if ((FILE_WRITE_TO_END_OF_FILE == FileOffset->LowPart && -1L == FileOffset->HighPart) ||
+            (UINT64)FileOffset->QuadPart + Length > (UINT64)FileNode->Header.FileSize.QuadPart)
+            FSP_RETURN();
+
+        Result = FsRtlFastCheckLockForWrite(&FileNode->FileLock,
+            FileOffset, &Length64, LockKey, FileObject, PsGetCurrentProcess());
+    }
+
+    FSP_LEAVE_BOOL("FileObject=%p, FileOffset=%lld, Length=%lu, CheckForReadOperation=%d",
+        FileObject, FileOffset->QuadPart, Length, CheckForReadOperation);
 }
 
 VOID FspAcquireFileForNtCreateSection(
@@ -23,6 +23,11 @@ static NTSTATUS FspFsvrtClose(
     PDEVICE_OBJECT DeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 static NTSTATUS FspFsvolClose(
     PDEVICE_OBJECT DeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+static VOID FspFsvolCloseBatchAdd(PDEVICE_OBJECT FsvolDeviceObject,
+    UINT64 UserContext, UINT64 UserContext2);
+static VOID FspFsvolCloseBatchPost(PDEVICE_OBJECT FsvolDeviceObject,
+    FSP_FSCTL_TRANSACT_REQ *Request);
+VOID FspFsvolCloseBatchFlush(PDEVICE_OBJECT FsvolDeviceObject);
 FSP_IOCMPL_DISPATCH FspFsvolCloseComplete;
 FSP_DRIVER_DISPATCH FspClose;
 
@@ -30,6 +35,9 @@ FSP_DRIVER_DISPATCH FspClose;
 #pragma alloc_text(PAGE, FspFsctlClose)
 #pragma alloc_text(PAGE, FspFsvrtClose)
 #pragma alloc_text(PAGE, FspFsvolClose)
+#pragma alloc_text(PAGE, FspFsvolCloseBatchAdd)
+#pragma alloc_text(PAGE, FspFsvolCloseBatchPost)
+#pragma alloc_text(PAGE, FspFsvolCloseBatchFlush)
 #pragma alloc_text(PAGE, FspFsvolCloseComplete)
 #pragma alloc_text(PAGE, FspClose)
 #endif
@@ -64,15 +72,20 @@ static NTSTATUS FspFsvolClose(
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     FSP_FILE_NODE *FileNode = FileObject->FsContext;
     FSP_FILE_DESC *FileDesc = FileObject->FsContext2;
-    FSP_FSCTL_TRANSACT_REQ *Request;
+    FSP_FSCTL_TRANSACT_REQ *Request = 0;
+    UINT64 UserContext = FileNode->UserContext;
+    UINT64 UserContext2 = FileDesc->UserContext2;
 
     ASSERT(FileNode == FileDesc->FileNode);
 
     /* create the user-mode file system request; MustSucceed because IRP_MJ_CLOSE cannot fail */
-    FspIopCreateRequestMustSucceed(0, 0, 0, &Request);
-    Request->Kind = FspFsctlTransactCloseKind;
-    Request->Req.Close.UserContext = FileNode->UserContext;
-    Request->Req.Close.UserContext2 = FileDesc->UserContext2;
+    if (0 == FspFsvolDeviceExtension(FsvolDeviceObject)->VolumeParams.CloseBatchSize)
+    {
+        FspIopCreateRequestMustSucceed(0, 0, 0, &Request);
+        Request->Kind = FspFsctlTransactCloseKind;
+        Request->Req.Close.UserContext = UserContext;
+        Request->Req.Close.UserContext2 = UserContext2;
+    }
 
     FspFileNodeClose(FileNode, FileObject);
 
@@ -80,6 +93,14 @@ static NTSTATUS FspFsvolClose(
     FspFileDescDelete(FileDesc);
     FspFileNodeDereference(FileNode);
 
+    /* if batching closes add this one to the volume's current batch */
+    if (0 == Request)
+    {
+        FspFsvolCloseBatchAdd(FsvolDeviceObject, UserContext, UserContext2);
+        Irp->IoStatus.Information = 0;
+        return STATUS_SUCCESS;
+    }
+
     /*
      * Post as a BestEffort work request. This allows us to complete our own IRP
      * and return immediately.
@@ -96,6 +117,88 @@ static NTSTATUS FspFsvolClose(
     return STATUS_SUCCESS;
 }
 
+/*
+ * Close batching.
+ *
+ * When VolumeParams.CloseBatchSize is set, closes are not sent to the user mode file system
+ * one at a time. Instead they are accumulated in a single CloseBatch request per volume,
+ * which is sent when it holds CloseBatchSize closes or at the latest on the next tick of the
+ * volume expiration timer (about one second). The batch is also sent when the file system
+ * stops or deletes its volume, before the volume I/O queue stops accepting requests.
+ *
+ * A batched close is therefore delivered late. This is only suitable for file systems
+ * that release nothing in Close that a subsequent Create may depend on (e.g. an exclusive
+ * handle to a backing file).
+ */
+static VOID FspFsvolCloseBatchAdd(PDEVICE_OBJECT FsvolDeviceObject,
+    UINT64 UserContext, UINT64 UserContext2)
+{
+    PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    ULONG CloseBatchSize = FsvolDeviceExtension->VolumeParams.CloseBatchSize;
+    FSP_FSCTL_TRANSACT_REQ *Request, *PostRequest = 0;
+    FSP_FSCTL_CLOSE_BATCH_ITEM *Item;
+
+    ExAcquireFastMutex(&FsvolDeviceExtension->CloseBatchMutex);
+
+    Request = FsvolDeviceExtension->CloseBatchRequest;
+    if (0 == Request)
+    {
+        FspIopCreateRequestMustSucceed(0, 0,
+            CloseBatchSize * sizeof(FSP_FSCTL_CLOSE_BATCH_ITEM), &Request);
+        Request->Kind = FspFsctlTransactCloseBatchKind;
+        FsvolDeviceExtension->CloseBatchRequest = Request;
+    }
+
+    Item = (FSP_FSCTL_CLOSE_BATCH_ITEM *)Request->Buffer + Request->Req.CloseBatch.Count++;
+    Item->UserContext = UserContext;
+    Item->UserContext2 = UserContext2;
+
+    if (CloseBatchSize <= Request->Req.CloseBatch.Count)
+    {
+        FsvolDeviceExtension->CloseBatchRequest = 0;
+        PostRequest = Request;
+    }
+
+    ExReleaseFastMutex(&FsvolDeviceExtension->CloseBatchMutex);
+
+    if (0 != PostRequest)
+        FspFsvolCloseBatchPost(FsvolDeviceObject, PostRequest);
+}
+
+static VOID FspFsvolCloseBatchPost(PDEVICE_OBJECT FsvolDeviceObject,
+    FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    PAGED_CODE();
+
+    /* only send the items in use */
+    Request->Size = (UINT16)(sizeof *Request +
+        Request->Req.CloseBatch.Count * sizeof(FSP_FSCTL_CLOSE_BATCH_ITEM));
+
+    /* see FspFsvolClose for why BestEffort is sufficient */
+    FspIopPostWorkRequestBestEffort(FsvolDeviceObject, Request);
+}
+
+VOID FspFsvolCloseBatchFlush(PDEVICE_OBJECT FsvolDeviceObject)
+{
+    PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    FSP_FSCTL_TRANSACT_REQ *Request;
+
+    if (0 == FsvolDeviceExtension->VolumeParams.CloseBatchSize)
+        return;
+
+    ExAcquireFastMutex(&FsvolDeviceExtension->CloseBatchMutex);
+    Request = FsvolDeviceExtension->CloseBatchRequest;
+    FsvolDeviceExtension->CloseBatchRequest = 0;
+    ExReleaseFastMutex(&FsvolDeviceExtension->CloseBatchMutex);
+
+    if (0 != Request)
+        FspFsvolCloseBatchPost(FsvolDeviceObject, Request);
+}
+
 NTSTATUS FspFsvolCloseComplete(
     PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Response)
 {
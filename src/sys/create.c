@@ -31,9 +31,25 @@ static NTSTATUS FspFsvolCreateTryOpen(PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Re
     FSP_FILE_NODE *FileNode, FSP_FILE_DESC *FileDesc, PFILE_OBJECT FileObject,
     BOOLEAN FlushImage);
 static VOID FspFsvolCreatePostClose(FSP_FILE_DESC *FileDesc);
+static BOOLEAN FspFsvolCreateNegativeNameCacheable(FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension,
+    ULONG CreateDisposition, BOOLEAN OpenTargetDirectory, BOOLEAN CaseSensitive,
+    BOOLEAN HasTraversePrivilege);
 static FSP_IOP_REQUEST_FINI FspFsvolCreateRequestFini;
 static FSP_IOP_REQUEST_FINI FspFsvolCreateTryOpenRequestFini;
 static FSP_IOP_REQUEST_FINI FspFsvolCreateOverwriteRequestFini;
+static VOID FspFsvolCreateCloseAccessToken(HANDLE AccessToken, PEPROCESS Process);
+static BOOLEAN FspFsvolQueryOpen(
+    PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp,
+    PFILE_NETWORK_OPEN_INFORMATION NetworkInformation);
+static NTSTATUS FspFsvolQueryOpenRequest(
+    PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp,
+    PUNICODE_STRING FileName, FSP_FSCTL_FILE_INFO *FileInfo);
+static BOOLEAN FspFsvolQueryOpenFileInfoCacheMatch(
+    const FSP_FILE_INFO_CACHE_DATA *CacheEntry, const FSP_FILE_INFO_CACHE_DATA *CacheData);
+static IO_COMPLETION_ROUTINE FspFsvolQueryOpenCompletion;
+NTSTATUS FspFsvolQueryOpenComplete(PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Response);
+static FSP_IOP_REQUEST_FINI FspFsvolQueryOpenRequestFini;
+FAST_IO_QUERY_OPEN FspFastIoQueryOpen;
 FSP_DRIVER_DISPATCH FspCreate;
 
 #ifdef ALLOC_PRAGMA
@@ -45,9 +61,17 @@ FSP_DRIVER_DISPATCH FspCreate;
 #pragma alloc_text(PAGE, FspFsvolCreateComplete)
 #pragma alloc_text(PAGE, FspFsvolCreateTryOpen)
 #pragma alloc_text(PAGE, FspFsvolCreatePostClose)
+#pragma alloc_text(PAGE, FspFsvolCreateNegativeNameCacheable)
 #pragma alloc_text(PAGE, FspFsvolCreateRequestFini)
 #pragma alloc_text(PAGE, FspFsvolCreateTryOpenRequestFini)
 #pragma alloc_text(PAGE, FspFsvolCreateOverwriteRequestFini)
+#pragma alloc_text(PAGE, FspFsvolCreateCloseAccessToken)
+#pragma alloc_text(PAGE, FspFsvolQueryOpen)
+#pragma alloc_text(PAGE, FspFsvolQueryOpenRequest)
+#pragma alloc_text(PAGE, FspFsvolQueryOpenFileInfoCacheMatch)
+#pragma alloc_text(PAGE, FspFsvolQueryOpenComplete)
+#pragma alloc_text(PAGE, FspFsvolQueryOpenRequestFini)
+#pragma alloc_text(PAGE, FspFastIoQueryOpen)
 #pragma alloc_text(PAGE, FspCreate)
 #endif
 
@@ -68,6 +92,11 @@ enum
     RequestFileObject                   = 2,
     RequestState                        = 3,
 
+    /* QueryOpen */
+    RequestSubjectContext               = 0,
+    //RequestAccessToken                = 2,
+    //RequestProcess                    = 3,
+
     /* RequestState */
     RequestPending                      = 0,
     RequestProcessing                   = 1,
@@ -321,6 +350,16 @@ static NTSTATUS FspFsvolCreateNoLock(
         return STATUS_CANNOT_DELETE;
     }
 
+    /* was this name recently reported as not found? */
+    if (FspFsvolCreateNegativeNameCacheable(FsvolDeviceExtension,
+        CreateDisposition, BooleanFlagOn(Flags, SL_OPEN_TARGET_DIRECTORY),
+        BooleanFlagOn(Flags, SL_CASE_SENSITIVE), HasTraversePrivilege) &&
+        FspNameCacheLookup(FsvolDeviceExtension->NegativeNameCache, &FileNode->FileName))
+    {
+        FspFileNodeDereference(FileNode);
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
     Result = FspFileDescCreate(&FileDesc);
     if (!NT_SUCCESS(Result))
     {
@@ -354,6 +393,8 @@ static NTSTATUS FspFsvolCreateNoLock(
         0 != FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch ||
         BooleanFlagOn(Flags, SL_CASE_SENSITIVE);
     FileDesc->HasTraversePrivilege = HasTraversePrivilege;
+    FileDesc->NegativeNameCacheGeneration =
+        FspNameCacheGeneration(FsvolDeviceExtension->NegativeNameCache);
     FspFsvolDeviceFileRenameSetOwner(FsvolDeviceObject, Request);
     FspIopRequestContext(Request, RequestDeviceObject) = FsvolDeviceObject;
     FspIopRequestContext(Request, RequestFileDesc) = FileDesc;
@@ -401,10 +442,12 @@ NTSTATUS FspFsvolCreatePrepare(
     FSP_FILE_DESC *FileDesc;
     PFILE_OBJECT FileObject;
 
-    if (FspFsctlTransactCreateKind == Request->Kind)
+    if (FspFsctlTransactCreateKind == Request->Kind ||
+        FspFsctlTransactQueryOpenKind == Request->Kind)
     {
-        SecuritySubjectContext = &IrpSp->Parameters.Create.SecurityContext->
-            AccessState->SubjectSecurityContext;
+        SecuritySubjectContext = FspFsctlTransactCreateKind == Request->Kind ?
+            &IrpSp->Parameters.Create.SecurityContext->AccessState->SubjectSecurityContext :
+            FspIopRequestContext(Request, RequestSubjectContext);
 
         /* duplicate the subject context access token into an impersonation token */
         SecurityQualityOfService.Length = sizeof SecurityQualityOfService;
@@ -498,6 +541,15 @@ NTSTATUS FspFsvolCreateComplete(
         /* did the user-mode file system sent us a failure code? */
         if (!NT_SUCCESS(Response->IoStatus.Status))
         {
+            if (STATUS_OBJECT_NAME_NOT_FOUND == Response->IoStatus.Status &&
+                FspFsvolCreateNegativeNameCacheable(FsvolDeviceExtension,
+                    (Request->Req.Create.CreateOptions >> 24) & 0xff,
+                    0 != Request->Req.Create.OpenTargetDirectory,
+                    0 != Request->Req.Create.CaseSensitive,
+                    0 != Request->Req.Create.HasTraversePrivilege))
+                FspNameCacheAddName(FsvolDeviceExtension->NegativeNameCache,
+                    &FileNode->FileName, FileDesc->NegativeNameCacheGeneration);
+
             Irp->IoStatus.Information = 0;
             Result = Response->IoStatus.Status;
             FSP_RETURN();
@@ -644,6 +696,11 @@ NTSTATUS FspFsvolCreateComplete(
             }
         }
 
+        /* a newly created file can no longer be "not found" */
+        if (FILE_CREATED == Response->IoStatus.Information)
+            FspNameCacheInvalidatePrefix(FsvolDeviceExtension->NegativeNameCache,
+                &FileNode->FileName);
+
         /* fix FileNode->FileName if we were doing SL_OPEN_TARGET_DIRECTORY */
         if (Request->Req.Create.OpenTargetDirectory)
         {
@@ -688,7 +745,8 @@ NTSTATUS FspFsvolCreateComplete(
         FileObject->PrivateCacheMap = 0;
         FileObject->FsContext = FileNode;
         FileObject->FsContext2 = FileDesc;
-        if (FspTimeoutInfinity32 == FsvolDeviceExtension->VolumeParams.FileInfoTimeout &&
+        if ((FspTimeoutInfinity32 == FsvolDeviceExtension->VolumeParams.FileInfoTimeout ||
+                FsvolDeviceExtension->VolumeParams.CacheValidation) &&
             !FlagOn(IrpSp->Parameters.Create.Options, FILE_NO_INTERMEDIATE_BUFFERING))
             /* enable caching! */
             SetFlag(FileObject->Flags, FO_CACHE_SUPPORTED);
@@ -836,6 +894,7 @@ static NTSTATUS FspFsvolCreateTryOpen(PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Re
         return Result;
     }
 
+    FspFileNodeValidateCache(FileNode, &Response->Rsp.Create.Opened.FileInfo);
     FspFileNodeSetFileInfo(FileNode, FileObject, &Response->Rsp.Create.Opened.FileInfo);
 
     if (FlushImage)
@@ -902,6 +961,29 @@ static VOID FspFsvolCreatePostClose(FSP_FILE_DESC *FileDesc)
      */
 }
 
+static BOOLEAN FspFsvolCreateNegativeNameCacheable(FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension,
+    ULONG CreateDisposition, BOOLEAN OpenTargetDirectory, BOOLEAN CaseSensitive,
+    BOOLEAN HasTraversePrivilege)
+{
+    PAGED_CODE();
+
+    /*
+     * A "not found" result may be reused only for opens that would fail the same way:
+     *
+     *   - The open must not be able to create the file.
+     *   - A case-sensitive open on a case-insensitive volume may miss names that a
+     *     case-insensitive open would find.
+     *   - Without traverse privilege the user mode file system may fail the open with
+     *     STATUS_ACCESS_DENIED instead; only cache results that do not depend on it.
+     */
+    return
+        0 != FsvolDeviceExtension->NegativeNameCache &&
+        (FILE_OPEN == CreateDisposition || FILE_OVERWRITE == CreateDisposition) &&
+        !OpenTargetDirectory &&
+        (!CaseSensitive || FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch) &&
+        HasTraversePrivilege;
+}
+
 static VOID FspFsvolCreateRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, PVOID Context[4])
 {
     PAGED_CODE();
@@ -918,28 +1000,7 @@ static VOID FspFsvolCreateRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, PVOID Con
     }
 
     if (0 != AccessToken)
-    {
-        KAPC_STATE ApcState;
-        BOOLEAN Attach;
-
-        ASSERT(0 != Process);
-        Attach = Process != PsGetCurrentProcess();
-
-        if (Attach)
-            KeStackAttachProcess(Process, &ApcState);
-#if DBG
-        NTSTATUS Result0;
-        Result0 = ObCloseHandle(AccessToken, UserMode);
-        if (!NT_SUCCESS(Result0))
-            DEBUGLOG("ObCloseHandle() = %s", NtStatusSym(Result0));
-#else
-        ObCloseHandle(AccessToken, UserMode);
-#endif
-        if (Attach)
-            KeUnstackDetachProcess(&ApcState);
-
-        ObDereferenceObject(Process);
-    }
+        FspFsvolCreateCloseAccessToken(AccessToken, Process);
 
     if (0 != FsvolDeviceObject)
         FspFsvolDeviceFileRenameReleaseOwner(FsvolDeviceObject, Request);
@@ -994,6 +1055,380 @@ static VOID FspFsvolCreateOverwriteRequestFini(FSP_FSCTL_TRANSACT_REQ *Request,
         FspFsvolDeviceFileRenameReleaseOwner(FsvolDeviceObject, Request);
 }
 
+static VOID FspFsvolCreateCloseAccessToken(HANDLE AccessToken, PEPROCESS Process)
+{
+    PAGED_CODE();
+
+    KAPC_STATE ApcState;
+    BOOLEAN Attach;
+
+    ASSERT(0 != Process);
+    Attach = Process != PsGetCurrentProcess();
+
+    if (Attach)
+        KeStackAttachProcess(Process, &ApcState);
+#if DBG
+    NTSTATUS Result0;
+    Result0 = ObCloseHandle(AccessToken, UserMode);
+    if (!NT_SUCCESS(Result0))
+        DEBUGLOG("ObCloseHandle() = %s", NtStatusSym(Result0));
+#else
+    ObCloseHandle(AccessToken, UserMode);
+#endif
+    if (Attach)
+        KeUnstackDetachProcess(&ApcState);
+
+    ObDereferenceObject(Process);
+}
+
+/*
+ * Attribute-only opens.
+ *
+ * Calls such as GetFileAttributes are issued by the I/O manager as a FastIoQueryOpen
+ * followed (if it fails) by a regular create, a query and a close. When the volume has
+ * VolumeParams.QueryOpen set, we answer such opens with a single QueryOpen request to the
+ * user mode file system, which returns the FSP_FSCTL_FILE_INFO for the file name. No
+ * FSP_FILE_NODE is created and no Close request is ever sent.
+ *
+ * The FSP_FSCTL_FILE_INFO returned is remembered in the FileInfoCache for FileInfoTimeout.
+ * Items are tagged with the access token (and requestor mode and traverse privilege) of
+ * the caller that the file system granted access to and are only used for the same kind
+ * of caller. The logon session is not enough: restricted, AppContainer and lower integrity
+ * tokens share the logon session of the token they were derived from. A token that is
+ * modified (e.g. AdjustTokenGroups) changes its ModifiedId and no longer matches. A name is invalidated when its FileNode leaves the ContextByNameTable (i.e.
+ * the file was open and may have changed), when it is renamed and when entries are added
+ * to or removed from its directory. While a file is open the cache only authorizes the
+ * caller; the file info itself comes from the FileNode.
+ *
+ * Anything out of the ordinary (relative opens, streams, files with unknown or delete
+ * pending state, reparse points, etc.) falls back to the regular create path.
+ */
+static BOOLEAN FspFsvolQueryOpen(
+    PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp,
+    PFILE_NETWORK_OPEN_INFORMATION NetworkInformation)
+{
+    PAGED_CODE();
+
+    NTSTATUS Result;
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    PFILE_OBJECT FileObject = IrpSp->FileObject;
+    UNICODE_STRING FileName = FileObject->FileName;
+    PACCESS_STATE AccessState = IrpSp->Parameters.Create.SecurityContext->AccessState;
+    ULONG CreateDisposition = (IrpSp->Parameters.Create.Options >> 24) & 0xff;
+    ULONG CreateOptions = IrpSp->Parameters.Create.Options;
+    ACCESS_MASK DesiredAccess = IrpSp->Parameters.Create.SecurityContext->DesiredAccess;
+    ULONG Flags = IrpSp->Flags;
+    KPROCESSOR_MODE RequestorMode =
+        FlagOn(Flags, SL_FORCE_ACCESS_CHECK) ? UserMode : Irp->RequestorMode;
+    BOOLEAN HasTraversePrivilege =
+        BooleanFlagOn(AccessState->Flags, TOKEN_HAS_TRAVERSE_PRIVILEGE);
+    BOOLEAN CaseSensitive = BooleanFlagOn(Flags, SL_CASE_SENSITIVE);
+    ULONG NegativeNameCacheGeneration, FileInfoCacheGeneration;
+    BOOLEAN FileInfoCacheable, FileInfoCached, Success;
+    FSP_FILE_INFO_CACHE_DATA CacheData, CacheEntry;
+    PTOKEN_STATISTICS Statistics;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    FSP_FILE_NODE *FileNode;
+
+    /* only plain opens of existing files by absolute name that ask for attributes only */
+    if (!FsvolDeviceExtension->VolumeParams.QueryOpen ||
+        0 != FileObject->RelatedFileObject ||
+        0 != Irp->AssociatedIrp.SystemBuffer/* EaBuffer */ ||
+        FILE_OPEN != CreateDisposition ||
+        FlagOn(CreateOptions,
+            FILE_OPEN_BY_FILE_ID | FILE_DELETE_ON_CLOSE | FILE_DIRECTORY_FILE | FILE_NON_DIRECTORY_FILE) ||
+        FlagOn(Flags, SL_OPEN_TARGET_DIRECTORY | SL_OPEN_PAGING_FILE) ||
+        FlagOn(DesiredAccess, ~(FILE_READ_ATTRIBUTES | SYNCHRONIZE)))
+        return FALSE;
+
+    /* according to fastfat, filenames that begin with two backslashes are ok */
+    if (sizeof(WCHAR) * 2 <= FileName.Length &&
+        L'\\' == FileName.Buffer[1] && L'\\' == FileName.Buffer[0])
+    {
+        FileName.Length -= sizeof(WCHAR);
+        FileName.MaximumLength -= sizeof(WCHAR);
+        FileName.Buffer++;
+    }
+
+    /* named streams and invalid names are left to the regular create */
+    if (!FspUnicodePathIsValid(&FileName, FALSE) ||
+        sizeof(WCHAR) > FileName.Length || L'\\' != FileName.Buffer[0])
+        return FALSE;
+
+    /* check and remove any volume prefix */
+    if (0 < FsvolDeviceExtension->VolumePrefix.Length)
+    {
+        if (!FspFsvolDeviceVolumePrefixInString(FsvolDeviceObject, &FileName) ||
+            (FileName.Length > FsvolDeviceExtension->VolumePrefix.Length &&
+            '\\' != FileName.Buffer[FsvolDeviceExtension->VolumePrefix.Length / sizeof(WCHAR)]))
+            return FALSE;
+
+        if (FileName.Length > FsvolDeviceExtension->VolumePrefix.Length)
+        {
+            FileName.Length -= FsvolDeviceExtension->VolumePrefix.Length;
+            FileName.MaximumLength -= FsvolDeviceExtension->VolumePrefix.Length;
+            FileName.Buffer += FsvolDeviceExtension->VolumePrefix.Length / sizeof(WCHAR);
+        }
+        else
+            FileName.Length = sizeof(WCHAR);
+    }
+
+    /* trailing backslashes are left to the regular create */
+    if (sizeof(WCHAR) * 2/* not empty or root */ <= FileName.Length &&
+        L'\\' == FileName.Buffer[FileName.Length / sizeof(WCHAR) - 1])
+        return FALSE;
+
+    /* the cache follows the volume case sensitivity; it cannot answer case sensitive opens */
+    FileInfoCacheable = 0 != FsvolDeviceExtension->FileInfoCache &&
+        (!CaseSensitive || FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch);
+    if (FileInfoCacheable)
+    {
+        RtlZeroMemory(&CacheData, sizeof CacheData);
+        SeLockSubjectContext(&AccessState->SubjectSecurityContext);
+        Result = SeQueryInformationToken(
+            SeQuerySubjectContextToken(&AccessState->SubjectSecurityContext),
+            TokenStatistics, &Statistics);
+        SeUnlockSubjectContext(&AccessState->SubjectSecurityContext);
+        FileInfoCacheable = NT_SUCCESS(Result);
+        if (FileInfoCacheable)
+        {
+            CacheData.TokenId = Statistics->TokenId;
+            CacheData.ModifiedId = Statistics->ModifiedId;
+            FspFreeExternal(Statistics);
+        }
+        CacheData.UserMode = UserMode == RequestorMode;
+        CacheData.HasTraversePrivilege = HasTraversePrivilege;
+    }
+
+    /* capture the generation before the ContextByNameTable lookup (which may invalidate) */
+    FileInfoCacheGeneration = FspNameCacheGeneration(FsvolDeviceExtension->FileInfoCache);
+    FileInfoCached = FileInfoCacheable &&
+        FspNameCacheLookupData(FsvolDeviceExtension->FileInfoCache, &FileName, &CacheEntry) &&
+        FspFsvolQueryOpenFileInfoCacheMatch(&CacheEntry, &CacheData);
+
+    FspFsvolDeviceLockContextTableShared(FsvolDeviceObject);
+    FileNode = FspFsvolDeviceLookupContextByName(FsvolDeviceObject, &FileName);
+    if (0 != FileNode)
+        FspFileNodeReference(FileNode);
+    FspFsvolDeviceUnlockContextTable(FsvolDeviceObject);
+
+    if (0 != FileNode)
+    {
+        /* an open file may have state (cached data, delete pending) the file system has not seen */
+        Success = FALSE;
+        if (FileInfoCached && FspFileNodeTryAcquireShared(FileNode, Main))
+        {
+            Success = !FileNode->DeletePending && FspFileNodeTryGetFileInfo(FileNode, &FileInfo);
+            FspFileNodeRelease(FileNode, Main);
+        }
+        FspFileNodeDereference(FileNode);
+        if (!Success)
+            return FALSE;
+
+        Result = STATUS_SUCCESS;
+    }
+    else if (FileInfoCached)
+    {
+        FileInfo = CacheEntry.FileInfo;
+        Result = STATUS_SUCCESS;
+    }
+    else
+    {
+        /* was this name recently reported as not found? */
+        if (FspFsvolCreateNegativeNameCacheable(FsvolDeviceExtension,
+            CreateDisposition, FALSE, CaseSensitive, HasTraversePrivilege) &&
+            FspNameCacheLookup(FsvolDeviceExtension->NegativeNameCache, &FileName))
+        {
+            Irp->IoStatus.Status = STATUS_OBJECT_NAME_NOT_FOUND;
+            Irp->IoStatus.Information = 0;
+            return TRUE;
+        }
+        NegativeNameCacheGeneration = FspNameCacheGeneration(FsvolDeviceExtension->NegativeNameCache);
+
+        Result = FspFsvolQueryOpenRequest(FsvolDeviceObject, Irp, IrpSp, &FileName, &FileInfo);
+
+        if (STATUS_SUCCESS == Result && FileInfoCacheable)
+        {
+            CacheData.FileInfo = FileInfo;
+            FspNameCacheAddNameData(FsvolDeviceExtension->FileInfoCache,
+                &FileName, FileInfoCacheGeneration, &CacheData);
+        }
+        else if (STATUS_OBJECT_NAME_NOT_FOUND == Result &&
+            FspFsvolCreateNegativeNameCacheable(FsvolDeviceExtension,
+                CreateDisposition, FALSE, CaseSensitive, HasTraversePrivilege))
+            FspNameCacheAddName(FsvolDeviceExtension->NegativeNameCache,
+                &FileName, NegativeNameCacheGeneration);
+    }
+
+    switch (Result)
+    {
+    case STATUS_SUCCESS:
+        /* reparse points must be resolved by the regular create */
+        if (FlagOn(FileInfo.FileAttributes, FILE_ATTRIBUTE_REPARSE_POINT) &&
+            !FlagOn(CreateOptions, FILE_OPEN_REPARSE_POINT))
+            return FALSE;
+        NetworkInformation->AllocationSize.QuadPart = FileInfo.AllocationSize;
+        NetworkInformation->EndOfFile.QuadPart = FileInfo.FileSize;
+        NetworkInformation->CreationTime.QuadPart = FileInfo.CreationTime;
+        NetworkInformation->LastAccessTime.QuadPart = FileInfo.LastAccessTime;
+        NetworkInformation->LastWriteTime.QuadPart = FileInfo.LastWriteTime;
+        NetworkInformation->ChangeTime.QuadPart = FileInfo.ChangeTime;
+        NetworkInformation->FileAttributes = 0 != FileInfo.FileAttributes ?
+            FileInfo.FileAttributes : FILE_ATTRIBUTE_NORMAL;
+        break;
+    case STATUS_OBJECT_NAME_NOT_FOUND:
+    case STATUS_OBJECT_PATH_NOT_FOUND:
+    case STATUS_ACCESS_DENIED:
+        break;
+    default:
+        /* STATUS_REPARSE, STATUS_INVALID_DEVICE_REQUEST (no GetFileInfoByName), etc. */
+        return FALSE;
+    }
+
+    Irp->IoStatus.Status = Result;
+    Irp->IoStatus.Information = STATUS_SUCCESS == Result ? FILE_OPENED : 0;
+    return TRUE;
+}
+
+static NTSTATUS FspFsvolQueryOpenRequest(
+    PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp,
+    PUNICODE_STRING FileName, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    PAGED_CODE();
+
+    NTSTATUS Result;
+    PACCESS_STATE AccessState = IrpSp->Parameters.Create.SecurityContext->AccessState;
+    ULONG Flags = IrpSp->Flags;
+    KPROCESSOR_MODE RequestorMode =
+        FlagOn(Flags, SL_FORCE_ACCESS_CHECK) ? UserMode : Irp->RequestorMode;
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    PIRP QueryOpenIrp;
+    PIO_STACK_LOCATION QueryOpenIrpSp;
+    KEVENT Event;
+
+    /* create the user-mode file system request */
+    Result = FspIopCreateRequestEx(0, FileName, 0, FspFsvolQueryOpenRequestFini, &Request);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    /* populate the QueryOpen request; the create IRP (and its subject context) outlives it */
+    Request->Kind = FspFsctlTransactQueryOpenKind;
+    Request->Req.Create.CreateOptions = IrpSp->Parameters.Create.Options;
+    Request->Req.Create.AccessToken = 0;
+    Request->Req.Create.DesiredAccess = FILE_READ_ATTRIBUTES;
+    Request->Req.Create.UserMode = UserMode == RequestorMode;
+    Request->Req.Create.HasTraversePrivilege =
+        BooleanFlagOn(AccessState->Flags, TOKEN_HAS_TRAVERSE_PRIVILEGE);
+    Request->Req.Create.CaseSensitive = BooleanFlagOn(Flags, SL_CASE_SENSITIVE);
+    FspIopRequestContext(Request, RequestSubjectContext) = &AccessState->SubjectSecurityContext;
+
+    QueryOpenIrp = IoAllocateIrp(FsvolDeviceObject->StackSize, FALSE);
+    if (0 == QueryOpenIrp)
+    {
+        FspIopDeleteRequest(Request);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeInitializeEvent(&Event, NotificationEvent, FALSE);
+
+    QueryOpenIrpSp = IoGetNextIrpStackLocation(QueryOpenIrp);
+    QueryOpenIrp->RequestorMode = KernelMode;
+    QueryOpenIrp->UserBuffer = FileInfo;
+    QueryOpenIrpSp->MajorFunction = IRP_MJ_FILE_SYSTEM_CONTROL;
+    QueryOpenIrpSp->MinorFunction = IRP_MN_USER_FS_REQUEST;
+    QueryOpenIrpSp->Parameters.FileSystemControl.FsControlCode = FSP_FSCTL_QUERY_OPEN;
+    QueryOpenIrpSp->Parameters.FileSystemControl.InputBufferLength = Request->Size;
+    QueryOpenIrpSp->Parameters.FileSystemControl.Type3InputBuffer = Request;
+
+    IoSetCompletionRoutine(QueryOpenIrp, FspFsvolQueryOpenCompletion, &Event, TRUE, TRUE, TRUE);
+
+    /*
+     * If we do not receive STATUS_PENDING, we still own the Request and must delete it.
+     * Wait in KernelMode: the completion writes into the caller's FileInfo, which lives
+     * on our stack.
+     */
+    Result = IoCallDriver(FsvolDeviceObject, QueryOpenIrp);
+    if (STATUS_PENDING != Result)
+        FspIopDeleteRequest(Request);
+    KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, 0);
+    Result = QueryOpenIrp->IoStatus.Status;
+    IoFreeIrp(QueryOpenIrp);
+
+    return Result;
+}
+
+static BOOLEAN FspFsvolQueryOpenFileInfoCacheMatch(
+    const FSP_FILE_INFO_CACHE_DATA *CacheEntry, const FSP_FILE_INFO_CACHE_DATA *CacheData)
+{
+    PAGED_CODE();
+
+    /* a kernel mode grant does not cover user mode callers, nor a traverse grant non-traversers */
+    return
+        RtlEqualLuid(&CacheEntry->TokenId, &CacheData->TokenId) &&
+        RtlEqualLuid(&CacheEntry->ModifiedId, &CacheData->ModifiedId) &&
+        (CacheEntry->UserMode || !CacheData->UserMode) &&
+        (!CacheEntry->HasTraversePrivilege || CacheData->HasTraversePrivilege);
+}
+
+static NTSTATUS FspFsvolQueryOpenCompletion(
+    PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context)
+{
+    // !PAGED_CODE();
+
+    KeSetEvent((PKEVENT)Context, 1, FALSE);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+NTSTATUS FspFsvolQueryOpenComplete(PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    PAGED_CODE();
+
+    FSP_FSCTL_FILE_INFO *FileInfo = Irp->UserBuffer;
+
+    if (STATUS_SUCCESS != Response->IoStatus.Status)
+    {
+        Irp->IoStatus.Information = 0;
+        return Response->IoStatus.Status;
+    }
+
+    *FileInfo = Response->Rsp.QueryOpen.FileInfo;
+
+    Irp->IoStatus.Information = sizeof *FileInfo;
+    return STATUS_SUCCESS;
+}
+
+static VOID FspFsvolQueryOpenRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, PVOID Context[4])
+{
+    PAGED_CODE();
+
+    HANDLE AccessToken = Context[RequestAccessToken];
+    PEPROCESS Process = Context[RequestProcess];
+
+    if (0 != AccessToken)
+        FspFsvolCreateCloseAccessToken(AccessToken, Process);
+}
+
+BOOLEAN FspFastIoQueryOpen(
+    PIRP Irp,
+    PFILE_NETWORK_OPEN_INFORMATION NetworkInformation,
+    PDEVICE_OBJECT DeviceObject)
+{
+    FSP_ENTER_BOOL(PAGED_CODE());
+
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+
+    if (FspFsvolDeviceExtensionKind != FspDeviceExtension(DeviceObject)->Kind ||
+        !FspDeviceReference(DeviceObject))
+        FSP_RETURN(Result = FALSE);
+
+    Result = FspFsvolQueryOpen(DeviceObject, Irp, IrpSp, NetworkInformation);
+
+    FspDeviceDereference(DeviceObject);
+
+    FSP_LEAVE_BOOL("FileObject=%p[\"%wZ\"]", IrpSp->FileObject, &IrpSp->FileObject->FileName);
+}
+
 NTSTATUS FspCreate(
     PDEVICE_OBJECT DeviceObject, PIRP Irp)
 {
@@ -174,6 +174,7 @@ const char *IoctlCodeSym(ULONG ControlCode)
     SYM(FSP_FSCTL_STOP)
     SYM(FSP_FSCTL_WORK)
     SYM(FSP_FSCTL_WORK_BEST_EFFORT)
+    SYM(FSP_FSCTL_QUERY_OPEN)
     // cygwin: sed -n '/[IF][OS]CTL.*CTL_CODE/s/^#define[ \t]*\([^ \t]*\).*/SYM(\1)/p'
     #include "ioctl.i"
     default:
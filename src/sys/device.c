@@ -42,6 +42,7 @@ VOID FspFsvolDeviceFileRenameSetOwner(PDEVICE_OBJECT DeviceObject, PVOID Owner);
 VOID FspFsvolDeviceFileRenameRelease(PDEVICE_OBJECT DeviceObject);
 VOID FspFsvolDeviceFileRenameReleaseOwner(PDEVICE_OBJECT DeviceObject, PVOID Owner);
 VOID FspFsvolDeviceLockContextTable(PDEVICE_OBJECT DeviceObject);
+VOID FspFsvolDeviceLockContextTableShared(PDEVICE_OBJECT DeviceObject);
 VOID FspFsvolDeviceUnlockContextTable(PDEVICE_OBJECT DeviceObject);
 NTSTATUS FspFsvolDeviceCopyContextByNameList(PDEVICE_OBJECT DeviceObject,
     PVOID **PContexts, PULONG PContextCount);
@@ -53,6 +54,10 @@ PVOID FspFsvolDeviceInsertContextByName(PDEVICE_OBJECT DeviceObject, PUNICODE_ST
     FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT *ElementStorage, PBOOLEAN PInserted);
 VOID FspFsvolDeviceDeleteContextByName(PDEVICE_OBJECT DeviceObject, PUNICODE_STRING FileName,
     PBOOLEAN PDeleted);
+static FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT **FspFsvolDeviceLookupContextByNameElement(
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension, PUNICODE_STRING FileName, ULONG Hash);
+static VOID FspFsvolDeviceExpandContextByNameTable(
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension);
 static RTL_AVL_COMPARE_ROUTINE FspFsvolDeviceCompareContextByName;
 static RTL_AVL_ALLOCATE_ROUTINE FspFsvolDeviceAllocateContextByName;
 static RTL_AVL_FREE_ROUTINE FspFsvolDeviceFreeContextByName;
@@ -79,6 +84,7 @@ VOID FspDeviceDeleteAll(VOID);
 #pragma alloc_text(PAGE, FspFsvolDeviceFileRenameRelease)
 #pragma alloc_text(PAGE, FspFsvolDeviceFileRenameReleaseOwner)
 #pragma alloc_text(PAGE, FspFsvolDeviceLockContextTable)
+#pragma alloc_text(PAGE, FspFsvolDeviceLockContextTableShared)
 #pragma alloc_text(PAGE, FspFsvolDeviceUnlockContextTable)
 #pragma alloc_text(PAGE, FspFsvolDeviceCopyContextByNameList)
 #pragma alloc_text(PAGE, FspFsvolDeviceDeleteContextByNameList)
@@ -86,6 +92,8 @@ VOID FspDeviceDeleteAll(VOID);
 #pragma alloc_text(PAGE, FspFsvolDeviceLookupContextByName)
 #pragma alloc_text(PAGE, FspFsvolDeviceInsertContextByName)
 #pragma alloc_text(PAGE, FspFsvolDeviceDeleteContextByName)
+#pragma alloc_text(PAGE, FspFsvolDeviceLookupContextByNameElement)
+#pragma alloc_text(PAGE, FspFsvolDeviceExpandContextByNameTable)
 #pragma alloc_text(PAGE, FspFsvolDeviceCompareContextByName)
 #pragma alloc_text(PAGE, FspFsvolDeviceAllocateContextByName)
 #pragma alloc_text(PAGE, FspFsvolDeviceFreeContextByName)
@@ -295,7 +303,7 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
     NTSTATUS Result;
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(DeviceObject);
     LARGE_INTEGER IrpTimeout;
-    LARGE_INTEGER SecurityTimeout, DirInfoTimeout;
+    LARGE_INTEGER SecurityTimeout, DirInfoTimeout, NegativeNameTimeout, FileInfoTimeout;
 
     /*
      * Volume device initialization is a mess, because of the different ways of
@@ -321,7 +329,8 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
     IrpTimeout.QuadPart = FsvolDeviceExtension->VolumeParams.IrpTimeout * 10000ULL;
         /* convert millis to nanos */
     Result = FspIoqCreate(
-        FsvolDeviceExtension->VolumeParams.IrpCapacity, &IrpTimeout, FspIopCompleteCanceledIrp,
+        FsvolDeviceExtension->VolumeParams.IrpCapacity, &IrpTimeout,
+        FsvolDeviceExtension->VolumeParams.IrpPriorityWeights, FspIopCompleteCanceledIrp,
         &FsvolDeviceExtension->Ioq);
     if (!NT_SUCCESS(Result))
         return Result;
@@ -331,7 +340,8 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
     SecurityTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.FileInfoTimeout);
         /* convert millis to nanos */
     Result = FspMetaCacheCreate(
-        FspFsvolDeviceSecurityCacheCapacity, FspFsvolDeviceSecurityCacheItemSizeMax, &SecurityTimeout,
+        FspFsvolDeviceSecurityCacheCapacity, FspFsvolDeviceSecurityCacheSizeCapacity,
+        FspFsvolDeviceSecurityCacheItemSizeMax, TRUE, &SecurityTimeout,
         &FsvolDeviceExtension->SecurityCache);
     if (!NT_SUCCESS(Result))
         return Result;
@@ -340,13 +350,39 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
     /* create our directory meta cache */
     DirInfoTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.FileInfoTimeout);
         /* convert millis to nanos */
+    /* allow for the item header, so that a full FspFsvolDeviceDirInfoCacheItemSizeMax fits */
     Result = FspMetaCacheCreate(
-        FspFsvolDeviceDirInfoCacheCapacity, FspFsvolDeviceDirInfoCacheItemSizeMax, &DirInfoTimeout,
+        FspFsvolDeviceDirInfoCacheCapacity, FspFsvolDeviceDirInfoCacheSizeCapacity,
+        FspFsvolDeviceDirInfoCacheItemSizeMax + PAGE_SIZE, FALSE, &DirInfoTimeout,
         &FsvolDeviceExtension->DirInfoCache);
     if (!NT_SUCCESS(Result))
         return Result;
     FsvolDeviceExtension->InitDoneDir = 1;
 
+    /* create our negative name cache */
+    NegativeNameTimeout.QuadPart = FspTimeoutFromMillis(
+        FsvolDeviceExtension->VolumeParams.NegativeLookupTimeout);
+        /* convert millis to nanos */
+    Result = FspNameCacheCreate(
+        FspFsvolDeviceNegativeNameCacheCapacity, 0,
+        !FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch, &NegativeNameTimeout,
+        &FsvolDeviceExtension->NegativeNameCache);
+    if (!NT_SUCCESS(Result))
+        return Result;
+    FsvolDeviceExtension->InitDoneNeg = 1;
+
+    /* create our file info cache; it is only consulted by attribute-only opens */
+    FileInfoTimeout.QuadPart = FsvolDeviceExtension->VolumeParams.QueryOpen ?
+        FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.FileInfoTimeout) : 0;
+        /* convert millis to nanos */
+    Result = FspNameCacheCreate(
+        FspFsvolDeviceFileInfoCacheCapacity, sizeof(FSP_FILE_INFO_CACHE_DATA),
+        !FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch, &FileInfoTimeout,
+        &FsvolDeviceExtension->FileInfoCache);
+    if (!NT_SUCCESS(Result))
+        return Result;
+    FsvolDeviceExtension->InitDoneFileInfo = 1;
+
     /* initialize the FSRTL Notify mechanism */
     Result = FspNotifyInitializeSync(&FsvolDeviceExtension->NotifySync);
     if (!NT_SUCCESS(Result))
@@ -355,15 +391,36 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
     FsvolDeviceExtension->InitDoneNotify = 1;
 
     /* initialize our context table */
-    ExInitializeResourceLite(&FsvolDeviceExtension->FileRenameResource);
-    ExInitializeResourceLite(&FsvolDeviceExtension->ContextTableResource);
-    RtlInitializeGenericTableAvl(&FsvolDeviceExtension->ContextByNameTable,
+    FsvolDeviceExtension->ContextByNameTable.Buckets = FspAlloc(
+        sizeof(PVOID) * FspFsvolDeviceContextByNameTableBucketCountMin);
+    if (0 == FsvolDeviceExtension->ContextByNameTable.Buckets)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(FsvolDeviceExtension->ContextByNameTable.Buckets,
+        sizeof(PVOID) * FspFsvolDeviceContextByNameTableBucketCountMin);
+    FsvolDeviceExtension->ContextByNameTable.BucketCount =
+        FspFsvolDeviceContextByNameTableBucketCountMin;
+    RtlInitializeGenericTableAvl(&FsvolDeviceExtension->ContextByNameTable.NameOrder,
         FspFsvolDeviceCompareContextByName,
         FspFsvolDeviceAllocateContextByName,
         FspFsvolDeviceFreeContextByName,
         0);
+    ExInitializeResourceLite(&FsvolDeviceExtension->FileRenameResource);
+    ExInitializeResourceLite(&FsvolDeviceExtension->ContextTableResource);
     FsvolDeviceExtension->InitDoneCtxTab = 1;
 
+    /* initialize close batching */
+    ExInitializeFastMutex(&FsvolDeviceExtension->CloseBatchMutex);
+
+    /* create our work queue if we have dedicated worker threads */
+    if (0 != FsvolDeviceExtension->VolumeParams.WorkerThreadCount)
+    {
+        Result = FspWorkQueueCreate(FsvolDeviceExtension->VolumeParams.WorkerThreadCount,
+            &FsvolDeviceExtension->WorkQueue);
+        if (!NT_SUCCESS(Result))
+            return Result;
+        FsvolDeviceExtension->InitDoneWq = 1;
+    }
+
     /* initialize our timer routine and start our expiration timer */
 #pragma prefast(suppress:28133, "We are a filesystem: we do not have AddDevice")
     Result = IoInitializeTimer(DeviceObject, FspFsvolDeviceTimerRoutine, 0);
@@ -406,6 +463,31 @@ static VOID FspFsvolDeviceFini(PDEVICE_OBJECT DeviceObject)
         FspNotifyUninitializeSync(&FsvolDeviceExtension->NotifySync);
     }
 
+    /*
+     * Stop our work queue. Work items hold IRPs and IRPs keep our DeviceObject referenced,
+     * so the queue is empty at this point (but we may be running in one of its threads).
+     */
+    if (FsvolDeviceExtension->InitDoneWq)
+        FspWorkQueueDelete(FsvolDeviceExtension->WorkQueue);
+
+    /*
+     * The close batch is flushed before the I/O queue is stopped (see FspVolumeDelete).
+     * A batch can only remain here if closes arrived after that; the file system is gone.
+     */
+    if (0 != FsvolDeviceExtension->CloseBatchRequest)
+        FspIopDeleteRequest(FsvolDeviceExtension->CloseBatchRequest);
+
+    /* delete the preregistered I/O buffers */
+    FspIoBuffersDelete(FsvolDeviceExtension->IoBuffers);
+
+    /* delete the file info cache */
+    if (FsvolDeviceExtension->InitDoneFileInfo)
+        FspNameCacheDelete(FsvolDeviceExtension->FileInfoCache);
+
+    /* delete the negative name cache */
+    if (FsvolDeviceExtension->InitDoneNeg)
+        FspNameCacheDelete(FsvolDeviceExtension->NegativeNameCache);
+
     /* delete the directory meta cache */
     if (FsvolDeviceExtension->InitDoneDir)
         FspMetaCacheDelete(FsvolDeviceExtension->DirInfoCache);
@@ -421,10 +503,11 @@ static VOID FspFsvolDeviceFini(PDEVICE_OBJECT DeviceObject)
     if (FsvolDeviceExtension->InitDoneCtxTab)
     {
         /*
-         * FspDeviceFreeContext/FspDeviceFreeContextByName is a no-op, so it is not necessary
+         * The ContextByNameTable elements live in their FileNode's, so it is not necessary
          * to enumerate and delete all entries in the ContextTable.
          */
 
+        FspFree(FsvolDeviceExtension->ContextByNameTable.Buckets);
         ExDeleteResourceLite(&FsvolDeviceExtension->ContextTableResource);
         ExDeleteResourceLite(&FsvolDeviceExtension->FileRenameResource);
     }
@@ -484,7 +567,10 @@ static VOID FspFsvolDeviceExpirationRoutine(PVOID Context)
     InterruptTime = KeQueryInterruptTime();
     FspMetaCacheInvalidateExpired(FsvolDeviceExtension->SecurityCache, InterruptTime);
     FspMetaCacheInvalidateExpired(FsvolDeviceExtension->DirInfoCache, InterruptTime);
+    FspNameCacheInvalidateExpired(FsvolDeviceExtension->NegativeNameCache, InterruptTime);
+    FspNameCacheInvalidateExpired(FsvolDeviceExtension->FileInfoCache, InterruptTime);
     FspIoqRemoveExpired(FsvolDeviceExtension->Ioq, InterruptTime);
+    FspFsvolCloseBatchFlush(DeviceObject);
 
     KeAcquireSpinLock(&FsvolDeviceExtension->ExpirationLock, &Irql);
     FsvolDeviceExtension->ExpirationInProgress = FALSE;
@@ -545,6 +631,22 @@ VOID FspFsvolDeviceFileRenameReleaseOwner(PDEVICE_OBJECT DeviceObject, PVOID Own
         ExReleaseResourceForThreadLite(&FsvolDeviceExtension->FileRenameResource, (ERESOURCE_THREAD)Owner);
 }
 
+/*
+ * The ContextByNameTable is a chained hash table of the FileNode's that are open (or still
+ * referenced by the cache manager), keyed by file name. Hashes are computed once (case
+ * folded on case insensitive volumes) when an element is inserted and compared before any
+ * name comparison. The bucket array is doubled when the table gets too full; it is never
+ * shrunk.
+ *
+ * The same elements are also kept in name order in an AVL tree (NameOrder), which is only
+ * used to enumerate the names below a directory. Lookups go to the hash table; inserts and
+ * deletes update both.
+ *
+ * The table is protected by ContextTableResource. Operations that change the table or the
+ * OpenCount/HandleCount/ShareAccess of its FileNode's acquire it exclusive; pure lookups
+ * acquire it shared and must reference any FileNode they keep.
+ */
+
 VOID FspFsvolDeviceLockContextTable(PDEVICE_OBJECT DeviceObject)
 {
     PAGED_CODE();
@@ -553,6 +655,14 @@ VOID FspFsvolDeviceLockContextTable(PDEVICE_OBJECT DeviceObject)
     ExAcquireResourceExclusiveLite(&FsvolDeviceExtension->ContextTableResource, TRUE);
 }
 
+VOID FspFsvolDeviceLockContextTableShared(PDEVICE_OBJECT DeviceObject)
+{
+    PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(DeviceObject);
+    ExAcquireResourceSharedLite(&FsvolDeviceExtension->ContextTableResource, TRUE);
+}
+
 VOID FspFsvolDeviceUnlockContextTable(PDEVICE_OBJECT DeviceObject)
 {
     PAGED_CODE();
@@ -567,25 +677,24 @@ NTSTATUS FspFsvolDeviceCopyContextByNameList(PDEVICE_OBJECT DeviceObject,
     PAGED_CODE();
 
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(DeviceObject);
-    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT_DATA *Data;
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE *Table = &FsvolDeviceExtension->ContextByNameTable;
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT *Element;
     PVOID *Contexts;
-    ULONG ContextCount, Index;
+    ULONG ContextCount, Index, BucketIndex;
 
     *PContexts = 0;
     *PContextCount = 0;
 
-    ContextCount = RtlNumberGenericTableElementsAvl(&FsvolDeviceExtension->ContextByNameTable);
+    ContextCount = Table->ElementCount;
     Contexts = FspAlloc(sizeof(PVOID) * ContextCount);
     if (0 == Contexts)
         return STATUS_INSUFFICIENT_RESOURCES;
 
     Index = 0;
-    Data = RtlEnumerateGenericTableAvl(&FsvolDeviceExtension->ContextByNameTable, TRUE);
-    while (Index < ContextCount && 0 != Data)
-    {
-        Contexts[Index++] = Data->Context;
-        Data = RtlEnumerateGenericTableAvl(&FsvolDeviceExtension->ContextByNameTable, FALSE);
-    }
+    for (BucketIndex = 0; Table->BucketCount > BucketIndex; BucketIndex++)
+        for (Element = Table->Buckets[BucketIndex];
+            Index < ContextCount && 0 != Element; Element = Element->DictNext)
+            Contexts[Index++] = Element->Data.Context;
 
     *PContexts = Contexts;
     *PContextCount = Index;
@@ -600,29 +709,42 @@ VOID FspFsvolDeviceDeleteContextByNameList(PVOID *Contexts, ULONG ContextCount)
     FspFree(Contexts);
 }
 
+/*
+ * Enumerate the contexts of all names below FileName; with SubpathOnly FALSE the context of
+ * FileName itself (an exact, possibly case insensitive, match) is also returned. Start with
+ * *PRestartKey set to 0 and call until 0 is returned. The table must remain locked for the
+ * duration of the enumeration.
+ *
+ * Names that start with FileName are contiguous in NameOrder, so this is a lookup followed
+ * by a walk over those names only (which may include siblings such as "FileName.txt").
+ */
 PVOID FspFsvolDeviceEnumerateContextByName(PDEVICE_OBJECT DeviceObject, PUNICODE_STRING FileName,
     BOOLEAN SubpathOnly, PVOID *PRestartKey)
 {
     PAGED_CODE();
 
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(DeviceObject);
+    PRTL_AVL_TABLE NameOrder = &FsvolDeviceExtension->ContextByNameTable.NameOrder;
     BOOLEAN CaseInsensitive = 0 == FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch;
     FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT_DATA *Result;
-    ULONG DeleteCount = 0;
-
-    if (0 != *PRestartKey)
-        SubpathOnly = FALSE;
+    ULONG DeleteCount;
 
-    Result = RtlEnumerateGenericTableLikeADirectory(&FsvolDeviceExtension->ContextByNameTable,
-        0, 0, SubpathOnly, PRestartKey, &DeleteCount, &FileName);
-
-    if (0 != Result &&
-        RtlPrefixUnicodeString(FileName, Result->FileName, CaseInsensitive) &&
-        FileName->Length < Result->FileName->Length &&
-        '\\' == Result->FileName->Buffer[FileName->Length / sizeof(WCHAR)])
-        return Result->Context;
-    else
-        return 0;
+    for (;;)
+    {
+        /* the table is locked, so the restart key remains valid */
+        DeleteCount = NameOrder->DeleteCount;
+        Result = RtlEnumerateGenericTableLikeADirectory(NameOrder,
+            0, 0, FALSE, PRestartKey, &DeleteCount, &FileName);
+
+        if (0 == Result ||
+            !RtlPrefixUnicodeString(FileName, Result->FileName, CaseInsensitive))
+            return 0;
+
+        if (FileName->Length < Result->FileName->Length ?
+            '\\' == Result->FileName->Buffer[FileName->Length / sizeof(WCHAR)] :
+            !SubpathOnly)
+            return Result->Context;
+    }
 }
 
 PVOID FspFsvolDeviceLookupContextByName(PDEVICE_OBJECT DeviceObject, PUNICODE_STRING FileName)
@@ -630,11 +752,14 @@ PVOID FspFsvolDeviceLookupContextByName(PDEVICE_OBJECT DeviceObject, PUNICODE_ST
     PAGED_CODE();
 
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(DeviceObject);
-    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT_DATA *Result;
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT **PElement;
+    BOOLEAN CaseInsensitive = 0 == FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch;
+    ULONG Hash = 0;
 
-    Result = RtlLookupElementGenericTableAvl(&FsvolDeviceExtension->ContextByNameTable, &FileName);
+    RtlHashUnicodeString(FileName, CaseInsensitive, HASH_STRING_ALGORITHM_DEFAULT, &Hash);
+    PElement = FspFsvolDeviceLookupContextByNameElement(FsvolDeviceExtension, FileName, Hash);
 
-    return 0 != Result ? Result->Context : 0;
+    return 0 != *PElement ? (*PElement)->Data.Context : 0;
 }
 
 PVOID FspFsvolDeviceInsertContextByName(PDEVICE_OBJECT DeviceObject, PUNICODE_STRING FileName, PVOID Context,
@@ -643,20 +768,43 @@ PVOID FspFsvolDeviceInsertContextByName(PDEVICE_OBJECT DeviceObject, PUNICODE_ST
     PAGED_CODE();
 
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(DeviceObject);
-    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT_DATA *Result, Element = { 0 };
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE *Table = &FsvolDeviceExtension->ContextByNameTable;
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT **PElement;
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT_DATA Data;
+    BOOLEAN CaseInsensitive = 0 == FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch;
+    BOOLEAN Inserted;
+    ULONG Hash = 0;
 
     ASSERT(0 != ElementStorage);
-    Element.FileName = FileName;
-    Element.Context = Context;
-
-    FsvolDeviceExtension->ContextByNameTableElementStorage = ElementStorage;
-    Result = RtlInsertElementGenericTableAvl(&FsvolDeviceExtension->ContextByNameTable,
-        &Element, sizeof Element, PInserted);
-    FsvolDeviceExtension->ContextByNameTableElementStorage = 0;
 
-    ASSERT(0 != Result);
+    RtlHashUnicodeString(FileName, CaseInsensitive, HASH_STRING_ALGORITHM_DEFAULT, &Hash);
+    PElement = FspFsvolDeviceLookupContextByNameElement(FsvolDeviceExtension, FileName, Hash);
+    if (0 != *PElement)
+    {
+        if (0 != PInserted)
+            *PInserted = FALSE;
+        return (*PElement)->Data.Context;
+    }
 
-    return Result->Context;
+    ElementStorage->DictNext = 0;
+    ElementStorage->Hash = Hash;
+    ElementStorage->Data.FileName = FileName;
+    ElementStorage->Data.Context = Context;
+    *PElement = ElementStorage;
+    Table->ElementCount++;
+
+    Data = ElementStorage->Data;
+    Table->NameOrderElementStorage = ElementStorage;
+    RtlInsertElementGenericTableAvl(&Table->NameOrder, &Data, sizeof Data, &Inserted);
+    Table->NameOrderElementStorage = 0;
+    ASSERT(Inserted);
+
+    if (Table->ElementCount > Table->BucketCount)
+        FspFsvolDeviceExpandContextByNameTable(FsvolDeviceExtension);
+
+    if (0 != PInserted)
+        *PInserted = TRUE;
+    return Context;
 }
 
 VOID FspFsvolDeviceDeleteContextByName(PDEVICE_OBJECT DeviceObject, PUNICODE_STRING FileName,
@@ -665,21 +813,90 @@ VOID FspFsvolDeviceDeleteContextByName(PDEVICE_OBJECT DeviceObject, PUNICODE_STR
     PAGED_CODE();
 
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(DeviceObject);
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT **PElement;
+    BOOLEAN CaseInsensitive = 0 == FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch;
     BOOLEAN Deleted;
+    ULONG Hash = 0;
+
+    RtlHashUnicodeString(FileName, CaseInsensitive, HASH_STRING_ALGORITHM_DEFAULT, &Hash);
+    PElement = FspFsvolDeviceLookupContextByNameElement(FsvolDeviceExtension, FileName, Hash);
+    Deleted = 0 != *PElement;
+    if (Deleted)
+    {
+        *PElement = (*PElement)->DictNext;
+        FsvolDeviceExtension->ContextByNameTable.ElementCount--;
+        RtlDeleteElementGenericTableAvl(&FsvolDeviceExtension->ContextByNameTable.NameOrder,
+            &FileName);
+    }
 
-    Deleted = RtlDeleteElementGenericTableAvl(&FsvolDeviceExtension->ContextByNameTable, &FileName);
+    /* the file may have changed while it was open; forget any info cached for its name */
+    if (Deleted)
+        FspNameCacheInvalidateName(FsvolDeviceExtension->FileInfoCache, FileName);
 
     if (0 != PDeleted)
         *PDeleted = Deleted;
 }
 
+static FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT **FspFsvolDeviceLookupContextByNameElement(
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension, PUNICODE_STRING FileName, ULONG Hash)
+{
+    /* returns the link that points (or would point) to the element for FileName */
+
+    PAGED_CODE();
+
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE *Table = &FsvolDeviceExtension->ContextByNameTable;
+    BOOLEAN CaseInsensitive = 0 == FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch;
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT **PElement;
+
+    for (PElement = &Table->Buckets[Hash % Table->BucketCount]; 0 != *PElement;
+        PElement = &(*PElement)->DictNext)
+        if ((*PElement)->Hash == Hash &&
+            RtlEqualUnicodeString((*PElement)->Data.FileName, FileName, CaseInsensitive))
+            break;
+
+    return PElement;
+}
+
+static VOID FspFsvolDeviceExpandContextByNameTable(
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension)
+{
+    PAGED_CODE();
+
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE *Table = &FsvolDeviceExtension->ContextByNameTable;
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT **Buckets, *Element, *NextElement;
+    ULONG BucketCount, BucketIndex, NewBucketIndex;
+
+    if (FspFsvolDeviceContextByNameTableBucketCountMax <= Table->BucketCount)
+        return;
+
+    /* if we cannot get a bigger bucket array, keep using the one we have */
+    BucketCount = Table->BucketCount * 2;
+    Buckets = FspAlloc(sizeof(PVOID) * BucketCount);
+    if (0 == Buckets)
+        return;
+    RtlZeroMemory(Buckets, sizeof(PVOID) * BucketCount);
+
+    for (BucketIndex = 0; Table->BucketCount > BucketIndex; BucketIndex++)
+        for (Element = Table->Buckets[BucketIndex]; 0 != Element; Element = NextElement)
+        {
+            NextElement = Element->DictNext;
+            NewBucketIndex = Element->Hash % BucketCount;
+            Element->DictNext = Buckets[NewBucketIndex];
+            Buckets[NewBucketIndex] = Element;
+        }
+
+    FspFree(Table->Buckets);
+    Table->Buckets = Buckets;
+    Table->BucketCount = BucketCount;
+}
+
 static RTL_GENERIC_COMPARE_RESULTS NTAPI FspFsvolDeviceCompareContextByName(
     PRTL_AVL_TABLE Table, PVOID FirstElement, PVOID SecondElement)
 {
     PAGED_CODE();
 
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
-        CONTAINING_RECORD(Table, FSP_FSVOL_DEVICE_EXTENSION, ContextByNameTable);
+        CONTAINING_RECORD(Table, FSP_FSVOL_DEVICE_EXTENSION, ContextByNameTable.NameOrder);
     BOOLEAN CaseInsensitive = 0 == FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch;
     PUNICODE_STRING FirstFileName = *(PUNICODE_STRING *)FirstElement;
     PUNICODE_STRING SecondFileName = *(PUNICODE_STRING *)SecondElement;
@@ -701,12 +918,17 @@ static PVOID NTAPI FspFsvolDeviceAllocateContextByName(
 {
     PAGED_CODE();
 
-    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
-        CONTAINING_RECORD(Table, FSP_FSVOL_DEVICE_EXTENSION, ContextByNameTable);
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE *ContextByNameTable =
+        CONTAINING_RECORD(Table, FSP_DEVICE_CONTEXT_BY_NAME_TABLE, NameOrder);
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT *ElementStorage =
+        ContextByNameTable->NameOrderElementStorage;
 
-    ASSERT(sizeof(FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT) == ByteSize);
+    ASSERT(
+        FIELD_OFFSET(FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT, Data) -
+        FIELD_OFFSET(FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT, Header) +
+        sizeof(FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT_DATA) == ByteSize);
 
-    return FsvolDeviceExtension->ContextByNameTableElementStorage;
+    return &ElementStorage->Header;
 }
 
 static VOID NTAPI FspFsvolDeviceFreeContextByName(
@@ -16,17 +16,21 @@
  */
 
 #include <sys/driver.h>
+#include <shared/dirinfo.h>
 
 static NTSTATUS FspFsvolQueryDirectoryCopy(
     PUNICODE_STRING DirectoryPattern, BOOLEAN CaseInsensitive,
-    UINT64 DirectoryOffset, PUINT64 PDirectoryOffset,
+    PUINT64 PDirectoryOffset,
     FILE_INFORMATION_CLASS FileInformationClass, BOOLEAN ReturnSingleEntry,
     FSP_FSCTL_DIR_INFO **PDirInfo, ULONG DirInfoSize,
     PVOID DestBuf, PULONG PDestLen);
+static BOOLEAN FspFsvolQueryDirectorySeekCache(
+    PCVOID DirInfoBuffer, ULONG DirInfoSize, UINT64 DirectoryOffset, PULONG PDirInfoCacheHint);
+static VOID FspFsvolQueryDirectorySetMarker(
+    FSP_FILE_DESC *FileDesc, PCVOID DirInfoBgn, PCVOID DirInfoEnd);
 static NTSTATUS FspFsvolQueryDirectoryCopyCache(
     FSP_FILE_DESC *FileDesc, BOOLEAN ResetCache,
     FILE_INFORMATION_CLASS FileInformationClass, BOOLEAN ReturnSingleEntry,
-    FSP_FSCTL_DIR_INFO *DirInfo, ULONG DirInfoSize,
     PVOID DestBuf, PULONG PDestLen);
 static NTSTATUS FspFsvolQueryDirectoryCopyInPlace(
     FSP_FILE_DESC *FileDesc,
@@ -51,6 +55,8 @@ FSP_DRIVER_DISPATCH FspDirectoryControl;
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, FspFsvolQueryDirectoryCopy)
+#pragma alloc_text(PAGE, FspFsvolQueryDirectorySeekCache)
+#pragma alloc_text(PAGE, FspFsvolQueryDirectorySetMarker)
 #pragma alloc_text(PAGE, FspFsvolQueryDirectoryCopyCache)
 #pragma alloc_text(PAGE, FspFsvolQueryDirectoryCopyInPlace)
 #pragma alloc_text(PAGE, FspFsvolQueryDirectoryRetry)
@@ -85,7 +91,7 @@ enum
 
 static NTSTATUS FspFsvolQueryDirectoryCopy(
     PUNICODE_STRING DirectoryPattern, BOOLEAN CaseInsensitive,
-    UINT64 DirectoryOffset, PUINT64 PDirectoryOffset,
+    PUINT64 PDirectoryOffset,
     FILE_INFORMATION_CLASS FileInformationClass, BOOLEAN ReturnSingleEntry,
     FSP_FSCTL_DIR_INFO **PDirInfo, ULONG DirInfoSize,
     PVOID DestBuf, PULONG PDestLen)
@@ -118,7 +124,7 @@ static NTSTATUS FspFsvolQueryDirectoryCopy(
     PAGED_CODE();
 
     BOOLEAN MatchAll = FspFileDescDirectoryPatternMatchAll == DirectoryPattern->Buffer;
-    BOOLEAN Loop = TRUE, DirectoryOffsetFound = FALSE;
+    BOOLEAN Loop = TRUE;
     FSP_FSCTL_DIR_INFO *DirInfo = *PDirInfo;
     PUINT8 DirInfoEnd = (PUINT8)DirInfo + DirInfoSize;
     PUINT8 DestBufBgn = (PUINT8)DestBuf;
@@ -168,12 +174,6 @@ static NTSTATUS FspFsvolQueryDirectoryCopy(
                 break;
             }
 
-            if (0 != DirectoryOffset && !DirectoryOffsetFound)
-            {
-                DirectoryOffsetFound = DirInfo->NextOffset == DirectoryOffset;
-                continue;
-            }
-
             FileName.Length =
             FileName.MaximumLength = (USHORT)(DirInfoSize - sizeof(FSP_FSCTL_DIR_INFO));
             FileName.Buffer = DirInfo->FileNameBuf;
@@ -264,45 +264,190 @@ static NTSTATUS FspFsvolQueryDirectoryCopy(
 #undef FILL_INFO_BASE
 }
 
+static BOOLEAN FspFsvolQueryDirectorySeekCache(
+    PCVOID DirInfoBuffer, ULONG DirInfoSize, UINT64 DirectoryOffset, PULONG PDirInfoCacheHint)
+{
+    /* find the position right after the entry whose NextOffset is DirectoryOffset */
+
+    PAGED_CODE();
+
+    FSP_FSCTL_DIR_INFO *DirInfo;
+
+    for (ULONG Offset = 0; Offset + sizeof(DirInfo->Size) <= DirInfoSize;
+        Offset += FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size))
+    {
+        DirInfo = (PVOID)((PUINT8)DirInfoBuffer + Offset);
+        if (sizeof(FSP_FSCTL_DIR_INFO) > DirInfo->Size)
+            break;
+        if (DirInfo->NextOffset == DirectoryOffset)
+        {
+            *PDirInfoCacheHint = Offset + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static VOID FspFsvolQueryDirectorySetMarker(
+    FSP_FILE_DESC *FileDesc, PCVOID DirInfoBgn, PCVOID DirInfoEnd)
+{
+    /*
+     * Remember the name of the last entry consumed (the one that ends at DirInfoEnd).
+     * If the cached DirInfo changes under us we use it to find where to resume.
+     */
+
+    PAGED_CODE();
+
+    FSP_FSCTL_DIR_INFO *DirInfo, *LastDirInfo = 0;
+    USHORT Length;
+
+    for (DirInfo = (PVOID)DirInfoBgn; (PUINT8)DirInfoEnd > (PUINT8)DirInfo;
+        DirInfo = (PVOID)((PUINT8)DirInfo + FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size)))
+        LastDirInfo = DirInfo;
+
+    FileDesc->DirectoryMarker.Length = 0;
+    if (0 == LastDirInfo || FspDirInfoIsDotEntry(LastDirInfo))
+        return;
+
+    Length = (USHORT)(LastDirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+    if (FileDesc->DirectoryMarker.MaximumLength < Length)
+    {
+        if (0 != FileDesc->DirectoryMarker.Buffer)
+            FspFree(FileDesc->DirectoryMarker.Buffer);
+        FileDesc->DirectoryMarker.MaximumLength = 0;
+        FileDesc->DirectoryMarker.Buffer = FspAlloc(Length);
+        if (0 == FileDesc->DirectoryMarker.Buffer)
+            return;
+        FileDesc->DirectoryMarker.MaximumLength = Length;
+    }
+
+    RtlCopyMemory(FileDesc->DirectoryMarker.Buffer, LastDirInfo->FileNameBuf, Length);
+    FileDesc->DirectoryMarker.Length = Length;
+}
+
 static NTSTATUS FspFsvolQueryDirectoryCopyCache(
     FSP_FILE_DESC *FileDesc, BOOLEAN ResetCache,
     FILE_INFORMATION_CLASS FileInformationClass, BOOLEAN ReturnSingleEntry,
-    FSP_FSCTL_DIR_INFO *DirInfo, ULONG DirInfoSize,
     PVOID DestBuf, PULONG PDestLen)
 {
+    /*
+     * Copy directory entries from the cached DirInfo, which may consist of multiple
+     * segments (see FspFileNodeTryAppendDirInfo). The FileDesc position within the
+     * cache is the (DirInfoSegment, DirInfoCacheHint) pair; it is valid as long as the
+     * first segment (FileNode DirInfo) stays the same.
+     *
+     * Returns STATUS_SUCCESS with a 0 *PDestLen if the request cannot be satisfied
+     * from the cache; in this case FileDesc->DirectoryOffset tells where user mode
+     * should continue.
+     */
+
     /* FileNode/FileDesc assumed acquired exclusive (Main or Full) */
 
     PAGED_CODE();
 
     FSP_FILE_NODE *FileNode = FileDesc->FileNode;
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
+    NTSTATUS Result = STATUS_SUCCESS;
+    BOOLEAN Sorted = 0 != FsvolDeviceExtension->VolumeParams.PatchDirInfo;
+    BOOLEAN CaseInsensitive = !FileDesc->CaseSensitive;
+    PUNICODE_STRING DirectoryPattern = &FileDesc->DirectoryPattern;
+    UINT64 DirectoryOffset = FileDesc->DirectoryOffset;
+    BOOLEAN Seek = FALSE;
+    PCVOID DirInfoBuffer;
+    ULONG DirInfoSize, DestLen = 0;
+    PUINT8 DirInfoBgn, DirInfoEnd;
+    FSP_FSCTL_DIR_INFO *DirInfo;
 
     if (ResetCache || FileDesc->DirInfo != FileNode->NonPaged->DirInfo)
-        FileDesc->DirInfoCacheHint = 0; /* reset the DirInfo hint if anything looks fishy! */
+    {
+        /* reset the DirInfo hint if anything looks fishy! */
+        FileDesc->DirInfo = FileNode->NonPaged->DirInfo;
+        FileDesc->DirInfoSegment = 0;
+        FileDesc->DirInfoCacheHint = 0;
 
-    FileDesc->DirInfo = FileNode->NonPaged->DirInfo;
+        if (0 != DirectoryOffset)
+        {
+            /*
+             * Resume at DirectoryOffset. If it is at a segment boundary we know where
+             * to go. Otherwise we have to look for it; if the DirInfo is sorted the
+             * DirectoryMarker tells us which segment to look in.
+             */
+            if (!FspFileNodeFindDirInfoSegment(FileNode, DirectoryOffset,
+                &FileDesc->DirInfoSegment))
+            {
+                if (Sorted && 0 != FileDesc->DirectoryMarker.Length)
+                    FileDesc->DirInfoSegment = FspFileNodeSeekDirInfoSegment(FileNode,
+                        &FileDesc->DirectoryMarker, CaseInsensitive);
+                Seek = TRUE;
+            }
+        }
+        else if (Sorted &&
+            FspFileDescDirectoryPatternMatchAll != DirectoryPattern->Buffer &&
+            0 != DirectoryPattern->Length && L'.' != DirectoryPattern->Buffer[0] &&
+            !FsRtlDoesNameContainWildCards(DirectoryPattern))
+            /* looking for a single name: start at the segment that would contain it */
+            FileDesc->DirInfoSegment = FspFileNodeSeekDirInfoSegment(FileNode,
+                DirectoryPattern, CaseInsensitive);
+    }
 
-    NTSTATUS Result;
-    BOOLEAN CaseInsensitive = !FileDesc->CaseSensitive;
-    PUNICODE_STRING DirectoryPattern = &FileDesc->DirectoryPattern;
-    UINT64 DirectoryOffset = FileDesc->DirectoryOffset;
-    PUINT8 DirInfoBgn = (PUINT8)DirInfo;
-    PUINT8 DirInfoEnd = (PUINT8)DirInfo + DirInfoSize;
+    for (;;)
+    {
+        if (!FspFileNodeReferenceDirInfoSegment(FileNode, FileDesc->DirInfoSegment,
+            &DirInfoBuffer, &DirInfoSize))
+            break;
 
-    DirInfo = (PVOID)(DirInfoBgn + FileDesc->DirInfoCacheHint);
-    DirInfoSize = (ULONG)(DirInfoEnd - (PUINT8)DirInfo);
+        DirInfoBgn = (PUINT8)DirInfoBuffer;
+        DirInfoEnd = (PUINT8)DirInfoBuffer + DirInfoSize;
 
-    Result = FspFsvolQueryDirectoryCopy(DirectoryPattern, CaseInsensitive,
-        0 != FileDesc->DirInfoCacheHint ? 0 : DirectoryOffset, &DirectoryOffset,
-        FileInformationClass, ReturnSingleEntry,
-        &DirInfo, DirInfoSize,
-        DestBuf, PDestLen);
+        if (Seek)
+        {
+            Seek = FALSE;
+            if (!FspFsvolQueryDirectorySeekCache(DirInfoBuffer, DirInfoSize,
+                DirectoryOffset, &FileDesc->DirInfoCacheHint))
+            {
+                /* DirectoryOffset is not in the cache; leave it to user mode */
+                FileDesc->DirInfoSegment = (ULONG)-1;
+                FspFileNodeDereferenceDirInfo(DirInfoBuffer);
+                break;
+            }
+        }
+
+        DirInfo = (PVOID)(DirInfoBgn + FileDesc->DirInfoCacheHint);
+        DestLen = *PDestLen;
+
+        Result = FspFsvolQueryDirectoryCopy(DirectoryPattern, CaseInsensitive,
+            &DirectoryOffset,
+            FileInformationClass, ReturnSingleEntry,
+            &DirInfo, (ULONG)(DirInfoEnd - (PUINT8)DirInfo),
+            DestBuf, &DestLen);
+
+        if (NT_SUCCESS(Result))
+        {
+            if (Sorted && 0 != DestLen)
+                FspFsvolQueryDirectorySetMarker(FileDesc,
+                    DirInfoBgn + FileDesc->DirInfoCacheHint, DirInfo);
+            FileDesc->DirInfoCacheHint = (ULONG)((PUINT8)DirInfo - DirInfoBgn);
+        }
+
+        FspFileNodeDereferenceDirInfo(DirInfoBuffer);
+
+        if (!NT_SUCCESS(Result) || 0 != DestLen)
+            break;
+
+        /* nothing (more) for us in this segment; continue with the next one */
+        FileDesc->DirInfoSegment++;
+        FileDesc->DirInfoCacheHint = 0;
+    }
+
+    *PDestLen = DestLen;
 
     if (NT_SUCCESS(Result))
     {
-        if (0 != *PDestLen)
+        if (0 != DestLen)
             FileDesc->DirectoryHasSuchFile = TRUE;
         FileDesc->DirectoryOffset = DirectoryOffset;
-        FileDesc->DirInfoCacheHint = (ULONG)((PUINT8)DirInfo - DirInfoBgn);
     }
     else if (STATUS_NO_MORE_FILES == Result && !FileDesc->DirectoryHasSuchFile)
         Result = STATUS_NO_SUCH_FILE;
@@ -332,7 +477,7 @@ static NTSTATUS FspFsvolQueryDirectoryCopyInPlace(
         "FSP_FSCTL_DIR_INFO must be bigger than FILE_ID_BOTH_DIR_INFORMATION");
 
     Result = FspFsvolQueryDirectoryCopy(DirectoryPattern, CaseInsensitive,
-        0, &DirectoryOffset,
+        &DirectoryOffset,
         FileInformationClass, ReturnSingleEntry,
         &DirInfo, DirInfoSize,
         DestBuf, PDestLen);
@@ -394,9 +539,13 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
      *
      *   - If the FileInfoTimeout is non-zero, then the directory maintains a
      *     DirInfo meta cache that can be used to fulfill IRP requests without
-     *     reaching out to user mode. In this case we want the SystemBufferLength
-     *     to be FspFsvolDeviceDirInfoCacheItemSizeMax so that we read up to the
-     *     cache size maximum.
+     *     reaching out to user mode. If the response is going to be cached we
+     *     want the SystemBufferLength to be FspFsvolDeviceDirInfoCacheItemSizeMax
+     *     so that we read up to the cache size maximum. This is the case when we
+     *     start a listing and when we continue a listing at the end of the cached
+     *     DirInfo, because the response may be appended to it as a new segment.
+     *     Otherwise (e.g. the position is past what the cache knows about) the
+     *     response is not cached.
      *
      *   - If the requested DirectoryPattern (stored in FileDesc) is not the "*"
      *     (MatchAll) pattern, then we want to read as many entries as possible
@@ -411,12 +560,13 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
      *     counter-productive to try to read more than we need.
      */
 #define GetSystemBufferLengthMaybeCached()\
-    (0 != FsvolDeviceExtension->VolumeParams.FileInfoTimeout && 0 == FileDesc->DirectoryOffset) ||\
-    FspFileDescDirectoryPatternMatchAll != FileDesc->DirectoryPattern.Buffer ?\
-        FspFsvolDeviceDirInfoCacheItemSizeMax : Length
+    0 != FsvolDeviceExtension->DirInfoCache &&\
+    (0 == FileDesc->DirectoryOffset ||\
+        (0 != FileNode->NonPaged->DirInfo && (ULONG)-1 != FileDesc->DirInfoSegment)) ?\
+        FspFsvolDeviceDirInfoCacheItemSizeMax : GetSystemBufferLengthNonCached()
 #define GetSystemBufferLengthNonCached()\
     FspFileDescDirectoryPatternMatchAll != FileDesc->DirectoryPattern.Buffer ?\
-        FspFsvolDeviceDirInfoCacheItemSizeMax : Length
+        FspFsvolDeviceDirInfoCacheItemSizeMax : IrpSp->Parameters.QueryDirectory.Length
 #define GetSystemBufferLengthBestGuess()\
     FspFsvolDeviceDirInfoCacheItemSizeMax
 
@@ -437,8 +587,6 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
         Irp->AssociatedIrp.SystemBuffer : Irp->UserBuffer;
     ULONG Length = IrpSp->Parameters.QueryDirectory.Length;
     ULONG SystemBufferLength;
-    PVOID DirInfoBuffer;
-    ULONG DirInfoSize;
     FSP_FSCTL_TRANSACT_REQ *Request = FspIrpRequest(Irp);
     BOOLEAN Success;
 
@@ -493,6 +641,7 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
     {
         FileDesc->DirectoryHasSuchFile = FALSE;
         FileDesc->DirectoryOffset = OFFSET_FROM_FILE_INDEX(FileIndex);
+        FileDesc->DirectoryMarker.Length = 0;
     }
     else if (RestartScan)
     {
@@ -501,31 +650,21 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
     }
 
     /* see if the required information is still in the cache and valid! */
-    if (FspFileNodeReferenceDirInfo(FileNode, &DirInfoBuffer, &DirInfoSize))
-    {
-        if (0 == SystemBufferLength)
-            SystemBufferLength = GetSystemBufferLengthNonCached();
-
-        Result = FspFsvolQueryDirectoryCopyCache(FileDesc,
-            IndexSpecified || RestartScan,
-            FileInformationClass, ReturnSingleEntry,
-            DirInfoBuffer, DirInfoSize, Buffer, &Length);
-
-        FspFileNodeDereferenceDirInfo(DirInfoBuffer);
-
-        if (!NT_SUCCESS(Result) || 0 != Length)
-        {
-            FspFileNodeRelease(FileNode, Full);
-            Irp->IoStatus.Information = Length;
-            return Result;
-        }
-    }
-    else
+    Result = FspFsvolQueryDirectoryCopyCache(FileDesc,
+        IndexSpecified || RestartScan,
+        FileInformationClass, ReturnSingleEntry,
+        Buffer, &Length);
+    if (!NT_SUCCESS(Result) || 0 != Length)
     {
-        if (0 == SystemBufferLength)
-            SystemBufferLength = GetSystemBufferLengthMaybeCached();
+        FspFileNodeRelease(FileNode, Full);
+        Irp->IoStatus.Information = Length;
+        return Result;
     }
 
+    /* the cache lookup has positioned the FileDesc; size the request accordingly */
+    if (0 == SystemBufferLength)
+        SystemBufferLength = GetSystemBufferLengthMaybeCached();
+
     FspFileNodeConvertExclusiveToShared(FileNode, Full);
 
     /* buffer the user buffer! */
@@ -784,10 +923,22 @@ NTSTATUS FspFsvolDirectoryControlPrepare(
     PAGED_CODE();
 
     NTSTATUS Result;
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(IrpSp->DeviceObject);
     PMDL Mdl = 0;
     PVOID Address;
     PEPROCESS Process;
 
+    /* use a preregistered I/O buffer slot if one is available; data are copied on completion */
+    Address = FspIoBuffersAllocateSlot(FsvolDeviceExtension->IoBuffers,
+        Request->Req.QueryDirectory.Length);
+    if (0 != Address)
+    {
+        Request->Req.QueryDirectory.Address = (UINT64)(UINT_PTR)Address;
+        FspIopRequestContext(Request, RequestAddress) = Address;
+        return STATUS_SUCCESS;
+    }
+
     Mdl = IoAllocateMdl(
         Irp->AssociatedIrp.SystemBuffer,
         Request->Req.QueryDirectory.Length,
@@ -843,7 +994,9 @@ NTSTATUS FspFsvolDirectoryControlComplete(
     ULONG DirInfoChangeNumber;
     PVOID DirInfoBuffer;
     ULONG DirInfoSize;
-    BOOLEAN Success;
+    UINT64 DirectoryOffset;
+    ULONG DirInfoSegment;
+    BOOLEAN Cached, Success;
 
     ASSERT(FileNode == FileDesc->FileNode);
     ASSERT(Request->Req.QueryDirectory.Offset == FileDesc->DirectoryOffset);
@@ -857,6 +1010,24 @@ NTSTATUS FspFsvolDirectoryControlComplete(
 
     if (FspFsctlTransactQueryDirectoryKind == Request->Kind)
     {
+        PVOID Address = FspIopRequestContext(Request, RequestAddress);
+        PEPROCESS Process = FspIopRequestContext(Request, RequestProcess);
+
+        if (0 != Address && 0 == Process)
+        {
+            /* copy from the preregistered I/O buffer slot before it is freed */
+            FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+                FspFsvolDeviceExtension(IrpSp->DeviceObject);
+            if (Response->IoStatus.Information > Request->Req.QueryDirectory.Length)
+            {
+                Irp->IoStatus.Information = 0;
+                FSP_RETURN(Result = STATUS_INTERNAL_ERROR);
+            }
+            RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer,
+                FspIoBuffersSlotSystemAddress(FsvolDeviceExtension->IoBuffers, Address),
+                (ULONG)Response->IoStatus.Information);
+        }
+
         DirInfoChangeNumber = FileNode->DirInfoChangeNumber;
         Request->Kind = FspFsctlTransactReservedKind;
         FspIopResetRequest(Request, 0);
@@ -874,27 +1045,46 @@ NTSTATUS FspFsvolDirectoryControlComplete(
         FSP_RETURN();
     }
 
-    if (0 == FileDesc->DirectoryOffset &&
-        FspFileNodeTrySetDirInfo(FileNode,
+    DirectoryOffset = FileDesc->DirectoryOffset;
+    Cached = FALSE;
+    if (0 == DirectoryOffset)
+        Cached = FspFileNodeTrySetDirInfo(FileNode,
+            Irp->AssociatedIrp.SystemBuffer,
+            (ULONG)Response->IoStatus.Information,
+            DirInfoChangeNumber);
+    else if (FspFileNodeTryAppendDirInfo(FileNode, DirectoryOffset,
             Irp->AssociatedIrp.SystemBuffer,
             (ULONG)Response->IoStatus.Information,
-            DirInfoChangeNumber) &&
-        FspFileNodeReferenceDirInfo(FileNode, &DirInfoBuffer, &DirInfoSize))
+            DirInfoChangeNumber, &DirInfoSegment) ||
+        FspFileNodeFindDirInfoSegment(FileNode, DirectoryOffset, &DirInfoSegment))
     {
+        /* the response continues the cached DirInfo (or is already in it) */
+        FileDesc->DirInfo = FileNode->NonPaged->DirInfo;
+        FileDesc->DirInfoSegment = DirInfoSegment;
+        FileDesc->DirInfoCacheHint = 0;
+        Cached = TRUE;
+    }
+
+    if (Cached)
         Result = FspFsvolQueryDirectoryCopyCache(FileDesc,
-            TRUE,
+            0 == DirectoryOffset,
             FileInformationClass, ReturnSingleEntry,
-            DirInfoBuffer, DirInfoSize, Buffer, &Length);
+            Buffer, &Length);
 
-        FspFileNodeDereferenceDirInfo(DirInfoBuffer);
-    }
-    else
+    /* if the cache did not get us anywhere use the response directly */
+    if (!Cached ||
+        (NT_SUCCESS(Result) && 0 == Length && FileDesc->DirectoryOffset == DirectoryOffset))
     {
+        Length = IrpSp->Parameters.QueryDirectory.Length;
         DirInfoBuffer = Irp->AssociatedIrp.SystemBuffer;
         DirInfoSize = (ULONG)Response->IoStatus.Information;
         Result = FspFsvolQueryDirectoryCopyInPlace(FileDesc,
             FileInformationClass, ReturnSingleEntry,
             DirInfoBuffer, DirInfoSize, Buffer, &Length);
+
+        /* the FileDesc position is now past what the cache knows about */
+        FileDesc->DirInfo = FileNode->NonPaged->DirInfo;
+        FileDesc->DirInfoSegment = (ULONG)-1;
     }
 
     if (NT_SUCCESS(Result) && 0 == Length)
@@ -943,7 +1133,13 @@ static VOID FspFsvolQueryDirectoryRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, P
     PVOID Address = Context[RequestAddress];
     PEPROCESS Process = Context[RequestProcess];
 
-    if (0 != Address)
+    if (0 != Address && 0 == Process)
+    {
+        ASSERT(0 != FileNode);
+        FspIoBuffersFreeSlot(FspFsvolDeviceExtension(FileNode->FsvolDeviceObject)->IoBuffers,
+            Address);
+    }
+    else if (0 != Address)
     {
         KAPC_STATE ApcState;
         BOOLEAN Attach;
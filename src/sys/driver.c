@@ -48,6 +48,7 @@ NTSTATUS DriverEntry(
 
     FspDriverObject = DriverObject;
     ExInitializeResourceLite(&FspDeviceGlobalResource);
+    FspIopInitialize();
 
     /* create the file system control device objects */
     UNICODE_STRING DeviceSddl;
@@ -59,14 +60,15 @@ NTSTATUS DriverEntry(
         &DeviceSddl, &FspFsctlDeviceClassGuid,
         &FspFsctlDiskDeviceObject);
     if (!NT_SUCCESS(Result))
-        FSP_RETURN();
+        FSP_RETURN(FspIopFinalize(); ExDeleteResourceLite(&FspDeviceGlobalResource));
     RtlInitUnicodeString(&DeviceName, L"\\Device\\" FSP_FSCTL_NET_DEVICE_NAME);
     Result = FspDeviceCreateSecure(FspFsctlDeviceExtensionKind, 0,
         &DeviceName, FILE_DEVICE_NETWORK_FILE_SYSTEM, FILE_DEVICE_SECURE_OPEN,
         &DeviceSddl, &FspFsctlDeviceClassGuid,
         &FspFsctlNetDeviceObject);
     if (!NT_SUCCESS(Result))
-        FSP_RETURN(FspDeviceDelete(FspFsctlDiskDeviceObject));
+        FSP_RETURN(FspDeviceDelete(FspFsctlDiskDeviceObject);
+            FspIopFinalize(); ExDeleteResourceLite(&FspDeviceGlobalResource));
     Result = FspDeviceInitialize(FspFsctlDiskDeviceObject);
     ASSERT(STATUS_SUCCESS == Result);
     Result = FspDeviceInitialize(FspFsctlNetDeviceObject);
@@ -114,6 +116,7 @@ NTSTATUS DriverEntry(
     FspIopCompleteFunction[IRP_MJ_SET_VOLUME_INFORMATION] = FspFsvolSetVolumeInformationComplete;
     FspIopPrepareFunction[IRP_MJ_DIRECTORY_CONTROL] = FspFsvolDirectoryControlPrepare;
     FspIopCompleteFunction[IRP_MJ_DIRECTORY_CONTROL] = FspFsvolDirectoryControlComplete;
+    FspIopPrepareFunction[IRP_MJ_FILE_SYSTEM_CONTROL] = FspFsvolFileSystemControlPrepare;
     FspIopCompleteFunction[IRP_MJ_FILE_SYSTEM_CONTROL] = FspFsvolFileSystemControlComplete;
     FspIopCompleteFunction[IRP_MJ_DEVICE_CONTROL] = FspFsvolDeviceControlComplete;
     FspIopCompleteFunction[IRP_MJ_SHUTDOWN] = FspFsvolShutdownComplete;
@@ -126,10 +129,10 @@ NTSTATUS DriverEntry(
     /* setup fast I/O and resource acquisition */
     FspFastIoDispatch.SizeOfFastIoDispatch = sizeof FspFastIoDispatch;
     FspFastIoDispatch.FastIoCheckIfPossible = FspFastIoCheckIfPossible;
-    //FspFastIoDispatch.FastIoRead = 0;
-    //FspFastIoDispatch.FastIoWrite = 0;
-    //FspFastIoDispatch.FastIoQueryBasicInfo = 0;
-    //FspFastIoDispatch.FastIoQueryStandardInfo = 0;
+    FspFastIoDispatch.FastIoRead = FsRtlCopyRead;
+    FspFastIoDispatch.FastIoWrite = FsRtlCopyWrite;
+    FspFastIoDispatch.FastIoQueryBasicInfo = FspFastIoQueryBasicInfo;
+    FspFastIoDispatch.FastIoQueryStandardInfo = FspFastIoQueryStandardInfo;
     //FspFastIoDispatch.FastIoLock = 0;
     //FspFastIoDispatch.FastIoUnlockSingle = 0;
     //FspFastIoDispatch.FastIoUnlockAll = 0;
@@ -138,17 +141,17 @@ NTSTATUS DriverEntry(
     FspFastIoDispatch.AcquireFileForNtCreateSection = FspAcquireFileForNtCreateSection;
     FspFastIoDispatch.ReleaseFileForNtCreateSection = FspReleaseFileForNtCreateSection;
     //FspFastIoDispatch.FastIoDetachDevice = 0;
-    //FspFastIoDispatch.FastIoQueryNetworkOpenInfo = 0;
+    FspFastIoDispatch.FastIoQueryNetworkOpenInfo = FspFastIoQueryNetworkOpenInfo;
     FspFastIoDispatch.AcquireForModWrite = FspAcquireForModWrite;
-    //FspFastIoDispatch.MdlRead = 0;
-    //FspFastIoDispatch.MdlReadComplete = 0;
-    //FspFastIoDispatch.PrepareMdlWrite = 0;
-    //FspFastIoDispatch.MdlWriteComplete = 0;
+    FspFastIoDispatch.MdlRead = FsRtlMdlReadDev;
+    FspFastIoDispatch.MdlReadComplete = FsRtlMdlReadCompleteDev;
+    FspFastIoDispatch.PrepareMdlWrite = FsRtlPrepareMdlWriteDev;
+    FspFastIoDispatch.MdlWriteComplete = FsRtlMdlWriteCompleteDev;
     //FspFastIoDispatch.FastIoReadCompressed = 0;
     //FspFastIoDispatch.FastIoWriteCompressed = 0;
     //FspFastIoDispatch.MdlReadCompleteCompressed = 0;
     //FspFastIoDispatch.MdlWriteCompleteCompressed = 0;
-    //FspFastIoDispatch.FastIoQueryOpen = 0;
+    FspFastIoDispatch.FastIoQueryOpen = FspFastIoQueryOpen;
     FspFastIoDispatch.ReleaseForModWrite = FspReleaseForModWrite;
     FspFastIoDispatch.AcquireForCcFlush = FspAcquireForCcFlush;
     FspFastIoDispatch.ReleaseForCcFlush = FspReleaseForCcFlush;
@@ -200,6 +203,7 @@ VOID FspUnload(
     FspFsctlNetDeviceObject = 0;
     //FspDeviceDeleteAll();
 
+    FspIopFinalize();
     ExDeleteResourceLite(&FspDeviceGlobalResource);
     FspDriverObject = 0;
 
@@ -307,6 +307,7 @@ FSP_IOCMPL_DISPATCH FspFsvolCreateComplete;
 FSP_IOCMPL_DISPATCH FspFsvolDeviceControlComplete;
 FSP_IOPREP_DISPATCH FspFsvolDirectoryControlPrepare;
 FSP_IOCMPL_DISPATCH FspFsvolDirectoryControlComplete;
+FSP_IOPREP_DISPATCH FspFsvolFileSystemControlPrepare;
 FSP_IOCMPL_DISPATCH FspFsvolFileSystemControlComplete;
 FSP_IOCMPL_DISPATCH FspFsvolFlushBuffersComplete;
 FSP_IOCMPL_DISPATCH FspFsvolLockControlComplete;
@@ -326,8 +327,18 @@ FSP_IOCMPL_DISPATCH FspFsvolShutdownComplete;
 FSP_IOPREP_DISPATCH FspFsvolWritePrepare;
 FSP_IOCMPL_DISPATCH FspFsvolWriteComplete;
 
+/* close batching */
+VOID FspFsvolCloseBatchFlush(PDEVICE_OBJECT FsvolDeviceObject);
+
+/* attribute-only opens */
+NTSTATUS FspFsvolQueryOpenComplete(PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Response);
+
 /* fast I/O and resource acquisition callbacks */
 FAST_IO_CHECK_IF_POSSIBLE FspFastIoCheckIfPossible;
+FAST_IO_QUERY_BASIC_INFO FspFastIoQueryBasicInfo;
+FAST_IO_QUERY_STANDARD_INFO FspFastIoQueryStandardInfo;
+FAST_IO_QUERY_NETWORK_OPEN_INFO FspFastIoQueryNetworkOpenInfo;
+FAST_IO_QUERY_OPEN FspFastIoQueryOpen;
 FAST_IO_ACQUIRE_FILE FspAcquireFileForNtCreateSection;
 FAST_IO_RELEASE_FILE FspReleaseFileForNtCreateSection;
 FAST_IO_ACQUIRE_FOR_MOD_WRITE FspAcquireForModWrite;
@@ -432,6 +443,11 @@ NTSTATUS FspGetDeviceObjectPointer(PUNICODE_STRING ObjectName, ACCESS_MASK Desir
     PULONG PFileNameIndex, PFILE_OBJECT *PFileObject, PDEVICE_OBJECT *PDeviceObject);
 NTSTATUS FspSendSetInformationIrp(PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject,
     FILE_INFORMATION_CLASS FileInformationClass, PVOID FileInformation, ULONG Length);
+NTSTATUS FspSendQueryInformationIrp(PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject,
+    FILE_INFORMATION_CLASS FileInformationClass, PVOID FileInformation, ULONG Length);
+NTSTATUS FspSendSplitIoIrps(PDEVICE_OBJECT DeviceObject, PIRP Irp,
+    ULONG ChunkSize, ULONG FanOut);
+BOOLEAN FspIsSplitIoChunkIrp(PIRP Irp);
 NTSTATUS FspBufferUserBuffer(PIRP Irp, ULONG Length, LOCK_OPERATION Operation);
 NTSTATUS FspLockUserBuffer(PIRP Irp, ULONG Length, LOCK_OPERATION Operation);
 NTSTATUS FspMapLockedPagesInUserMode(PMDL Mdl, PVOID *PAddress, ULONG ExtraPriorityFlags);
@@ -537,6 +553,20 @@ NTSTATUS FspIrpHookNext(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context);
 #define FspIrpDictNext(Irp)             \
     (*(PIRP *)&(Irp)->Tail.Overlay.DriverContext[1])
 static inline
+ULONG FspIrpPriority(PIRP Irp)
+{
+    /* the Pending queue lane shares storage with FspIrpDictNext; 0 means not set */
+    ULONG Value = (ULONG)((UINT_PTR)Irp->Tail.Overlay.DriverContext[1] & 3);
+    return 0 != Value ? Value - 1 : FspFsctlIrpPriorityBulk;
+}
+static inline
+VOID FspIrpSetPriority(PIRP Irp, ULONG Priority)
+{
+    ASSERT(FspFsctlIrpPriorityCount > Priority);
+    ASSERT(0 == ((UINT_PTR)Irp->Tail.Overlay.DriverContext[1] & ~3));
+    Irp->Tail.Overlay.DriverContext[1] = (PVOID)(UINT_PTR)(Priority + 1);
+}
+static inline
 FSP_FSCTL_TRANSACT_REQ *FspIrpRequest(PIRP Irp)
 {
     return (PVOID)((UINT_PTR)Irp->Tail.Overlay.DriverContext[2] & ~0xf);
@@ -578,21 +608,47 @@ VOID FspIrpSetTopFlags(PIRP Irp, ULONG Flags)
 #define FspIoqCancelled                 ((PIRP)2)
 #define FspIoqPostIrp(Q, I, R)          FspIoqPostIrpEx(Q, I, FALSE, R)
 #define FspIoqPostIrpBestEffort(Q, I, R)FspIoqPostIrpEx(Q, I, TRUE, R)
+#define FspIoqShardCountMax            64
+#define FspIoqTimerWheelSlotCount0      64  /* 1 sec per slot */
+#define FspIoqTimerWheelSlotCount1      16  /* 64 sec per slot */
+typedef struct
+{
+    ULONG CurrentTime;
+    LIST_ENTRY ExpiredList;
+    LIST_ENTRY Slots0[FspIoqTimerWheelSlotCount0];
+    LIST_ENTRY Slots1[FspIoqTimerWheelSlotCount1];
+} FSP_IOQ_TIMER_WHEEL;
 typedef struct
 {
     KSPIN_LOCK SpinLock;
-    BOOLEAN Stopped;
+    LIST_ENTRY PendingIrpList[FspFsctlIrpPriorityCount];
+    ULONG PriorityLane, PriorityCredit;
+    IO_CSQ PendingIoCsq;
+    PVOID Ioq;
+    FSP_IOQ_TIMER_WHEEL TimerWheel;
+} DECLSPEC_CACHEALIGN FSP_IOQ_SHARD;
+typedef struct
+{
+    NPAGED_LOOKASIDE_LIST TimerLookaside;
+    KSPIN_LOCK SpinLock;
+    volatile BOOLEAN Stopped;
     KEVENT PendingIrpEvent;
-    LIST_ENTRY PendingIrpList, ProcessIrpList, RetriedIrpList;
-    IO_CSQ PendingIoCsq, ProcessIoCsq, RetriedIoCsq;
+    FSP_IOQ_SHARD *PendingShards;
+    ULONG PendingShardCount;
+    LIST_ENTRY ProcessIrpList, RetriedIrpList;
+    IO_CSQ ProcessIoCsq, RetriedIoCsq;
     ULONG IrpTimeout;
-    ULONG PendingIrpCapacity, PendingIrpCount, ProcessIrpCount, RetriedIrpCount;
+    ULONG PriorityWeights[FspFsctlIrpPriorityCount];
+    volatile ULONG PendingIrpCapacity;
+    ULONG ProcessIrpCount, RetriedIrpCount;
+    volatile LONG PendingIrpCount;
     VOID (*CompleteCanceledIrp)(PIRP Irp);
     ULONG ProcessIrpBucketCount;
     PVOID ProcessIrpBuckets[];
 } FSP_IOQ;
 NTSTATUS FspIoqCreate(
-    ULONG IrpCapacity, PLARGE_INTEGER IrpTimeout, VOID (*CompleteCanceledIrp)(PIRP Irp),
+    ULONG IrpCapacity, PLARGE_INTEGER IrpTimeout, const UINT8 *PriorityWeights,
+    VOID (*CompleteCanceledIrp)(PIRP Irp),
     FSP_IOQ **PIoq);
 VOID FspIoqDelete(FSP_IOQ *Ioq);
 VOID FspIoqStop(FSP_IOQ *Ioq);
@@ -601,7 +657,10 @@ VOID FspIoqRemoveExpired(FSP_IOQ *Ioq, UINT64 InterruptTime);
 BOOLEAN FspIoqPostIrpEx(FSP_IOQ *Ioq, PIRP Irp, BOOLEAN BestEffort, NTSTATUS *PResult);
 PIRP FspIoqNextPendingIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp, PLARGE_INTEGER Timeout,
     PIRP CancellableIrp);
+NTSTATUS FspIoqWaitPendingIrp(FSP_IOQ *Ioq, PKEVENT Event, PLARGE_INTEGER Timeout,
+    PIRP CancellableIrp);
 ULONG FspIoqPendingIrpCount(FSP_IOQ *Ioq);
+VOID FspIoqSetIrpCredits(FSP_IOQ *Ioq, ULONG IrpCredits);
 BOOLEAN FspIoqStartProcessingIrp(FSP_IOQ *Ioq, PIRP Irp);
 PIRP FspIoqEndProcessingIrp(FSP_IOQ *Ioq, UINT_PTR IrpHint);
 ULONG FspIoqProcessIrpCount(FSP_IOQ *Ioq);
@@ -615,14 +674,20 @@ typedef struct
     KSPIN_LOCK SpinLock;
     UINT64 MetaTimeout;
     ULONG MetaCapacity, ItemCount;
+    ULONG MetaSizeCapacity, ItemSize;
     ULONG ItemSizeMax;
     UINT64 ItemIndex;
-    LIST_ENTRY ItemList;
+    LIST_ENTRY ItemList, LruList;
+    FAST_MUTEX InternMutex;
+    ULONG InternBucketCount;
+    PVOID *InternBuckets;
+    LONG InternSize;
     ULONG ItemBucketCount;
     PVOID ItemBuckets[];
 } FSP_META_CACHE;
 NTSTATUS FspMetaCacheCreate(
-    ULONG MetaCapacity, ULONG ItemSizeMax, PLARGE_INTEGER MetaTimeout,
+    ULONG MetaCapacity, ULONG MetaSizeCapacity, ULONG ItemSizeMax, BOOLEAN InternItems,
+    PLARGE_INTEGER MetaTimeout,
     FSP_META_CACHE **PMetaCache);
 VOID FspMetaCacheDelete(FSP_META_CACHE *MetaCache);
 VOID FspMetaCacheInvalidateExpired(FSP_META_CACHE *MetaCache, UINT64 ExpirationTime);
@@ -632,11 +697,71 @@ VOID FspMetaCacheDereferenceItemBuffer(PCVOID Buffer);
 UINT64 FspMetaCacheAddItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size);
 VOID FspMetaCacheInvalidateItem(FSP_META_CACHE *MetaCache, UINT64 ItemIndex);
 
+/* name cache */
+typedef struct
+{
+    FAST_MUTEX Mutex;
+    UINT64 NameTimeout;
+    ULONG NameCapacity, ItemCount;
+    ULONG DataSize;
+    BOOLEAN CaseInsensitive;
+    ULONG Generation;
+    LIST_ENTRY ItemList;
+    ULONG ItemBucketCount;
+    PVOID ItemBuckets[];
+} FSP_NAME_CACHE;
+NTSTATUS FspNameCacheCreate(
+    ULONG NameCapacity, ULONG DataSize, BOOLEAN CaseInsensitive, PLARGE_INTEGER NameTimeout,
+    FSP_NAME_CACHE **PNameCache);
+VOID FspNameCacheDelete(FSP_NAME_CACHE *NameCache);
+VOID FspNameCacheInvalidateExpired(FSP_NAME_CACHE *NameCache, UINT64 ExpirationTime);
+ULONG FspNameCacheGeneration(FSP_NAME_CACHE *NameCache);
+BOOLEAN FspNameCacheLookup(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name);
+BOOLEAN FspNameCacheLookupData(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name, PVOID Data);
+VOID FspNameCacheAddName(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name, ULONG Generation);
+VOID FspNameCacheAddNameData(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name, ULONG Generation,
+    PCVOID Data);
+VOID FspNameCacheInvalidateName(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name);
+VOID FspNameCacheInvalidatePrefix(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Prefix);
+
+/* file info cache (name cache payload) */
+typedef struct
+{
+    LUID TokenId, ModifiedId;
+    UINT32 UserMode:1, HasTraversePrivilege:1;
+    FSP_FSCTL_FILE_INFO FileInfo;
+} FSP_FILE_INFO_CACHE_DATA;
+
+/* I/O buffers */
+typedef struct
+{
+    KSPIN_LOCK SpinLock;
+    LONG RefCount;                      /* 1 while registered + 1 per slot in use */
+    BOOLEAN Registered;
+    PEPROCESS Process;
+    PMDL Mdl;
+    PUINT8 SystemAddress;
+    UINT64 UserAddress;
+    ULONG SlotSize, SlotCount;
+    ULONG SlotHint;
+    RTL_BITMAP SlotBitmap;
+    ULONG SlotBitmapBuffer[];
+} FSP_IO_BUFFERS;
+NTSTATUS FspIoBuffersCreate(UINT64 UserAddress, ULONG SlotSize, ULONG SlotCount,
+    FSP_IO_BUFFERS **PIoBuffers);
+VOID FspIoBuffersDelete(FSP_IO_BUFFERS *IoBuffers);
+VOID FspIoBuffersUnregister(FSP_IO_BUFFERS *IoBuffers);
+PVOID FspIoBuffersAllocateSlot(FSP_IO_BUFFERS *IoBuffers, ULONG Length);
+VOID FspIoBuffersFreeSlot(FSP_IO_BUFFERS *IoBuffers, PVOID Address);
+PVOID FspIoBuffersSlotSystemAddress(FSP_IO_BUFFERS *IoBuffers, PVOID Address);
+
 /* I/O processing */
 #define FSP_FSCTL_WORK                  \
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'W', METHOD_NEITHER, FILE_ANY_ACCESS)
 #define FSP_FSCTL_WORK_BEST_EFFORT      \
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'w', METHOD_NEITHER, FILE_ANY_ACCESS)
+#define FSP_FSCTL_QUERY_OPEN            \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'q', METHOD_NEITHER, FILE_ANY_ACCESS)
 enum
 {
     FspIopRequestMustSucceed            = 0x01,
@@ -665,6 +790,8 @@ typedef struct
     FSP_IOP_REQUEST_FINI *RequestFini;
     PVOID Context[4];
     FSP_FSCTL_TRANSACT_RSP *Response;
+    UINT16 AllocationClass;
+    BOOLEAN NonPaged;
     __declspec(align(REQ_ALIGN_SIZE)) UINT8 RequestBuf[];
 } FSP_FSCTL_TRANSACT_REQ_HEADER;
 static inline
@@ -673,11 +800,15 @@ PVOID *FspIopRequestContextAddress(FSP_FSCTL_TRANSACT_REQ *Request, ULONG I)
     FSP_FSCTL_TRANSACT_REQ_HEADER *RequestHeader = (PVOID)((PUINT8)Request - sizeof *RequestHeader);
     return &RequestHeader->Context[I];
 }
+VOID FspIopInitialize(VOID);
+VOID FspIopFinalize(VOID);
+VOID FspIopGetRequestStats(FSP_FSCTL_REQUEST_STATS *Stats);
 NTSTATUS FspIopCreateRequestFunnel(
     PIRP Irp, PUNICODE_STRING FileName, ULONG ExtraSize, FSP_IOP_REQUEST_FINI *RequestFini,
     ULONG Flags, FSP_FSCTL_TRANSACT_REQ **PRequest);
 VOID FspIopDeleteRequest(FSP_FSCTL_TRANSACT_REQ *Request);
 VOID FspIopResetRequest(FSP_FSCTL_TRANSACT_REQ *Request, FSP_IOP_REQUEST_FINI *RequestFini);
+VOID FspIopSetIrpPriority(PIRP Irp);
 NTSTATUS FspIopPostWorkRequestFunnel(PDEVICE_OBJECT DeviceObject,
     FSP_FSCTL_TRANSACT_REQ *Request, BOOLEAN BestEffort);
 VOID FspIopCompleteIrpEx(PIRP Irp, NTSTATUS Result, BOOLEAN DeviceDereference);
@@ -714,25 +845,57 @@ VOID FspWqPostIrpWorkItem(PIRP Irp);
     FspWqCreateAndPostIrpWorkItem(I, RW, RF, FALSE)
 #define FspWqRepostIrpWorkItem(I, RW, RF)\
     FspWqCreateAndPostIrpWorkItem(I, RW, RF, TRUE)
+typedef struct
+{
+    KSPIN_LOCK SpinLock;
+    LIST_ENTRY ItemList;
+    KSEMAPHORE Semaphore;
+    BOOLEAN Stopping;
+    LONG RefCount;                      /* 1 for the owner + 1 per running thread */
+    LONG Depth, DepthMax;
+    LONG64 TotalCount;
+    ULONG ThreadCount;
+    PKTHREAD Threads[];
+} FSP_WORK_QUEUE;
+NTSTATUS FspWorkQueueCreate(ULONG ThreadCount, FSP_WORK_QUEUE **PWorkQueue);
+VOID FspWorkQueueDelete(FSP_WORK_QUEUE *WorkQueue);
+VOID FspWorkQueuePost(FSP_WORK_QUEUE *WorkQueue, PWORK_QUEUE_ITEM WorkItem);
 
 /* device management */
 enum
 {
     FspFsvolDeviceSecurityCacheCapacity = 100,
+    FspFsvolDeviceSecurityCacheSizeCapacity = 64 * 1024,
     FspFsvolDeviceSecurityCacheItemSizeMax = 4096,
-    FspFsvolDeviceDirInfoCacheCapacity = 100,
+    FspFsvolDeviceDirInfoCacheCapacity = 1024,
+    FspFsvolDeviceDirInfoCacheSizeCapacity = 16 * 1024 * 1024,
     FspFsvolDeviceDirInfoCacheItemSizeMax = FSP_FSCTL_ALIGN_UP(16384, PAGE_SIZE),
+    FspFsvolDeviceDirInfoCacheSegmentCountMax = 256,
+    FspFsvolDeviceNegativeNameCacheCapacity = 256,
+    FspFsvolDeviceFileInfoCacheCapacity = 1024,
+    FspFsvolDeviceContextByNameTableBucketCountMin = 64,
+    FspFsvolDeviceContextByNameTableBucketCountMax = 64 * 1024,
 };
 typedef struct
 {
     PUNICODE_STRING FileName;
     PVOID Context;
 } FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT_DATA;
-typedef struct
+typedef struct _FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT
 {
-    RTL_BALANCED_LINKS Header;
+    struct _FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT *DictNext;
+    ULONG Hash;
+    RTL_BALANCED_LINKS Header;          /* Header and Data are the NameOrder node */
     FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT_DATA Data;
 } FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT;
+typedef struct
+{
+    ULONG ElementCount;
+    ULONG BucketCount;
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE_ELEMENT **Buckets;
+    RTL_AVL_TABLE NameOrder;
+    PVOID NameOrderElementStorage;
+} FSP_DEVICE_CONTEXT_BY_NAME_TABLE;
 enum
 {
     FspFsctlDeviceExtensionKind = '\0ltC',  /* file system control device (e.g. \Device\WinFsp.Disk) */
@@ -749,7 +912,8 @@ typedef struct
 {
     FSP_DEVICE_EXTENSION Base;
     UINT32 InitDoneFsvrt:1, InitDoneIoq:1, InitDoneSec:1, InitDoneDir:1,
-        InitDoneCtxTab:1, InitDoneTimer:1, InitDoneInfo:1, InitDoneNotify:1;
+        InitDoneCtxTab:1, InitDoneTimer:1, InitDoneInfo:1, InitDoneNotify:1,
+        InitDoneNeg:1, InitDoneFileInfo:1, InitDoneWq:1;
     PDEVICE_OBJECT FsctlDeviceObject;
     PDEVICE_OBJECT FsvrtDeviceObject;
     HANDLE MupHandle;
@@ -760,13 +924,18 @@ typedef struct
     FSP_IOQ *Ioq;
     FSP_META_CACHE *SecurityCache;
     FSP_META_CACHE *DirInfoCache;
+    FSP_NAME_CACHE *NegativeNameCache;
+    FSP_NAME_CACHE *FileInfoCache;
+    FSP_IO_BUFFERS *IoBuffers;
+    FSP_WORK_QUEUE *WorkQueue;
+    FAST_MUTEX CloseBatchMutex;
+    FSP_FSCTL_TRANSACT_REQ *CloseBatchRequest;
     KSPIN_LOCK ExpirationLock;
     WORK_QUEUE_ITEM ExpirationWorkItem;
     BOOLEAN ExpirationInProgress;
     ERESOURCE FileRenameResource;
     ERESOURCE ContextTableResource;
-    RTL_AVL_TABLE ContextByNameTable;
-    PVOID ContextByNameTableElementStorage;
+    FSP_DEVICE_CONTEXT_BY_NAME_TABLE ContextByNameTable;
     UNICODE_STRING VolumeName;
     WCHAR VolumeNameBuf[FSP_FSCTL_VOLUME_NAME_SIZE / sizeof(WCHAR)];
     KSPIN_LOCK InfoSpinLock;
@@ -803,6 +972,7 @@ VOID FspFsvolDeviceFileRenameSetOwner(PDEVICE_OBJECT DeviceObject, PVOID Owner);
 VOID FspFsvolDeviceFileRenameRelease(PDEVICE_OBJECT DeviceObject);
 VOID FspFsvolDeviceFileRenameReleaseOwner(PDEVICE_OBJECT DeviceObject, PVOID Owner);
 VOID FspFsvolDeviceLockContextTable(PDEVICE_OBJECT DeviceObject);
+VOID FspFsvolDeviceLockContextTableShared(PDEVICE_OBJECT DeviceObject);
 VOID FspFsvolDeviceUnlockContextTable(PDEVICE_OBJECT DeviceObject);
 NTSTATUS FspFsvolDeviceCopyContextByNameList(PDEVICE_OBJECT DeviceObject,
     PVOID **PContexts, PULONG PContextCount);
@@ -862,6 +1032,10 @@ NTSTATUS FspVolumeGetNameList(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 NTSTATUS FspVolumeTransact(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+NTSTATUS FspVolumeTransactRing(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+NTSTATUS FspVolumeRegisterIoBuffers(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 NTSTATUS FspVolumeStop(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 NTSTATUS FspVolumeWork(
@@ -890,6 +1064,7 @@ typedef struct
     SECTION_OBJECT_POINTERS SectionObjectPointers;
     KSPIN_LOCK DirInfoSpinLock;
     UINT64 DirInfo;                     /* allows to invalidate DirInfo w/o resources acquired */
+    UINT64 DirInfoSegments;             /* segment index of a DirInfo larger than one item */
 } FSP_FILE_NODE_NONPAGED;
 typedef struct
 {
@@ -919,6 +1094,7 @@ typedef struct
     ULONG SecurityChangeNumber;
     ULONG DirInfoChangeNumber;
     BOOLEAN TruncateOnClose;
+    BOOLEAN CacheStale;                 /* cached data must be flushed and purged */
     FILE_LOCK FileLock;
     struct
     {
@@ -948,7 +1124,13 @@ typedef struct
     UNICODE_STRING DirectoryPattern;
     UINT64 DirectoryOffset;
     UINT64 DirInfo;
+    ULONG DirInfoSegment;
     ULONG DirInfoCacheHint;
+    UNICODE_STRING DirectoryMarker;
+    ULONG NegativeNameCacheGeneration;
+    UINT64 ReadAheadNextOffset;
+    ULONG ReadAheadLength;
+    ULONG ReadAheadSequentialCount;
 } FSP_FILE_DESC;
 NTSTATUS FspFileNodeCopyList(PDEVICE_OBJECT DeviceObject,
     FSP_FILE_NODE ***PFileNodes, PULONG PFileNodeCount);
@@ -993,6 +1175,14 @@ VOID FspFileNodeSetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
     const FSP_FSCTL_FILE_INFO *FileInfo);
 BOOLEAN FspFileNodeTrySetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
     const FSP_FSCTL_FILE_INFO *FileInfo, ULONG InfoChangeNumber);
+VOID FspFileNodeSetCacheStamp(FSP_FILE_NODE *FileNode, const FSP_FSCTL_FILE_INFO *FileInfo);
+VOID FspFileNodeValidateCache(FSP_FILE_NODE *FileNode, const FSP_FSCTL_FILE_INFO *FileInfo);
+NTSTATUS FspFileNodeRevalidateCache(FSP_FILE_NODE *FileNode, PFILE_OBJECT FileObject);
+static inline
+BOOLEAN FspFileNodeCacheValid(FSP_FILE_NODE *FileNode)
+{
+    return FspExpirationTimeValid(FileNode->InfoExpirationTime) && !FileNode->CacheStale;
+}
 BOOLEAN FspFileNodeReferenceSecurity(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize);
 VOID FspFileNodeSetSecurity(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size);
 BOOLEAN FspFileNodeTrySetSecurity(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
@@ -1001,6 +1191,13 @@ BOOLEAN FspFileNodeReferenceDirInfo(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PU
 VOID FspFileNodeSetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size);
 BOOLEAN FspFileNodeTrySetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
     ULONG DirInfoChangeNumber);
+BOOLEAN FspFileNodeReferenceDirInfoSegment(FSP_FILE_NODE *FileNode, ULONG Segment,
+    PCVOID *PBuffer, PULONG PSize);
+BOOLEAN FspFileNodeTryAppendDirInfo(FSP_FILE_NODE *FileNode, UINT64 Offset,
+    PCVOID Buffer, ULONG Size, ULONG DirInfoChangeNumber, PULONG PSegment);
+BOOLEAN FspFileNodeFindDirInfoSegment(FSP_FILE_NODE *FileNode, UINT64 Offset, PULONG PSegment);
+ULONG FspFileNodeSeekDirInfoSegment(FSP_FILE_NODE *FileNode,
+    PUNICODE_STRING FileName, BOOLEAN CaseInsensitive);
 VOID FspFileNodeNotifyChange(FSP_FILE_NODE *FileNode, ULONG Filter, ULONG Action);
 NTSTATUS FspFileNodeProcessLockIrp(FSP_FILE_NODE *FileNode, PIRP Irp);
 NTSTATUS FspFileDescCreate(FSP_FILE_DESC **PFileDesc);
@@ -16,6 +16,7 @@
  */
 
 #include <sys/driver.h>
+#include <shared/dirinfo.h>
 
 NTSTATUS FspFileNodeCopyList(PDEVICE_OBJECT DeviceObject,
     FSP_FILE_NODE ***PFileNodes, PULONG PFileNodeCount);
@@ -48,6 +49,9 @@ VOID FspFileNodeSetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
     const FSP_FSCTL_FILE_INFO *FileInfo);
 BOOLEAN FspFileNodeTrySetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
     const FSP_FSCTL_FILE_INFO *FileInfo, ULONG InfoChangeNumber);
+VOID FspFileNodeSetCacheStamp(FSP_FILE_NODE *FileNode, const FSP_FSCTL_FILE_INFO *FileInfo);
+VOID FspFileNodeValidateCache(FSP_FILE_NODE *FileNode, const FSP_FSCTL_FILE_INFO *FileInfo);
+NTSTATUS FspFileNodeRevalidateCache(FSP_FILE_NODE *FileNode, PFILE_OBJECT FileObject);
 BOOLEAN FspFileNodeReferenceSecurity(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize);
 VOID FspFileNodeSetSecurity(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size);
 BOOLEAN FspFileNodeTrySetSecurity(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
@@ -57,6 +61,19 @@ VOID FspFileNodeSetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size);
 BOOLEAN FspFileNodeTrySetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
     ULONG DirInfoChangeNumber);
 static VOID FspFileNodeInvalidateDirInfo(FSP_FILE_NODE *FileNode);
+static VOID FspFileNodeInvalidateDirInfoSegments(FSP_FILE_NODE *FileNode, UINT64 DirInfoSegments);
+static BOOLEAN FspFileNodeScanDirInfo(PCVOID Buffer, ULONG Size,
+    PUNICODE_STRING FileName, PUINT64 PNextOffset, PBOOLEAN PComplete);
+BOOLEAN FspFileNodeReferenceDirInfoSegment(FSP_FILE_NODE *FileNode, ULONG Segment,
+    PCVOID *PBuffer, PULONG PSize);
+BOOLEAN FspFileNodeTryAppendDirInfo(FSP_FILE_NODE *FileNode, UINT64 Offset,
+    PCVOID Buffer, ULONG Size, ULONG DirInfoChangeNumber, PULONG PSegment);
+BOOLEAN FspFileNodeFindDirInfoSegment(FSP_FILE_NODE *FileNode, UINT64 Offset, PULONG PSegment);
+ULONG FspFileNodeSeekDirInfoSegment(FSP_FILE_NODE *FileNode,
+    PUNICODE_STRING FileName, BOOLEAN CaseInsensitive);
+static FSP_DIR_INFO_COMPARE FspFileNodeCompareDirInfoName;
+static BOOLEAN FspFileNodeTryPatchDirInfo(FSP_FILE_NODE *FileNode, FSP_FILE_NODE *ChildNode,
+    PUNICODE_STRING ChildName, ULONG Action);
 VOID FspFileNodeNotifyChange(FSP_FILE_NODE *FileNode,
     ULONG Filter, ULONG Action);
 NTSTATUS FspFileNodeProcessLockIrp(FSP_FILE_NODE *FileNode, PIRP Irp);
@@ -90,6 +107,9 @@ NTSTATUS FspFileDescResetDirectoryPattern(FSP_FILE_DESC *FileDesc,
 #pragma alloc_text(PAGE, FspFileNodeTryGetFileInfo)
 #pragma alloc_text(PAGE, FspFileNodeSetFileInfo)
 #pragma alloc_text(PAGE, FspFileNodeTrySetFileInfo)
+#pragma alloc_text(PAGE, FspFileNodeSetCacheStamp)
+#pragma alloc_text(PAGE, FspFileNodeValidateCache)
+#pragma alloc_text(PAGE, FspFileNodeRevalidateCache)
 #pragma alloc_text(PAGE, FspFileNodeReferenceSecurity)
 #pragma alloc_text(PAGE, FspFileNodeSetSecurity)
 #pragma alloc_text(PAGE, FspFileNodeTrySetSecurity)
@@ -97,6 +117,14 @@ NTSTATUS FspFileDescResetDirectoryPattern(FSP_FILE_DESC *FileDesc,
 // !#pragma alloc_text(PAGE, FspFileNodeSetDirInfo)
 // !#pragma alloc_text(PAGE, FspFileNodeTrySetDirInfo)
 // !#pragma alloc_text(PAGE, FspFileNodeInvalidateDirInfo)
+// !#pragma alloc_text(PAGE, FspFileNodeInvalidateDirInfoSegments)
+#pragma alloc_text(PAGE, FspFileNodeScanDirInfo)
+// !#pragma alloc_text(PAGE, FspFileNodeReferenceDirInfoSegment)
+// !#pragma alloc_text(PAGE, FspFileNodeTryAppendDirInfo)
+#pragma alloc_text(PAGE, FspFileNodeFindDirInfoSegment)
+#pragma alloc_text(PAGE, FspFileNodeSeekDirInfoSegment)
+#pragma alloc_text(PAGE, FspFileNodeCompareDirInfoName)
+// !#pragma alloc_text(PAGE, FspFileNodeTryPatchDirInfo)
 #pragma alloc_text(PAGE, FspFileNodeNotifyChange)
 #pragma alloc_text(PAGE, FspFileNodeProcessLockIrp)
 #pragma alloc_text(PAGE, FspFileNodeCompleteLockIrp)
@@ -130,7 +158,7 @@ NTSTATUS FspFileNodeCopyList(PDEVICE_OBJECT DeviceObject,
     NTSTATUS Result;
     ULONG Index;
 
-    FspFsvolDeviceLockContextTable(DeviceObject);
+    FspFsvolDeviceLockContextTableShared(DeviceObject);
     Result = FspFsvolDeviceCopyContextByNameList(DeviceObject, PFileNodes, PFileNodeCount);
     if (NT_SUCCESS(Result))
     {
@@ -181,7 +209,11 @@ NTSTATUS FspFileNodeCreate(PDEVICE_OBJECT DeviceObject,
     RtlZeroMemory(FileNode, sizeof *FileNode + ExtraSize);
     FileNode->Header.NodeTypeCode = FspFileNodeFileKind;
     FileNode->Header.NodeByteSize = sizeof *FileNode;
-    FileNode->Header.IsFastIoPossible = FastIoIsNotPossible;
+    /* cached (and therefore fast) I/O is only possible with an infinite FileInfoTimeout */
+    FileNode->Header.IsFastIoPossible =
+        FspTimeoutInfinity32 == FspFsvolDeviceExtension(DeviceObject)->VolumeParams.FileInfoTimeout ||
+        FspFsvolDeviceExtension(DeviceObject)->VolumeParams.CacheValidation ?
+            FastIoIsQuestionable : FastIoIsNotPossible;
     FileNode->Header.Resource = &NonPaged->Resource;
     FileNode->Header.PagingIoResource = &NonPaged->PagingIoResource;
     FileNode->Header.ValidDataLength.QuadPart = MAXLONGLONG;
@@ -211,6 +243,7 @@ VOID FspFileNodeDelete(FSP_FILE_NODE *FileNode)
 
     FsRtlTeardownPerStreamContexts(&FileNode->Header);
 
+    FspFileNodeInvalidateDirInfoSegments(FileNode, FileNode->NonPaged->DirInfoSegments);
     FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, FileNode->NonPaged->DirInfo);
     FspMetaCacheInvalidateItem(FsvolDeviceExtension->SecurityCache, FileNode->Security);
 
@@ -799,10 +832,116 @@ BOOLEAN FspFileNodeTrySetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileOb
     if (FileNode->InfoChangeNumber != InfoChangeNumber)
         return FALSE;
 
+    /* FileInfo comes from a query and may reflect changes made outside of this FSD */
+    FspFileNodeValidateCache(FileNode, FileInfo);
     FspFileNodeSetFileInfo(FileNode, CcFileObject, FileInfo);
     return TRUE;
 }
 
+VOID FspFileNodeSetCacheStamp(FSP_FILE_NODE *FileNode, const FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    /*
+     * The FileNode must be acquired (Pgio) when calling this function.
+     *
+     * Paging writes that are not top-level (e.g. from the lazy writer) cannot go through
+     * FspFileNodeSetFileInfo, which may change the cache file sizes. They must still adopt
+     * the times that they produced; otherwise the next open or query would find the cache
+     * stamp changed and treat our own write as a change made behind our back.
+     */
+
+    PAGED_CODE();
+
+    FileNode->LastWriteTime = FileInfo->LastWriteTime;
+    FileNode->ChangeTime = FileInfo->ChangeTime;
+    FileNode->InfoChangeNumber++;
+}
+
+VOID FspFileNodeValidateCache(FSP_FILE_NODE *FileNode, const FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    /*
+     * The FileNode must be acquired exclusive (Main) when calling this function.
+     *
+     * When the volume allows cached I/O with a finite FileInfoTimeout, the file times and
+     * size reported by the user mode file system serve as a version stamp for the cached
+     * data. If the stamp reported on open or query no longer matches the one we recorded,
+     * the file was changed behind our back and its cached data must go.
+     *
+     * This function runs in the completion context of an open or query, where we cannot
+     * flush: the flush sends paging writes to the same user mode file system. It therefore
+     * only marks the cache stale; FspFileNodeRevalidateCache does the flush and purge.
+     *
+     * FileInfo from our own modifying requests (write, set information, etc.) is adopted
+     * by FspFileNodeSetFileInfo without validation.
+     */
+
+    PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
+
+    if (!FsvolDeviceExtension->VolumeParams.CacheValidation ||
+        FspTimeoutInfinity32 == FsvolDeviceExtension->VolumeParams.FileInfoTimeout ||
+        0 == FileNode->NonPaged->SectionObjectPointers.DataSectionObject)
+        return;
+
+    if (FileNode->ChangeTime == FileInfo->ChangeTime &&
+        FileNode->LastWriteTime == FileInfo->LastWriteTime &&
+        (UINT64)FileNode->Header.FileSize.QuadPart == FileInfo->FileSize)
+        return;
+
+    FileNode->CacheStale = TRUE;
+}
+
+NTSTATUS FspFileNodeRevalidateCache(FSP_FILE_NODE *FileNode, PFILE_OBJECT FileObject)
+{
+    /*
+     * The FileNode must not be acquired when calling this function.
+     *
+     * Refresh expired FileNode info by querying the file system. The query completion
+     * (FspFileNodeTrySetFileInfo) validates the cache against the new info.
+     *
+     * If the cache was found stale (now or by an earlier open or query), write back our
+     * own dirty data and then purge the cache with the FileNode acquired exclusive (Full),
+     * so that no cached read, write or paging I/O runs concurrently with the purge.
+     */
+
+    PAGED_CODE();
+
+    FILE_STANDARD_INFORMATION StandardInformation;
+    IO_STATUS_BLOCK IoStatus;
+    NTSTATUS Result;
+
+    if (!FspExpirationTimeValid(FileNode->InfoExpirationTime))
+    {
+        Result = FspSendQueryInformationIrp(FileNode->FsvolDeviceObject/* bypass filters */,
+            FileObject, FileStandardInformation, &StandardInformation, sizeof StandardInformation);
+        if (!NT_SUCCESS(Result))
+            return Result;
+    }
+
+    if (!FileNode->CacheStale)
+        return STATUS_SUCCESS;
+
+    Result = STATUS_SUCCESS;
+
+    FspFileNodeAcquireExclusive(FileNode, Full);
+
+    if (FileNode->CacheStale)
+    {
+        Result = FspCcFlushCache(&FileNode->NonPaged->SectionObjectPointers, 0, 0, &IoStatus);
+        if (NT_SUCCESS(Result))
+        {
+            if (!CcPurgeCacheSection(&FileNode->NonPaged->SectionObjectPointers, 0, 0, FALSE))
+                DEBUGLOG("CcPurgeCacheSection failed: FileNode=%p", FileNode);
+            FileNode->CacheStale = FALSE;
+        }
+    }
+
+    FspFileNodeRelease(FileNode, Full);
+
+    return Result;
+}
+
 BOOLEAN FspFileNodeReferenceSecurity(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize)
 {
     PAGED_CODE();
@@ -868,6 +1007,7 @@ VOID FspFileNodeSetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size)
     /* no need to acquire the DirInfoSpinLock as the FileNode is acquired */
     DirInfo = NonPaged->DirInfo;
 
+    FspFileNodeInvalidateDirInfoSegments(FileNode, NonPaged->DirInfoSegments);
     FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, DirInfo);
     DirInfo = 0 != Buffer ?
         FspMetaCacheAddItem(FsvolDeviceExtension->DirInfoCache, Buffer, Size) : 0;
@@ -876,6 +1016,7 @@ VOID FspFileNodeSetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size)
     /* acquire the DirInfoSpinLock to protect against concurrent FspFileNodeInvalidateDirInfo */
     KeAcquireSpinLock(&NonPaged->DirInfoSpinLock, &Irql);
     NonPaged->DirInfo = DirInfo;
+    NonPaged->DirInfoSegments = 0;
     KeReleaseSpinLock(&NonPaged->DirInfoSpinLock, Irql);
 }
 
@@ -899,16 +1040,512 @@ static VOID FspFileNodeInvalidateDirInfo(FSP_FILE_NODE *FileNode)
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
     FSP_FILE_NODE_NONPAGED *NonPaged = FileNode->NonPaged;
     KIRQL Irql;
-    UINT64 DirInfo;
+    UINT64 DirInfo, DirInfoSegments;
 
     /* acquire the DirInfoSpinLock to protect against concurrent FspFileNodeSetDirInfo */
     KeAcquireSpinLock(&NonPaged->DirInfoSpinLock, &Irql);
     DirInfo = NonPaged->DirInfo;
+    DirInfoSegments = NonPaged->DirInfoSegments;
     KeReleaseSpinLock(&NonPaged->DirInfoSpinLock, Irql);
 
+    FspFileNodeInvalidateDirInfoSegments(FileNode, DirInfoSegments);
     FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, DirInfo);
 }
 
+/*
+ * A DirInfo listing that does not fit in a single DirInfo cache item is cached as a chain
+ * of segments: the buffers returned by successive QueryDirectory requests, each of which
+ * continues at the NextOffset of the last entry of the previous one. NonPaged->DirInfo is
+ * always the first segment. NonPaged->DirInfoSegments is a meta cache item that holds the
+ * index of all segments together with the first file name in each, so that a lookup by
+ * name can binary search for its segment when the listing is sorted.
+ *
+ * Segment indexes are immutable like DirInfo buffers; appending a segment publishes a new
+ * index. An index is only valid while its first segment is NonPaged->DirInfo and is still
+ * cached, so setting or invalidating the DirInfo (which may happen without the FileNode
+ * acquired) also invalidates the whole chain.
+ */
+typedef struct
+{
+    UINT64 DirInfo;                     /* meta cache item of the segment */
+    UINT64 NextOffset;                  /* NextOffset of the last entry in the segment */
+    UINT16 FileNameOffset;              /* first file name (other than "." and "..") */
+    UINT16 FileNameLength;
+} FSP_FILE_NODE_DIR_INFO_SEGMENT;
+typedef struct
+{
+    ULONG SegmentCount;
+    BOOLEAN Complete;                   /* last segment ends with the EOF marker */
+    FSP_FILE_NODE_DIR_INFO_SEGMENT Segments[];
+    /* followed by the file names */
+} FSP_FILE_NODE_DIR_INFO_INDEX;
+
+static inline PUINT8 FspFileNodeDirInfoIndexNames(FSP_FILE_NODE_DIR_INFO_INDEX *Index)
+{
+    return (PUINT8)&Index->Segments[Index->SegmentCount];
+}
+
+static VOID FspFileNodeInvalidateDirInfoSegments(FSP_FILE_NODE *FileNode, UINT64 DirInfoSegments)
+{
+    // !PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
+    FSP_FILE_NODE_DIR_INFO_INDEX *Index;
+    PCVOID IndexBuffer;
+
+    if (0 == DirInfoSegments)
+        return;
+
+    /* the first segment is NonPaged->DirInfo and is invalidated by the caller */
+    if (FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
+        DirInfoSegments, &IndexBuffer, 0))
+    {
+        Index = (PVOID)IndexBuffer;
+        for (ULONG I = 1; Index->SegmentCount > I; I++)
+            FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache,
+                Index->Segments[I].DirInfo);
+        FspMetaCacheDereferenceItemBuffer(IndexBuffer);
+    }
+
+    FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, DirInfoSegments);
+}
+
+static BOOLEAN FspFileNodeScanDirInfo(PCVOID Buffer, ULONG Size,
+    PUNICODE_STRING FileName, PUINT64 PNextOffset, PBOOLEAN PComplete)
+{
+    PAGED_CODE();
+
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    BOOLEAN Empty = TRUE;
+
+    RtlZeroMemory(FileName, sizeof *FileName);
+    *PNextOffset = 0;
+    *PComplete = FALSE;
+
+    for (ULONG Offset = 0; Offset + sizeof(DirInfo->Size) <= Size;
+        Offset += FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size))
+    {
+        DirInfo = (PVOID)((PUINT8)Buffer + Offset);
+
+        if (sizeof(FSP_FSCTL_DIR_INFO) > DirInfo->Size)
+        {
+            /* EOF marker */
+            *PComplete = TRUE;
+            return TRUE;
+        }
+
+        if (Offset + DirInfo->Size > Size)
+            return FALSE;
+
+        if (0 == FileName->Buffer && !FspDirInfoIsDotEntry(DirInfo))
+        {
+            FileName->Length = FileName->MaximumLength =
+                (USHORT)(DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+            FileName->Buffer = DirInfo->FileNameBuf;
+        }
+
+        *PNextOffset = DirInfo->NextOffset;
+        Empty = FALSE;
+    }
+
+    return !Empty;
+}
+
+BOOLEAN FspFileNodeReferenceDirInfoSegment(FSP_FILE_NODE *FileNode, ULONG Segment,
+    PCVOID *PBuffer, PULONG PSize)
+{
+    // !PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
+    FSP_FILE_NODE_NONPAGED *NonPaged = FileNode->NonPaged;
+    FSP_FILE_NODE_DIR_INFO_INDEX *Index;
+    PCVOID IndexBuffer, Buffer;
+    UINT64 DirInfo;
+
+    if (0 == Segment)
+        return FspFileNodeReferenceDirInfo(FileNode, PBuffer, PSize);
+
+    *PBuffer = 0;
+    *PSize = 0;
+
+    /* no need to acquire the DirInfoSpinLock as the FileNode is acquired */
+    if (!FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
+        NonPaged->DirInfoSegments, &IndexBuffer, 0))
+        return FALSE;
+    Index = (PVOID)IndexBuffer;
+    DirInfo = Index->SegmentCount > Segment && Index->Segments[0].DirInfo == NonPaged->DirInfo ?
+        Index->Segments[Segment].DirInfo : 0;
+    FspMetaCacheDereferenceItemBuffer(IndexBuffer);
+
+    /* the chain is only valid while its first segment is */
+    if (0 == DirInfo || !FspFileNodeReferenceDirInfo(FileNode, &Buffer, 0))
+        return FALSE;
+    FspFileNodeDereferenceDirInfo(Buffer);
+
+    return FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
+        DirInfo, PBuffer, PSize);
+}
+
+BOOLEAN FspFileNodeTryAppendDirInfo(FSP_FILE_NODE *FileNode, UINT64 Offset,
+    PCVOID Buffer, ULONG Size, ULONG DirInfoChangeNumber, PULONG PSegment)
+{
+    /*
+     * Append Buffer (the response to a QueryDirectory at Offset) to the cached DirInfo
+     * as a new segment, provided that Offset continues its last segment. The new segment
+     * index is published only if the DirInfo has not been patched or invalidated in the
+     * meantime. On success *PSegment receives the number of the new segment.
+     */
+
+    // !PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
+    FSP_FILE_NODE_NONPAGED *NonPaged = FileNode->NonPaged;
+    FSP_FILE_NODE_DIR_INFO_INDEX *Index, *NewIndex = 0;
+    FSP_FILE_NODE_DIR_INFO_SEGMENT FirstSegment, *Segments, *Segment;
+    PCVOID DirInfoBuffer, IndexBuffer = 0;
+    ULONG DirInfoSize, IndexSize, SegmentCount, NamesSize, NewIndexSize;
+    PVOID Names;
+    UNICODE_STRING FileName;
+    UINT64 DirInfo, DirInfoSegments, NextOffset;
+    UINT64 NewDirInfo = 0, NewDirInfoSegments = 0;
+    BOOLEAN Complete, Published = FALSE;
+    KIRQL Irql;
+
+    *PSegment = 0;
+
+    if (FileNode->DirInfoChangeNumber != DirInfoChangeNumber)
+        return FALSE;
+
+    /* no need to acquire the DirInfoSpinLock as the FileNode is acquired */
+    DirInfo = NonPaged->DirInfo;
+    DirInfoSegments = NonPaged->DirInfoSegments;
+
+    if (!FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
+        DirInfo, &DirInfoBuffer, &DirInfoSize))
+        return FALSE;
+
+    if (FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
+        DirInfoSegments, &IndexBuffer, &IndexSize))
+    {
+        Index = (PVOID)IndexBuffer;
+        if (Index->Segments[0].DirInfo != DirInfo)
+            goto exit;
+        Segments = Index->Segments;
+        SegmentCount = Index->SegmentCount;
+        Names = FspFileNodeDirInfoIndexNames(Index);
+        NamesSize = IndexSize - (ULONG)((PUINT8)Names - (PUINT8)Index);
+        Complete = Index->Complete;
+    }
+    else
+    {
+        /* the DirInfo is a single segment so far */
+        if (!FspFileNodeScanDirInfo(DirInfoBuffer, DirInfoSize,
+            &FileName, &FirstSegment.NextOffset, &Complete))
+            goto exit;
+        FirstSegment.DirInfo = DirInfo;
+        FirstSegment.FileNameOffset = 0;
+        FirstSegment.FileNameLength = FileName.Length;
+        Segments = &FirstSegment;
+        SegmentCount = 1;
+        Names = FileName.Buffer;
+        NamesSize = FileName.Length;
+    }
+
+    if (Complete ||
+        FspFsvolDeviceDirInfoCacheSegmentCountMax <= SegmentCount ||
+        Segments[SegmentCount - 1].NextOffset != Offset)
+        goto exit;
+
+    if (!FspFileNodeScanDirInfo(Buffer, Size, &FileName, &NextOffset, &Complete))
+        goto exit;
+
+    NewIndexSize = FIELD_OFFSET(FSP_FILE_NODE_DIR_INFO_INDEX, Segments) +
+        (SegmentCount + 1) * sizeof *Segments + NamesSize + FileName.Length;
+    NewIndex = FspAlloc(NewIndexSize);
+    if (0 == NewIndex)
+        goto exit;
+
+    NewDirInfo = FspMetaCacheAddItem(FsvolDeviceExtension->DirInfoCache, Buffer, Size);
+    if (0 == NewDirInfo)
+        goto exit;
+
+    RtlZeroMemory(NewIndex, FIELD_OFFSET(FSP_FILE_NODE_DIR_INFO_INDEX, Segments));
+    NewIndex->SegmentCount = SegmentCount + 1;
+    NewIndex->Complete = Complete;
+    RtlCopyMemory(NewIndex->Segments, Segments, SegmentCount * sizeof *Segments);
+    Segment = &NewIndex->Segments[SegmentCount];
+    Segment->DirInfo = NewDirInfo;
+    Segment->NextOffset = NextOffset;
+    Segment->FileNameOffset = (UINT16)NamesSize;
+    Segment->FileNameLength = FileName.Length;
+    RtlCopyMemory(FspFileNodeDirInfoIndexNames(NewIndex), Names, NamesSize);
+    RtlCopyMemory(FspFileNodeDirInfoIndexNames(NewIndex) + NamesSize,
+        FileName.Buffer, FileName.Length);
+
+    /* if the index does not fit in the cache we get 0: the DirInfo stops growing here */
+    NewDirInfoSegments = FspMetaCacheAddItem(FsvolDeviceExtension->DirInfoCache,
+        NewIndex, NewIndexSize);
+    if (0 == NewDirInfoSegments)
+        goto exit;
+
+    /* acquire the DirInfoSpinLock to protect against concurrent FspFileNodeTryPatchDirInfo */
+    KeAcquireSpinLock(&NonPaged->DirInfoSpinLock, &Irql);
+    Published = NonPaged->DirInfo == DirInfo && NonPaged->DirInfoSegments == DirInfoSegments;
+    if (Published)
+        NonPaged->DirInfoSegments = NewDirInfoSegments;
+    KeReleaseSpinLock(&NonPaged->DirInfoSpinLock, Irql);
+
+    if (Published)
+    {
+        /* the old index goes; its segments are shared with the new one */
+        FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, DirInfoSegments);
+        *PSegment = SegmentCount;
+    }
+
+exit:
+    if (!Published)
+    {
+        FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, NewDirInfoSegments);
+        FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, NewDirInfo);
+    }
+
+    if (0 != NewIndex)
+        FspFree(NewIndex);
+
+    if (0 != IndexBuffer)
+        FspMetaCacheDereferenceItemBuffer(IndexBuffer);
+    FspMetaCacheDereferenceItemBuffer(DirInfoBuffer);
+
+    return Published;
+}
+
+BOOLEAN FspFileNodeFindDirInfoSegment(FSP_FILE_NODE *FileNode, UINT64 Offset, PULONG PSegment)
+{
+    /* find the segment that starts right after the entry whose NextOffset is Offset */
+
+    PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
+    FSP_FILE_NODE_NONPAGED *NonPaged = FileNode->NonPaged;
+    FSP_FILE_NODE_DIR_INFO_INDEX *Index;
+    PCVOID IndexBuffer;
+    BOOLEAN Result = FALSE;
+
+    *PSegment = 0;
+
+    if (!FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
+        NonPaged->DirInfoSegments, &IndexBuffer, 0))
+        return FALSE;
+
+    Index = (PVOID)IndexBuffer;
+    if (Index->Segments[0].DirInfo == NonPaged->DirInfo)
+        for (ULONG I = 1; Index->SegmentCount > I; I++)
+            if (Index->Segments[I - 1].NextOffset == Offset)
+            {
+                *PSegment = I;
+                Result = TRUE;
+                break;
+            }
+
+    FspMetaCacheDereferenceItemBuffer(IndexBuffer);
+
+    return Result;
+}
+
+ULONG FspFileNodeSeekDirInfoSegment(FSP_FILE_NODE *FileNode,
+    PUNICODE_STRING FileName, BOOLEAN CaseInsensitive)
+{
+    /*
+     * Binary search for the last segment whose first file name is not greater than
+     * FileName. Only meaningful if the DirInfo is sorted by name (VolumeParams.PatchDirInfo).
+     */
+
+    PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
+    FSP_FILE_NODE_NONPAGED *NonPaged = FileNode->NonPaged;
+    FSP_FILE_NODE_DIR_INFO_INDEX *Index;
+    FSP_FILE_NODE_DIR_INFO_SEGMENT *Segment;
+    PCVOID IndexBuffer;
+    PUINT8 Names;
+    ULONG Lo, Hi, Mi, Result = 0;
+
+    if (!FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
+        NonPaged->DirInfoSegments, &IndexBuffer, 0))
+        return 0;
+
+    Index = (PVOID)IndexBuffer;
+    if (Index->Segments[0].DirInfo == NonPaged->DirInfo)
+    {
+        Names = FspFileNodeDirInfoIndexNames(Index);
+
+        /* only the last segment can be empty (EOF marker only); it sorts last */
+        for (Lo = 1, Hi = Index->SegmentCount; Lo < Hi;)
+        {
+            Mi = Lo + (Hi - Lo) / 2;
+            Segment = &Index->Segments[Mi];
+            if (0 != Segment->FileNameLength &&
+                0 >= FspFileNodeCompareDirInfoName(
+                    (PWSTR)(Names + Segment->FileNameOffset), Segment->FileNameLength,
+                    FileName->Buffer, FileName->Length,
+                    CaseInsensitive))
+            {
+                Result = Mi;
+                Lo = Mi + 1;
+            }
+            else
+                Hi = Mi;
+        }
+    }
+
+    FspMetaCacheDereferenceItemBuffer(IndexBuffer);
+
+    return Result;
+}
+
+static INT FspFileNodeCompareDirInfoName(
+    PCWSTR FileName0, ULONG FileNameLength0, PCWSTR FileName1, ULONG FileNameLength1,
+    BOOLEAN CaseInsensitive)
+{
+    PAGED_CODE();
+
+    UNICODE_STRING Name0, Name1;
+
+    Name0.Length = Name0.MaximumLength = (USHORT)FileNameLength0;
+    Name0.Buffer = (PWSTR)FileName0;
+    Name1.Length = Name1.MaximumLength = (USHORT)FileNameLength1;
+    Name1.Buffer = (PWSTR)FileName1;
+
+    return RtlCompareUnicodeString(&Name0, &Name1, CaseInsensitive);
+}
+
+static BOOLEAN FspFileNodeTryPatchDirInfo(FSP_FILE_NODE *FileNode, FSP_FILE_NODE *ChildNode,
+    PUNICODE_STRING ChildName, ULONG Action)
+{
+    /*
+     * Insert or remove the DirInfo entry of ChildNode in the cached DirInfo of FileNode
+     * (its parent directory), so that the next directory listing does not have to go back
+     * to user mode. This requires that the user mode file system return entries sorted by
+     * name and use the IndexNumber as NextOffset (VolumeParams.PatchDirInfo).
+     *
+     * The parent directory is not acquired. Cached DirInfo buffers are immutable, so we
+     * build a patched copy and publish it only if the parent DirInfo has not changed in
+     * the meantime; otherwise we retry against the new DirInfo. Returns FALSE if the
+     * cached DirInfo could not be patched and must be invalidated.
+     */
+
+    // !PAGED_CODE();
+
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
+    FSP_FILE_NODE_NONPAGED *NonPaged = FileNode->NonPaged;
+    BOOLEAN CaseInsensitive = !FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch;
+    BOOLEAN Insert = FILE_ACTION_ADDED == Action || FILE_ACTION_RENAMED_NEW_NAME == Action;
+    FSP_FSCTL_DIR_INFO *DirInfo = 0;
+    PCVOID Buffer;
+    PVOID NewBuffer;
+    ULONG Size, NewSize;
+    UINT64 DirInfoIndex, NewDirInfoIndex;
+    BOOLEAN Result = FALSE, Segmented, Published;
+    KIRQL Irql;
+
+    if (!FsvolDeviceExtension->VolumeParams.PatchDirInfo)
+        return FALSE;
+
+    /* named streams do not appear in directory listings */
+    for (USHORT I = 0; ChildName->Length / sizeof(WCHAR) > I; I++)
+        if (L':' == ChildName->Buffer[I])
+            return FALSE;
+
+    if (Insert)
+    {
+        DirInfo = FspAlloc(sizeof *DirInfo + ChildName->Length);
+        if (0 == DirInfo)
+            return FALSE;
+        RtlZeroMemory(DirInfo, sizeof *DirInfo);
+        if (!FspFileNodeTryGetFileInfo(ChildNode, &DirInfo->FileInfo))
+            goto exit;
+        DirInfo->Size = (UINT16)(sizeof *DirInfo + ChildName->Length);
+        DirInfo->FileInfo.IndexNumber = ChildNode->IndexNumber;
+        DirInfo->NextOffset = ChildNode->IndexNumber;
+        RtlCopyMemory(DirInfo->FileNameBuf, ChildName->Buffer, ChildName->Length);
+    }
+
+    /* a few retries are enough; under heavy contention invalidation is cheaper */
+    for (ULONG Retry = 0; 4 > Retry; Retry++)
+    {
+        KeAcquireSpinLock(&NonPaged->DirInfoSpinLock, &Irql);
+        DirInfoIndex = NonPaged->DirInfo;
+        Segmented = 0 != NonPaged->DirInfoSegments;
+        KeReleaseSpinLock(&NonPaged->DirInfoSpinLock, Irql);
+
+        /* segmented DirInfo is not patched */
+        if (Segmented)
+            break;
+
+        if (!FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
+            DirInfoIndex, &Buffer, &Size))
+        {
+            /* nothing cached: nothing to patch */
+            Result = TRUE;
+            break;
+        }
+
+        NewBuffer = FspAlloc(Size + (Insert ? FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size) : 0));
+        if (0 == NewBuffer)
+        {
+            FspMetaCacheDereferenceItemBuffer(Buffer);
+            break;
+        }
+
+        Result = Insert ?
+            FspDirInfoBufferInsert((PVOID)Buffer, Size, DirInfo,
+                FspFileNodeCompareDirInfoName, CaseInsensitive,
+                NewBuffer, &NewSize) :
+            FspDirInfoBufferRemove((PVOID)Buffer, Size, ChildName->Buffer, ChildName->Length,
+                FspFileNodeCompareDirInfoName, CaseInsensitive,
+                NewBuffer, &NewSize);
+        FspMetaCacheDereferenceItemBuffer(Buffer);
+
+        if (!Result || 0 == NewSize)
+        {
+            FspFree(NewBuffer);
+            break;
+        }
+
+        /* if the patched DirInfo does not fit in the cache we get 0: same as invalidation */
+        NewDirInfoIndex = FspMetaCacheAddItem(FsvolDeviceExtension->DirInfoCache,
+            NewBuffer, NewSize);
+        FspFree(NewBuffer);
+
+        KeAcquireSpinLock(&NonPaged->DirInfoSpinLock, &Irql);
+        Published = NonPaged->DirInfo == DirInfoIndex && 0 == NonPaged->DirInfoSegments;
+        if (Published)
+            NonPaged->DirInfo = NewDirInfoIndex;
+        KeReleaseSpinLock(&NonPaged->DirInfoSpinLock, Irql);
+
+        if (Published)
+        {
+            FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, DirInfoIndex);
+            break;
+        }
+
+        FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, NewDirInfoIndex);
+        Result = FALSE;
+    }
+
+exit:
+    if (0 != DirInfo)
+        FspFree(DirInfo);
+
+    return Result;
+}
+
 VOID FspFileNodeNotifyChange(FSP_FILE_NODE *FileNode,
     ULONG Filter, ULONG Action)
 {
@@ -932,7 +1569,10 @@ VOID FspFileNodeNotifyChange(FSP_FILE_NODE *FileNode,
     case FILE_ACTION_RENAMED_NEW_NAME:
         FspFsvolDeviceInvalidateVolumeInfo(FsvolDeviceObject);
 
-        FspFsvolDeviceLockContextTable(FsvolDeviceObject);
+        /* the parent directory times have changed */
+        FspNameCacheInvalidateName(FsvolDeviceExtension->FileInfoCache, &Parent);
+
+        FspFsvolDeviceLockContextTableShared(FsvolDeviceObject);
         ParentNode = FspFsvolDeviceLookupContextByName(FsvolDeviceObject, &Parent);
         if (0 != ParentNode)
             FspFileNodeReference(ParentNode);
@@ -940,7 +1580,8 @@ VOID FspFileNodeNotifyChange(FSP_FILE_NODE *FileNode,
 
         if (0 != ParentNode)
         {
-            FspFileNodeInvalidateDirInfo(ParentNode);
+            if (!FspFileNodeTryPatchDirInfo(ParentNode, FileNode, &Suffix, Action))
+                FspFileNodeInvalidateDirInfo(ParentNode);
             FspFileNodeDereference(ParentNode);
         }
         break;
@@ -1017,6 +1658,9 @@ VOID FspFileDescDelete(FSP_FILE_DESC *FileDesc)
             RtlFreeUnicodeString(&FileDesc->DirectoryPattern);
     }
 
+    if (0 != FileDesc->DirectoryMarker.Buffer)
+        FspFree(FileDesc->DirectoryMarker.Buffer);
+
     FspFree(FileDesc);
 }
 
@@ -66,6 +66,12 @@ static NTSTATUS FspFsvolSetInformation(
 FSP_IOPREP_DISPATCH FspFsvolSetInformationPrepare;
 FSP_IOCMPL_DISPATCH FspFsvolSetInformationComplete;
 static FSP_IOP_REQUEST_FINI FspFsvolSetInformationRequestFini;
+static BOOLEAN FspFastIoQueryInformation(PFILE_OBJECT FileObject, BOOLEAN Wait,
+    FILE_INFORMATION_CLASS FileInformationClass, PVOID Buffer, ULONG Length,
+    PIO_STATUS_BLOCK IoStatus);
+FAST_IO_QUERY_BASIC_INFO FspFastIoQueryBasicInfo;
+FAST_IO_QUERY_STANDARD_INFO FspFastIoQueryStandardInfo;
+FAST_IO_QUERY_NETWORK_OPEN_INFO FspFastIoQueryNetworkOpenInfo;
 FSP_DRIVER_DISPATCH FspQueryInformation;
 FSP_DRIVER_DISPATCH FspSetInformation;
 
@@ -93,6 +99,10 @@ FSP_DRIVER_DISPATCH FspSetInformation;
 #pragma alloc_text(PAGE, FspFsvolSetInformationPrepare)
 #pragma alloc_text(PAGE, FspFsvolSetInformationComplete)
 #pragma alloc_text(PAGE, FspFsvolSetInformationRequestFini)
+#pragma alloc_text(PAGE, FspFastIoQueryInformation)
+#pragma alloc_text(PAGE, FspFastIoQueryBasicInfo)
+#pragma alloc_text(PAGE, FspFastIoQueryStandardInfo)
+#pragma alloc_text(PAGE, FspFastIoQueryNetworkOpenInfo)
 #pragma alloc_text(PAGE, FspQueryInformation)
 #pragma alloc_text(PAGE, FspSetInformation)
 #endif
@@ -944,7 +954,7 @@ static NTSTATUS FspFsvolSetRenameInformation(
      */
 
     Result = STATUS_SUCCESS;
-    FspFsvolDeviceLockContextTable(FsvolDeviceObject);
+    FspFsvolDeviceLockContextTableShared(FsvolDeviceObject);
     if (1 < FileNode->HandleCount ||
         (FileNode->IsDirectory &&
             FspFileNodeHasOpenHandles(FsvolDeviceObject, &FileNode->FileName, TRUE)) ||
@@ -985,6 +995,16 @@ static NTSTATUS FspFsvolSetRenameInformationSuccess(
     NewFileName.Buffer = FspAllocMustSucceed(NewFileName.Length);
     RtlCopyMemory(NewFileName.Buffer, Request->Buffer + Request->FileName.Size, NewFileName.Length);
 
+    /* the new name (and anything below it) now exists */
+    FspNameCacheInvalidatePrefix(FspFsvolDeviceExtension(FsvolDeviceObject)->NegativeNameCache,
+        &NewFileName);
+
+    /* file info cached below the old or the new name is stale */
+    FspNameCacheInvalidatePrefix(FspFsvolDeviceExtension(FsvolDeviceObject)->FileInfoCache,
+        &FileNode->FileName);
+    FspNameCacheInvalidatePrefix(FspFsvolDeviceExtension(FsvolDeviceObject)->FileInfoCache,
+        &NewFileName);
+
     FspFileNodeRename(FileNode, &NewFileName);
 
     /* fastfat has some really arcane rules on rename notifications; simplify! */
@@ -1244,6 +1264,99 @@ static VOID FspFsvolSetInformationRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, P
     }
 }
 
+static BOOLEAN FspFastIoQueryInformation(PFILE_OBJECT FileObject, BOOLEAN Wait,
+    FILE_INFORMATION_CLASS FileInformationClass, PVOID Buffer, ULONG Length,
+    PIO_STATUS_BLOCK IoStatus)
+{
+    PAGED_CODE();
+
+    /* is this a valid FileObject? */
+    if (!FspFileNodeIsValid(FileObject->FsContext))
+        return FALSE;
+
+    NTSTATUS Result;
+    FSP_FILE_NODE *FileNode = FileObject->FsContext;
+    PVOID BufferP = Buffer;
+    PVOID BufferEnd = (PUINT8)Buffer + Length;
+    FSP_FSCTL_FILE_INFO FileInfoBuf;
+    BOOLEAN Success;
+
+    /* serve the query only from unexpired FileNode info; otherwise take the IRP path */
+    Success = DEBUGTEST(90) &&
+        FspFileNodeTryAcquireSharedF(FileNode, FspFileNodeAcquireMain, Wait);
+    if (!Success)
+        return FALSE;
+    Success = FspFileNodeTryGetFileInfo(FileNode, &FileInfoBuf);
+    FspFileNodeRelease(FileNode, Main);
+    if (!Success)
+        return FALSE;
+
+    switch (FileInformationClass)
+    {
+    case FileBasicInformation:
+        Result = FspFsvolQueryBasicInformation(FileObject, &BufferP, BufferEnd, &FileInfoBuf);
+        break;
+    case FileNetworkOpenInformation:
+        Result = FspFsvolQueryNetworkOpenInformation(FileObject, &BufferP, BufferEnd, &FileInfoBuf);
+        break;
+    case FileStandardInformation:
+        Result = FspFsvolQueryStandardInformation(FileObject, &BufferP, BufferEnd, &FileInfoBuf);
+        break;
+    default:
+        ASSERT(0);
+        return FALSE;
+    }
+
+    IoStatus->Status = Result;
+    IoStatus->Information = (UINT_PTR)((PUINT8)BufferP - (PUINT8)Buffer);
+    return TRUE;
+}
+
+BOOLEAN FspFastIoQueryBasicInfo(
+    PFILE_OBJECT FileObject,
+    BOOLEAN Wait,
+    PFILE_BASIC_INFORMATION Buffer,
+    PIO_STATUS_BLOCK IoStatus,
+    PDEVICE_OBJECT DeviceObject)
+{
+    FSP_ENTER_BOOL(PAGED_CODE());
+
+    Result = FspFastIoQueryInformation(FileObject, Wait,
+        FileBasicInformation, Buffer, sizeof *Buffer, IoStatus);
+
+    FSP_LEAVE_BOOL("FileObject=%p", FileObject);
+}
+
+BOOLEAN FspFastIoQueryStandardInfo(
+    PFILE_OBJECT FileObject,
+    BOOLEAN Wait,
+    PFILE_STANDARD_INFORMATION Buffer,
+    PIO_STATUS_BLOCK IoStatus,
+    PDEVICE_OBJECT DeviceObject)
+{
+    FSP_ENTER_BOOL(PAGED_CODE());
+
+    Result = FspFastIoQueryInformation(FileObject, Wait,
+        FileStandardInformation, Buffer, sizeof *Buffer, IoStatus);
+
+    FSP_LEAVE_BOOL("FileObject=%p", FileObject);
+}
+
+BOOLEAN FspFastIoQueryNetworkOpenInfo(
+    PFILE_OBJECT FileObject,
+    BOOLEAN Wait,
+    PFILE_NETWORK_OPEN_INFORMATION Buffer,
+    PIO_STATUS_BLOCK IoStatus,
+    PDEVICE_OBJECT DeviceObject)
+{
+    FSP_ENTER_BOOL(PAGED_CODE());
+
+    Result = FspFastIoQueryInformation(FileObject, Wait,
+        FileNetworkOpenInformation, Buffer, sizeof *Buffer, IoStatus);
+
+    FSP_LEAVE_BOOL("FileObject=%p", FileObject);
+}
+
 NTSTATUS FspQueryInformation(
     PDEVICE_OBJECT DeviceObject, PIRP Irp)
 {
@@ -17,6 +17,8 @@
 
 #include <sys/driver.h>
 
+static NTSTATUS FspFsctlGetRequestStats(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 static NTSTATUS FspFsctlFileSystemControl(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 static NTSTATUS FspFsvolFileSystemControlReparsePoint(
@@ -27,15 +29,18 @@ static NTSTATUS FspFsvolFileSystemControlReparsePointComplete(
     BOOLEAN IsWrite);
 static NTSTATUS FspFsvolFileSystemControl(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+FSP_IOPREP_DISPATCH FspFsvolFileSystemControlPrepare;
 FSP_IOCMPL_DISPATCH FspFsvolFileSystemControlComplete;
 static FSP_IOP_REQUEST_FINI FspFsvolFileSystemControlRequestFini;
 FSP_DRIVER_DISPATCH FspFileSystemControl;
 
 #ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FspFsctlGetRequestStats)
 #pragma alloc_text(PAGE, FspFsctlFileSystemControl)
 #pragma alloc_text(PAGE, FspFsvolFileSystemControlReparsePoint)
 #pragma alloc_text(PAGE, FspFsvolFileSystemControlReparsePointComplete)
 #pragma alloc_text(PAGE, FspFsvolFileSystemControl)
+#pragma alloc_text(PAGE, FspFsvolFileSystemControlPrepare)
 #pragma alloc_text(PAGE, FspFsvolFileSystemControlComplete)
 #pragma alloc_text(PAGE, FspFsvolFileSystemControlRequestFini)
 #pragma alloc_text(PAGE, FspFileSystemControl)
@@ -46,6 +51,22 @@ enum
     RequestFileNode                     = 0,
 };
 
+static NTSTATUS FspFsctlGetRequestStats(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
+{
+    PAGED_CODE();
+
+    ASSERT(FSP_FSCTL_REQUEST_STATS == IrpSp->Parameters.FileSystemControl.FsControlCode);
+
+    if (sizeof(FSP_FSCTL_REQUEST_STATS) > IrpSp->Parameters.FileSystemControl.OutputBufferLength)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    FspIopGetRequestStats(Irp->AssociatedIrp.SystemBuffer);
+
+    Irp->IoStatus.Information = sizeof(FSP_FSCTL_REQUEST_STATS);
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS FspFsctlFileSystemControl(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
 {
@@ -64,11 +85,22 @@ static NTSTATUS FspFsctlFileSystemControl(
         case FSP_FSCTL_VOLUME_LIST:
             Result = FspVolumeGetNameList(FsctlDeviceObject, Irp, IrpSp);
             break;
+        case FSP_FSCTL_REQUEST_STATS:
+            Result = FspFsctlGetRequestStats(FsctlDeviceObject, Irp, IrpSp);
+            break;
         case FSP_FSCTL_TRANSACT:
         case FSP_FSCTL_TRANSACT_BATCH:
             if (0 != IrpSp->FileObject->FsContext2)
                 Result = FspVolumeTransact(FsctlDeviceObject, Irp, IrpSp);
             break;
+        case FSP_FSCTL_TRANSACT_RING:
+            if (0 != IrpSp->FileObject->FsContext2)
+                Result = FspVolumeTransactRing(FsctlDeviceObject, Irp, IrpSp);
+            break;
+        case FSP_FSCTL_REGISTER_IO_BUFFERS:
+            if (0 != IrpSp->FileObject->FsContext2)
+                Result = FspVolumeRegisterIoBuffers(FsctlDeviceObject, Irp, IrpSp);
+            break;
         case FSP_FSCTL_STOP:
             if (0 != IrpSp->FileObject->FsContext2)
                 Result = FspVolumeStop(FsctlDeviceObject, Irp, IrpSp);
@@ -311,6 +343,7 @@ static NTSTATUS FspFsvolFileSystemControl(
         {
         case FSP_FSCTL_WORK:
         case FSP_FSCTL_WORK_BEST_EFFORT:
+        case FSP_FSCTL_QUERY_OPEN:
             Result = FspVolumeWork(FsvolDeviceObject, Irp, IrpSp);
             break;
         case FSCTL_GET_REPARSE_POINT:
@@ -327,11 +360,28 @@ static NTSTATUS FspFsvolFileSystemControl(
     return Result;
 }
 
+NTSTATUS FspFsvolFileSystemControlPrepare(
+    PIRP Irp, FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    PAGED_CODE();
+
+    /* QueryOpen requests need an access token just like Create requests */
+    if (FspFsctlTransactQueryOpenKind == Request->Kind)
+        return FspFsvolCreatePrepare(Irp, Request);
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS FspFsvolFileSystemControlComplete(
     PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Response)
 {
     FSP_ENTER_IOC(PAGED_CODE());
 
+    /* QueryOpen (FSP_FSCTL_QUERY_OPEN) has no FileObject either, but has a result */
+    if (IRP_MN_USER_FS_REQUEST == IrpSp->MinorFunction &&
+        FSP_FSCTL_QUERY_OPEN == IrpSp->Parameters.FileSystemControl.FsControlCode)
+        FSP_RETURN(Result = FspFsvolQueryOpenComplete(Irp, Response));
+
     /* exit now if we do not have a FileObject (FSP_FSCTL_WORK*) */
     if (0 == IrpSp->FileObject)
         FSP_RETURN();
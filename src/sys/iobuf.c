@@ -0,0 +1,221 @@
+/**
+ * @file sys/iobuf.c
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <sys/driver.h>
+
+/*
+ * Preregistered I/O buffers.
+ *
+ * The user mode file system may register a region of its address space with the FSD
+ * once; the region is divided into equally sized slots. The FSD locks the region and
+ * maps it into system space at registration time. Read, write and query directory
+ * requests that fit in a slot then use a free slot as their user mode buffer: data are
+ * copied between the slot and the IRP buffer, instead of mapping the IRP buffer into the
+ * file system process (and unmapping it again) for every request.
+ *
+ * Slots may only be handed out in the process that registered the buffers. The region
+ * stays locked while it is registered or any of its slots are in use; it is unregistered
+ * when the volume is deleted. The FSP_IO_BUFFERS structure itself lives as long as the
+ * volume device.
+ */
+
+NTSTATUS FspIoBuffersCreate(UINT64 UserAddress, ULONG SlotSize, ULONG SlotCount,
+    FSP_IO_BUFFERS **PIoBuffers);
+VOID FspIoBuffersDelete(FSP_IO_BUFFERS *IoBuffers);
+VOID FspIoBuffersUnregister(FSP_IO_BUFFERS *IoBuffers);
+static VOID FspIoBuffersDereference(FSP_IO_BUFFERS *IoBuffers);
+PVOID FspIoBuffersAllocateSlot(FSP_IO_BUFFERS *IoBuffers, ULONG Length);
+VOID FspIoBuffersFreeSlot(FSP_IO_BUFFERS *IoBuffers, PVOID Address);
+PVOID FspIoBuffersSlotSystemAddress(FSP_IO_BUFFERS *IoBuffers, PVOID Address);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FspIoBuffersCreate)
+#pragma alloc_text(PAGE, FspIoBuffersDelete)
+#endif
+
+NTSTATUS FspIoBuffersCreate(UINT64 UserAddress, ULONG SlotSize, ULONG SlotCount,
+    FSP_IO_BUFFERS **PIoBuffers)
+{
+    PAGED_CODE();
+
+    NTSTATUS Result;
+    FSP_IO_BUFFERS *IoBuffers;
+    ULONG BitmapSize;
+    PMDL Mdl;
+    PVOID SystemAddress;
+
+    *PIoBuffers = 0;
+
+    if (0 == UserAddress || 0 != UserAddress % PAGE_SIZE ||
+        0 == SlotSize || 0 != SlotSize % PAGE_SIZE || FSP_FSCTL_IO_BUFFERS_SLOTSIZE_MAX < SlotSize ||
+        0 == SlotCount || FSP_FSCTL_IO_BUFFERS_SIZE_MAX / SlotSize < SlotCount)
+        return STATUS_INVALID_PARAMETER;
+
+    BitmapSize = (SlotCount + 31) / 32 * sizeof(ULONG);
+    IoBuffers = FspAllocNonPaged(sizeof *IoBuffers + BitmapSize);
+    if (0 == IoBuffers)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    Mdl = IoAllocateMdl((PVOID)(UINT_PTR)UserAddress, SlotSize * SlotCount, FALSE, FALSE, 0);
+    if (0 == Mdl)
+    {
+        FspFree(IoBuffers);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    try
+    {
+        MmProbeAndLockPages(Mdl, UserMode, IoWriteAccess);
+        Result = STATUS_SUCCESS;
+    }
+    except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        Result = GetExceptionCode();
+        Result = FsRtlIsNtstatusExpected(Result) ? STATUS_INVALID_USER_BUFFER : Result;
+    }
+    if (!NT_SUCCESS(Result))
+    {
+        IoFreeMdl(Mdl);
+        FspFree(IoBuffers);
+        return Result;
+    }
+
+    SystemAddress = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+    if (0 == SystemAddress)
+    {
+        MmUnlockPages(Mdl);
+        IoFreeMdl(Mdl);
+        FspFree(IoBuffers);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(IoBuffers, sizeof *IoBuffers + BitmapSize);
+    KeInitializeSpinLock(&IoBuffers->SpinLock);
+    IoBuffers->RefCount = 1;
+    IoBuffers->Registered = TRUE;
+    IoBuffers->Process = PsGetCurrentProcess();
+    ObReferenceObject(IoBuffers->Process);
+    IoBuffers->Mdl = Mdl;
+    IoBuffers->SystemAddress = SystemAddress;
+    IoBuffers->UserAddress = UserAddress;
+    IoBuffers->SlotSize = SlotSize;
+    IoBuffers->SlotCount = SlotCount;
+    RtlInitializeBitMap(&IoBuffers->SlotBitmap, IoBuffers->SlotBitmapBuffer, SlotCount);
+
+    *PIoBuffers = IoBuffers;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspIoBuffersDelete(FSP_IO_BUFFERS *IoBuffers)
+{
+    PAGED_CODE();
+
+    if (0 == IoBuffers)
+        return;
+
+    FspIoBuffersUnregister(IoBuffers);
+
+    /* slots still in use at this point are leaked by their requests; release the pages anyway */
+    if (0 != IoBuffers->Mdl)
+    {
+        MmUnlockPages(IoBuffers->Mdl);
+        IoFreeMdl(IoBuffers->Mdl);
+        ObDereferenceObject(IoBuffers->Process);
+    }
+
+    FspFree(IoBuffers);
+}
+
+VOID FspIoBuffersUnregister(FSP_IO_BUFFERS *IoBuffers)
+{
+    if (0 == IoBuffers)
+        return;
+
+    KIRQL Irql;
+    BOOLEAN Registered;
+
+    KeAcquireSpinLock(&IoBuffers->SpinLock, &Irql);
+    Registered = IoBuffers->Registered;
+    IoBuffers->Registered = FALSE;
+    KeReleaseSpinLock(&IoBuffers->SpinLock, Irql);
+
+    if (Registered)
+        FspIoBuffersDereference(IoBuffers);
+}
+
+static VOID FspIoBuffersDereference(FSP_IO_BUFFERS *IoBuffers)
+{
+    if (0 == InterlockedDecrement(&IoBuffers->RefCount))
+    {
+        MmUnlockPages(IoBuffers->Mdl);
+        IoFreeMdl(IoBuffers->Mdl);
+        ObDereferenceObject(IoBuffers->Process);
+        IoBuffers->Mdl = 0;
+        IoBuffers->SystemAddress = 0;
+        IoBuffers->Process = 0;
+    }
+}
+
+PVOID FspIoBuffersAllocateSlot(FSP_IO_BUFFERS *IoBuffers, ULONG Length)
+{
+    if (0 == IoBuffers || IoBuffers->SlotSize < Length ||
+        IoBuffers->Process != PsGetCurrentProcess())
+        return 0;
+
+    KIRQL Irql;
+    ULONG SlotIndex = (ULONG)-1;
+
+    KeAcquireSpinLock(&IoBuffers->SpinLock, &Irql);
+    if (IoBuffers->Registered)
+    {
+        SlotIndex = RtlFindClearBitsAndSet(&IoBuffers->SlotBitmap, 1, IoBuffers->SlotHint);
+        if ((ULONG)-1 != SlotIndex)
+        {
+            IoBuffers->SlotHint = SlotIndex + 1 < IoBuffers->SlotCount ? SlotIndex + 1 : 0;
+            InterlockedIncrement(&IoBuffers->RefCount);
+        }
+    }
+    KeReleaseSpinLock(&IoBuffers->SpinLock, Irql);
+
+    if ((ULONG)-1 == SlotIndex)
+        return 0;
+
+    return (PVOID)(UINT_PTR)(IoBuffers->UserAddress + (UINT64)SlotIndex * IoBuffers->SlotSize);
+}
+
+VOID FspIoBuffersFreeSlot(FSP_IO_BUFFERS *IoBuffers, PVOID Address)
+{
+    ULONG SlotIndex = (ULONG)(((UINT64)(UINT_PTR)Address - IoBuffers->UserAddress) /
+        IoBuffers->SlotSize);
+    KIRQL Irql;
+
+    ASSERT(SlotIndex < IoBuffers->SlotCount);
+
+    KeAcquireSpinLock(&IoBuffers->SpinLock, &Irql);
+    ASSERT(RtlCheckBit(&IoBuffers->SlotBitmap, SlotIndex));
+    RtlClearBit(&IoBuffers->SlotBitmap, SlotIndex);
+    KeReleaseSpinLock(&IoBuffers->SpinLock, Irql);
+
+    FspIoBuffersDereference(IoBuffers);
+}
+
+PVOID FspIoBuffersSlotSystemAddress(FSP_IO_BUFFERS *IoBuffers, PVOID Address)
+{
+    /* the caller must own the slot; this keeps the buffers locked and mapped */
+    return IoBuffers->SystemAddress + ((UINT64)(UINT_PTR)Address - IoBuffers->UserAddress);
+}
@@ -17,11 +17,15 @@
 
 #include <sys/driver.h>
 
+VOID FspIopInitialize(VOID);
+VOID FspIopFinalize(VOID);
+VOID FspIopGetRequestStats(FSP_FSCTL_REQUEST_STATS *Stats);
 NTSTATUS FspIopCreateRequestFunnel(
     PIRP Irp, PUNICODE_STRING FileName, ULONG ExtraSize, FSP_IOP_REQUEST_FINI *RequestFini,
     ULONG Flags, FSP_FSCTL_TRANSACT_REQ **PRequest);
 VOID FspIopDeleteRequest(FSP_FSCTL_TRANSACT_REQ *Request);
 VOID FspIopResetRequest(FSP_FSCTL_TRANSACT_REQ *Request, FSP_IOP_REQUEST_FINI *RequestFini);
+VOID FspIopSetIrpPriority(PIRP Irp);
 NTSTATUS FspIopPostWorkRequestFunnel(PDEVICE_OBJECT DeviceObject,
     FSP_FSCTL_TRANSACT_REQ *Request, BOOLEAN AllocateIrpMustSucceed);
 static IO_COMPLETION_ROUTINE FspIopPostWorkRequestCompletion;
@@ -34,9 +38,13 @@ NTSTATUS FspIopDispatchPrepare(PIRP Irp, FSP_FSCTL_TRANSACT_REQ *Request);
 NTSTATUS FspIopDispatchComplete(PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Response);
 
 #ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, FspIopInitialize)
+#pragma alloc_text(PAGE, FspIopFinalize)
+#pragma alloc_text(PAGE, FspIopGetRequestStats)
 #pragma alloc_text(PAGE, FspIopCreateRequestFunnel)
 #pragma alloc_text(PAGE, FspIopDeleteRequest)
 #pragma alloc_text(PAGE, FspIopResetRequest)
+#pragma alloc_text(PAGE, FspIopSetIrpPriority)
 #pragma alloc_text(PAGE, FspIopPostWorkRequestFunnel)
 #pragma alloc_text(PAGE, FspIopCompleteIrpEx)
 #pragma alloc_text(PAGE, FspIopCompleteCanceledIrp)
@@ -56,6 +64,75 @@ NTSTATUS FspIopDispatchComplete(PIRP Irp, const FSP_FSCTL_TRANSACT_RSP *Response
 #define REQ_HEADER_ALIGN_OVERHEAD       (sizeof(PVOID) + REQ_HEADER_ALIGN_MASK)
 #endif
 
+/*
+ * Requests are allocated from per size class lookaside lists, one set for paged and one
+ * for nonpaged requests. Requests that do not fit in any class (e.g. maximum size requests
+ * on 32-bit systems) are allocated from pool. The lookaside lists keep per class hit/miss
+ * counts (TotalAllocates/AllocateMisses), which are reported by FSP_FSCTL_REQUEST_STATS.
+ *
+ * Requests recycled through a lookaside list still hold the contents of an earlier request.
+ * Only the header, the fixed part of the request and the file name padding are zeroed here;
+ * the request is copied to user mode as is, so creators must write every byte of the extra
+ * space they ask for.
+ */
+static const ULONG FspIopRequestClassSize[] = { 256, 1024, 4096 };
+#define FSP_IOP_REQUEST_CLASS_COUNT     (sizeof FspIopRequestClassSize / sizeof FspIopRequestClassSize[0])
+FSP_FSCTL_STATIC_ASSERT(FSP_FSCTL_REQUEST_CLASS_COUNT == FSP_IOP_REQUEST_CLASS_COUNT,
+    "FSP_FSCTL_REQUEST_CLASS_COUNT must match the request class table.");
+static PAGED_LOOKASIDE_LIST FspIopPagedRequestLookasideList[FSP_IOP_REQUEST_CLASS_COUNT];
+static NPAGED_LOOKASIDE_LIST FspIopNonPagedRequestLookasideList[FSP_IOP_REQUEST_CLASS_COUNT];
+static LONG64 FspIopPoolRequestAllocates;
+
+static inline ULONG FspIopRequestAllocationClass(ULONG AllocationSize)
+{
+    /* 0 means pool; otherwise the class index plus one */
+    for (ULONG Index = 0; FSP_IOP_REQUEST_CLASS_COUNT > Index; Index++)
+        if (AllocationSize <= FspIopRequestClassSize[Index])
+            return Index + 1;
+    return 0;
+}
+
+VOID FspIopInitialize(VOID)
+{
+    for (ULONG Index = 0; FSP_IOP_REQUEST_CLASS_COUNT > Index; Index++)
+    {
+        ExInitializePagedLookasideList(&FspIopPagedRequestLookasideList[Index],
+            0, 0, 0, FspIopRequestClassSize[Index], FSP_ALLOC_INTERNAL_TAG, 0);
+        ExInitializeNPagedLookasideList(&FspIopNonPagedRequestLookasideList[Index],
+            0, 0, 0, FspIopRequestClassSize[Index], FSP_ALLOC_INTERNAL_TAG, 0);
+    }
+}
+
+VOID FspIopFinalize(VOID)
+{
+    PAGED_CODE();
+
+    for (ULONG Index = 0; FSP_IOP_REQUEST_CLASS_COUNT > Index; Index++)
+    {
+        ExDeletePagedLookasideList(&FspIopPagedRequestLookasideList[Index]);
+        ExDeleteNPagedLookasideList(&FspIopNonPagedRequestLookasideList[Index]);
+    }
+}
+
+VOID FspIopGetRequestStats(FSP_FSCTL_REQUEST_STATS *Stats)
+{
+    PAGED_CODE();
+
+    PGENERAL_LOOKASIDE Paged, NonPaged;
+
+    RtlZeroMemory(Stats, sizeof *Stats);
+    for (ULONG Index = 0; FSP_IOP_REQUEST_CLASS_COUNT > Index; Index++)
+    {
+        Paged = &FspIopPagedRequestLookasideList[Index].L;
+        NonPaged = &FspIopNonPagedRequestLookasideList[Index].L;
+        Stats->Class[Index].Size = FspIopRequestClassSize[Index];
+        Stats->Class[Index].Misses = (UINT64)Paged->AllocateMisses + NonPaged->AllocateMisses;
+        Stats->Class[Index].Hits = (UINT64)Paged->TotalAllocates + NonPaged->TotalAllocates -
+            Stats->Class[Index].Misses;
+    }
+    Stats->PoolAllocates = InterlockedCompareExchange64(&FspIopPoolRequestAllocates, 0, 0);
+}
+
 NTSTATUS FspIopCreateRequestFunnel(
     PIRP Irp, PUNICODE_STRING FileName, ULONG ExtraSize, FSP_IOP_REQUEST_FINI *RequestFini,
     ULONG Flags, FSP_FSCTL_TRANSACT_REQ **PRequest)
@@ -64,28 +141,45 @@ NTSTATUS FspIopCreateRequestFunnel(
 
     FSP_FSCTL_TRANSACT_REQ_HEADER *RequestHeader;
     FSP_FSCTL_TRANSACT_REQ *Request;
+    POOL_TYPE PoolType = FlagOn(Flags, FspIopRequestNonPaged) ? NonPagedPool : PagedPool;
+    ULONG FileNameSize = 0, AllocationSize, AllocationClass;
 
     *PRequest = 0;
 
     if (0 != FileName)
-        ExtraSize += FSP_FSCTL_DEFAULT_ALIGN_UP(FileName->Length + sizeof(WCHAR));
+    {
+        FileNameSize = FSP_FSCTL_DEFAULT_ALIGN_UP(FileName->Length + sizeof(WCHAR));
+        ExtraSize += FileNameSize;
+    }
 
     if (FSP_FSCTL_TRANSACT_REQ_SIZEMAX < sizeof *Request + ExtraSize)
         return STATUS_INVALID_PARAMETER;
 
-    if (FlagOn(Flags, FspIopRequestMustSucceed))
-        RequestHeader = FspAllocatePoolMustSucceed(
-            FlagOn(Flags, FspIopRequestNonPaged) ? NonPagedPool : PagedPool,
-            sizeof *RequestHeader + sizeof *Request + ExtraSize + REQ_HEADER_ALIGN_OVERHEAD,
-            FSP_ALLOC_INTERNAL_TAG);
-    else
+    AllocationSize = sizeof *RequestHeader + sizeof *Request + ExtraSize + REQ_HEADER_ALIGN_OVERHEAD;
+    AllocationClass = FspIopRequestAllocationClass(AllocationSize);
+    RequestHeader = 0;
+    if (0 != AllocationClass)
+    {
+        /* pool blocks of the class size may be freed to the lookaside list */
+        AllocationSize = FspIopRequestClassSize[AllocationClass - 1];
+        RequestHeader = NonPagedPool == PoolType ?
+            ExAllocateFromNPagedLookasideList(&FspIopNonPagedRequestLookasideList[AllocationClass - 1]) :
+            ExAllocateFromPagedLookasideList(&FspIopPagedRequestLookasideList[AllocationClass - 1]);
+    }
+    if (0 == RequestHeader)
     {
-        RequestHeader = ExAllocatePoolWithTag(
-            FlagOn(Flags, FspIopRequestNonPaged) ? NonPagedPool : PagedPool,
-            sizeof *RequestHeader + sizeof *Request + ExtraSize + REQ_HEADER_ALIGN_OVERHEAD,
-            FSP_ALLOC_INTERNAL_TAG);
-        if (0 == RequestHeader)
-            return STATUS_INSUFFICIENT_RESOURCES;
+        if (0 == AllocationClass)
+            InterlockedIncrement64(&FspIopPoolRequestAllocates);
+        if (FlagOn(Flags, FspIopRequestMustSucceed))
+            RequestHeader = FspAllocatePoolMustSucceed(PoolType, AllocationSize,
+                FSP_ALLOC_INTERNAL_TAG);
+        else
+        {
+            RequestHeader = ExAllocatePoolWithTag(PoolType, AllocationSize,
+                FSP_ALLOC_INTERNAL_TAG);
+            if (0 == RequestHeader)
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
     }
 
 #if 0 != REQ_HEADER_ALIGN_MASK
@@ -95,8 +189,10 @@ NTSTATUS FspIopCreateRequestFunnel(
     ((PVOID *)RequestHeader)[-1] = Allocation;
 #endif
 
-    RtlZeroMemory(RequestHeader, sizeof *RequestHeader + sizeof *Request + ExtraSize);
+    RtlZeroMemory(RequestHeader, sizeof *RequestHeader + sizeof *Request);
     RequestHeader->RequestFini = RequestFini;
+    RequestHeader->AllocationClass = AllocationClass;
+    RequestHeader->NonPaged = NonPagedPool == PoolType;
 
     Request = (PVOID)RequestHeader->RequestBuf;
     Request->Size = (UINT16)(sizeof *Request + ExtraSize);
@@ -104,8 +200,7 @@ NTSTATUS FspIopCreateRequestFunnel(
     if (0 != FileName)
     {
         RtlCopyMemory(Request->Buffer, FileName->Buffer, FileName->Length);
-        //Request->Buffer[FileName->Length] = '\0';
-        //Request->Buffer[FileName->Length + 1] = '\0';
+        RtlZeroMemory(Request->Buffer + FileName->Length, FileNameSize - FileName->Length);
         //Request->FileName.Offset = 0;
         Request->FileName.Size = FileName->Length + sizeof(WCHAR);
     }
@@ -114,6 +209,7 @@ NTSTATUS FspIopCreateRequestFunnel(
     {
         ASSERT(0 == FspIrpRequest(Irp));
         FspIrpSetRequest(Irp, Request);
+        FspIopSetIrpPriority(Irp);
     }
     *PRequest = Request;
 
@@ -125,6 +221,8 @@ VOID FspIopDeleteRequest(FSP_FSCTL_TRANSACT_REQ *Request)
     PAGED_CODE();
 
     FSP_FSCTL_TRANSACT_REQ_HEADER *RequestHeader = (PVOID)((PUINT8)Request - sizeof *RequestHeader);
+    ULONG AllocationClass = RequestHeader->AllocationClass;
+    BOOLEAN NonPaged = RequestHeader->NonPaged;
 
     if (0 != RequestHeader->RequestFini)
         RequestHeader->RequestFini(Request, RequestHeader->Context);
@@ -136,7 +234,14 @@ VOID FspIopDeleteRequest(FSP_FSCTL_TRANSACT_REQ *Request)
     RequestHeader = ((PVOID *)RequestHeader)[-1];
 #endif
 
-    FspFree(RequestHeader);
+    if (0 == AllocationClass)
+        FspFree(RequestHeader);
+    else if (NonPaged)
+        ExFreeToNPagedLookasideList(&FspIopNonPagedRequestLookasideList[AllocationClass - 1],
+            RequestHeader);
+    else
+        ExFreeToPagedLookasideList(&FspIopPagedRequestLookasideList[AllocationClass - 1],
+            RequestHeader);
 }
 
 VOID FspIopResetRequest(FSP_FSCTL_TRANSACT_REQ *Request, FSP_IOP_REQUEST_FINI *RequestFini)
@@ -152,6 +257,59 @@ VOID FspIopResetRequest(FSP_FSCTL_TRANSACT_REQ *Request, FSP_IOP_REQUEST_FINI *R
     RequestHeader->RequestFini = RequestFini;
 }
 
+VOID FspIopSetIrpPriority(PIRP Irp)
+{
+    PAGED_CODE();
+
+    /*
+     * Compute the Pending queue lane when the IRP is prepared and keep it in the IRP context.
+     * The lane is read under the queue spin lock, where the (possibly paged) Request cannot
+     * be accessed.
+     */
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    ULONG Priority;
+
+    if (FlagOn(Irp->Flags, IRP_PAGING_IO))
+        Priority = FspFsctlIrpPriorityPaging;
+    else
+        switch (IrpSp->MajorFunction)
+        {
+        case IRP_MJ_CREATE:
+        case IRP_MJ_CLEANUP:
+        case IRP_MJ_CLOSE:
+        case IRP_MJ_QUERY_INFORMATION:
+        case IRP_MJ_SET_INFORMATION:
+        case IRP_MJ_QUERY_EA:
+        case IRP_MJ_SET_EA:
+        case IRP_MJ_QUERY_VOLUME_INFORMATION:
+        case IRP_MJ_SET_VOLUME_INFORMATION:
+        case IRP_MJ_DIRECTORY_CONTROL:
+        case IRP_MJ_QUERY_SECURITY:
+        case IRP_MJ_SET_SECURITY:
+            Priority = FspFsctlIrpPriorityMetadata;
+            break;
+        case IRP_MJ_FILE_SYSTEM_CONTROL:
+            /* FSP_FSCTL_WORK* and FSP_FSCTL_QUERY_OPEN: the lane depends on the carried Request */
+            Priority = FspFsctlIrpPriorityBulk;
+            if (0 != FspIrpRequest(Irp))
+                switch (FspIrpRequest(Irp)->Kind)
+                {
+                case FspFsctlTransactCleanupKind:
+                case FspFsctlTransactCloseKind:
+                case FspFsctlTransactCloseBatchKind:
+                case FspFsctlTransactQueryOpenKind:
+                    Priority = FspFsctlIrpPriorityMetadata;
+                    break;
+                }
+            break;
+        default:
+            Priority = FspFsctlIrpPriorityBulk;
+            break;
+        }
+
+    FspIrpSetPriority(Irp, Priority);
+}
+
 NTSTATUS FspIopPostWorkRequestFunnel(PDEVICE_OBJECT DeviceObject,
     FSP_FSCTL_TRANSACT_REQ *Request, BOOLEAN BestEffort)
 {
@@ -266,6 +424,8 @@ BOOLEAN FspIopRetryPrepareIrp(PIRP Irp, NTSTATUS *PResult)
     PDEVICE_OBJECT DeviceObject = IoGetCurrentIrpStackLocation(Irp)->DeviceObject;
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(DeviceObject);
 
+    /* the lane was lost when the IRP went through the Process queue */
+    FspIopSetIrpPriority(Irp);
     return FspIoqPostIrpBestEffort(FsvolDeviceExtension->Ioq, Irp, PResult);
 }
 
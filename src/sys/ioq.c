@@ -123,6 +123,59 @@
  * To deal with the second problem we simply call FspIoqPendingResetSynch after
  * a WaitForSingleObject call if the IRP dequeueing fails; this ensures that the
  * event is in the correst state.
+ *
+ *
+ * Pending Queue Sharding
+ *
+ * The pending queue is split into shards, one per processor (up to
+ * FspIoqShardCountMax). Each shard has its own spin lock and IO_CSQ, so that
+ * threads that post IRP's on different processors do not contend with each
+ * other or with the dispatcher threads. An IRP is posted to the shard of the
+ * processor that posts it. A dispatcher thread first looks at the shard of the
+ * processor it runs on and then steals from the other shards in order.
+ *
+ * The PendingIrpCount is a global interlocked counter that enforces the
+ * PendingIrpCapacity across all shards. It is also the condition that
+ * FspIoqPendingResetSynch examines; because it is no longer protected by a
+ * single lock, FspIoqPendingResetSynch clears the PendingIrpEvent and then
+ * re-examines the counter, so that a concurrent post cannot be lost. Posting
+ * increments the counter before it inserts the IRP and signals the event.
+ *
+ * Sharding relaxes the FIFO order of the pending queue to per-processor FIFO
+ * order. This is fine, because the user-mode file system may process requests
+ * concurrently anyway. The Process and Retried queues are still guarded by the
+ * FSP_IOQ spin lock.
+ */
+
+/*
+ * Pending IRP Priority Lanes
+ *
+ * Each pending queue shard has one FIFO list ("lane") per IRP priority class:
+ * paging I/O, metadata (namespace) operations and bulk data. The lane of an IRP
+ * is determined when it is prepared (FspIopSetIrpPriority) and is kept in the IRP
+ * context, so that it can be read under the queue lock. Dequeueing is weighted
+ * round robin: the shard serves up to PriorityWeights[Lane] IRP's from a lane
+ * before it moves on to the next lane; an empty lane forfeits the rest of its turn. This bounds the wait of
+ * a metadata IRP behind a bulk backlog to a few bulk IRP's per round, while bulk
+ * IRP's are never starved: every lane is served at least once per round.
+ */
+
+/*
+ * Pending IRP Expiration
+ *
+ * Every pending IRP that can expire (i.e. that was not posted "best effort") is
+ * also tracked by an FSP_IOQ_TIMER in the hierarchical timer wheel of its shard.
+ * The wheel has two levels: level 0 has one slot per second for the next 64
+ * seconds and level 1 has one slot per 64 seconds for the next 1024 seconds
+ * (more than the maximum IrpTimeout). When the wheel time enters a new 64 second
+ * block, the corresponding level 1 slot is cascaded into level 0. Timers that are
+ * too far in the future for level 1 are kept in its last slot and re-inserted when
+ * they are cascaded.
+ *
+ * FspIoqRemoveExpired advances the wheel to the current time, which moves the timers
+ * of the elapsed level 0 slots to an ExpiredList; the IRP's on the ExpiredList are
+ * then removed through the IO_CSQ as before. This way expiration costs O(expired)
+ * rather than O(queued) and the pending lists are never scanned under the lock.
  */
 
 /*
@@ -191,6 +244,122 @@ typedef struct
     ULONG ExpirationTime;
 } FSP_IOQ_PEEK_CONTEXT;
 
+typedef struct
+{
+    LIST_ENTRY ListEntry;
+    PIRP Irp;
+} FSP_IOQ_TIMER;
+
+typedef struct
+{
+    FSP_IOQ_TIMER *Timer;               /* 0 for best effort IRP's */
+} FSP_IOQ_INSERT_CONTEXT;
+
+/*
+ * Shares storage with FspIrpDictNext; a pending IRP is not in the Process queue.
+ * The low bits hold the IRP lane (FspIrpPriority); timers are at least 8-byte aligned.
+ */
+#define FspIrpIoqTimer(Irp)             \
+    ((FSP_IOQ_TIMER *)((UINT_PTR)(Irp)->Tail.Overlay.DriverContext[1] & ~3))
+#define FspIrpSetIoqTimer(Irp, T)       \
+    ((Irp)->Tail.Overlay.DriverContext[1] = (PVOID)((UINT_PTR)(T) |\
+        ((UINT_PTR)(Irp)->Tail.Overlay.DriverContext[1] & 3)))
+
+static VOID FspIoqTimerWheelInitialize(FSP_IOQ_TIMER_WHEEL *Wheel, ULONG CurrentTime)
+{
+    Wheel->CurrentTime = CurrentTime;
+    InitializeListHead(&Wheel->ExpiredList);
+    for (ULONG I = 0; FspIoqTimerWheelSlotCount0 > I; I++)
+        InitializeListHead(&Wheel->Slots0[I]);
+    for (ULONG I = 0; FspIoqTimerWheelSlotCount1 > I; I++)
+        InitializeListHead(&Wheel->Slots1[I]);
+}
+
+static VOID FspIoqTimerWheelInsert(FSP_IOQ_TIMER_WHEEL *Wheel, FSP_IOQ_TIMER *Timer)
+{
+    ULONG ExpirationTime = FspIrpTimestamp(Timer->Irp);
+    ULONG Block, CurrentBlock;
+    if (0 > (LONG)(ExpirationTime - Wheel->CurrentTime))
+        /* already expired; expire with the next advance */
+        ExpirationTime = Wheel->CurrentTime;
+    if (FspIoqTimerWheelSlotCount0 > ExpirationTime - Wheel->CurrentTime)
+        InsertTailList(&Wheel->Slots0[ExpirationTime % FspIoqTimerWheelSlotCount0],
+            &Timer->ListEntry);
+    else
+    {
+        Block = ExpirationTime / FspIoqTimerWheelSlotCount0;
+        CurrentBlock = Wheel->CurrentTime / FspIoqTimerWheelSlotCount0;
+        if (FspIoqTimerWheelSlotCount1 <= Block - CurrentBlock)
+            Block = CurrentBlock + FspIoqTimerWheelSlotCount1 - 1;
+        InsertTailList(&Wheel->Slots1[Block % FspIoqTimerWheelSlotCount1],
+            &Timer->ListEntry);
+    }
+}
+
+static VOID FspIoqTimerWheelAdvance(FSP_IOQ_TIMER_WHEEL *Wheel, ULONG Time)
+{
+    PLIST_ENTRY Head, Entry;
+    FSP_IOQ_TIMER *Timer;
+
+    if (FspIoqTimerWheelSlotCount0 * FspIoqTimerWheelSlotCount1 <
+        (LONG)(Time - Wheel->CurrentTime))
+    {
+        /*
+         * We have fallen behind by more than the span of the wheel (e.g. after a
+         * system sleep). Rather than step through each second, collect all timers
+         * and sort them into expired and not expired.
+         */
+        LIST_ENTRY TimerList;
+        InitializeListHead(&TimerList);
+        for (ULONG I = 0; FspIoqTimerWheelSlotCount0 > I; I++)
+            while (!IsListEmpty(&Wheel->Slots0[I]))
+                InsertTailList(&TimerList, RemoveHeadList(&Wheel->Slots0[I]));
+        for (ULONG I = 0; FspIoqTimerWheelSlotCount1 > I; I++)
+            while (!IsListEmpty(&Wheel->Slots1[I]))
+                InsertTailList(&TimerList, RemoveHeadList(&Wheel->Slots1[I]));
+        Wheel->CurrentTime = Time + 1;
+        while (!IsListEmpty(&TimerList))
+        {
+            Entry = RemoveHeadList(&TimerList);
+            Timer = CONTAINING_RECORD(Entry, FSP_IOQ_TIMER, ListEntry);
+            if (0 > (LONG)(Time - FspIrpTimestamp(Timer->Irp)))
+                FspIoqTimerWheelInsert(Wheel, Timer);
+            else
+                InsertTailList(&Wheel->ExpiredList, Entry);
+        }
+        return;
+    }
+
+    while (0 <= (LONG)(Time - Wheel->CurrentTime))
+    {
+        if (0 == Wheel->CurrentTime % FspIoqTimerWheelSlotCount0)
+        {
+            /* entering a new block; cascade its level 1 slot into level 0 */
+            Head = &Wheel->Slots1[
+                Wheel->CurrentTime / FspIoqTimerWheelSlotCount0 % FspIoqTimerWheelSlotCount1];
+            while (!IsListEmpty(Head))
+            {
+                Entry = RemoveHeadList(Head);
+                FspIoqTimerWheelInsert(Wheel, CONTAINING_RECORD(Entry, FSP_IOQ_TIMER, ListEntry));
+            }
+        }
+
+        /* splice the level 0 slot for the current second onto the ExpiredList */
+        Head = &Wheel->Slots0[Wheel->CurrentTime % FspIoqTimerWheelSlotCount0];
+        if (!IsListEmpty(Head))
+        {
+            PLIST_ENTRY ExpiredList = &Wheel->ExpiredList;
+            Head->Flink->Blink = ExpiredList->Blink;
+            ExpiredList->Blink->Flink = Head->Flink;
+            Head->Blink->Flink = ExpiredList;
+            ExpiredList->Blink = Head->Blink;
+            InitializeListHead(Head);
+        }
+
+        Wheel->CurrentTime++;
+    }
+}
+
 static inline VOID FspIoqPendingResetSynch(FSP_IOQ *Ioq)
 {
     /*
@@ -201,19 +370,54 @@ static inline VOID FspIoqPendingResetSynch(FSP_IOQ *Ioq)
         /* list is not empty or is stopped; wake up a waiter */
         KeSetEvent(&Ioq->PendingIrpEvent, 1, FALSE);
     else
+    {
         /* list is empty and not stopped; future threads should go to sleep */
         KeClearEvent(&Ioq->PendingIrpEvent);
+
+        /* a post on another shard may have raced with us; look again after clearing */
+        KeMemoryBarrier();
+        if (0 != Ioq->PendingIrpCount || Ioq->Stopped)
+            KeSetEvent(&Ioq->PendingIrpEvent, 1, FALSE);
+    }
+}
+
+static inline FSP_IOQ_SHARD *FspIoqCurrentShard(FSP_IOQ *Ioq)
+{
+    return Ioq->PendingShards + KeGetCurrentProcessorNumberEx(0) % Ioq->PendingShardCount;
+}
+
+static inline BOOLEAN FspIoqShardIsEmpty(FSP_IOQ_SHARD *Shard)
+{
+    for (ULONG I = 0; FspFsctlIrpPriorityCount > I; I++)
+        if (!IsListEmpty(&Shard->PendingIrpList[I]))
+            return FALSE;
+    return TRUE;
+}
+
+static inline BOOLEAN FspIoqShardIsListHead(FSP_IOQ_SHARD *Shard, PLIST_ENTRY Entry)
+{
+    return Shard->PendingIrpList <= Entry && Entry < Shard->PendingIrpList + FspFsctlIrpPriorityCount;
 }
 
 static NTSTATUS FspIoqPendingInsertIrpEx(PIO_CSQ IoCsq, PIRP Irp, PVOID InsertContext)
 {
-    FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
+    FSP_IOQ_SHARD *Shard = CONTAINING_RECORD(IoCsq, FSP_IOQ_SHARD, PendingIoCsq);
+    FSP_IOQ *Ioq = Shard->Ioq;
+    FSP_IOQ_TIMER *Timer = ((FSP_IOQ_INSERT_CONTEXT *)InsertContext)->Timer;
+    ULONG Priority = FspIrpPriority(Irp);
     if (Ioq->Stopped)
         return STATUS_CANCELLED;
-    if (!InsertContext && Ioq->PendingIrpCapacity <= Ioq->PendingIrpCount)
+    if ((LONG)Ioq->PendingIrpCapacity < InterlockedIncrement(&Ioq->PendingIrpCount) &&
+        0 != Timer)
+    {
+        InterlockedDecrement(&Ioq->PendingIrpCount);
         return STATUS_INSUFFICIENT_RESOURCES;
-    Ioq->PendingIrpCount++;
-    InsertTailList(&Ioq->PendingIrpList, &Irp->Tail.Overlay.ListEntry);
+    }
+    InsertTailList(&Shard->PendingIrpList[Priority], &Irp->Tail.Overlay.ListEntry);
+    ASSERT(0 == FspIrpIoqTimer(Irp));
+    FspIrpSetIoqTimer(Irp, Timer);
+    if (0 != Timer)
+        FspIoqTimerWheelInsert(&Shard->TimerWheel, Timer);
     KeSetEvent(&Ioq->PendingIrpEvent, 1, FALSE);
         /* equivalent to FspIoqPendingResetSynch(Ioq) */
     return STATUS_SUCCESS;
@@ -221,66 +425,156 @@ static NTSTATUS FspIoqPendingInsertIrpEx(PIO_CSQ IoCsq, PIRP Irp, PVOID InsertCo
 
 static VOID FspIoqPendingRemoveIrp(PIO_CSQ IoCsq, PIRP Irp)
 {
-    FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
-    Ioq->PendingIrpCount--;
+    FSP_IOQ_SHARD *Shard = CONTAINING_RECORD(IoCsq, FSP_IOQ_SHARD, PendingIoCsq);
+    FSP_IOQ *Ioq = Shard->Ioq;
+    FSP_IOQ_TIMER *Timer = FspIrpIoqTimer(Irp);
+    InterlockedDecrement(&Ioq->PendingIrpCount);
     RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    if (0 != Timer)
+    {
+        RemoveEntryList(&Timer->ListEntry);
+        ExFreeToNPagedLookasideList(&Ioq->TimerLookaside, Timer);
+    }
+    /* clear the lane as well; the Process queue uses this storage for FspIrpDictNext */
+    Irp->Tail.Overlay.DriverContext[1] = 0;
     FspIoqPendingResetSynch(Ioq);
 }
 
 static PIRP FspIoqPendingPeekNextIrp(PIO_CSQ IoCsq, PIRP Irp, PVOID PeekContext)
 {
-    FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
+    FSP_IOQ_SHARD *Shard = CONTAINING_RECORD(IoCsq, FSP_IOQ_SHARD, PendingIoCsq);
+    FSP_IOQ *Ioq = Shard->Ioq;
     if (PeekContext && Ioq->Stopped)
         return 0;
-    PLIST_ENTRY Head = &Ioq->PendingIrpList;
-    PLIST_ENTRY Entry = 0 == Irp ? Head->Flink : Irp->Tail.Overlay.ListEntry.Flink;
-    if (Head == Entry)
+    if (PeekContext && 0 == ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->IrpHint)
+    {
+        /* expiration: the timer wheel knows which IRP's have expired */
+        FSP_IOQ_TIMER_WHEEL *Wheel = &Shard->TimerWheel;
+        PLIST_ENTRY Entry;
+        if (0 == Irp)
+        {
+            FspIoqTimerWheelAdvance(Wheel, ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->ExpirationTime);
+            Entry = Wheel->ExpiredList.Flink;
+        }
+        else
+            /* IoCsqRemoveNextIrp skips IRP's that are being cancelled */
+            Entry = FspIrpIoqTimer(Irp)->ListEntry.Flink;
+        if (&Wheel->ExpiredList == Entry)
+            return 0;
+        return CONTAINING_RECORD(Entry, FSP_IOQ_TIMER, ListEntry)->Irp;
+    }
+    PVOID IrpHint = PeekContext ? ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->IrpHint : 0;
+    PLIST_ENTRY Head, Entry;
+    if (0 != Irp)
+    {
+        /*
+         * IoCsqRemoveNextIrp skips IRP's that are being cancelled; continue in the same lane
+         * and then in the later lanes of this shard, so that a caller that drains the queue
+         * does not stop early. Never wrap around to an earlier lane, because that could
+         * return an IRP that IoCsqRemoveNextIrp has already skipped.
+         */
+        Entry = Irp->Tail.Overlay.ListEntry.Flink;
+        if (!FspIoqShardIsListHead(Shard, Entry))
+        {
+            Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+            if (Irp != IrpHint)
+                return Irp;
+            /* boundary IRP; find the end of this lane (only when racing with cancellation) */
+            do
+                Entry = Entry->Flink;
+            while (!FspIoqShardIsListHead(Shard, Entry));
+        }
+        for (ULONG I = (ULONG)(Entry - Shard->PendingIrpList) + 1; FspFsctlIrpPriorityCount > I; I++)
+        {
+            Head = &Shard->PendingIrpList[I];
+            if (Head != Head->Flink)
+            {
+                Irp = CONTAINING_RECORD(Head->Flink, IRP, Tail.Overlay.ListEntry);
+                if (Irp != IrpHint)
+                    return Irp;
+            }
+        }
         return 0;
-    Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+    }
     if (!PeekContext)
-        return Irp;
-    PVOID IrpHint = ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->IrpHint;
-    if (0 == IrpHint)
     {
-        ULONG ExpirationTime = ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->ExpirationTime;
-        for (;;)
+        for (ULONG I = 0; FspFsctlIrpPriorityCount > I; I++)
         {
-            if (FspIrpTimestampInfinity != FspIrpTimestamp(Irp))
-                return FspIrpTimestamp(Irp) <= ExpirationTime ? Irp : 0;
-            Entry = Entry->Flink;
-            if (Head == Entry)
-                return 0;
-            Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+            Head = &Shard->PendingIrpList[I];
+            if (Head != Head->Flink)
+                return CONTAINING_RECORD(Head->Flink, IRP, Tail.Overlay.ListEntry);
         }
+        return 0;
     }
-    else
+    /* weighted round robin; do not go beyond the boundary IRP (IrpHint) in any lane */
+    ULONG Lane = Shard->PriorityLane, Credit = Shard->PriorityCredit;
+    for (ULONG I = 0; FspFsctlIrpPriorityCount >= I; I++)
     {
-        if (Irp == IrpHint)
-            return 0;
-        return Irp;
+        if (0 != Credit)
+        {
+            Head = &Shard->PendingIrpList[Lane];
+            if (Head != Head->Flink)
+            {
+                Irp = CONTAINING_RECORD(Head->Flink, IRP, Tail.Overlay.ListEntry);
+                if (Irp != IrpHint)
+                {
+                    Shard->PriorityLane = Lane;
+                    Shard->PriorityCredit = Credit - 1;
+                    return Irp;
+                }
+            }
+        }
+        Lane = (Lane + 1) % FspFsctlIrpPriorityCount;
+        Credit = Ioq->PriorityWeights[Lane];
     }
+    return 0;
 }
 
 _IRQL_raises_(DISPATCH_LEVEL)
 static VOID FspIoqPendingAcquireLock(PIO_CSQ IoCsq, _At_(*PIrql, _IRQL_saves_) PKIRQL PIrql)
 {
-    FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
-    KeAcquireSpinLock(&Ioq->SpinLock, PIrql);
+    FSP_IOQ_SHARD *Shard = CONTAINING_RECORD(IoCsq, FSP_IOQ_SHARD, PendingIoCsq);
+    KeAcquireSpinLock(&Shard->SpinLock, PIrql);
 }
 
 _IRQL_requires_(DISPATCH_LEVEL)
 static VOID FspIoqPendingReleaseLock(PIO_CSQ IoCsq, _IRQL_restores_ KIRQL Irql)
 {
-    FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    FSP_IOQ_SHARD *Shard = CONTAINING_RECORD(IoCsq, FSP_IOQ_SHARD, PendingIoCsq);
+    KeReleaseSpinLock(&Shard->SpinLock, Irql);
 }
 
 static VOID FspIoqPendingCompleteCanceledIrp(PIO_CSQ IoCsq, PIRP Irp)
 {
-    FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
+    FSP_IOQ_SHARD *Shard = CONTAINING_RECORD(IoCsq, FSP_IOQ_SHARD, PendingIoCsq);
+    FSP_IOQ *Ioq = Shard->Ioq;
     Ioq->CompleteCanceledIrp(Irp);
 }
 
+static PIRP FspIoqPendingRemoveNextIrp(FSP_IOQ *Ioq, PVOID PeekContext)
+{
+    /*
+     * Remove the next IRP from the shard of the current processor. If that shard
+     * has nothing for us, steal from the other shards.
+     */
+    FSP_IOQ_SHARD *FirstShard = FspIoqCurrentShard(Ioq), *Shard = FirstShard;
+    FSP_IOQ_SHARD *ShardEnd = Ioq->PendingShards + Ioq->PendingShardCount;
+    PIRP Irp;
+    do
+    {
+        /* unlocked peek; an IRP that we miss here will set the PendingIrpEvent */
+        if (!FspIoqShardIsEmpty(Shard))
+        {
+            Irp = IoCsqRemoveNextIrp(&Shard->PendingIoCsq, PeekContext);
+            if (0 != Irp)
+                return Irp;
+        }
+        if (ShardEnd == ++Shard)
+            Shard = Ioq->PendingShards;
+    } while (FirstShard != Shard);
+    return 0;
+}
+
 static NTSTATUS FspIoqProcessInsertIrpEx(PIO_CSQ IoCsq, PIRP Irp, PVOID InsertContext)
 {
     FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, ProcessIoCsq);
@@ -445,7 +739,8 @@ static VOID FspIoqRetriedCompleteCanceledIrp(PIO_CSQ IoCsq, PIRP Irp)
 }
 
 NTSTATUS FspIoqCreate(
-    ULONG IrpCapacity, PLARGE_INTEGER IrpTimeout, VOID (*CompleteCanceledIrp)(PIRP Irp),
+    ULONG IrpCapacity, PLARGE_INTEGER IrpTimeout, const UINT8 *PriorityWeights,
+    VOID (*CompleteCanceledIrp)(PIRP Irp),
     FSP_IOQ **PIoq)
 {
     ASSERT(0 != CompleteCanceledIrp);
@@ -454,23 +749,51 @@ NTSTATUS FspIoqCreate(
 
     FSP_IOQ *Ioq;
     ULONG BucketCount = (PAGE_SIZE - sizeof *Ioq) / sizeof Ioq->ProcessIrpBuckets[0];
+    ULONG ShardCount, ShardSize;
     Ioq = FspAllocNonPaged(PAGE_SIZE);
     if (0 == Ioq)
         return STATUS_INSUFFICIENT_RESOURCES;
     RtlZeroMemory(Ioq, PAGE_SIZE);
 
+    ShardCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    if (FspIoqShardCountMax < ShardCount)
+        ShardCount = FspIoqShardCountMax;
+    else if (0 == ShardCount)
+        ShardCount = 1;
+    ShardSize = ShardCount * sizeof(FSP_IOQ_SHARD);
+    if (PAGE_SIZE > ShardSize)
+        ShardSize = PAGE_SIZE; /* allocations of PAGE_SIZE or more are page aligned */
+    Ioq->PendingShards = FspAllocNonPaged(ShardSize);
+    if (0 == Ioq->PendingShards)
+    {
+        FspFree(Ioq);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(Ioq->PendingShards, ShardSize);
+    Ioq->PendingShardCount = ShardCount;
+
+    ExInitializeNPagedLookasideList(&Ioq->TimerLookaside,
+        0, 0, 0, sizeof(FSP_IOQ_TIMER), FSP_ALLOC_INTERNAL_TAG, 0);
     KeInitializeSpinLock(&Ioq->SpinLock);
     KeInitializeEvent(&Ioq->PendingIrpEvent, SynchronizationEvent, FALSE);
-    InitializeListHead(&Ioq->PendingIrpList);
+    for (ULONG I = 0; ShardCount > I; I++)
+    {
+        FSP_IOQ_SHARD *Shard = Ioq->PendingShards + I;
+        KeInitializeSpinLock(&Shard->SpinLock);
+        for (ULONG J = 0; FspFsctlIrpPriorityCount > J; J++)
+            InitializeListHead(&Shard->PendingIrpList[J]);
+        IoCsqInitializeEx(&Shard->PendingIoCsq,
+            FspIoqPendingInsertIrpEx,
+            FspIoqPendingRemoveIrp,
+            FspIoqPendingPeekNextIrp,
+            FspIoqPendingAcquireLock,
+            FspIoqPendingReleaseLock,
+            FspIoqPendingCompleteCanceledIrp);
+        Shard->Ioq = Ioq;
+        FspIoqTimerWheelInitialize(&Shard->TimerWheel, QueryInterruptTimeInSec());
+    }
     InitializeListHead(&Ioq->ProcessIrpList);
     InitializeListHead(&Ioq->RetriedIrpList);
-    IoCsqInitializeEx(&Ioq->PendingIoCsq,
-        FspIoqPendingInsertIrpEx,
-        FspIoqPendingRemoveIrp,
-        FspIoqPendingPeekNextIrp,
-        FspIoqPendingAcquireLock,
-        FspIoqPendingReleaseLock,
-        FspIoqPendingCompleteCanceledIrp);
     IoCsqInitializeEx(&Ioq->ProcessIoCsq,
         FspIoqProcessInsertIrpEx,
         FspIoqProcessRemoveIrp,
@@ -487,6 +810,8 @@ NTSTATUS FspIoqCreate(
         FspIoqRetriedCompleteCanceledIrp);
     Ioq->IrpTimeout = ConvertInterruptTimeToSec(IrpTimeout->QuadPart + InterruptTimeToSecFactor - 1);
         /* convert to seconds (and round up) */
+    for (ULONG I = 0; FspFsctlIrpPriorityCount > I; I++)
+        Ioq->PriorityWeights[I] = 0 != PriorityWeights[I] ? PriorityWeights[I] : 1;
     Ioq->PendingIrpCapacity = IrpCapacity;
     Ioq->CompleteCanceledIrp = CompleteCanceledIrp;
     Ioq->ProcessIrpBucketCount = BucketCount;
@@ -499,6 +824,8 @@ NTSTATUS FspIoqCreate(
 VOID FspIoqDelete(FSP_IOQ *Ioq)
 {
     FspIoqStop(Ioq);
+    ExDeleteNPagedLookasideList(&Ioq->TimerLookaside);
+    FspFree(Ioq->PendingShards);
     FspFree(Ioq);
 }
 
@@ -512,8 +839,9 @@ VOID FspIoqStop(FSP_IOQ *Ioq)
         /* equivalent to FspIoqPendingResetSynch(Ioq) */
     KeReleaseSpinLock(&Ioq->SpinLock, Irql);
     PIRP Irp;
-    while (0 != (Irp = IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, 0)))
-        Ioq->CompleteCanceledIrp(Irp);
+    for (ULONG I = 0; Ioq->PendingShardCount > I; I++)
+        while (0 != (Irp = IoCsqRemoveNextIrp(&Ioq->PendingShards[I].PendingIoCsq, 0)))
+            Ioq->CompleteCanceledIrp(Irp);
     while (0 != (Irp = FspCsqRemoveNextIrp(&Ioq->ProcessIoCsq, 0)))
         Ioq->CompleteCanceledIrp(Irp);
     while (0 != (Irp = FspCsqRemoveNextIrp(&Ioq->RetriedIoCsq, 0)))
@@ -536,8 +864,9 @@ VOID FspIoqRemoveExpired(FSP_IOQ *Ioq, UINT64 InterruptTime)
     PeekContext.IrpHint = 0;
     PeekContext.ExpirationTime = ConvertInterruptTimeToSec(InterruptTime);
     PIRP Irp;
-    while (0 != (Irp = IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, &PeekContext)))
-        Ioq->CompleteCanceledIrp(Irp);
+    for (ULONG I = 0; Ioq->PendingShardCount > I; I++)
+        while (0 != (Irp = IoCsqRemoveNextIrp(&Ioq->PendingShards[I].PendingIoCsq, &PeekContext)))
+            Ioq->CompleteCanceledIrp(Irp);
 #if !defined(FSP_IOQ_PROCESS_NO_CANCEL)
     while (0 != (Irp = FspCsqRemoveNextIrp(&Ioq->ProcessIoCsq, &PeekContext)))
         Ioq->CompleteCanceledIrp(Irp);
@@ -549,9 +878,24 @@ VOID FspIoqRemoveExpired(FSP_IOQ *Ioq, UINT64 InterruptTime)
 BOOLEAN FspIoqPostIrpEx(FSP_IOQ *Ioq, PIRP Irp, BOOLEAN BestEffort, NTSTATUS *PResult)
 {
     NTSTATUS Result;
+    FSP_IOQ_INSERT_CONTEXT InsertContext;
+    InsertContext.Timer = 0;
+    if (!BestEffort)
+    {
+        InsertContext.Timer = ExAllocateFromNPagedLookasideList(&Ioq->TimerLookaside);
+        if (0 == InsertContext.Timer)
+        {
+            if (0 != PResult)
+                *PResult = STATUS_INSUFFICIENT_RESOURCES;
+            return FALSE;
+        }
+        InsertContext.Timer->Irp = Irp;
+    }
     FspIrpTimestamp(Irp) = BestEffort ? FspIrpTimestampInfinity :
         QueryInterruptTimeInSec() + Ioq->IrpTimeout;
-    Result = IoCsqInsertIrpEx(&Ioq->PendingIoCsq, Irp, 0, (PVOID)BestEffort);
+    Result = IoCsqInsertIrpEx(&FspIoqCurrentShard(Ioq)->PendingIoCsq, Irp, 0, &InsertContext);
+    if (!NT_SUCCESS(Result) && 0 != InsertContext.Timer)
+        ExFreeToNPagedLookasideList(&Ioq->TimerLookaside, InsertContext.Timer);
     if (NT_SUCCESS(Result))
     {
         if (0 != PResult)
@@ -584,7 +928,7 @@ PIRP FspIoqNextPendingIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp, PLARGE_INTEGER Timeout
         if (STATUS_CANCELLED == Result || STATUS_THREAD_IS_TERMINATING == Result)
             return FspIoqCancelled;
         ASSERT(STATUS_SUCCESS == Result);
-        PendingIrp = IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, &PeekContext);
+        PendingIrp = FspIoqPendingRemoveNextIrp(Ioq, &PeekContext);
         if (0 == PendingIrp)
         {
             /*
@@ -593,27 +937,59 @@ PIRP FspIoqNextPendingIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp, PLARGE_INTEGER Timeout
              * our synchronization based on the actual condition of the pending
              * queue.
              */
-            KIRQL Irql;
-            KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
             FspIoqPendingResetSynch(Ioq);
-            KeReleaseSpinLock(&Ioq->SpinLock, Irql);
         }
     }
     else
-        PendingIrp = IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, &PeekContext);
+        PendingIrp = FspIoqPendingRemoveNextIrp(Ioq, &PeekContext);
     return PendingIrp;
 }
 
-ULONG FspIoqPendingIrpCount(FSP_IOQ *Ioq)
+NTSTATUS FspIoqWaitPendingIrp(FSP_IOQ *Ioq, PKEVENT Event, PLARGE_INTEGER Timeout,
+    PIRP CancellableIrp)
 {
-    ULONG Result;
-    KIRQL Irql;
-    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
-    Result = Ioq->PendingIrpCount;
-    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    /*
+     * Wait until there are pending IRP's (or the Ioq is stopped) or until Event is
+     * signaled. No IRP is removed; use FspIoqNextPendingIrp with a 0 Timeout for that.
+     * Returns STATUS_WAIT_0 for pending IRP's and STATUS_WAIT_1 for Event.
+     */
+    PVOID WaitObjects[2];
+    NTSTATUS Result;
+    WaitObjects[0] = &Ioq->PendingIrpEvent;
+    WaitObjects[1] = Event;
+    Result = FsRtlCancellableWaitForMultipleObjects(2, WaitObjects, WaitAny, Timeout, 0,
+        CancellableIrp);
+    if (STATUS_WAIT_0 == Result)
+        /*
+         * The wait has reset our PendingIrpEvent, but we did not remove an IRP. Reset
+         * our synchronization based on the actual condition of the pending queue, so
+         * that other threads waiting in FspIoqNextPendingIrp are not starved.
+         */
+        FspIoqPendingResetSynch(Ioq);
     return Result;
 }
 
+ULONG FspIoqPendingIrpCount(FSP_IOQ *Ioq)
+{
+    LONG Result = Ioq->PendingIrpCount;
+    return 0 < Result ? Result : 0;
+}
+
+VOID FspIoqSetIrpCredits(FSP_IOQ *Ioq, ULONG IrpCredits)
+{
+    /*
+     * The user-mode file system advertises how many IRP's it can accept. Use this
+     * as the capacity of the pending queue: a file system that falls behind gets
+     * fewer pending IRP's (backpressure), while one with a deep backend can raise
+     * the capacity well above the static IrpCapacity maximum.
+     */
+    if (FspFsctlIrpCapacityMinimum > IrpCredits)
+        IrpCredits = FspFsctlIrpCapacityMinimum;
+    else if (FspFsctlIrpCreditMaximum < IrpCredits)
+        IrpCredits = FspFsctlIrpCreditMaximum;
+    InterlockedExchange((PLONG)&Ioq->PendingIrpCapacity, IrpCredits);
+}
+
 BOOLEAN FspIoqStartProcessingIrp(FSP_IOQ *Ioq, PIRP Irp)
 {
     NTSTATUS Result;
@@ -19,28 +19,138 @@
 
 typedef struct _FSP_META_CACHE_ITEM
 {
-    LIST_ENTRY ListEntry;
+    LIST_ENTRY ListEntry, LruEntry;
     struct _FSP_META_CACHE_ITEM *DictNext;
     PVOID ItemBuffer;
+    ULONG ItemSize;
     UINT64 ItemIndex;
     UINT64 ExpirationTime;
     LONG RefCount;
 } FSP_META_CACHE_ITEM;
 
-typedef struct
+typedef struct _FSP_META_CACHE_ITEM_BUFFER
 {
-    PVOID Item;
+    FSP_META_CACHE *MetaCache;          /* non-0 if buffer is interned */
+    struct _FSP_META_CACHE_ITEM_BUFFER *InternNext;
+    ULONG InternHash;
+    LONG RefCount;
     ULONG Size;
     __declspec(align(MEMORY_ALLOCATION_ALIGNMENT)) UINT8 Buffer[];
 } FSP_META_CACHE_ITEM_BUFFER;
 
+/*
+ * Meta cache items live in two lists. The ItemList is kept in insertion order, which
+ * is also expiration order since all items share the same timeout. The LruList is kept
+ * in access order: an item is moved to its tail whenever its buffer is referenced.
+ *
+ * When the cache is full (either by item count or by the total size of item buffers)
+ * we first evict an expired item if one exists and otherwise the least recently used
+ * item. This keeps frequently referenced items (e.g. the security descriptor of a busy
+ * directory) alive, while large rarely used items (e.g. DirInfo of a huge directory
+ * that was listed once) are evicted first.
+ */
+
+/*
+ * Item buffers are reference counted separately from items. Every item holds a reference
+ * to its buffer and so does every caller of FspMetaCacheReferenceItemBuffer.
+ *
+ * A meta cache that interns its items (e.g. the security cache) keeps its buffers in an
+ * intern table keyed by a hash of their contents. Adding an item whose contents equal
+ * those of an existing buffer shares that buffer rather than copying it. On a typical
+ * volume thousands of files share a handful of security descriptors, so interning
+ * stores each distinct descriptor only once.
+ *
+ * The intern table lives in paged memory and is protected by a fast mutex. The last
+ * reference to an interned buffer is always released under the mutex, so that a buffer
+ * found in the intern table can never be resurrected after its count has reached 0.
+ *
+ * An interned buffer is charged to the cache size once (InternSize) when it is created
+ * and uncharged when it is freed; the items that share it are not charged for it.
+ */
+
+static inline ULONG FspMetaCacheInternHash(PCVOID Buffer, ULONG Size)
+{
+    /* FNV-1a */
+    ULONG Hash = 2166136261;
+    for (PUINT8 P = (PVOID)Buffer, EndP = P + Size; EndP > P; P++)
+        Hash = (Hash ^ *P) * 16777619;
+    return Hash;
+}
+
+static FSP_META_CACHE_ITEM_BUFFER *FspMetaCacheInternBuffer(FSP_META_CACHE *MetaCache,
+    PCVOID Buffer, ULONG Size)
+{
+    FSP_META_CACHE_ITEM_BUFFER *ItemBuffer;
+    ULONG Hash = FspMetaCacheInternHash(Buffer, Size);
+    ULONG HashIndex = Hash % MetaCache->InternBucketCount;
+    ExAcquireFastMutex(&MetaCache->InternMutex);
+    for (ItemBuffer = MetaCache->InternBuckets[HashIndex]; ItemBuffer; ItemBuffer = ItemBuffer->InternNext)
+        if (ItemBuffer->InternHash == Hash && ItemBuffer->Size == Size &&
+            RtlEqualMemory(ItemBuffer->Buffer, Buffer, Size))
+        {
+            InterlockedIncrement(&ItemBuffer->RefCount);
+            goto exit;
+        }
+    ItemBuffer = FspAlloc(sizeof *ItemBuffer + Size);
+    if (0 == ItemBuffer)
+        goto exit;
+    RtlZeroMemory(ItemBuffer, sizeof *ItemBuffer);
+    ItemBuffer->MetaCache = MetaCache;
+    ItemBuffer->InternHash = Hash;
+    ItemBuffer->RefCount = 1;
+    ItemBuffer->Size = Size;
+    RtlCopyMemory(ItemBuffer->Buffer, Buffer, Size);
+    ItemBuffer->InternNext = MetaCache->InternBuckets[HashIndex];
+    MetaCache->InternBuckets[HashIndex] = ItemBuffer;
+    InterlockedExchangeAdd(&MetaCache->InternSize, (LONG)(sizeof *ItemBuffer + Size));
+exit:
+    ExReleaseFastMutex(&MetaCache->InternMutex);
+    return ItemBuffer;
+}
+
+static VOID FspMetaCacheDereferenceBuffer(FSP_META_CACHE_ITEM_BUFFER *ItemBuffer)
+{
+    FSP_META_CACHE *MetaCache = ItemBuffer->MetaCache;
+    LONG RefCount, OldRefCount;
+    if (0 == MetaCache)
+    {
+        if (0 == InterlockedDecrement(&ItemBuffer->RefCount))
+            FspFree(ItemBuffer);
+        return;
+    }
+    /* fast path: this is not the last reference; no need to touch the intern table */
+    for (RefCount = ItemBuffer->RefCount; 1 < RefCount; RefCount = OldRefCount)
+    {
+        OldRefCount = InterlockedCompareExchange(&ItemBuffer->RefCount, RefCount - 1, RefCount);
+        if (OldRefCount == RefCount)
+            return;
+    }
+    ExAcquireFastMutex(&MetaCache->InternMutex);
+    RefCount = InterlockedDecrement(&ItemBuffer->RefCount);
+    if (0 == RefCount)
+    {
+        ULONG HashIndex = ItemBuffer->InternHash % MetaCache->InternBucketCount;
+        for (FSP_META_CACHE_ITEM_BUFFER **P = (PVOID)&MetaCache->InternBuckets[HashIndex];
+            *P; P = &(*P)->InternNext)
+            if (*P == ItemBuffer)
+            {
+                *P = (*P)->InternNext;
+                break;
+            }
+        InterlockedExchangeAdd(&MetaCache->InternSize, -(LONG)(sizeof *ItemBuffer + ItemBuffer->Size));
+    }
+    ExReleaseFastMutex(&MetaCache->InternMutex);
+    if (0 == RefCount)
+        FspFree(ItemBuffer);
+}
+
 static inline VOID FspMetaCacheDereferenceItem(FSP_META_CACHE_ITEM *Item)
 {
     LONG RefCount = InterlockedDecrement(&Item->RefCount);
     if (0 == RefCount)
     {
         /* if we ever need to add a finalizer for meta items it should go here */
-        FspFree(Item->ItemBuffer);
+        FspMetaCacheDereferenceBuffer(Item->ItemBuffer);
         FspFree(Item);
     }
 }
@@ -69,7 +179,25 @@ static inline VOID FspMetaCacheAddItemAtDpcLevel(FSP_META_CACHE *MetaCache, FSP_
     Item->DictNext = MetaCache->ItemBuckets[HashIndex];
     MetaCache->ItemBuckets[HashIndex] = Item;
     InsertTailList(&MetaCache->ItemList, &Item->ListEntry);
+    InsertTailList(&MetaCache->LruList, &Item->LruEntry);
     MetaCache->ItemCount++;
+    MetaCache->ItemSize += Item->ItemSize;
+}
+
+static inline VOID FspMetaCacheRemoveItemAtDpcLevel(FSP_META_CACHE *MetaCache,
+    FSP_META_CACHE_ITEM *Item)
+{
+    ULONG HashIndex = Item->ItemIndex % MetaCache->ItemBucketCount;
+    for (FSP_META_CACHE_ITEM **P = (PVOID)&MetaCache->ItemBuckets[HashIndex]; *P; P = &(*P)->DictNext)
+        if (*P == Item)
+        {
+            *P = (*P)->DictNext;
+            break;
+        }
+    RemoveEntryList(&Item->ListEntry);
+    RemoveEntryList(&Item->LruEntry);
+    MetaCache->ItemCount--;
+    MetaCache->ItemSize -= Item->ItemSize;
 }
 
 static inline FSP_META_CACHE_ITEM *FspMetaCacheRemoveIndexedItemAtDpcLevel(FSP_META_CACHE *MetaCache,
@@ -83,7 +211,9 @@ static inline FSP_META_CACHE_ITEM *FspMetaCacheRemoveIndexedItemAtDpcLevel(FSP_M
             Item = *P;
             *P = (*P)->DictNext;
             RemoveEntryList(&Item->ListEntry);
+            RemoveEntryList(&Item->LruEntry);
             MetaCache->ItemCount--;
+            MetaCache->ItemSize -= Item->ItemSize;
             break;
         }
     return Item;
@@ -99,24 +229,33 @@ static inline FSP_META_CACHE_ITEM *FspMetaCacheRemoveExpiredItemAtDpcLevel(FSP_M
     FSP_META_CACHE_ITEM *Item = CONTAINING_RECORD(Entry, FSP_META_CACHE_ITEM, ListEntry);
     if (!FspExpirationTimeValid2(Item->ExpirationTime, ExpirationTime))
         return 0;
-    ULONG HashIndex = Item->ItemIndex % MetaCache->ItemBucketCount;
-    for (FSP_META_CACHE_ITEM **P = (PVOID)&MetaCache->ItemBuckets[HashIndex]; *P; P = &(*P)->DictNext)
-        if (*P == Item)
-        {
-            *P = (*P)->DictNext;
-            break;
-        }
-    RemoveEntryList(&Item->ListEntry);
-    MetaCache->ItemCount--;
+    FspMetaCacheRemoveItemAtDpcLevel(MetaCache, Item);
+    return Item;
+}
+
+static inline FSP_META_CACHE_ITEM *FspMetaCacheRemoveVictimItemAtDpcLevel(FSP_META_CACHE *MetaCache,
+    UINT64 ExpirationTime)
+{
+    FSP_META_CACHE_ITEM *Item = FspMetaCacheRemoveExpiredItemAtDpcLevel(MetaCache, ExpirationTime);
+    if (0 != Item)
+        return Item;
+    PLIST_ENTRY Head = &MetaCache->LruList;
+    PLIST_ENTRY Entry = Head->Flink;
+    if (Head == Entry)
+        return 0;
+    Item = CONTAINING_RECORD(Entry, FSP_META_CACHE_ITEM, LruEntry);
+    FspMetaCacheRemoveItemAtDpcLevel(MetaCache, Item);
     return Item;
 }
 
 NTSTATUS FspMetaCacheCreate(
-    ULONG MetaCapacity, ULONG ItemSizeMax, PLARGE_INTEGER MetaTimeout,
+    ULONG MetaCapacity, ULONG MetaSizeCapacity, ULONG ItemSizeMax, BOOLEAN InternItems,
+    PLARGE_INTEGER MetaTimeout,
     FSP_META_CACHE **PMetaCache)
 {
     *PMetaCache = 0;
-    if (0 == MetaCapacity || 0 == ItemSizeMax || 0 == MetaTimeout->QuadPart)
+    if (0 == MetaCapacity || 0 == MetaSizeCapacity || 0 == ItemSizeMax ||
+        0 == MetaTimeout->QuadPart)
         return STATUS_SUCCESS;
     FSP_META_CACHE *MetaCache;
     ULONG BucketCount = (PAGE_SIZE - sizeof *MetaCache) / sizeof MetaCache->ItemBuckets[0];
@@ -124,9 +263,23 @@ NTSTATUS FspMetaCacheCreate(
     if (0 == MetaCache)
         return STATUS_INSUFFICIENT_RESOURCES;
     RtlZeroMemory(MetaCache, PAGE_SIZE);
+    if (InternItems)
+    {
+        MetaCache->InternBuckets = FspAlloc(PAGE_SIZE);
+        if (0 == MetaCache->InternBuckets)
+        {
+            FspFree(MetaCache);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlZeroMemory(MetaCache->InternBuckets, PAGE_SIZE);
+        MetaCache->InternBucketCount = PAGE_SIZE / sizeof MetaCache->InternBuckets[0];
+        ExInitializeFastMutex(&MetaCache->InternMutex);
+    }
     KeInitializeSpinLock(&MetaCache->SpinLock);
     InitializeListHead(&MetaCache->ItemList);
+    InitializeListHead(&MetaCache->LruList);
     MetaCache->MetaCapacity = MetaCapacity;
+    MetaCache->MetaSizeCapacity = MetaSizeCapacity;
     MetaCache->ItemSizeMax = ItemSizeMax;
     MetaCache->MetaTimeout = MetaTimeout->QuadPart;
     MetaCache->ItemBucketCount = BucketCount;
@@ -139,6 +292,8 @@ VOID FspMetaCacheDelete(FSP_META_CACHE *MetaCache)
     if (0 == MetaCache)
         return;
     FspMetaCacheInvalidateExpired(MetaCache, (UINT64)-1LL);
+    if (0 != MetaCache->InternBuckets)
+        FspFree(MetaCache->InternBuckets);
     FspFree(MetaCache);
 }
 
@@ -178,8 +333,13 @@ BOOLEAN FspMetaCacheReferenceItemBuffer(FSP_META_CACHE *MetaCache, UINT64 ItemIn
         return FALSE;
     }
     InterlockedIncrement(&Item->RefCount);
+    RemoveEntryList(&Item->LruEntry);
+    InsertTailList(&MetaCache->LruList, &Item->LruEntry);
     KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
+    /* item buffer is paged; transfer our item reference to it outside the spin lock */
     ItemBuffer = Item->ItemBuffer;
+    InterlockedIncrement(&ItemBuffer->RefCount);
+    FspMetaCacheDereferenceItem(Item);
     *PBuffer = ItemBuffer->Buffer;
     if (0 != PSize)
         *PSize = ItemBuffer->Size;
@@ -189,39 +349,66 @@ BOOLEAN FspMetaCacheReferenceItemBuffer(FSP_META_CACHE *MetaCache, UINT64 ItemIn
 VOID FspMetaCacheDereferenceItemBuffer(PCVOID Buffer)
 {
     FSP_META_CACHE_ITEM_BUFFER *ItemBuffer = (PVOID)((PUINT8)Buffer - sizeof *ItemBuffer);
-    FspMetaCacheDereferenceItem(ItemBuffer->Item);
+    FspMetaCacheDereferenceBuffer(ItemBuffer);
 }
 
 UINT64 FspMetaCacheAddItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size)
 {
     if (0 == MetaCache)
         return 0;
-    FSP_META_CACHE_ITEM *Item;
+    FSP_META_CACHE_ITEM *Item, *VictimItem;
     FSP_META_CACHE_ITEM_BUFFER *ItemBuffer;
     UINT64 ItemIndex = 0;
+    UINT64 ExpirationTime;
     KIRQL Irql;
     if (sizeof *ItemBuffer + Size > MetaCache->ItemSizeMax)
         return 0;
     Item = FspAllocNonPaged(sizeof *Item);
     if (0 == Item)
         return 0;
-    ItemBuffer = FspAlloc(sizeof *ItemBuffer + Size);
+    if (0 != MetaCache->InternBuckets)
+        ItemBuffer = FspMetaCacheInternBuffer(MetaCache, Buffer, Size);
+    else
+    {
+        ItemBuffer = FspAlloc(sizeof *ItemBuffer + Size);
+        if (0 != ItemBuffer)
+        {
+            RtlZeroMemory(ItemBuffer, sizeof *ItemBuffer);
+            ItemBuffer->RefCount = 1;
+            ItemBuffer->Size = Size;
+            RtlCopyMemory(ItemBuffer->Buffer, Buffer, Size);
+        }
+    }
     if (0 == ItemBuffer)
     {
         FspFree(Item);
         return 0;
     }
     RtlZeroMemory(Item, sizeof *Item);
-    RtlZeroMemory(ItemBuffer, sizeof *ItemBuffer);
     Item->ItemBuffer = ItemBuffer;
+    /* interned buffers are charged through InternSize */
+    Item->ItemSize = 0 == ItemBuffer->MetaCache ? sizeof *ItemBuffer + Size : 0;
     Item->ExpirationTime = FspExpirationTimeFromTimeout(MetaCache->MetaTimeout);
     Item->RefCount = 1;
-    ItemBuffer->Item = Item;
-    ItemBuffer->Size = Size;
-    RtlCopyMemory(ItemBuffer->Buffer, Buffer, Size);
-    KeAcquireSpinLock(&MetaCache->SpinLock, &Irql);
-    if (MetaCache->ItemCount >= MetaCache->MetaCapacity)
-        FspMetaCacheRemoveExpiredItemAtDpcLevel(MetaCache, (UINT64)-1LL);
+    ExpirationTime = KeQueryInterruptTime();
+    for (;;)
+    {
+        KeAcquireSpinLock(&MetaCache->SpinLock, &Irql);
+        if (MetaCache->ItemCount < MetaCache->MetaCapacity &&
+            MetaCache->ItemSize + (ULONG)MetaCache->InternSize + Item->ItemSize <=
+                MetaCache->MetaSizeCapacity)
+            break;
+        VictimItem = FspMetaCacheRemoveVictimItemAtDpcLevel(MetaCache, ExpirationTime);
+        if (0 == VictimItem)
+            break;
+        KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
+        /*
+         * Victim items may free paged memory; dereference them outside the spin lock.
+         * This is also where an interned buffer that is no longer shared is uncharged,
+         * so evict one item at a time and look at the size again.
+         */
+        FspMetaCacheDereferenceItem(VictimItem);
+    }
     ItemIndex = MetaCache->ItemIndex;
     ItemIndex = (UINT64)-1LL == ItemIndex ? 1 : ItemIndex + 1;
     MetaCache->ItemIndex = Item->ItemIndex = ItemIndex;
@@ -0,0 +1,296 @@
+/**
+ * @file sys/name.c
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <sys/driver.h>
+
+/*
+ * The name cache remembers file names (full paths within the volume) for a limited
+ * time. It is used as a negative lookup cache: names for which the user mode file
+ * system has reported STATUS_OBJECT_NAME_NOT_FOUND are added to it and subsequent
+ * opens of the same names are failed without a round trip to user mode.
+ *
+ * Names in the cache must be invalidated whenever they may come into existence. This
+ * is done by FspNameCacheInvalidatePrefix, which removes a name and all names below
+ * it. Every invalidation also bumps the cache Generation; a name looked up before an
+ * invalidation and added after it is ignored, so that a racing create cannot leave a
+ * stale entry in the cache.
+ *
+ * A name cache may also carry a fixed size data payload with every name (DataSize).
+ * This is used by the file info cache, which remembers the FSP_FSCTL_FILE_INFO of
+ * recently queried names. Adding a name that is already in such a cache replaces it.
+ *
+ * All items share the same timeout, so the ItemList is kept in expiration order.
+ * Items are allocated from paged pool and all operations happen at PASSIVE_LEVEL
+ * under a fast mutex.
+ */
+
+typedef struct _FSP_NAME_CACHE_ITEM
+{
+    LIST_ENTRY ListEntry;
+    struct _FSP_NAME_CACHE_ITEM *DictNext;
+    UINT64 ExpirationTime;
+    ULONG Hash;
+    UNICODE_STRING Name;
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 Buffer[]; /* Data followed by Name */
+} FSP_NAME_CACHE_ITEM;
+
+static inline ULONG FspNameCacheHash(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name)
+{
+    ULONG Hash = 0;
+
+    RtlHashUnicodeString(Name, NameCache->CaseInsensitive, HASH_STRING_ALGORITHM_DEFAULT, &Hash);
+
+    return Hash;
+}
+
+static inline BOOLEAN FspNameCacheIsPrefix(FSP_NAME_CACHE *NameCache,
+    PUNICODE_STRING Prefix, PUNICODE_STRING Name)
+{
+    WCHAR C;
+
+    if (!RtlPrefixUnicodeString(Prefix, Name, NameCache->CaseInsensitive))
+        return FALSE;
+    if (Prefix->Length == Name->Length)
+        return TRUE;
+    if (sizeof(WCHAR) == Prefix->Length)
+        return TRUE; /* root directory */
+
+    C = Name->Buffer[Prefix->Length / sizeof(WCHAR)];
+    return L'\\' == C || L':' == C;
+}
+
+static inline FSP_NAME_CACHE_ITEM *FspNameCacheLookupItem(FSP_NAME_CACHE *NameCache,
+    PUNICODE_STRING Name, ULONG Hash)
+{
+    ULONG HashIndex = Hash % NameCache->ItemBucketCount;
+
+    for (FSP_NAME_CACHE_ITEM *Item = NameCache->ItemBuckets[HashIndex]; Item; Item = Item->DictNext)
+        if (Item->Hash == Hash &&
+            RtlEqualUnicodeString(&Item->Name, Name, NameCache->CaseInsensitive))
+            return Item;
+
+    return 0;
+}
+
+static inline VOID FspNameCacheRemoveItem(FSP_NAME_CACHE *NameCache, FSP_NAME_CACHE_ITEM *Item)
+{
+    ULONG HashIndex = Item->Hash % NameCache->ItemBucketCount;
+
+    for (FSP_NAME_CACHE_ITEM **P = (PVOID)&NameCache->ItemBuckets[HashIndex]; *P; P = &(*P)->DictNext)
+        if (*P == Item)
+        {
+            *P = (*P)->DictNext;
+            break;
+        }
+    RemoveEntryList(&Item->ListEntry);
+    NameCache->ItemCount--;
+
+    FspFree(Item);
+}
+
+NTSTATUS FspNameCacheCreate(
+    ULONG NameCapacity, ULONG DataSize, BOOLEAN CaseInsensitive, PLARGE_INTEGER NameTimeout,
+    FSP_NAME_CACHE **PNameCache)
+{
+    FSP_NAME_CACHE *NameCache;
+    ULONG BucketCount = (PAGE_SIZE - sizeof *NameCache) / sizeof NameCache->ItemBuckets[0];
+
+    *PNameCache = 0;
+
+    if (0 == NameCapacity || 0 == NameTimeout->QuadPart)
+        return STATUS_SUCCESS;
+
+    NameCache = FspAllocNonPaged(PAGE_SIZE);
+    if (0 == NameCache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(NameCache, PAGE_SIZE);
+    ExInitializeFastMutex(&NameCache->Mutex);
+    InitializeListHead(&NameCache->ItemList);
+    NameCache->NameCapacity = NameCapacity;
+    NameCache->DataSize = FSP_FSCTL_DEFAULT_ALIGN_UP(DataSize);
+    NameCache->NameTimeout = NameTimeout->QuadPart;
+    NameCache->CaseInsensitive = CaseInsensitive;
+    NameCache->ItemBucketCount = BucketCount;
+
+    *PNameCache = NameCache;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspNameCacheDelete(FSP_NAME_CACHE *NameCache)
+{
+    if (0 == NameCache)
+        return;
+
+    FspNameCacheInvalidateExpired(NameCache, (UINT64)-1LL);
+
+    FspFree(NameCache);
+}
+
+VOID FspNameCacheInvalidateExpired(FSP_NAME_CACHE *NameCache, UINT64 ExpirationTime)
+{
+    PLIST_ENTRY Head, Entry;
+    FSP_NAME_CACHE_ITEM *Item;
+
+    if (0 == NameCache)
+        return;
+
+    Head = &NameCache->ItemList;
+    ExAcquireFastMutex(&NameCache->Mutex);
+    while (Head != (Entry = Head->Flink))
+    {
+        Item = CONTAINING_RECORD(Entry, FSP_NAME_CACHE_ITEM, ListEntry);
+        if (FspExpirationTimeValid2(Item->ExpirationTime, ExpirationTime))
+            break;
+        FspNameCacheRemoveItem(NameCache, Item);
+    }
+    ExReleaseFastMutex(&NameCache->Mutex);
+}
+
+ULONG FspNameCacheGeneration(FSP_NAME_CACHE *NameCache)
+{
+    ULONG Generation;
+
+    if (0 == NameCache)
+        return 0;
+
+    ExAcquireFastMutex(&NameCache->Mutex);
+    Generation = NameCache->Generation;
+    ExReleaseFastMutex(&NameCache->Mutex);
+
+    return Generation;
+}
+
+BOOLEAN FspNameCacheLookup(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name)
+{
+    return FspNameCacheLookupData(NameCache, Name, 0);
+}
+
+BOOLEAN FspNameCacheLookupData(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name, PVOID Data)
+{
+    ULONG Hash;
+    FSP_NAME_CACHE_ITEM *Item;
+    BOOLEAN Result = FALSE;
+
+    if (0 == NameCache)
+        return FALSE;
+
+    Hash = FspNameCacheHash(NameCache, Name);
+    ExAcquireFastMutex(&NameCache->Mutex);
+    Item = FspNameCacheLookupItem(NameCache, Name, Hash);
+    if (0 != Item)
+    {
+        Result = FspExpirationTimeValid(Item->ExpirationTime);
+        if (!Result)
+            FspNameCacheRemoveItem(NameCache, Item);
+        else if (0 != Data)
+            RtlCopyMemory(Data, Item->Buffer, NameCache->DataSize);
+    }
+    ExReleaseFastMutex(&NameCache->Mutex);
+
+    return Result;
+}
+
+VOID FspNameCacheAddName(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name, ULONG Generation)
+{
+    FspNameCacheAddNameData(NameCache, Name, Generation, 0);
+}
+
+VOID FspNameCacheAddNameData(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name, ULONG Generation,
+    PCVOID Data)
+{
+    ULONG Hash, HashIndex;
+    FSP_NAME_CACHE_ITEM *Item, *OldItem;
+
+    if (0 == NameCache)
+        return;
+
+    Hash = FspNameCacheHash(NameCache, Name);
+    Item = FspAlloc(sizeof *Item + NameCache->DataSize + Name->Length);
+    if (0 == Item)
+        return;
+
+    RtlZeroMemory(Item, sizeof *Item + NameCache->DataSize);
+    Item->Hash = Hash;
+    Item->Name.Length = Item->Name.MaximumLength = Name->Length;
+    Item->Name.Buffer = (PVOID)(Item->Buffer + NameCache->DataSize);
+    RtlCopyMemory(Item->Name.Buffer, Name->Buffer, Name->Length);
+    if (0 != Data)
+        RtlCopyMemory(Item->Buffer, Data, NameCache->DataSize);
+
+    ExAcquireFastMutex(&NameCache->Mutex);
+    OldItem = Generation == NameCache->Generation ?
+        FspNameCacheLookupItem(NameCache, Name, Hash) : 0;
+    if (Generation != NameCache->Generation ||
+        (0 != OldItem && 0 == NameCache->DataSize))
+    {
+        ExReleaseFastMutex(&NameCache->Mutex);
+        FspFree(Item);
+        return;
+    }
+    if (0 != OldItem)
+        FspNameCacheRemoveItem(NameCache, OldItem);
+    if (NameCache->ItemCount >= NameCache->NameCapacity)
+        FspNameCacheRemoveItem(NameCache,
+            CONTAINING_RECORD(NameCache->ItemList.Flink, FSP_NAME_CACHE_ITEM, ListEntry));
+    Item->ExpirationTime = FspExpirationTimeFromTimeout(NameCache->NameTimeout);
+    HashIndex = Hash % NameCache->ItemBucketCount;
+    Item->DictNext = NameCache->ItemBuckets[HashIndex];
+    NameCache->ItemBuckets[HashIndex] = Item;
+    InsertTailList(&NameCache->ItemList, &Item->ListEntry);
+    NameCache->ItemCount++;
+    ExReleaseFastMutex(&NameCache->Mutex);
+}
+
+VOID FspNameCacheInvalidateName(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Name)
+{
+    ULONG Hash;
+    FSP_NAME_CACHE_ITEM *Item;
+
+    if (0 == NameCache)
+        return;
+
+    Hash = FspNameCacheHash(NameCache, Name);
+    ExAcquireFastMutex(&NameCache->Mutex);
+    NameCache->Generation++;
+    Item = FspNameCacheLookupItem(NameCache, Name, Hash);
+    if (0 != Item)
+        FspNameCacheRemoveItem(NameCache, Item);
+    ExReleaseFastMutex(&NameCache->Mutex);
+}
+
+VOID FspNameCacheInvalidatePrefix(FSP_NAME_CACHE *NameCache, PUNICODE_STRING Prefix)
+{
+    PLIST_ENTRY Head, Entry, NextEntry;
+    FSP_NAME_CACHE_ITEM *Item;
+
+    if (0 == NameCache)
+        return;
+
+    Head = &NameCache->ItemList;
+    ExAcquireFastMutex(&NameCache->Mutex);
+    NameCache->Generation++;
+    for (Entry = Head->Flink; Head != Entry; Entry = NextEntry)
+    {
+        NextEntry = Entry->Flink;
+        Item = CONTAINING_RECORD(Entry, FSP_NAME_CACHE_ITEM, ListEntry);
+        if (FspNameCacheIsPrefix(NameCache, Prefix, &Item->Name))
+            FspNameCacheRemoveItem(NameCache, Item);
+    }
+    ExReleaseFastMutex(&NameCache->Mutex);
+}
@@ -49,6 +49,57 @@ enum
     RequestProcess                      = 3,
 };
 
+enum
+{
+    ReadAheadSequentialThreshold        = 2,
+    ReadAheadLengthMaximum              = 4 * 1024 * 1024,
+};
+
+/*
+ * Sequential access detection for non-cached reads. A read that starts where the
+ * previous read on the same handle ended extends the sequential run; any other read
+ * starts a new one. Once a run reaches ReadAheadSequentialThreshold reads, the request
+ * carries a hint for the range that is expected next; the hint window doubles with
+ * every sequential read up to ReadAheadLengthMaximum.
+ *
+ * The hint is advisory and the FileDesc state is updated without synchronization;
+ * concurrent reads on the same handle may at worst cause a missed or spurious hint.
+ */
+static inline VOID FspFsvolReadAheadUpdate(FSP_FILE_DESC *FileDesc,
+    UINT64 ReadOffset, ULONG ReadLength, PUINT64 PReadAheadOffset, PULONG PReadAheadLength)
+{
+    ULONG ReadAheadLength;
+
+    if (0 != FileDesc->ReadAheadSequentialCount && ReadOffset == FileDesc->ReadAheadNextOffset)
+    {
+        if (ReadAheadSequentialThreshold > FileDesc->ReadAheadSequentialCount)
+            FileDesc->ReadAheadSequentialCount++;
+        ReadAheadLength = ReadAheadLengthMaximum / 2 < FileDesc->ReadAheadLength ?
+            ReadAheadLengthMaximum : FileDesc->ReadAheadLength * 2;
+        if (ReadAheadLength < ReadLength)
+            ReadAheadLength = ReadLength;
+    }
+    else
+    {
+        FileDesc->ReadAheadSequentialCount = 1;
+        ReadAheadLength = ReadLength;
+    }
+
+    FileDesc->ReadAheadNextOffset = ReadOffset + ReadLength;
+    FileDesc->ReadAheadLength = ReadAheadLength;
+
+    if (ReadAheadSequentialThreshold <= FileDesc->ReadAheadSequentialCount)
+    {
+        *PReadAheadOffset = FileDesc->ReadAheadNextOffset;
+        *PReadAheadLength = ReadAheadLength;
+    }
+    else
+    {
+        *PReadAheadOffset = 0;
+        *PReadAheadLength = 0;
+    }
+}
+
 static NTSTATUS FspFsvolRead(
     PDEVICE_OBJECT FsvolDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
 {
@@ -110,6 +161,17 @@ static NTSTATUS FspFsvolReadCached(
     CC_FILE_SIZES FileSizes;
     BOOLEAN Success;
 
+    /* revalidate the cache if the FileNode info has expired or the cache is stale */
+    if (!FspFileNodeCacheValid(FileNode))
+    {
+        if (!CanWait)
+            return FspWqRepostIrpWorkItem(Irp, FspFsvolReadCached, 0);
+
+        Result = FspFileNodeRevalidateCache(FileNode, FileObject);
+        if (!NT_SUCCESS(Result))
+            return Result;
+    }
+
     /* try to acquire the FileNode Main shared */
     Success = DEBUGTEST(90) &&
         FspFileNodeTryAcquireSharedF(FileNode, FspFileNodeAcquireMain, CanWait);
@@ -125,7 +187,8 @@ static NTSTATUS FspFsvolReadCached(
 
     /* trim ReadLength; the cache manager does not tolerate reads beyond file size */
     ASSERT(FspTimeoutInfinity32 ==
-        FspFsvolDeviceExtension(FsvolDeviceObject)->VolumeParams.FileInfoTimeout);
+        FspFsvolDeviceExtension(FsvolDeviceObject)->VolumeParams.FileInfoTimeout ||
+        FspFsvolDeviceExtension(FsvolDeviceObject)->VolumeParams.CacheValidation);
     FspFileNodeGetFileInfo(FileNode, &FileInfo);
     if ((UINT64)ReadOffset.QuadPart >= FileInfo.FileSize)
     {
@@ -207,10 +270,12 @@ static NTSTATUS FspFsvolReadNonCached(
 {
     PAGED_CODE();
 
-    /* assert: either a top-level IRP or Paging I/O */
-    ASSERT(0 == FspIrpTopFlags(Irp) || FlagOn(Irp->Flags, IRP_PAGING_IO));
+    /* assert: either a top-level IRP, Paging I/O or a split I/O chunk (see FspSendSplitIoIrps) */
+    ASSERT(0 == FspIrpTopFlags(Irp) || FlagOn(Irp->Flags, IRP_PAGING_IO) ||
+        FspIsSplitIoChunkIrp(Irp));
 
     NTSTATUS Result;
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     FSP_FILE_NODE *FileNode = FileObject->FsContext;
     FSP_FILE_DESC *FileDesc = FileObject->FsContext2;
@@ -218,6 +283,8 @@ static NTSTATUS FspFsvolReadNonCached(
     ULONG ReadLength = IrpSp->Parameters.Read.Length;
     ULONG ReadKey = IrpSp->Parameters.Read.Key;
     BOOLEAN PagingIo = BooleanFlagOn(Irp->Flags, IRP_PAGING_IO);
+    BOOLEAN SplitIoChunk = !PagingIo && FspIsSplitIoChunkIrp(Irp);
+    BOOLEAN SplitIo;
     FSP_FSCTL_TRANSACT_REQ *Request;
     BOOLEAN Success;
 
@@ -232,21 +299,27 @@ static NTSTATUS FspFsvolReadNonCached(
     if (!NT_SUCCESS(Result))
         return Result;
 
-    /* acquire FileNode exclusive Full */
+    /* split a large read into chunks that the file system can serve concurrently */
+    SplitIo = !PagingIo && 0 != FsvolDeviceExtension->VolumeParams.SplitIoChunkSize &&
+        FsvolDeviceExtension->VolumeParams.SplitIoChunkSize < ReadLength;
+    if (SplitIo && !CanWait)
+        return FspWqRepostIrpWorkItem(Irp, FspFsvolReadNonCached, 0);
+
+    /* acquire FileNode exclusive Full; a split I/O chunk already holds it through its parent */
     Success = DEBUGTEST(90) &&
         FspFileNodeTryAcquireExclusiveF(FileNode, FspFileNodeAcquireFull, CanWait);
     if (!Success)
         return FspWqRepostIrpWorkItem(Irp, FspFsvolReadNonCached, 0);
 
-    /* check the file locks */
-    if (!PagingIo && !FsRtlCheckLockForReadAccess(&FileNode->FileLock, Irp))
+    /* check the file locks; the parent of a split I/O chunk checked the whole range */
+    if (!PagingIo && !SplitIoChunk && !FsRtlCheckLockForReadAccess(&FileNode->FileLock, Irp))
     {
         FspFileNodeRelease(FileNode, Full);
         return STATUS_FILE_LOCK_CONFLICT;
     }
 
     /* if this is a non-cached transfer on a cached file then flush the file */
-    if (!PagingIo && 0 != FileObject->SectionObjectPointer->DataSectionObject)
+    if (!PagingIo && !SplitIoChunk && 0 != FileObject->SectionObjectPointer->DataSectionObject)
     {
         if (!CanWait)
         {
@@ -268,6 +341,23 @@ static NTSTATUS FspFsvolReadNonCached(
     /* convert FileNode to shared */
     FspFileNodeConvertExclusiveToShared(FileNode, Full);
 
+    if (SplitIo)
+    {
+        /* the chunks inherit our Full acquisition through their top flags and run concurrently */
+        Result = FspSendSplitIoIrps(FsvolDeviceObject, Irp,
+            FsvolDeviceExtension->VolumeParams.SplitIoChunkSize,
+            FsvolDeviceExtension->VolumeParams.SplitIoFanOut);
+
+        FspFileNodeRelease(FileNode, Full);
+
+        /* update the current file offset if synchronous I/O */
+        if (NT_SUCCESS(Result) && FlagOn(FileObject->Flags, FO_SYNCHRONOUS_IO))
+            FileObject->CurrentByteOffset.QuadPart =
+                ReadOffset.QuadPart + Irp->IoStatus.Information;
+
+        return Result;
+    }
+
     /* delete any work item if present! */
     FspIrpDeleteRequest(Irp);
 
@@ -285,6 +375,9 @@ static NTSTATUS FspFsvolReadNonCached(
     Request->Req.Read.Offset = ReadOffset.QuadPart;
     Request->Req.Read.Length = ReadLength;
     Request->Req.Read.Key = ReadKey;
+    if (!PagingIo)
+        FspFsvolReadAheadUpdate(FileDesc, ReadOffset.QuadPart, ReadLength,
+            &Request->Req.Read.ReadAheadOffset, &Request->Req.Read.ReadAheadLength);
 
     FspFileNodeSetOwner(FileNode, Full, Request);
     FspIopRequestContext(Request, RequestIrp) = Irp;
@@ -298,10 +391,21 @@ NTSTATUS FspFsvolReadPrepare(
     PAGED_CODE();
 
     NTSTATUS Result;
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(IrpSp->DeviceObject);
     FSP_SAFE_MDL *SafeMdl = 0;
     PVOID Address;
     PEPROCESS Process;
 
+    /* use a preregistered I/O buffer slot if one is available; data are copied on completion */
+    Address = FspIoBuffersAllocateSlot(FsvolDeviceExtension->IoBuffers, Request->Req.Read.Length);
+    if (0 != Address)
+    {
+        Request->Req.Read.Address = (UINT64)(UINT_PTR)Address;
+        FspIopRequestContext(Request, RequestAddress) = Address;
+        return STATUS_SUCCESS;
+    }
+
     /* create a "safe" MDL if necessary */
     if (!FspSafeMdlCheck(Irp->MdlAddress))
     {
@@ -348,12 +452,34 @@ NTSTATUS FspFsvolReadComplete(
 
     FSP_FSCTL_TRANSACT_REQ *Request = FspIrpRequest(Irp);
     FSP_SAFE_MDL *SafeMdl = FspIopRequestContext(Request, RequestSafeMdl);
+    PVOID Address = FspIopRequestContext(Request, RequestAddress);
+    PEPROCESS Process = FspIopRequestContext(Request, RequestProcess);
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     LARGE_INTEGER ReadOffset = IrpSp->Parameters.Read.ByteOffset;
     BOOLEAN PagingIo = BooleanFlagOn(Irp->Flags, IRP_PAGING_IO);
     BOOLEAN SynchronousIo = BooleanFlagOn(FileObject->Flags, FO_SYNCHRONOUS_IO);
 
-    if (0 != SafeMdl)
+    if (0 != Address && 0 == Process)
+    {
+        /* copy from the preregistered I/O buffer slot */
+        FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+            FspFsvolDeviceExtension(IrpSp->DeviceObject);
+        PVOID Buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+        if (Response->IoStatus.Information > Request->Req.Read.Length)
+        {
+            Irp->IoStatus.Information = 0;
+            FSP_RETURN(Result = STATUS_INTERNAL_ERROR);
+        }
+        if (0 == Buffer)
+        {
+            Irp->IoStatus.Information = 0;
+            FSP_RETURN(Result = STATUS_INSUFFICIENT_RESOURCES);
+        }
+        RtlCopyMemory(Buffer,
+            FspIoBuffersSlotSystemAddress(FsvolDeviceExtension->IoBuffers, Address),
+            (ULONG)Response->IoStatus.Information);
+    }
+    else if (0 != SafeMdl)
         FspSafeMdlCopyBack(SafeMdl);
 
     /* if we are top-level */
@@ -368,7 +494,8 @@ NTSTATUS FspFsvolReadComplete(
     }
     else
     {
-        ASSERT(PagingIo);
+        /* Paging I/O or a split I/O chunk; the parent IRP updates the file offset */
+        ASSERT(PagingIo || KernelMode == Irp->RequestorMode);
         FspIopResetRequest(Request, 0);
     }
 
@@ -393,7 +520,14 @@ static VOID FspFsvolReadNonCachedRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, PV
     PVOID Address = Context[RequestAddress];
     PEPROCESS Process = Context[RequestProcess];
 
-    if (0 != Address)
+    if (0 != Address && 0 == Process)
+    {
+        ASSERT(0 != Irp);
+        FspIoBuffersFreeSlot(
+            FspFsvolDeviceExtension(IoGetCurrentIrpStackLocation(Irp)->DeviceObject)->IoBuffers,
+            Address);
+    }
+    else if (0 != Address)
     {
         KAPC_STATE ApcState;
         BOOLEAN Attach;
@@ -323,6 +323,10 @@ NTSTATUS FspFsvolSetSecurityComplete(
         FspFileNodeSetSecurity(FileNode, 0, 0);
     }
 
+    /* cached file info was authorized under the old security (also for files below it) */
+    FspNameCacheInvalidatePrefix(FspFsvolDeviceExtension(FileNode->FsvolDeviceObject)->FileInfoCache,
+        &FileNode->FileName);
+
     FspIopRequestContext(Request, RequestFileNode) = 0;
     FspFileNodeReleaseOwner(FileNode, Full, Request);
 
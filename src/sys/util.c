@@ -24,8 +24,15 @@ NTSTATUS FspGetDeviceObjectPointer(PUNICODE_STRING ObjectName, ACCESS_MASK Desir
     PULONG PFileNameIndex, PFILE_OBJECT *PFileObject, PDEVICE_OBJECT *PDeviceObject);
 NTSTATUS FspSendSetInformationIrp(PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject,
     FILE_INFORMATION_CLASS FileInformationClass, PVOID FileInformation, ULONG Length);
-static NTSTATUS FspSendSetInformationIrpCompletion(
+NTSTATUS FspSendQueryInformationIrp(PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject,
+    FILE_INFORMATION_CLASS FileInformationClass, PVOID FileInformation, ULONG Length);
+static NTSTATUS FspSendInformationIrpCompletion(
+    PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context0);
+NTSTATUS FspSendSplitIoIrps(PDEVICE_OBJECT DeviceObject, PIRP Irp,
+    ULONG ChunkSize, ULONG FanOut);
+static NTSTATUS FspSendSplitIoIrpsCompletion(
     PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context0);
+BOOLEAN FspIsSplitIoChunkIrp(PIRP Irp);
 NTSTATUS FspBufferUserBuffer(PIRP Irp, ULONG Length, LOCK_OPERATION Operation);
 NTSTATUS FspLockUserBuffer(PIRP Irp, ULONG Length, LOCK_OPERATION Operation);
 NTSTATUS FspMapLockedPagesInUserMode(PMDL Mdl, PVOID *PAddress, ULONG ExtraPriorityFlags);
@@ -92,6 +99,9 @@ NTSTATUS FspIrpHookNext(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context);
 #pragma alloc_text(PAGE, FspCreateGuid)
 #pragma alloc_text(PAGE, FspGetDeviceObjectPointer)
 #pragma alloc_text(PAGE, FspSendSetInformationIrp)
+#pragma alloc_text(PAGE, FspSendQueryInformationIrp)
+#pragma alloc_text(PAGE, FspSendSplitIoIrps)
+#pragma alloc_text(PAGE, FspIsSplitIoChunkIrp)
 #pragma alloc_text(PAGE, FspBufferUserBuffer)
 #pragma alloc_text(PAGE, FspLockUserBuffer)
 #pragma alloc_text(PAGE, FspMapLockedPagesInUserMode)
@@ -298,7 +308,7 @@ typedef struct
 {
     IO_STATUS_BLOCK IoStatus;
     KEVENT Event;
-} FSP_SEND_SET_INFORMATION_IRP_CONTEXT;
+} FSP_SEND_INFORMATION_IRP_CONTEXT;
 
 NTSTATUS FspSendSetInformationIrp(PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject,
     FILE_INFORMATION_CLASS FileInformationClass, PVOID FileInformation, ULONG Length)
@@ -312,7 +322,7 @@ NTSTATUS FspSendSetInformationIrp(PDEVICE_OBJECT DeviceObject, PFILE_OBJECT File
     NTSTATUS Result;
     PIRP Irp;
     PIO_STACK_LOCATION IrpSp;
-    FSP_SEND_SET_INFORMATION_IRP_CONTEXT Context;
+    FSP_SEND_INFORMATION_IRP_CONTEXT Context;
 
     if (0 == DeviceObject)
         DeviceObject = IoGetRelatedDeviceObject(FileObject);
@@ -329,7 +339,7 @@ NTSTATUS FspSendSetInformationIrp(PDEVICE_OBJECT DeviceObject, PFILE_OBJECT File
     IrpSp->Parameters.SetFile.FileInformationClass = FileInformationClass;
     IrpSp->Parameters.SetFile.Length = FileInformationClass;
 
-    IoSetCompletionRoutine(Irp, FspSendSetInformationIrpCompletion, &Context, TRUE, TRUE, TRUE);
+    IoSetCompletionRoutine(Irp, FspSendInformationIrpCompletion, &Context, TRUE, TRUE, TRUE);
 
     KeInitializeEvent(&Context.Event, NotificationEvent, FALSE);
     Result = IoCallDriver(DeviceObject, Irp);
@@ -339,12 +349,51 @@ NTSTATUS FspSendSetInformationIrp(PDEVICE_OBJECT DeviceObject, PFILE_OBJECT File
     return NT_SUCCESS(Result) ? Context.IoStatus.Status : Result;
 }
 
-static NTSTATUS FspSendSetInformationIrpCompletion(
+NTSTATUS FspSendQueryInformationIrp(PDEVICE_OBJECT DeviceObject, PFILE_OBJECT FileObject,
+    FILE_INFORMATION_CLASS FileInformationClass, PVOID FileInformation, ULONG Length)
+{
+    PAGED_CODE();
+
+    ASSERT(
+        FileBasicInformation == FileInformationClass ||
+        FileStandardInformation == FileInformationClass);
+
+    NTSTATUS Result;
+    PIRP Irp;
+    PIO_STACK_LOCATION IrpSp;
+    FSP_SEND_INFORMATION_IRP_CONTEXT Context;
+
+    if (0 == DeviceObject)
+        DeviceObject = IoGetRelatedDeviceObject(FileObject);
+
+    Irp = IoAllocateIrp(DeviceObject->StackSize, FALSE);
+    if (0 == Irp)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    IrpSp = IoGetNextIrpStackLocation(Irp);
+    Irp->RequestorMode = KernelMode;
+    Irp->AssociatedIrp.SystemBuffer = FileInformation;
+    IrpSp->MajorFunction = IRP_MJ_QUERY_INFORMATION;
+    IrpSp->FileObject = FileObject;
+    IrpSp->Parameters.QueryFile.FileInformationClass = FileInformationClass;
+    IrpSp->Parameters.QueryFile.Length = Length;
+
+    IoSetCompletionRoutine(Irp, FspSendInformationIrpCompletion, &Context, TRUE, TRUE, TRUE);
+
+    KeInitializeEvent(&Context.Event, NotificationEvent, FALSE);
+    Result = IoCallDriver(DeviceObject, Irp);
+    if (STATUS_PENDING == Result)
+        KeWaitForSingleObject(&Context.Event, Executive, KernelMode, FALSE, 0);
+
+    return NT_SUCCESS(Result) ? Context.IoStatus.Status : Result;
+}
+
+static NTSTATUS FspSendInformationIrpCompletion(
     PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context0)
 {
     // !PAGED_CODE();
 
-    FSP_SEND_SET_INFORMATION_IRP_CONTEXT *Context = Context0;
+    FSP_SEND_INFORMATION_IRP_CONTEXT *Context = Context0;
 
     Context->IoStatus = Irp->IoStatus;
     KeSetEvent(&Context->Event, 1, FALSE);
@@ -354,6 +403,210 @@ static NTSTATUS FspSendSetInformationIrpCompletion(
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
+typedef struct
+{
+    KSPIN_LOCK SpinLock;
+    KSEMAPHORE Semaphore;
+    KEVENT Event;
+    LONG PendingCount;
+    PUINT8 VirtualAddress;
+    ULONG ChunkSize, ChunkCount;
+    ULONG ShortIndex;                   /* first chunk that failed or was short */
+    IO_STATUS_BLOCK ShortIoStatus;
+} FSP_SEND_SPLIT_IO_IRPS_CONTEXT;
+
+NTSTATUS FspSendSplitIoIrps(PDEVICE_OBJECT DeviceObject, PIRP Irp,
+    ULONG ChunkSize, ULONG FanOut)
+{
+    PAGED_CODE();
+
+    /*
+     * Split a non-cached read or write into chunks of ChunkSize bytes and send each
+     * chunk to DeviceObject as a separate IRP, so that the user mode file system can
+     * serve the chunks concurrently. At most FanOut chunks are in flight at any time.
+     * The original IRP must have its buffer locked in Irp->MdlAddress.
+     *
+     * The caller must hold the FileNode resources that the chunks need (e.g. Full for
+     * a read), having already checked file locks and cache coherency for the whole range.
+     * The chunk IRPs carry these resources in their top flags, so the regular non-cached
+     * path does not acquire them again and the chunks do not serialize on each other.
+     * The returned Information is the number of bytes transferred up to the first chunk
+     * that failed or was short.
+     */
+
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    BOOLEAN IsRead = IRP_MJ_READ == IrpSp->MajorFunction;
+    UINT64 Offset = IsRead ?
+        IrpSp->Parameters.Read.ByteOffset.QuadPart : IrpSp->Parameters.Write.ByteOffset.QuadPart;
+    ULONG Length = IsRead ? IrpSp->Parameters.Read.Length : IrpSp->Parameters.Write.Length;
+    ULONG Key = IsRead ? IrpSp->Parameters.Read.Key : IrpSp->Parameters.Write.Key;
+    FSP_SEND_SPLIT_IO_IRPS_CONTEXT *Context;
+    PIRP ChunkIrp;
+    PIO_STACK_LOCATION ChunkIrpSp;
+    PMDL ChunkMdl;
+    ULONG ChunkOffset, ChunkLength;
+    NTSTATUS Result;
+
+    ASSERT(IRP_MJ_READ == IrpSp->MajorFunction || IRP_MJ_WRITE == IrpSp->MajorFunction);
+    ASSERT(0 != Irp->MdlAddress);
+    ASSERT(0 != ChunkSize && 0 != FanOut);
+
+    /* the completion routine may run at DISPATCH_LEVEL */
+    Context = FspAllocNonPaged(sizeof *Context);
+    if (0 == Context)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(Context, sizeof *Context);
+    KeInitializeSpinLock(&Context->SpinLock);
+    KeInitializeSemaphore(&Context->Semaphore, FanOut, FanOut);
+    KeInitializeEvent(&Context->Event, NotificationEvent, FALSE);
+    Context->PendingCount = 1;
+    Context->VirtualAddress = MmGetMdlVirtualAddress(Irp->MdlAddress);
+    Context->ChunkSize = ChunkSize;
+    Context->ChunkCount = (ULONG)(((UINT64)Length + ChunkSize - 1) / ChunkSize);
+    Context->ShortIndex = Context->ChunkCount;
+
+    for (ULONG Index = 0; Context->ChunkCount > Index; Index++)
+    {
+        ChunkOffset = Index * ChunkSize;
+        ChunkLength = Length - ChunkOffset < ChunkSize ? Length - ChunkOffset : ChunkSize;
+
+        KeWaitForSingleObject(&Context->Semaphore, Executive, KernelMode, FALSE, 0);
+
+        /* stop sending chunks once a chunk has failed or was short */
+        if (Context->ShortIndex < Index)
+        {
+            KeReleaseSemaphore(&Context->Semaphore, 1, 1, FALSE);
+            break;
+        }
+
+        ChunkIrp = IoAllocateIrp(DeviceObject->StackSize, FALSE);
+        ChunkMdl = 0 != ChunkIrp ?
+            IoAllocateMdl(Context->VirtualAddress + ChunkOffset, ChunkLength, FALSE, FALSE, 0) : 0;
+        if (0 == ChunkMdl)
+        {
+            if (0 != ChunkIrp)
+                IoFreeIrp(ChunkIrp);
+            KeReleaseSemaphore(&Context->Semaphore, 1, 1, FALSE);
+
+            KIRQL Irql;
+            KeAcquireSpinLock(&Context->SpinLock, &Irql);
+            if (Context->ShortIndex > Index)
+            {
+                Context->ShortIndex = Index;
+                Context->ShortIoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+                Context->ShortIoStatus.Information = 0;
+            }
+            KeReleaseSpinLock(&Context->SpinLock, Irql);
+            break;
+        }
+        IoBuildPartialMdl(Irp->MdlAddress, ChunkMdl,
+            Context->VirtualAddress + ChunkOffset, ChunkLength);
+
+        ChunkIrp->MdlAddress = ChunkMdl;
+        ChunkIrp->Flags = IRP_NOCACHE | IRP_SYNCHRONOUS_API;
+            /* chunks are dispatched inline; they never repost to the work queue */
+        ChunkIrp->RequestorMode = KernelMode;
+        ChunkIrp->Tail.Overlay.Thread = Irp->Tail.Overlay.Thread;
+            /* byte range locks are owned by the process of the original IRP */
+        FspIrpSetTopFlags(ChunkIrp, FspIrpFlags(Irp));
+            /* resources held by the original IRP; see FSP_FILE_NODE_GET_FLAGS */
+        ChunkIrpSp = IoGetNextIrpStackLocation(ChunkIrp);
+        ChunkIrpSp->MajorFunction = IrpSp->MajorFunction;
+        ChunkIrpSp->FileObject = IrpSp->FileObject;
+        if (IsRead)
+        {
+            ChunkIrpSp->Parameters.Read.ByteOffset.QuadPart = Offset + ChunkOffset;
+            ChunkIrpSp->Parameters.Read.Length = ChunkLength;
+            ChunkIrpSp->Parameters.Read.Key = Key;
+        }
+        else
+        {
+            ChunkIrpSp->Parameters.Write.ByteOffset.QuadPart = Offset + ChunkOffset;
+            ChunkIrpSp->Parameters.Write.Length = ChunkLength;
+            ChunkIrpSp->Parameters.Write.Key = Key;
+        }
+
+        IoSetCompletionRoutine(ChunkIrp, FspSendSplitIoIrpsCompletion, Context, TRUE, TRUE, TRUE);
+
+        InterlockedIncrement(&Context->PendingCount);
+        IoCallDriver(DeviceObject, ChunkIrp);
+    }
+
+    if (0 != InterlockedDecrement(&Context->PendingCount))
+        KeWaitForSingleObject(&Context->Event, Executive, KernelMode, FALSE, 0);
+
+    if (Context->ChunkCount == Context->ShortIndex)
+    {
+        Irp->IoStatus.Information = Length;
+        Result = STATUS_SUCCESS;
+    }
+    else if (0 == Context->ShortIndex && !NT_SUCCESS(Context->ShortIoStatus.Status))
+    {
+        Irp->IoStatus.Information = 0;
+        Result = Context->ShortIoStatus.Status;
+    }
+    else
+    {
+        /* partial transfer: report the bytes transferred before the short chunk */
+        Irp->IoStatus.Information = (ULONG_PTR)Context->ShortIndex * ChunkSize +
+            (NT_SUCCESS(Context->ShortIoStatus.Status) ? Context->ShortIoStatus.Information : 0);
+        Result = STATUS_SUCCESS;
+    }
+
+    FspFree(Context);
+
+    return Result;
+}
+
+static NTSTATUS FspSendSplitIoIrpsCompletion(
+    PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context0)
+{
+    // !PAGED_CODE();
+
+    FSP_SEND_SPLIT_IO_IRPS_CONTEXT *Context = Context0;
+    PMDL ChunkMdl = Irp->MdlAddress;
+    ULONG Index = (ULONG)(((PUINT8)MmGetMdlVirtualAddress(ChunkMdl) - Context->VirtualAddress) /
+        Context->ChunkSize);
+    KIRQL Irql;
+
+    if (!NT_SUCCESS(Irp->IoStatus.Status) ||
+        MmGetMdlByteCount(ChunkMdl) > Irp->IoStatus.Information)
+    {
+        KeAcquireSpinLock(&Context->SpinLock, &Irql);
+        if (Context->ShortIndex > Index)
+        {
+            Context->ShortIndex = Index;
+            Context->ShortIoStatus = Irp->IoStatus;
+        }
+        KeReleaseSpinLock(&Context->SpinLock, Irql);
+    }
+
+    /* partial MDL's may have been mapped into system space */
+    MmPrepareMdlForReuse(ChunkMdl);
+    IoFreeMdl(ChunkMdl);
+    Irp->MdlAddress = 0;
+    IoFreeIrp(Irp);
+
+    KeReleaseSemaphore(&Context->Semaphore, 1, 1, FALSE);
+    if (0 == InterlockedDecrement(&Context->PendingCount))
+        KeSetEvent(&Context->Event, 1, FALSE);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+BOOLEAN FspIsSplitIoChunkIrp(PIRP Irp)
+{
+    PAGED_CODE();
+
+    /*
+     * FspSendSplitIoIrps marks its chunk IRPs by setting FspSendSplitIoIrpsCompletion in the
+     * stack location that it passes to us. Other recursive IRPs (e.g. non-cached reads issued
+     * by a filter while we hold resources) are not chunks and must take the regular path.
+     */
+    return FspSendSplitIoIrpsCompletion == IoGetCurrentIrpStackLocation(Irp)->CompletionRoutine;
+}
+
 NTSTATUS FspBufferUserBuffer(PIRP Irp, ULONG Length, LOCK_OPERATION Operation)
 {
     PAGED_CODE();
@@ -41,6 +41,12 @@ static NTSTATUS FspVolumeGetNameListNoLock(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 NTSTATUS FspVolumeTransact(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+static BOOLEAN FspVolumeTransactRingConsumeResponse(
+    FSP_FSCTL_TRANSACT_RING *Ring, ULONG SlotCount, FSP_FSCTL_TRANSACT_RSP *Response);
+NTSTATUS FspVolumeTransactRing(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
+NTSTATUS FspVolumeRegisterIoBuffers(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 NTSTATUS FspVolumeStop(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp);
 NTSTATUS FspVolumeWork(
@@ -60,6 +66,9 @@ NTSTATUS FspVolumeWork(
 #pragma alloc_text(PAGE, FspVolumeGetNameList)
 #pragma alloc_text(PAGE, FspVolumeGetNameListNoLock)
 #pragma alloc_text(PAGE, FspVolumeTransact)
+#pragma alloc_text(PAGE, FspVolumeTransactRingConsumeResponse)
+#pragma alloc_text(PAGE, FspVolumeTransactRing)
+#pragma alloc_text(PAGE, FspVolumeRegisterIoBuffers)
 #pragma alloc_text(PAGE, FspVolumeStop)
 #pragma alloc_text(PAGE, FspVolumeWork)
 #endif
@@ -102,6 +111,7 @@ static NTSTATUS FspVolumeCreateNoLock(
     NTSTATUS Result;
     PFILE_OBJECT FileObject = IrpSp->FileObject;
     FSP_FSCTL_VOLUME_PARAMS VolumeParams = { 0 };
+    USHORT VolumeParamsSize;
     USHORT PrefixLength = 0;
     GUID Guid;
     UNICODE_STRING DeviceSddl;
@@ -113,17 +123,28 @@ static NTSTATUS FspVolumeCreateNoLock(
     FSP_CREATE_VOLUME_REGISTER_MUP_WORK_ITEM RegisterMupWorkItem;
 
     /* check parameters */
-    if (PREFIXW_SIZE + sizeof(FSP_FSCTL_VOLUME_PARAMS) * sizeof(WCHAR) > FileObject->FileName.Length)
+    if (PREFIXW_SIZE + FSP_FSCTL_VOLUME_PARAMS_V0_SIZE * sizeof(WCHAR) > FileObject->FileName.Length)
         return STATUS_INVALID_PARAMETER;
 
-    /* copy the VolumeParams */
-    for (USHORT Index = 0, Length = sizeof(FSP_FSCTL_VOLUME_PARAMS); Length > Index; Index++)
+    /* copy the VolumeParams; an older user mode sends only the version 0 fields */
+    VolumeParamsSize = (FileObject->FileName.Length - PREFIXW_SIZE) / sizeof(WCHAR);
+    if (sizeof(FSP_FSCTL_VOLUME_PARAMS) < VolumeParamsSize)
+        VolumeParamsSize = sizeof(FSP_FSCTL_VOLUME_PARAMS);
+    for (USHORT Index = 0; VolumeParamsSize > Index; Index++)
     {
         WCHAR Value = FileObject->FileName.Buffer[PREFIXW_SIZE / sizeof(WCHAR) + Index];
         if (0xF000 != (Value & 0xFF00))
             return STATUS_INVALID_PARAMETER;
         ((PUINT8)&VolumeParams)[Index] = Value & 0xFF;
     }
+    if (sizeof(FSP_FSCTL_VOLUME_PARAMS) != VolumeParamsSize ||
+        sizeof(FSP_FSCTL_VOLUME_PARAMS) != VolumeParams.Version)
+    {
+        /* version 0 VolumeParams: every feature configured past the version 0 fields is off */
+        VolumeParams.Version = 0;
+        RtlZeroMemory((PUINT8)&VolumeParams + FSP_FSCTL_VOLUME_PARAMS_V0_SIZE,
+            sizeof(FSP_FSCTL_VOLUME_PARAMS) - FSP_FSCTL_VOLUME_PARAMS_V0_SIZE);
+    }
 
     /* check the VolumeParams */
     if (0 == VolumeParams.SectorSize)
@@ -145,6 +166,32 @@ static NTSTATUS FspVolumeCreateNoLock(
     if (FspFsctlIrpCapacityMinimum > VolumeParams.IrpCapacity ||
         VolumeParams.IrpCapacity > FspFsctlIrpCapacityMaximum)
         VolumeParams.IrpCapacity = FspFsctlIrpCapacityDefault;
+    if (0 == VolumeParams.IrpPriorityWeights[FspFsctlIrpPriorityPaging])
+        VolumeParams.IrpPriorityWeights[FspFsctlIrpPriorityPaging] =
+            FspFsctlIrpPriorityWeightPagingDefault;
+    if (0 == VolumeParams.IrpPriorityWeights[FspFsctlIrpPriorityMetadata])
+        VolumeParams.IrpPriorityWeights[FspFsctlIrpPriorityMetadata] =
+            FspFsctlIrpPriorityWeightMetadataDefault;
+    if (0 == VolumeParams.IrpPriorityWeights[FspFsctlIrpPriorityBulk])
+        VolumeParams.IrpPriorityWeights[FspFsctlIrpPriorityBulk] =
+            FspFsctlIrpPriorityWeightBulkDefault;
+    if (0 != VolumeParams.SplitIoChunkSize)
+    {
+        if (FspFsctlSplitIoChunkSizeMinimum > VolumeParams.SplitIoChunkSize)
+            VolumeParams.SplitIoChunkSize = FspFsctlSplitIoChunkSizeMinimum;
+        /* chunks must start on a sector boundary */
+        VolumeParams.SplitIoChunkSize -= VolumeParams.SplitIoChunkSize % VolumeParams.SectorSize;
+        if (0 == VolumeParams.SplitIoFanOut)
+            VolumeParams.SplitIoFanOut = FspFsctlSplitIoFanOutDefault;
+        else if (FspFsctlSplitIoFanOutMaximum < VolumeParams.SplitIoFanOut)
+            VolumeParams.SplitIoFanOut = FspFsctlSplitIoFanOutMaximum;
+    }
+    if (1 >= VolumeParams.CloseBatchSize)
+        VolumeParams.CloseBatchSize = 0;
+    else if (FspFsctlCloseBatchSizeMaximum < VolumeParams.CloseBatchSize)
+        VolumeParams.CloseBatchSize = FspFsctlCloseBatchSizeMaximum;
+    if (FspFsctlWorkerThreadCountMaximum < VolumeParams.WorkerThreadCount)
+        VolumeParams.WorkerThreadCount = FspFsctlWorkerThreadCountMaximum;
     if (FILE_DEVICE_NETWORK_FILE_SYSTEM == FsctlDeviceObject->DeviceType)
     {
         VolumeParams.Prefix[sizeof VolumeParams.Prefix / sizeof(WCHAR) - 1] = L'\0';
@@ -299,9 +346,15 @@ static VOID FspVolumeDeleteNoLock(
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
     IrpSp->FileObject->FsContext2 = 0;
 
+    /* send any batched closes while the I/O queue still accepts them */
+    FspFsvolCloseBatchFlush(FsvolDeviceObject);
+
     /* stop the I/O queue */
     FspIoqStop(FsvolDeviceExtension->Ioq);
 
+    /* unlock the preregistered I/O buffers once their last slot is freed */
+    FspIoBuffersUnregister(FsvolDeviceExtension->IoBuffers);
+
     /* do we have a virtual disk device or a MUP handle? */
     if (0 != FsvolDeviceExtension->FsvrtDeviceObject)
     {
@@ -689,6 +742,14 @@ NTSTATUS FspVolumeTransact(
         if (0 == NextResponse)
             break;
 
+        if (0 == Response->Hint && FspFsctlTransactReservedKind == Response->Kind)
+        {
+            /* credit response; see FspFsctlTransactProduceCreditResponse */
+            FspIoqSetIrpCredits(FsvolDeviceExtension->Ioq, (ULONG)Response->IoStatus.Information);
+            Response = NextResponse;
+            continue;
+        }
+
         ProcessIrp = FspIoqEndProcessingIrp(FsvolDeviceExtension->Ioq, (UINT_PTR)Response->Hint);
         if (0 == ProcessIrp)
         {
@@ -851,6 +912,343 @@ exit:
     return Result;
 }
 
+static BOOLEAN FspVolumeTransactRingConsumeResponse(
+    FSP_FSCTL_TRANSACT_RING *Ring, ULONG SlotCount, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    PAGED_CODE();
+
+    FSP_FSCTL_TRANSACT_RSP *SlotResponse;
+    LONG64 Position;
+    UINT16 Size;
+
+    for (;;)
+    {
+        SlotResponse = FspFsctlTransactRingConsumeBegin(Ring, SlotCount, &Position);
+        if (0 == SlotResponse)
+            return FALSE;
+
+        /*
+         * The ring is shared with user mode, which may modify it at any time.
+         * Capture the response size once and copy the response out of the ring
+         * before looking at it.
+         */
+        Size = *(volatile UINT16 *)&SlotResponse->Size;
+        if (sizeof(FSP_FSCTL_TRANSACT_RSP) <= Size && FSP_FSCTL_TRANSACT_RSP_SIZEMAX >= Size)
+        {
+            RtlCopyMemory(Response, SlotResponse, Size);
+            Response->Size = Size;
+        }
+        else
+            Size = 0;
+
+        FspFsctlTransactRingConsumeEnd(Ring, SlotCount, Position);
+
+        if (0 != Size)
+            return TRUE;
+
+        DEBUGLOG("BOGUS(Size=%u)", (unsigned)Size);
+    }
+}
+
+NTSTATUS FspVolumeTransactRing(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
+{
+    PAGED_CODE();
+
+    ASSERT(IRP_MJ_FILE_SYSTEM_CONTROL == IrpSp->MajorFunction);
+    ASSERT(IRP_MN_USER_FS_REQUEST == IrpSp->MinorFunction);
+    ASSERT(FSP_FSCTL_TRANSACT_RING == IrpSp->Parameters.FileSystemControl.FsControlCode);
+    ASSERT(METHOD_OUT_DIRECT == (IrpSp->Parameters.FileSystemControl.FsControlCode & 3));
+    ASSERT(0 != IrpSp->FileObject->FsContext2);
+
+    /* check parameters */
+    PDEVICE_OBJECT FsvolDeviceObject = IrpSp->FileObject->FsContext2;
+    ULONG InputBufferLength = IrpSp->Parameters.FileSystemControl.InputBufferLength;
+    ULONG OutputBufferLength = IrpSp->Parameters.FileSystemControl.OutputBufferLength;
+    FSP_FSCTL_TRANSACT_RING_PARAMS *RingParams = Irp->AssociatedIrp.SystemBuffer;
+    if (sizeof(FSP_FSCTL_TRANSACT_RING_PARAMS) > InputBufferLength || 0 == RingParams)
+        return STATUS_INVALID_PARAMETER;
+    if (FspFsctlTransactRingSize(1) * 2 > OutputBufferLength || 0 == Irp->MdlAddress)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    if (!FspDeviceReference(FsvolDeviceObject))
+        return STATUS_CANCELLED;
+
+    NTSTATUS Result;
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    PKEVENT RequestEvent = 0, ResponseEvent = 0, SpaceEvent = 0;
+    PVOID RingBuffer;
+    FSP_FSCTL_TRANSACT_RING *RequestRing, *ResponseRing;
+    ULONG SlotCount, ProducedCount;
+    BOOLEAN Reposted, CanProduce;
+    LONG64 Position;
+    FSP_FSCTL_TRANSACT_RSP *Response = 0;
+    FSP_FSCTL_TRANSACT_REQ *Request, *PendingIrpRequest;
+    PIRP ProcessIrp, PendingIrp, RetriedIrp, RepostedIrp;
+    ULONG LoopCount;
+    LARGE_INTEGER Timeout;
+    PIRP TopLevelIrp = IoGetTopLevelIrp();
+
+    RingBuffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+    if (0 == RingBuffer)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    /* capture the ring geometry once; never trust the ring header again */
+    RequestRing = RingBuffer;
+    SlotCount = *(volatile UINT32 *)&RequestRing->SlotCount;
+    if (0 == SlotCount || FSP_FSCTL_TRANSACT_RING_SLOTCOUNT_MAX < SlotCount ||
+        0 != (SlotCount & (SlotCount - 1)) ||
+        FspFsctlTransactRingSize(SlotCount) * 2 > OutputBufferLength)
+    {
+        Result = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+    ResponseRing = (PVOID)((PUINT8)RingBuffer + FspFsctlTransactRingSize(SlotCount));
+
+    Result = ObReferenceObjectByHandle((HANDLE)(UINT_PTR)RingParams->RequestEvent,
+        EVENT_MODIFY_STATE, *ExEventObjectType, UserMode, &RequestEvent, 0);
+    if (!NT_SUCCESS(Result))
+    {
+        RequestEvent = 0;
+        goto exit;
+    }
+    Result = ObReferenceObjectByHandle((HANDLE)(UINT_PTR)RingParams->ResponseEvent,
+        SYNCHRONIZE, *ExEventObjectType, UserMode, &ResponseEvent, 0);
+    if (!NT_SUCCESS(Result))
+    {
+        ResponseEvent = 0;
+        goto exit;
+    }
+    Result = ObReferenceObjectByHandle((HANDLE)(UINT_PTR)RingParams->SpaceEvent,
+        EVENT_MODIFY_STATE, *ExEventObjectType, UserMode, &SpaceEvent, 0);
+    if (!NT_SUCCESS(Result))
+    {
+        SpaceEvent = 0;
+        goto exit;
+    }
+
+    Response = FspAlloc(FSP_FSCTL_TRANSACT_RSP_SIZEMAX);
+    if (0 == Response)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    for (;;)
+    {
+        /* process any user-mode file system responses */
+        RepostedIrp = 0;
+        while (FspVolumeTransactRingConsumeResponse(ResponseRing, SlotCount, Response))
+        {
+            ProcessIrp = FspIoqEndProcessingIrp(FsvolDeviceExtension->Ioq, (UINT_PTR)Response->Hint);
+            if (0 == ProcessIrp)
+            {
+                /* either IRP was canceled or a bogus Hint was provided */
+                DEBUGLOG("BOGUS(Kind=%d, Hint=%p)", Response->Kind, (PVOID)(UINT_PTR)Response->Hint);
+                continue;
+            }
+
+            ASSERT((UINT_PTR)ProcessIrp == (UINT_PTR)Response->Hint);
+            ASSERT(FspIrpRequest(ProcessIrp)->Hint == Response->Hint);
+
+            IoSetTopLevelIrp(ProcessIrp);
+            Result = FspIopDispatchComplete(ProcessIrp, Response);
+            if (STATUS_PENDING == Result)
+            {
+                if (0 == RepostedIrp)
+                    RepostedIrp = ProcessIrp;
+            }
+        }
+
+        /* wake up any producer that found the response ring full */
+        if (InterlockedExchange(&ResponseRing->ProducerWaiting, 0))
+            KeSetEvent(SpaceEvent, 1, FALSE);
+
+        /* process any retried IRP's */
+        LoopCount = FspIoqRetriedIrpCount(FsvolDeviceExtension->Ioq);
+        while (0 < LoopCount--) /* upper bound on loop guarantees forward progress! */
+        {
+            /* get the next retried IRP, but do not go beyond the first reposted IRP! */
+            RetriedIrp = FspIoqNextCompleteIrp(FsvolDeviceExtension->Ioq, RepostedIrp);
+            if (0 == RetriedIrp)
+                break;
+
+            IoSetTopLevelIrp(RetriedIrp);
+            Result = FspIopDispatchComplete(RetriedIrp, FspIopIrpResponse(RetriedIrp));
+            if (STATUS_PENDING == Result)
+            {
+                if (0 == RepostedIrp)
+                    RepostedIrp = RetriedIrp;
+            }
+        }
+        Reposted = 0 != RepostedIrp;
+
+        /* send pending IRP's to the user-mode file system while there is room in the ring */
+        RepostedIrp = 0;
+        ProducedCount = 0;
+        LoopCount = FspIoqPendingIrpCount(FsvolDeviceExtension->Ioq);
+        while (0 < LoopCount-- && /* upper bound on loop guarantees forward progress! */
+            FspFsctlTransactRingCanProduce(RequestRing, SlotCount))
+        {
+            /* get the next pending IRP, but do not go beyond the first reposted IRP! */
+            PendingIrp = FspIoqNextPendingIrp(FsvolDeviceExtension->Ioq, RepostedIrp, 0, Irp);
+            if (0 == PendingIrp)
+                break;
+
+            PendingIrpRequest = FspIrpRequest(PendingIrp);
+
+            IoSetTopLevelIrp(PendingIrp);
+            Result = FspIopDispatchPrepare(PendingIrp, PendingIrpRequest);
+            if (STATUS_PENDING == Result)
+            {
+                if (0 == RepostedIrp)
+                    RepostedIrp = PendingIrp;
+                continue;
+            }
+            else if (!NT_SUCCESS(Result))
+            {
+                FspIopCompleteIrp(PendingIrp, Result);
+                continue;
+            }
+
+            Request = FspFsctlTransactRingProduceBegin(RequestRing, SlotCount, &Position);
+            if (0 == Request)
+            {
+                /* we are the only producer; the ring has been corrupted by user mode */
+                FspIopCompleteCanceledIrp(PendingIrp);
+                Result = STATUS_INVALID_PARAMETER;
+                goto exit;
+            }
+
+            RtlCopyMemory(Request, PendingIrpRequest, PendingIrpRequest->Size);
+
+            /*
+             * The user-mode file system may consume the request as soon as it is published.
+             * Start processing the IRP before publishing, so that a fast response finds it.
+             */
+            if (!FspIoqStartProcessingIrp(FsvolDeviceExtension->Ioq, PendingIrp))
+            {
+                /*
+                 * This can only happen if the Ioq was stopped. Abandon everything
+                 * and return STATUS_CANCELLED.
+                 */
+                ASSERT(FspIoqStopped(FsvolDeviceExtension->Ioq));
+                FspIopCompleteCanceledIrp(PendingIrp);
+                Result = STATUS_CANCELLED;
+                goto exit;
+            }
+
+            FspFsctlTransactRingProduceEnd(RequestRing, SlotCount, Position);
+            ProducedCount++;
+        }
+
+        if (0 != ProducedCount)
+            KeSetEvent(RequestEvent, 1, FALSE);
+        Reposted = Reposted || 0 != RepostedIrp;
+
+        if (FspIoqStopped(FsvolDeviceExtension->Ioq))
+        {
+            Result = STATUS_CANCELLED;
+            goto exit;
+        }
+
+        /* announce that we are about to wait and recheck the response ring */
+        InterlockedExchange(&ResponseRing->Waiting, 1);
+        if (FspFsctlTransactRingCanConsume(ResponseRing, SlotCount))
+            continue;
+
+        /*
+         * If the request ring is full there is no point in waiting for pending IRP's.
+         * Wait for the dispatcher threads to make progress instead.
+         */
+        CanProduce = FspFsctlTransactRingCanProduce(RequestRing, SlotCount);
+        Timeout.QuadPart = CanProduce && !Reposted ?
+            FsvolDeviceExtension->VolumeParams.TransactTimeout * -10000LL :
+            -(LONGLONG)FspVolumeTransactEarlyTimeout;
+            /* convert millis to nanos and make relative */
+        Result = CanProduce ?
+            FspIoqWaitPendingIrp(FsvolDeviceExtension->Ioq, ResponseEvent, &Timeout, Irp) :
+            FsRtlCancellableWaitForSingleObject(ResponseEvent, &Timeout, Irp);
+        InterlockedExchange(&ResponseRing->Waiting, 0);
+        if (STATUS_CANCELLED == Result || STATUS_THREAD_IS_TERMINATING == Result)
+        {
+            Result = STATUS_CANCELLED;
+            goto exit;
+        }
+        if (STATUS_TIMEOUT == Result && CanProduce && !Reposted &&
+            !FspFsctlTransactRingCanConsume(ResponseRing, SlotCount))
+        {
+            /* idle for TransactTimeout; let user mode know that we are still alive */
+            Result = STATUS_SUCCESS;
+            goto exit;
+        }
+    }
+
+exit:
+    Irp->IoStatus.Information = 0;
+    IoSetTopLevelIrp(TopLevelIrp);
+    if (0 != Response)
+        FspFree(Response);
+    if (0 != SpaceEvent)
+        ObDereferenceObject(SpaceEvent);
+    if (0 != ResponseEvent)
+        ObDereferenceObject(ResponseEvent);
+    if (0 != RequestEvent)
+        ObDereferenceObject(RequestEvent);
+    FspDeviceDereference(FsvolDeviceObject);
+    return Result;
+}
+
+NTSTATUS FspVolumeRegisterIoBuffers(
+    PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
+{
+    PAGED_CODE();
+
+    ASSERT(IRP_MJ_FILE_SYSTEM_CONTROL == IrpSp->MajorFunction);
+    ASSERT(IRP_MN_USER_FS_REQUEST == IrpSp->MinorFunction);
+    ASSERT(FSP_FSCTL_REGISTER_IO_BUFFERS == IrpSp->Parameters.FileSystemControl.FsControlCode);
+    ASSERT(METHOD_BUFFERED == (IrpSp->Parameters.FileSystemControl.FsControlCode & 3));
+    ASSERT(0 != IrpSp->FileObject->FsContext2);
+
+    /* check parameters */
+    PDEVICE_OBJECT FsvolDeviceObject = IrpSp->FileObject->FsContext2;
+    ULONG InputBufferLength = IrpSp->Parameters.FileSystemControl.InputBufferLength;
+    FSP_FSCTL_IO_BUFFERS_PARAMS *IoBuffersParams = Irp->AssociatedIrp.SystemBuffer;
+    if (sizeof(FSP_FSCTL_IO_BUFFERS_PARAMS) > InputBufferLength || 0 == IoBuffersParams)
+        return STATUS_INVALID_PARAMETER;
+
+    if (!FspDeviceReference(FsvolDeviceObject))
+        return STATUS_CANCELLED;
+
+    NTSTATUS Result;
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
+    FSP_IO_BUFFERS *IoBuffers;
+
+    Result = FspIoBuffersCreate(
+        IoBuffersParams->Address, IoBuffersParams->SlotSize, IoBuffersParams->SlotCount,
+        &IoBuffers);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    /* buffers can only be registered once per volume */
+    if (0 != InterlockedCompareExchangePointer(&FsvolDeviceExtension->IoBuffers, IoBuffers, 0))
+    {
+        FspIoBuffersDelete(IoBuffers);
+        Result = STATUS_INVALID_DEVICE_STATE;
+        goto exit;
+    }
+
+    Irp->IoStatus.Information = 0;
+    Result = STATUS_SUCCESS;
+
+exit:
+    FspDeviceDereference(FsvolDeviceObject);
+    return Result;
+}
+
 NTSTATUS FspVolumeStop(
     PDEVICE_OBJECT FsctlDeviceObject, PIRP Irp, PIO_STACK_LOCATION IrpSp)
 {
@@ -864,6 +1262,7 @@ NTSTATUS FspVolumeStop(
     PDEVICE_OBJECT FsvolDeviceObject = IrpSp->FileObject->FsContext2;
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
 
+    FspFsvolCloseBatchFlush(FsvolDeviceObject);
     FspIoqStop(FsvolDeviceExtension->Ioq);
 
     return STATUS_SUCCESS;
@@ -878,7 +1277,8 @@ NTSTATUS FspVolumeWork(
     ASSERT(IRP_MN_USER_FS_REQUEST == IrpSp->MinorFunction);
     ASSERT(
         FSP_FSCTL_WORK == IrpSp->Parameters.FileSystemControl.FsControlCode ||
-        FSP_FSCTL_WORK_BEST_EFFORT == IrpSp->Parameters.FileSystemControl.FsControlCode);
+        FSP_FSCTL_WORK_BEST_EFFORT == IrpSp->Parameters.FileSystemControl.FsControlCode ||
+        FSP_FSCTL_QUERY_OPEN == IrpSp->Parameters.FileSystemControl.FsControlCode);
 
     if (KernelMode != Irp->RequestorMode)
         return STATUS_INVALID_DEVICE_REQUEST;
@@ -886,13 +1286,15 @@ NTSTATUS FspVolumeWork(
     NTSTATUS Result;
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(FsvolDeviceObject);
     FSP_FSCTL_TRANSACT_REQ *Request = IrpSp->Parameters.FileSystemControl.Type3InputBuffer;
-    BOOLEAN BestEffort = FSP_FSCTL_WORK_BEST_EFFORT == IrpSp->Parameters.FileSystemControl.FsControlCode;
+    ULONG FsControlCode = IrpSp->Parameters.FileSystemControl.FsControlCode;
+    BOOLEAN BestEffort = FSP_FSCTL_WORK_BEST_EFFORT == FsControlCode;
 
     ASSERT(0 == Request->Hint);
 
     /* associate the passed Request with our Irp; acquire ownership of the Request */
     Request->Hint = (UINT_PTR)Irp;
     FspIrpSetRequest(Irp, Request);
+    FspIopSetIrpPriority(Irp);
 
     /*
      * Post the IRP to our Ioq; we do this here instead of at FSP_LEAVE_MJ time,
@@ -906,7 +1308,7 @@ NTSTATUS FspVolumeWork(
     }
 
     DEBUGLOG("%s(Irp=%p) = %s",
-        IoctlCodeSym(BestEffort ? FSP_FSCTL_WORK_BEST_EFFORT : FSP_FSCTL_WORK),
+        IoctlCodeSym(FsControlCode),
         Irp, /* referencing pointer value, which is safe despite FspIoqPostIrpEx above! */
         NtStatusSym(Result));
 
@@ -17,8 +17,175 @@
 
 #include <sys/driver.h>
 
+/*
+ * Per-volume work queue.
+ *
+ * A volume may ask for its own set of worker threads (VolumeParams.WorkerThreadCount).
+ * IRP work items (including retries) are then posted to a per-volume queue instead of
+ * the system CriticalWorkQueue, so that a slow or stalled file system cannot starve
+ * the system worker threads and other volumes, and vice versa.
+ *
+ * The queue is a simple FIFO protected by a spin lock; a semaphore counts the queued
+ * items and wakes up the threads. A thread that finds the queue empty after waking up
+ * exits; this is how the queue is stopped. The last volume reference may be released
+ * from one of the queue's own threads (when a work item completes the last IRP), so the
+ * queue is reference counted and is freed by whichever of the owner or the threads is
+ * last to let go of it.
+ */
+
+NTSTATUS FspWorkQueueCreate(ULONG ThreadCount, FSP_WORK_QUEUE **PWorkQueue);
+VOID FspWorkQueueDelete(FSP_WORK_QUEUE *WorkQueue);
+VOID FspWorkQueuePost(FSP_WORK_QUEUE *WorkQueue, PWORK_QUEUE_ITEM WorkItem);
+static KSTART_ROUTINE FspWorkQueueThread;
+static VOID FspWorkQueueDereference(FSP_WORK_QUEUE *WorkQueue);
 static VOID FspWqWorkRoutine(PVOID Context);
 
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FspWorkQueueCreate)
+#pragma alloc_text(PAGE, FspWorkQueueDelete)
+#endif
+
+enum
+{
+    FspWorkQueueThreadPriority          = 13,   /* same as the system CriticalWorkQueue */
+};
+
+NTSTATUS FspWorkQueueCreate(ULONG ThreadCount, FSP_WORK_QUEUE **PWorkQueue)
+{
+    PAGED_CODE();
+
+    NTSTATUS Result;
+    FSP_WORK_QUEUE *WorkQueue;
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    HANDLE ThreadHandle;
+
+    *PWorkQueue = 0;
+
+    if (0 == ThreadCount)
+        return STATUS_INVALID_PARAMETER;
+
+    WorkQueue = FspAllocNonPaged(sizeof *WorkQueue + ThreadCount * sizeof WorkQueue->Threads[0]);
+    if (0 == WorkQueue)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(WorkQueue, sizeof *WorkQueue + ThreadCount * sizeof WorkQueue->Threads[0]);
+    KeInitializeSpinLock(&WorkQueue->SpinLock);
+    InitializeListHead(&WorkQueue->ItemList);
+    KeInitializeSemaphore(&WorkQueue->Semaphore, 0, MAXLONG);
+    WorkQueue->RefCount = 1;
+
+    InitializeObjectAttributes(&ObjectAttributes, 0, OBJ_KERNEL_HANDLE, 0, 0);
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        InterlockedIncrement(&WorkQueue->RefCount);
+        Result = PsCreateSystemThread(&ThreadHandle, THREAD_ALL_ACCESS, &ObjectAttributes,
+            0, 0, FspWorkQueueThread, WorkQueue);
+        if (!NT_SUCCESS(Result))
+        {
+            InterlockedDecrement(&WorkQueue->RefCount);
+            FspWorkQueueDelete(WorkQueue);
+            return Result;
+        }
+
+        /* cannot fail for a kernel handle we just created */
+        ObReferenceObjectByHandle(ThreadHandle, SYNCHRONIZE, *PsThreadType, KernelMode,
+            &WorkQueue->Threads[I], 0);
+        ObCloseHandle(ThreadHandle, KernelMode);
+        WorkQueue->ThreadCount++;
+    }
+
+    *PWorkQueue = WorkQueue;
+
+    return STATUS_SUCCESS;
+}
+
+VOID FspWorkQueueDelete(FSP_WORK_QUEUE *WorkQueue)
+{
+    PAGED_CODE();
+
+    PKTHREAD CurrentThread = KeGetCurrentThread();
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&WorkQueue->SpinLock, &Irql);
+    ASSERT(IsListEmpty(&WorkQueue->ItemList));
+    WorkQueue->Stopping = TRUE;
+    KeReleaseSpinLock(&WorkQueue->SpinLock, Irql);
+
+    /* wake up every thread; each one finds the queue empty and exits */
+    if (0 != WorkQueue->ThreadCount)
+        KeReleaseSemaphore(&WorkQueue->Semaphore, 1, WorkQueue->ThreadCount, FALSE);
+
+    for (ULONG I = 0; WorkQueue->ThreadCount > I; I++)
+    {
+        /* we may be running in one of our threads; it will exit when we return */
+        if (CurrentThread != WorkQueue->Threads[I])
+            KeWaitForSingleObject(WorkQueue->Threads[I], Executive, KernelMode, FALSE, 0);
+        ObDereferenceObject(WorkQueue->Threads[I]);
+    }
+
+    DEBUGLOG("ThreadCount=%lu, DepthMax=%ld, TotalCount=%I64d",
+        WorkQueue->ThreadCount, WorkQueue->DepthMax, WorkQueue->TotalCount);
+
+    FspWorkQueueDereference(WorkQueue);
+}
+
+VOID FspWorkQueuePost(FSP_WORK_QUEUE *WorkQueue, PWORK_QUEUE_ITEM WorkItem)
+{
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&WorkQueue->SpinLock, &Irql);
+    ASSERT(!WorkQueue->Stopping);
+    InsertTailList(&WorkQueue->ItemList, &WorkItem->List);
+    if (WorkQueue->DepthMax < ++WorkQueue->Depth)
+        WorkQueue->DepthMax = WorkQueue->Depth;
+    WorkQueue->TotalCount++;
+    KeReleaseSpinLock(&WorkQueue->SpinLock, Irql);
+
+    KeReleaseSemaphore(&WorkQueue->Semaphore, 1, 1, FALSE);
+}
+
+static VOID FspWorkQueueThread(PVOID Context)
+{
+    FSP_WORK_QUEUE *WorkQueue = Context;
+    PLIST_ENTRY Entry;
+    PWORK_QUEUE_ITEM WorkItem;
+    KIRQL Irql;
+
+    KeSetPriorityThread(KeGetCurrentThread(), FspWorkQueueThreadPriority);
+
+    for (;;)
+    {
+        KeWaitForSingleObject(&WorkQueue->Semaphore, Executive, KernelMode, FALSE, 0);
+
+        KeAcquireSpinLock(&WorkQueue->SpinLock, &Irql);
+        Entry = WorkQueue->ItemList.Flink;
+        if (&WorkQueue->ItemList != Entry)
+        {
+            RemoveEntryList(Entry);
+            WorkQueue->Depth--;
+        }
+        KeReleaseSpinLock(&WorkQueue->SpinLock, Irql);
+
+        if (&WorkQueue->ItemList == Entry)
+            break;
+
+        WorkItem = CONTAINING_RECORD(Entry, WORK_QUEUE_ITEM, List);
+        WorkItem->WorkerRoutine(WorkItem->Parameter);
+
+        ASSERT(PASSIVE_LEVEL == KeGetCurrentIrql());
+    }
+
+    FspWorkQueueDereference(WorkQueue);
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static VOID FspWorkQueueDereference(FSP_WORK_QUEUE *WorkQueue)
+{
+    if (0 == InterlockedDecrement(&WorkQueue->RefCount))
+        FspFree(WorkQueue);
+}
+
 NTSTATUS FspWqCreateAndPostIrpWorkItem(PIRP Irp,
     FSP_WQ_REQUEST_WORK *WorkRoutine, FSP_IOP_REQUEST_FINI *RequestFini,
     BOOLEAN CreateAndPost)
@@ -69,8 +236,14 @@ VOID FspWqPostIrpWorkItem(PIRP Irp)
     ASSERT(RequestWorkItem->Size == sizeof *RequestWorkItem + sizeof(WORK_QUEUE_ITEM));
     ASSERT(RequestWorkItem->Hint == (UINT_PTR)Irp);
 
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(IoGetCurrentIrpStackLocation(Irp)->DeviceObject);
+
     IoMarkIrpPending(Irp);
-    ExQueueWorkItem((PWORK_QUEUE_ITEM)&RequestWorkItem->Buffer, CriticalWorkQueue);
+    if (0 != FsvolDeviceExtension->WorkQueue)
+        FspWorkQueuePost(FsvolDeviceExtension->WorkQueue, (PWORK_QUEUE_ITEM)&RequestWorkItem->Buffer);
+    else
+        ExQueueWorkItem((PWORK_QUEUE_ITEM)&RequestWorkItem->Buffer, CriticalWorkQueue);
 }
 
 static VOID FspWqWorkRoutine(PVOID Context)
@@ -134,6 +134,17 @@ static NTSTATUS FspFsvolWriteCached(
         /* if we are unable to defer we will go ahead and (try to) service the IRP now! */
     }
 
+    /* revalidate the cache if the FileNode info has expired or the cache is stale */
+    if (!FspFileNodeCacheValid(FileNode))
+    {
+        if (!CanWait)
+            return FspWqRepostIrpWorkItem(Irp, FspFsvolWriteCached, 0);
+
+        Result = FspFileNodeRevalidateCache(FileNode, FileObject);
+        if (!NT_SUCCESS(Result))
+            return Result;
+    }
+
     /* try to acquire the FileNode Main exclusive */
     Success = DEBUGTEST(90) &&
         FspFileNodeTryAcquireExclusiveF(FileNode, FspFileNodeAcquireMain, CanWait);
@@ -149,7 +160,8 @@ static NTSTATUS FspFsvolWriteCached(
 
     /* compute new file size */
     ASSERT(FspTimeoutInfinity32 ==
-        FspFsvolDeviceExtension(FsvolDeviceObject)->VolumeParams.FileInfoTimeout);
+        FspFsvolDeviceExtension(FsvolDeviceObject)->VolumeParams.FileInfoTimeout ||
+        FspFsvolDeviceExtension(FsvolDeviceObject)->VolumeParams.CacheValidation);
     FspFileNodeGetFileInfo(FileNode, &FileInfo);
     if (WriteToEndOfFile)
         WriteOffset.QuadPart = FileInfo.FileSize;
@@ -356,10 +368,30 @@ NTSTATUS FspFsvolWritePrepare(
     PAGED_CODE();
 
     NTSTATUS Result;
+    PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(IrpSp->DeviceObject);
     FSP_SAFE_MDL *SafeMdl = 0;
     PVOID Address;
     PEPROCESS Process;
 
+    /* use a preregistered I/O buffer slot if one is available; data are copied into it */
+    Address = FspIoBuffersAllocateSlot(FsvolDeviceExtension->IoBuffers, Request->Req.Write.Length);
+    if (0 != Address)
+    {
+        PVOID Buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+        if (0 == Buffer)
+        {
+            FspIoBuffersFreeSlot(FsvolDeviceExtension->IoBuffers, Address);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlCopyMemory(FspIoBuffersSlotSystemAddress(FsvolDeviceExtension->IoBuffers, Address),
+            Buffer, Request->Req.Write.Length);
+
+        Request->Req.Write.Address = (UINT64)(UINT_PTR)Address;
+        FspIopRequestContext(Request, RequestAddress) = Address;
+        return STATUS_SUCCESS;
+    }
+
     /* create a "safe" MDL if necessary */
     if (!FspSafeMdlCheck(Irp->MdlAddress))
     {
@@ -435,6 +467,10 @@ NTSTATUS FspFsvolWriteComplete(
     else
     {
         ASSERT(PagingIo);
+
+        /* keep the cache stamp current; see FspFileNodeSetCacheStamp */
+        FspFileNodeSetCacheStamp(FileNode, &Response->Rsp.Write.FileInfo);
+
         FspIopResetRequest(Request, 0);
     }
 
@@ -459,7 +495,14 @@ static VOID FspFsvolWriteNonCachedRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, P
     PVOID Address = Context[RequestAddress];
     PEPROCESS Process = Context[RequestProcess];
 
-    if (0 != Address)
+    if (0 != Address && 0 == Process)
+    {
+        ASSERT(0 != Irp);
+        FspIoBuffersFreeSlot(
+            FspFsvolDeviceExtension(IoGetCurrentIrpStackLocation(Irp)->DeviceObject)->IoBuffers,
+            Address);
+    }
+    else if (0 != Address)
     {
         KAPC_STATE ApcState;
         BOOLEAN Attach;
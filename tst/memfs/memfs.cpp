@@ -19,6 +19,7 @@
 #include "memfs.h"
 #include <sddl.h>
 #include <map>
+#include <unordered_map>
 #include <cassert>
 #include <VersionHelpers.h>
 
@@ -72,7 +73,12 @@ struct MEMFS_FILE_NODE_LESS
         return 0 > MemfsFileNameCompare(a, b);
     }
 };
-typedef std::map<PWSTR, MEMFS_FILE_NODE *, MEMFS_FILE_NODE_LESS> MEMFS_FILE_NODE_MAP;
+typedef std::unordered_map<UINT64, MEMFS_FILE_NODE *> MEMFS_FILE_NODE_INDEX;
+struct MEMFS_FILE_NODE_MAP : std::map<PWSTR, MEMFS_FILE_NODE *, MEMFS_FILE_NODE_LESS>
+{
+    /* IndexNumber -> FileNode; lets ReadDirectory resume from its Offset without a re-scan */
+    MEMFS_FILE_NODE_INDEX Index;
+};
 
 typedef struct _MEMFS
 {
@@ -171,6 +177,15 @@ MEMFS_FILE_NODE *MemfsFileNodeMapGet(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR Fil
     return iter->second;
 }
 
+static inline
+MEMFS_FILE_NODE *MemfsFileNodeMapGetByIndex(MEMFS_FILE_NODE_MAP *FileNodeMap, UINT64 IndexNumber)
+{
+    MEMFS_FILE_NODE_INDEX::iterator iter = FileNodeMap->Index.find(IndexNumber);
+    if (iter == FileNodeMap->Index.end())
+        return 0;
+    return iter->second;
+}
+
 static inline
 MEMFS_FILE_NODE *MemfsFileNodeMapGetParent(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName0,
     PNTSTATUS PResult)
@@ -199,16 +214,23 @@ static inline
 NTSTATUS MemfsFileNodeMapInsert(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
     PBOOLEAN PInserted)
 {
+    BOOLEAN IndexInserted = FALSE;
     *PInserted = 0;
     try
     {
+        IndexInserted = FileNodeMap->Index.insert(
+            MEMFS_FILE_NODE_INDEX::value_type(FileNode->FileInfo.IndexNumber, FileNode)).second;
         *PInserted = FileNodeMap->insert(MEMFS_FILE_NODE_MAP::value_type(FileNode->FileName, FileNode)).second;
         if (*PInserted)
             FileNode->RefCount++;
+        else if (IndexInserted)
+            FileNodeMap->Index.erase(FileNode->FileInfo.IndexNumber);
         return STATUS_SUCCESS;
     }
     catch (...)
     {
+        if (IndexInserted)
+            FileNodeMap->Index.erase(FileNode->FileInfo.IndexNumber);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 }
@@ -217,6 +239,7 @@ static inline
 VOID MemfsFileNodeMapRemove(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
     --FileNode->RefCount;
+    FileNodeMap->Index.erase(FileNode->FileInfo.IndexNumber);
     FileNodeMap->erase(FileNode->FileName);
 }
 
@@ -237,11 +260,12 @@ BOOLEAN MemfsFileNodeMapHasChild(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NO
 
 static inline
 BOOLEAN MemfsFileNodeMapEnumerateChildren(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
-    BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
+    PWSTR PrevFileName0, BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
 {
     WCHAR Root[2] = L"\\";
     PWSTR Remain, Suffix;
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->upper_bound(FileNode->FileName);
+    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->upper_bound(
+        0 != PrevFileName0 ? PrevFileName0 : FileNode->FileName);
     BOOLEAN Equal;
     for (; FileNodeMap->end() != iter; ++iter)
     {
@@ -863,10 +887,8 @@ static NTSTATUS SetSecurity(FSP_FILE_SYSTEM *FileSystem,
 typedef struct _MEMFS_READ_DIRECTORY_CONTEXT
 {
     PVOID Buffer;
-    UINT64 Offset;
     ULONG Length;
     PULONG PBytesTransferred;
-    BOOLEAN OffsetFound;
 } MEMFS_READ_DIRECTORY_CONTEXT;
 
 static BOOLEAN AddDirInfo(MEMFS_FILE_NODE *FileNode, PWSTR FileName,
@@ -897,12 +919,6 @@ static BOOLEAN ReadDirectoryEnumFn(MEMFS_FILE_NODE *FileNode, PVOID Context0)
 {
     MEMFS_READ_DIRECTORY_CONTEXT *Context = (MEMFS_READ_DIRECTORY_CONTEXT *)Context0;
 
-    if (0 != Context->Offset && !Context->OffsetFound)
-    {
-        Context->OffsetFound = FileNode->FileInfo.IndexNumber == Context->Offset;
-        return TRUE;
-    }
-
     return AddDirInfo(FileNode, 0,
         Context->Buffer, Context->Length, Context->PBytesTransferred);
 }
@@ -915,8 +931,9 @@ static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
-    MEMFS_FILE_NODE *ParentNode;
+    MEMFS_FILE_NODE *ParentNode, *PrevFileNode;
     MEMFS_READ_DIRECTORY_CONTEXT Context;
+    PWSTR PrevFileName = 0;
     NTSTATUS Result;
 
     ParentNode = MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileNode->FileName, &Result);
@@ -924,23 +941,37 @@ static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
         return Result;
 
     Context.Buffer = Buffer;
-    Context.Offset = Offset;
     Context.Length = Length;
     Context.PBytesTransferred = PBytesTransferred;
-    Context.OffsetFound = FALSE;
 
+    /*
+     * Offset is the NextOffset (IndexNumber) of the last entry returned: "." has the
+     * directory's IndexNumber, ".." has the parent's and any other entry has its own.
+     * Use it as a cursor and seek directly to the entry that follows it.
+     */
     if (0 == Offset)
         if (!AddDirInfo(FileNode, L".", Buffer, Length, PBytesTransferred))
             return STATUS_SUCCESS;
     if (0 == Offset || FileNode->FileInfo.IndexNumber == Offset)
     {
-        Context.OffsetFound = FileNode->FileInfo.IndexNumber == Context.Offset;
-
         if (!AddDirInfo(ParentNode, L"..", Buffer, Length, PBytesTransferred))
             return STATUS_SUCCESS;
     }
+    else if (ParentNode->FileInfo.IndexNumber != Offset)
+    {
+        PrevFileNode = MemfsFileNodeMapGetByIndex(Memfs->FileNodeMap, Offset);
+        if (0 == PrevFileNode ||
+            FileNode != MemfsFileNodeMapGetParent(Memfs->FileNodeMap, PrevFileNode->FileName, &Result))
+        {
+            /* the entry at the cursor is gone (deleted or moved away): end the listing */
+            FspFileSystemAddDirInfo(0, Buffer, Length, PBytesTransferred);
+            return STATUS_SUCCESS;
+        }
+        PrevFileName = PrevFileNode->FileName;
+    }
 
-    if (MemfsFileNodeMapEnumerateChildren(Memfs->FileNodeMap, FileNode, ReadDirectoryEnumFn, &Context))
+    if (MemfsFileNodeMapEnumerateChildren(Memfs->FileNodeMap, FileNode, PrevFileName,
+        ReadDirectoryEnumFn, &Context))
         FspFileSystemAddDirInfo(0, Buffer, Length, PBytesTransferred);
 
     return STATUS_SUCCESS;
@@ -1065,6 +1096,26 @@ static NTSTATUS DeleteReparsePoint(FSP_FILE_SYSTEM *FileSystem,
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS GetFileInfoByName(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    MEMFS_FILE_NODE *FileNode;
+    NTSTATUS Result;
+
+    FileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, FileName);
+    if (0 == FileNode)
+    {
+        Result = STATUS_OBJECT_NAME_NOT_FOUND;
+        MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileName, &Result);
+        return Result;
+    }
+
+    *FileInfo = FileNode->FileInfo;
+
+    return STATUS_SUCCESS;
+}
+
 static FSP_FILE_SYSTEM_INTERFACE MemfsInterface =
 {
     GetVolumeInfo,
@@ -1090,6 +1141,11 @@ static FSP_FILE_SYSTEM_INTERFACE MemfsInterface =
     GetReparsePoint,
     SetReparsePoint,
     DeleteReparsePoint,
+    0,                                  /* ReadEx */
+    0,                                  /* WriteEx */
+    0,                                  /* ReadAhead */
+    0,                                  /* CloseBatch */
+    GetFileInfoByName,
 };
 
 NTSTATUS MemfsCreate(
@@ -1141,11 +1197,13 @@ NTSTATUS MemfsCreate(
     }
 
     memset(&VolumeParams, 0, sizeof VolumeParams);
+    VolumeParams.Version = sizeof VolumeParams;
     VolumeParams.SectorSize = MEMFS_SECTOR_SIZE;
     VolumeParams.SectorsPerAllocationUnit = MEMFS_SECTORS_PER_ALLOCATION_UNIT;
     VolumeParams.VolumeCreationTime = MemfsGetSystemTime();
     VolumeParams.VolumeSerialNumber = (UINT32)(MemfsGetSystemTime() / (10000 * 1000));
     VolumeParams.FileInfoTimeout = FileInfoTimeout;
+    VolumeParams.NegativeLookupTimeout = (Flags & MemfsNegativeLookup) ? FileInfoTimeout : 0;
     VolumeParams.CaseSensitiveSearch = 1;
     VolumeParams.CasePreservedNames = 1;
     VolumeParams.UnicodeOnDisk = 1;
@@ -1153,6 +1211,12 @@ NTSTATUS MemfsCreate(
     VolumeParams.ReparsePoints = 1;
     VolumeParams.ReparsePointsAccessCheck = 0;
     VolumeParams.PostCleanupOnDeleteOnly = 1;
+    VolumeParams.CacheValidation = !!(Flags & MemfsCacheValidation);
+    VolumeParams.SplitIoChunkSize = (Flags & MemfsSplitIo) ? 256 * 1024 : 0;
+    VolumeParams.CloseBatchSize = (Flags & MemfsCloseBatch) ? 64 : 0;
+    VolumeParams.QueryOpen = !!(Flags & MemfsQueryOpen);
+    VolumeParams.PatchDirInfo = !!(Flags & MemfsPatchDirInfo);
+    VolumeParams.WorkerThreadCount = (Flags & MemfsWorkerThreads) ? 4 : 0;
     if (0 != VolumePrefix)
         wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR), VolumePrefix);
     wcscpy_s(VolumeParams.FileSystemName, sizeof VolumeParams.FileSystemName / sizeof(WCHAR), L"MEMFS");
@@ -30,6 +30,13 @@ enum
 {
     MemfsDisk                           = 0x00,
     MemfsNet                            = 0x01,
+    MemfsNegativeLookup                 = 0x02,
+    MemfsCacheValidation                = 0x04,
+    MemfsSplitIo                        = 0x08,
+    MemfsCloseBatch                     = 0x10,
+    MemfsQueryOpen                      = 0x20,
+    MemfsWorkerThreads                  = 0x40,
+    MemfsPatchDirInfo                   = 0x80,
 };
 
 NTSTATUS MemfsCreate(
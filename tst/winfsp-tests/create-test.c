@@ -1,5 +1,6 @@
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
+#include <process.h>
 #include <sddl.h>
 #include <strsafe.h>
 #include "memfs.h"
@@ -455,6 +456,708 @@ void create_curdir_test(void)
         create_curdir_dotest(MemfsNet, L"\\\\memfs\\share");
 }
 
+static volatile LONG create_negative_dotest_create_count;
+
+static NTSTATUS create_negative_dotest_create(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    InterlockedIncrement(&create_negative_dotest_create_count);
+    return FspFileSystemOpCreate(FileSystem, Request, Response);
+}
+
+static ULONG create_negative_dotest(ULONG Flags, PWSTR Prefix, ULONG FileInfoTimeout)
+{
+    /* names that Explorer, the loader and build tools commonly probe for */
+    static PWSTR ProbeNames[] =
+    {
+        L"desktop.ini", L"Autorun.inf", L".git", L"version.dll",
+        L"dir1\\desktop.ini", L"dir1\\.git", L"dir1\\Directory.Build.props",
+    };
+    void *memfs = memfs_start_ex(Flags, FileInfoTimeout);
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH], FilePath2[MAX_PATH];
+    ULONG CreateCount;
+
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactCreateKind,
+        create_negative_dotest_create);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    Success = CreateDirectoryW(FilePath, 0);
+    ASSERT(Success);
+
+    InterlockedExchange(&create_negative_dotest_create_count, 0);
+    for (ULONG Round = 0; 10 > Round; Round++)
+        for (ULONG I = 0; sizeof ProbeNames / sizeof ProbeNames[0] > I; I++)
+        {
+            StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\%s",
+                Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs),
+                ProbeNames[I]);
+            Handle = CreateFileW(FilePath,
+                GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+            ASSERT(INVALID_HANDLE_VALUE == Handle);
+            ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+        }
+    CreateCount = create_negative_dotest_create_count;
+
+    /* a probed name that is then created must be found */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\desktop.ini",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    Handle = CreateFileW(FilePath,
+        GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    /* a probed name that is then the target of a rename must be found */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    StringCbPrintfW(FilePath2, sizeof FilePath2, L"%s%s\\dir1\\.git",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    Handle = CreateFileW(FilePath,
+        GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+    Success = MoveFileExW(FilePath, FilePath2, 0);
+    ASSERT(Success);
+    Handle = CreateFileW(FilePath2,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\dir1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    Success = RemoveDirectoryW(FilePath);
+    ASSERT(Success);
+
+    memfs_stop(memfs);
+
+    return CreateCount;
+}
+
+void create_negative_test(void)
+{
+    ULONG UncachedCount, CachedCount;
+
+    if (WinFspDiskTests)
+    {
+        UncachedCount = create_negative_dotest(MemfsDisk, 0, 1000);
+        CachedCount = create_negative_dotest(MemfsDisk | MemfsNegativeLookup, 0, 1000);
+        ASSERT(10 * 7 <= UncachedCount);
+        ASSERT(CachedCount < UncachedCount);
+        FspDebugLog(__FUNCTION__ ": disk probe round trips: uncached=%u cached=%u\n",
+            UncachedCount, CachedCount);
+    }
+    if (WinFspNetTests)
+    {
+        UncachedCount = create_negative_dotest(MemfsNet, L"\\\\memfs\\share", 1000);
+        CachedCount = create_negative_dotest(MemfsNet | MemfsNegativeLookup, L"\\\\memfs\\share", 1000);
+        ASSERT(10 * 7 <= UncachedCount);
+        ASSERT(CachedCount < UncachedCount);
+        FspDebugLog(__FUNCTION__ ": net probe round trips: uncached=%u cached=%u\n",
+            UncachedCount, CachedCount);
+    }
+}
+
+static volatile LONG create_closebatch_dotest_request_count;
+static volatile LONG create_closebatch_dotest_close_count;
+
+static NTSTATUS create_closebatch_dotest_close(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    InterlockedIncrement(&create_closebatch_dotest_request_count);
+    InterlockedIncrement(&create_closebatch_dotest_close_count);
+    return FspFileSystemOpClose(FileSystem, Request, Response);
+}
+
+static NTSTATUS create_closebatch_dotest_closebatch(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    InterlockedIncrement(&create_closebatch_dotest_request_count);
+    InterlockedExchangeAdd(&create_closebatch_dotest_close_count, Request->Req.CloseBatch.Count);
+    return FspFileSystemOpCloseBatch(FileSystem, Request, Response);
+}
+
+static void create_closebatch_dotest(ULONG Flags, PWSTR Prefix)
+{
+    void *memfs = memfs_create(Flags, INFINITE, 1024, 1024 * 1024);
+
+    HANDLE Handle;
+    WCHAR FilePath[MAX_PATH];
+    ULONG OpenCount = 1000;
+    LONG CloseCount;
+
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactCloseKind,
+        create_closebatch_dotest_close);
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactCloseBatchKind,
+        create_closebatch_dotest_closebatch);
+
+    memfs_start_dispatcher(memfs, 0);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    /* wait for the create's close; it may be batched */
+    for (ULONG I = 0; 100 > I && 1 > create_closebatch_dotest_close_count; I++)
+        Sleep(50);
+    ASSERT(1 <= create_closebatch_dotest_close_count);
+
+    InterlockedExchange(&create_closebatch_dotest_request_count, 0);
+    InterlockedExchange(&create_closebatch_dotest_close_count, 0);
+
+    /* open/close storm */
+    for (ULONG I = 0; OpenCount > I; I++)
+    {
+        Handle = CreateFileW(FilePath,
+            FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+        CloseHandle(Handle);
+    }
+
+    /* every close must eventually be delivered; a partial batch is sent within a few seconds */
+    for (ULONG I = 0; 100 > I && (LONG)OpenCount > create_closebatch_dotest_close_count; I++)
+        Sleep(50);
+    CloseCount = create_closebatch_dotest_close_count;
+    ASSERT((LONG)OpenCount <= CloseCount);
+    if (Flags & MemfsCloseBatch)
+        ASSERT(CloseCount / 64 + 2 >= create_closebatch_dotest_request_count);
+    else
+        ASSERT(CloseCount == create_closebatch_dotest_request_count);
+
+    ASSERT(DeleteFileW(FilePath));
+
+    memfs_stop(memfs);
+}
+
+void create_closebatch_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        create_closebatch_dotest(MemfsDisk | MemfsCloseBatch, 0);
+        create_closebatch_dotest(MemfsDisk, 0);
+    }
+    if (WinFspNetTests)
+    {
+        create_closebatch_dotest(MemfsNet | MemfsCloseBatch, L"\\\\memfs\\share");
+        create_closebatch_dotest(MemfsNet, L"\\\\memfs\\share");
+    }
+}
+
+static volatile LONG create_queryopen_dotest_create_count;
+static volatile LONG create_queryopen_dotest_queryopen_count;
+
+static NTSTATUS create_queryopen_dotest_create(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    InterlockedIncrement(&create_queryopen_dotest_create_count);
+    return FspFileSystemOpCreate(FileSystem, Request, Response);
+}
+
+static NTSTATUS create_queryopen_dotest_queryopen(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    InterlockedIncrement(&create_queryopen_dotest_queryopen_count);
+    return FspFileSystemOpQueryOpen(FileSystem, Request, Response);
+}
+
+static void create_queryopen_dotest(ULONG Flags, PWSTR Prefix)
+{
+    void *memfs = memfs_create(Flags, INFINITE, 1024, 1024 * 1024);
+
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH], DirPath[MAX_PATH], MissingPath[MAX_PATH];
+    WIN32_FILE_ATTRIBUTE_DATA AttributeData;
+    BY_HANDLE_FILE_INFORMATION FileInfo;
+    ULONG ProbeCount = 1000;
+    DWORD BytesTransferred;
+
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactCreateKind,
+        create_queryopen_dotest_create);
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactQueryOpenKind,
+        create_queryopen_dotest_queryopen);
+
+    memfs_start_dispatcher(memfs, 0);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    StringCbPrintfW(DirPath, sizeof DirPath, L"%s%s\\dir1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    StringCbPrintfW(MissingPath, sizeof MissingPath, L"%s%s\\dir1\\missing",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    Success = WriteFile(Handle, "hello", 5, &BytesTransferred, 0);
+    ASSERT(Success);
+    Success = GetFileInformationByHandle(Handle, &FileInfo);
+    ASSERT(Success);
+    CloseHandle(Handle);
+
+    Success = CreateDirectoryW(DirPath, 0);
+    ASSERT(Success);
+
+    /* an attribute probe sees the same information as an open handle */
+    Success = GetFileAttributesExW(FilePath, GetFileExInfoStandard, &AttributeData);
+    ASSERT(Success);
+    ASSERT(FileInfo.dwFileAttributes == AttributeData.dwFileAttributes);
+    ASSERT(5 == AttributeData.nFileSizeLow && 0 == AttributeData.nFileSizeHigh);
+    ASSERT(FileInfo.ftCreationTime.dwLowDateTime == AttributeData.ftCreationTime.dwLowDateTime);
+    ASSERT(FileInfo.ftCreationTime.dwHighDateTime == AttributeData.ftCreationTime.dwHighDateTime);
+
+    ASSERT(FILE_ATTRIBUTE_DIRECTORY & GetFileAttributesW(DirPath));
+    ASSERT(INVALID_FILE_ATTRIBUTES == GetFileAttributesW(MissingPath));
+    ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+
+    /* a probe of an open file is answered from its FileNode or by the regular create */
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    ASSERT(FileInfo.dwFileAttributes == GetFileAttributesW(FilePath));
+    CloseHandle(Handle);
+
+    InterlockedExchange(&create_queryopen_dotest_create_count, 0);
+    InterlockedExchange(&create_queryopen_dotest_queryopen_count, 0);
+
+    /* attribute-probe storm */
+    for (ULONG I = 0; ProbeCount > I; I++)
+    {
+        ASSERT(FileInfo.dwFileAttributes == GetFileAttributesW(FilePath));
+        ASSERT(FILE_ATTRIBUTE_DIRECTORY & GetFileAttributesW(DirPath));
+        ASSERT(INVALID_FILE_ATTRIBUTES == GetFileAttributesW(MissingPath));
+    }
+
+    /*
+     * The I/O manager only tries FastIoQueryOpen on the device that owns the name; probes
+     * through the MUP (or a filter that disables fast I/O) still arrive as regular opens.
+     */
+    if (Flags & MemfsQueryOpen)
+    {
+        if (!(Flags & MemfsNet))
+            ASSERT(ProbeCount / 2 > (ULONG)create_queryopen_dotest_create_count);
+    }
+    else
+    {
+        ASSERT(0 == create_queryopen_dotest_queryopen_count);
+        ASSERT(ProbeCount * 2 <= (ULONG)create_queryopen_dotest_create_count);
+    }
+
+    ASSERT(RemoveDirectoryW(DirPath));
+    ASSERT(DeleteFileW(FilePath));
+
+    memfs_stop(memfs);
+}
+
+void create_queryopen_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        create_queryopen_dotest(MemfsDisk | MemfsQueryOpen, 0);
+        create_queryopen_dotest(MemfsDisk, 0);
+    }
+    if (WinFspNetTests)
+    {
+        create_queryopen_dotest(MemfsNet | MemfsQueryOpen, L"\\\\memfs\\share");
+        create_queryopen_dotest(MemfsNet, L"\\\\memfs\\share");
+    }
+}
+
+static void create_fileinfocache_dotest(ULONG Flags, PWSTR Prefix)
+{
+    void *memfs = memfs_create(Flags, INFINITE, 1024, 1024 * 1024);
+
+    HANDLE Handle, Token, RestrictedToken, ImpersonationToken;
+    BOOL Success;
+    WCHAR RootPath[MAX_PATH], FilePath[MAX_PATH], NewFilePath[MAX_PATH];
+    WIN32_FILE_ATTRIBUTE_DATA AttributeData;
+    SECURITY_ATTRIBUTES SecurityAttributes = { sizeof SecurityAttributes };
+    SID_AND_ATTRIBUTES RestrictingSid = { 0 };
+    ULONG DirCount = 10, FileCount = 50, PassCount = 10;
+    LONG QueryOpenCount[2];
+    DWORD BytesTransferred;
+
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactCreateKind,
+        create_queryopen_dotest_create);
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactQueryOpenKind,
+        create_queryopen_dotest_queryopen);
+
+    memfs_start_dispatcher(memfs, 0);
+
+    StringCbPrintfW(RootPath, sizeof RootPath, L"%s%s",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    /* a small working tree */
+    for (ULONG I = 0; DirCount > I; I++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\dir%u", RootPath, I);
+        Success = CreateDirectoryW(FilePath, 0);
+        ASSERT(Success);
+        for (ULONG J = 0; FileCount > J; J++)
+        {
+            StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\dir%u\\file%u", RootPath, I, J);
+            Handle = CreateFileW(FilePath,
+                GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+                CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+            ASSERT(INVALID_HANDLE_VALUE != Handle);
+            Success = WriteFile(Handle, FilePath, J, &BytesTransferred, 0);
+            ASSERT(Success);
+            CloseHandle(Handle);
+        }
+    }
+
+    /*
+     * Replay a "git status"-like trace: stat every directory and every file of the tree,
+     * several times over. The first pass fills the file info cache; later passes should
+     * not need the file system.
+     */
+    for (ULONG K = 0; 2 > K; K++)
+    {
+        InterlockedExchange(&create_queryopen_dotest_create_count, 0);
+        InterlockedExchange(&create_queryopen_dotest_queryopen_count, 0);
+
+        for (ULONG P = 0; (0 == K ? 1 : PassCount) > P; P++)
+            for (ULONG I = 0; DirCount > I; I++)
+            {
+                StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\dir%u", RootPath, I);
+                ASSERT(FILE_ATTRIBUTE_DIRECTORY & GetFileAttributesW(FilePath));
+                for (ULONG J = 0; FileCount > J; J++)
+                {
+                    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\dir%u\\file%u", RootPath, I, J);
+                    Success = GetFileAttributesExW(FilePath, GetFileExInfoStandard, &AttributeData);
+                    ASSERT(Success);
+                    ASSERT(J == AttributeData.nFileSizeLow && 0 == AttributeData.nFileSizeHigh);
+                }
+            }
+
+        QueryOpenCount[K] = create_queryopen_dotest_queryopen_count;
+    }
+
+    /* see create_queryopen_dotest for why this is not asserted on network volumes */
+    if ((Flags & MemfsQueryOpen) && !(Flags & MemfsNet))
+    {
+        ASSERT((LONG)(DirCount * (FileCount + 1)) <= QueryOpenCount[0]);
+        ASSERT((LONG)(DirCount * (FileCount + 1)) > QueryOpenCount[1]);
+    }
+
+    /*
+     * A restricted token shares the logon session of the token it was derived from; it must
+     * not be answered from cache items that the file system granted to the unrestricted token.
+     */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\restricted", RootPath);
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(L"D:P(A;;GA;;;WD)",
+        SDDL_REVISION_1, &SecurityAttributes.lpSecurityDescriptor, 0);
+    ASSERT(Success);
+    Handle = CreateFileW(FilePath,
+        GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, &SecurityAttributes,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+    LocalFree(SecurityAttributes.lpSecurityDescriptor);
+    ASSERT(INVALID_FILE_ATTRIBUTES != GetFileAttributesW(FilePath));
+
+    /* the restricted check only sees Anonymous, which the file does not grant */
+    Success = ConvertStringSidToSidW(L"AN", &RestrictingSid.Sid);
+    ASSERT(Success);
+    Success = OpenProcessToken(GetCurrentProcess(), TOKEN_DUPLICATE | TOKEN_QUERY, &Token);
+    ASSERT(Success);
+    Success = CreateRestrictedToken(Token, 0, 0, 0, 0, 0, 1, &RestrictingSid, &RestrictedToken);
+    ASSERT(Success);
+    Success = DuplicateToken(RestrictedToken, SecurityImpersonation, &ImpersonationToken);
+    ASSERT(Success);
+    Success = SetThreadToken(0, ImpersonationToken);
+    ASSERT(Success);
+    ASSERT(INVALID_FILE_ATTRIBUTES == GetFileAttributesW(FilePath));
+    ASSERT(ERROR_ACCESS_DENIED == GetLastError());
+    Success = RevertToSelf();
+    ASSERT(Success);
+    CloseHandle(ImpersonationToken);
+    CloseHandle(RestrictedToken);
+    CloseHandle(Token);
+    LocalFree(RestrictingSid.Sid);
+
+    ASSERT(INVALID_FILE_ATTRIBUTES != GetFileAttributesW(FilePath));
+    Success = DeleteFileW(FilePath);
+    ASSERT(Success);
+
+    /* a write through an open handle is seen once the handle is closed */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\dir0\\file1", RootPath);
+    Handle = CreateFileW(FilePath,
+        GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    Success = WriteFile(Handle, "0123456789", 10, &BytesTransferred, 0);
+    ASSERT(Success);
+    Success = GetFileAttributesExW(FilePath, GetFileExInfoStandard, &AttributeData);
+    ASSERT(Success);
+    ASSERT(10 == AttributeData.nFileSizeLow);
+    CloseHandle(Handle);
+    Success = GetFileAttributesExW(FilePath, GetFileExInfoStandard, &AttributeData);
+    ASSERT(Success);
+    ASSERT(10 == AttributeData.nFileSizeLow);
+
+    Success = SetFileAttributesW(FilePath, FILE_ATTRIBUTE_HIDDEN);
+    ASSERT(Success);
+    ASSERT(FILE_ATTRIBUTE_HIDDEN == GetFileAttributesW(FilePath));
+    Success = SetFileAttributesW(FilePath, FILE_ATTRIBUTE_NORMAL);
+    ASSERT(Success);
+
+    /* renames and deletes are seen immediately */
+    StringCbPrintfW(NewFilePath, sizeof NewFilePath, L"%s\\dir1\\renamed", RootPath);
+    Success = MoveFileExW(FilePath, NewFilePath, 0);
+    ASSERT(Success);
+    ASSERT(INVALID_FILE_ATTRIBUTES == GetFileAttributesW(FilePath));
+    ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+    Success = GetFileAttributesExW(NewFilePath, GetFileExInfoStandard, &AttributeData);
+    ASSERT(Success);
+    ASSERT(10 == AttributeData.nFileSizeLow);
+    Success = DeleteFileW(NewFilePath);
+    ASSERT(Success);
+    ASSERT(INVALID_FILE_ATTRIBUTES == GetFileAttributesW(NewFilePath));
+    ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+
+    /* files below a renamed directory move with it */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\dir2", RootPath);
+    StringCbPrintfW(NewFilePath, sizeof NewFilePath, L"%s\\renamed", RootPath);
+    Success = MoveFileExW(FilePath, NewFilePath, 0);
+    ASSERT(Success);
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\dir2\\file3", RootPath);
+    ASSERT(INVALID_FILE_ATTRIBUTES == GetFileAttributesW(FilePath));
+    StringCbPrintfW(NewFilePath, sizeof NewFilePath, L"%s\\renamed\\file3", RootPath);
+    Success = GetFileAttributesExW(NewFilePath, GetFileExInfoStandard, &AttributeData);
+    ASSERT(Success);
+    ASSERT(3 == AttributeData.nFileSizeLow);
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\dir2", RootPath);
+    StringCbPrintfW(NewFilePath, sizeof NewFilePath, L"%s\\renamed", RootPath);
+    Success = MoveFileExW(NewFilePath, FilePath, 0);
+    ASSERT(Success);
+
+    for (ULONG I = 0; DirCount > I; I++)
+    {
+        for (ULONG J = 0; FileCount > J; J++)
+        {
+            if (0 == I && 1 == J)
+                continue;
+            StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\dir%u\\file%u", RootPath, I, J);
+            Success = DeleteFileW(FilePath);
+            ASSERT(Success);
+        }
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\dir%u", RootPath, I);
+        Success = RemoveDirectoryW(FilePath);
+        ASSERT(Success);
+    }
+
+    memfs_stop(memfs);
+}
+
+void create_fileinfocache_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        create_fileinfocache_dotest(MemfsDisk | MemfsQueryOpen, 0);
+        create_fileinfocache_dotest(MemfsDisk, 0);
+    }
+    if (WinFspNetTests)
+    {
+        create_fileinfocache_dotest(MemfsNet | MemfsQueryOpen, L"\\\\memfs\\share");
+        create_fileinfocache_dotest(MemfsNet, L"\\\\memfs\\share");
+    }
+}
+
+typedef struct
+{
+    PWSTR RootPath;
+    ULONG Index;
+} CREATE_CTXTAB_DOTEST_DATA;
+
+static unsigned __stdcall create_ctxtab_dotest_thread(void *Data0)
+{
+    CREATE_CTXTAB_DOTEST_DATA *Data = Data0;
+    WCHAR DirPath[MAX_PATH], NewDirPath[MAX_PATH], FilePath[MAX_PATH];
+    HANDLE Handles[32], Handle;
+    ULONG Error = 0;
+
+    StringCbPrintfW(DirPath, sizeof DirPath, L"%s\\t%u", Data->RootPath, Data->Index);
+    StringCbPrintfW(NewDirPath, sizeof NewDirPath, L"%s\\u%u", Data->RootPath, Data->Index);
+
+    if (!CreateDirectoryW(DirPath, 0))
+        return GetLastError();
+
+    for (ULONG K = 0; 20 > K && 0 == Error; K++)
+    {
+        /* open many files at once; every open and close goes through the ContextByNameTable */
+        for (ULONG J = 0; sizeof Handles / sizeof Handles[0] > J; J++)
+        {
+            StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\f%u", DirPath, J);
+            Handles[J] = CreateFileW(FilePath,
+                GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+                OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+            if (INVALID_HANDLE_VALUE == Handles[J])
+                return GetLastError();
+        }
+
+        /* a directory with open files below it cannot be renamed */
+        if (MoveFileExW(DirPath, NewDirPath, 0) || ERROR_ACCESS_DENIED != GetLastError())
+            Error = ERROR_INVALID_STATE;
+
+        for (ULONG J = 0; sizeof Handles / sizeof Handles[0] > J; J++)
+            CloseHandle(Handles[J]);
+        if (0 != Error)
+            break;
+
+        /* once the files are closed it can; names below it follow */
+        if (!MoveFileExW(DirPath, NewDirPath, 0))
+            return GetLastError();
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\f%u", NewDirPath, K % 32);
+        Handle = CreateFileW(FilePath,
+            GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+        CloseHandle(Handle);
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\f%u", DirPath, K % 32);
+        if (INVALID_FILE_ATTRIBUTES != GetFileAttributesW(FilePath) ||
+            ERROR_PATH_NOT_FOUND != GetLastError())
+            Error = ERROR_INVALID_STATE;
+        if (!MoveFileExW(NewDirPath, DirPath, 0))
+            return GetLastError();
+    }
+
+    for (ULONG J = 0; sizeof Handles / sizeof Handles[0] > J; J++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\f%u", DirPath, J);
+        DeleteFileW(FilePath);
+    }
+    if (!RemoveDirectoryW(DirPath) && 0 == Error)
+        Error = GetLastError();
+
+    return Error;
+}
+
+static void create_ctxtab_dotest(ULONG Flags, PWSTR Prefix)
+{
+    void *memfs = memfs_create(Flags, 1000, 8192, 1024 * 1024);
+
+    WCHAR RootPath[MAX_PATH];
+    static CREATE_CTXTAB_DOTEST_DATA Data[8];
+    HANDLE Threads[8];
+    DWORD ExitCode;
+
+    memfs_start_dispatcher(memfs, 0);
+
+    StringCbPrintfW(RootPath, sizeof RootPath, L"%s%s",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    /* concurrent opens, closes and directory renames */
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        Data[I].RootPath = RootPath;
+        Data[I].Index = I;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, create_ctxtab_dotest_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(0 == ExitCode);
+    }
+
+    memfs_stop(memfs);
+}
+
+void create_ctxtab_test(void)
+{
+    if (WinFspDiskTests)
+        create_ctxtab_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        create_ctxtab_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+static void create_ctxtab_perf_dotest(ULONG Flags, PWSTR Prefix)
+{
+    void *memfs = memfs_create(Flags, 1000, 8192, 1024 * 1024);
+
+    WCHAR RootPath[MAX_PATH], FilePath[MAX_PATH];
+    static HANDLE Handles[4096];
+    HANDLE Handle;
+    DWORD Ticks[2];
+    ULONG OpenCount = 10000;
+
+    memfs_start_dispatcher(memfs, 0);
+
+    StringCbPrintfW(RootPath, sizeof RootPath, L"%s%s",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    /* open/close throughput with few and with many other files open */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file", RootPath);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    for (ULONG K = 0; 2 > K; K++)
+    {
+        if (1 == K)
+            for (ULONG J = 0; sizeof Handles / sizeof Handles[0] > J; J++)
+            {
+                StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\open%u", RootPath, J);
+                Handles[J] = CreateFileW(FilePath,
+                    GENERIC_READ | GENERIC_WRITE, 0, 0,
+                    CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+                ASSERT(INVALID_HANDLE_VALUE != Handles[J]);
+            }
+
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file", RootPath);
+        Ticks[K] = GetTickCount();
+        for (ULONG I = 0; OpenCount > I; I++)
+        {
+            Handle = CreateFileW(FilePath,
+                GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+            ASSERT(INVALID_HANDLE_VALUE != Handle);
+            CloseHandle(Handle);
+        }
+        Ticks[K] = GetTickCount() - Ticks[K];
+    }
+
+    FspDebugLog(__FUNCTION__ "(Flags=%lx): %lu opens: %u ms (1 file open), %u ms (%u files open)\n",
+        Flags, OpenCount, Ticks[0], Ticks[1], (ULONG)(sizeof Handles / sizeof Handles[0] + 1));
+
+    for (ULONG J = 0; sizeof Handles / sizeof Handles[0] > J; J++)
+        CloseHandle(Handles[J]);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file", RootPath);
+    ASSERT(DeleteFileW(FilePath));
+
+    memfs_stop(memfs);
+}
+
+void create_ctxtab_perf_test(void)
+{
+    if (WinFspDiskTests)
+        create_ctxtab_perf_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        create_ctxtab_perf_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
 void create_tests(void)
 {
     TEST(create_test);
@@ -462,4 +1165,10 @@ void create_tests(void)
     TEST(create_sd_test);
     TEST(create_share_test);
     TEST(create_curdir_test);
+    TEST(create_negative_test);
+    TEST(create_closebatch_test);
+    TEST(create_queryopen_test);
+    TEST(create_fileinfocache_test);
+    TEST(create_ctxtab_test);
+    TEST_OPT(create_ctxtab_perf_test);
 }
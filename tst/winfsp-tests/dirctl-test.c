@@ -328,9 +328,617 @@ void dirnotify_test(void)
     }
 }
 
+typedef struct
+{
+    PWSTR FilePath;
+    ULONG FileCount;
+} QUERYDIR_CURSOR_DOTEST_DATA;
+
+static unsigned __stdcall querydir_cursor_dotest_thread(void *Data0)
+{
+    QUERYDIR_CURSOR_DOTEST_DATA *Data = Data0;
+    WCHAR FileName[MAX_PATH];
+    HANDLE Handle;
+
+    for (ULONG I = 0; Data->FileCount > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"%s%u", Data->FilePath, I);
+        Handle = CreateFileW(FileName,
+            GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+        CloseHandle(Handle);
+    }
+
+    return 0;
+}
+
+static void querydir_cursor_dotest(ULONG Flags, PWSTR Prefix, ULONG FileCount, BOOLEAN LatencyCheck)
+{
+    /* FileInfoTimeout of 0: no DirInfo cache; every page is a request to the file system */
+    void *memfs = memfs_create(Flags, 0, FileCount + 1024, 1024 * 1024);
+
+    WCHAR DirPath[MAX_PATH], FilePath[8][MAX_PATH], FileName[MAX_PATH];
+    QUERYDIR_CURSOR_DOTEST_DATA Data[8];
+    HANDLE Threads[8], Handle;
+    DWORD ExitCode;
+    static UINT8 Buffer[16 * 1024];
+    static UINT8 Seen[8][8 * 1024];
+    static ULONG Latency[4096];
+    ULONG PageCount = 0, EntryCount = 0, DotCount = 0, First, Last, T, J;
+    FILE_ID_BOTH_DIR_INFO *DirInfo;
+    PWSTR P;
+    BOOL Success;
+    LARGE_INTEGER Frequency, Start, Stop;
+
+    ASSERT(0 == FileCount % 8 && sizeof Seen[0] >= FileCount / 8);
+    memset(Seen, 0, sizeof Seen);
+
+    QueryPerformanceFrequency(&Frequency);
+
+    memfs_start_dispatcher(memfs, 0);
+
+    StringCbPrintfW(DirPath, sizeof DirPath, L"%s%s\\dir",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    Success = CreateDirectoryW(DirPath, 0);
+    ASSERT(Success);
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        StringCbPrintfW(FilePath[I], sizeof FilePath[I], L"%s\\file%u_", DirPath, I);
+        Data[I].FilePath = FilePath[I];
+        Data[I].FileCount = FileCount / 8;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, querydir_cursor_dotest_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(0 == ExitCode);
+    }
+
+    Handle = CreateFileW(DirPath,
+        FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+        OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    /* list the directory page by page; every file must be returned exactly once */
+    for (;;)
+    {
+        QueryPerformanceCounter(&Start);
+        Success = GetFileInformationByHandleEx(Handle,
+            0 == PageCount ? FileIdBothDirectoryRestartInfo : FileIdBothDirectoryInfo,
+            Buffer, sizeof Buffer);
+        QueryPerformanceCounter(&Stop);
+        if (!Success)
+        {
+            ASSERT(ERROR_NO_MORE_FILES == GetLastError());
+            break;
+        }
+
+        ASSERT(sizeof Latency / sizeof Latency[0] > PageCount);
+        Latency[PageCount++] = (ULONG)((Stop.QuadPart - Start.QuadPart) * 1000000 / Frequency.QuadPart);
+
+        for (DirInfo = (PVOID)Buffer;; DirInfo = (PVOID)((PUINT8)DirInfo + DirInfo->NextEntryOffset))
+        {
+            ASSERT(sizeof FileName > DirInfo->FileNameLength);
+            memcpy(FileName, DirInfo->FileName, DirInfo->FileNameLength);
+            FileName[DirInfo->FileNameLength / sizeof(WCHAR)] = L'\0';
+
+            EntryCount++;
+            if (0 == wcscmp(FileName, L".") || 0 == wcscmp(FileName, L".."))
+                DotCount++;
+            else
+            {
+                ASSERT(0 == wcsncmp(FileName, L"file", 4));
+                T = wcstoul(FileName + 4, &P, 10);
+                ASSERT(L'_' == *P);
+                J = wcstoul(P + 1, &P, 10);
+                ASSERT(L'\0' == *P);
+                ASSERT(8 > T && FileCount / 8 > J);
+                ASSERT(0 == Seen[T][J]);
+                Seen[T][J] = 1;
+            }
+
+            if (0 == DirInfo->NextEntryOffset)
+                break;
+        }
+    }
+
+    CloseHandle(Handle);
+
+    ASSERT(2 == DotCount);
+    ASSERT(FileCount + 2 == EntryCount);
+
+    if (LatencyCheck)
+    {
+        ASSERT(64 <= PageCount);
+
+        /* compare the median cost of the first and last 32 pages; re-scans make the last ones slow */
+        ulong_sort(Latency, 32);
+        ulong_sort(Latency + PageCount - 32, 32);
+        First = Latency[16];
+        Last = Latency[PageCount - 16];
+
+        FspDebugLog(__FUNCTION__ "(Flags=%lx): %lu entries in %lu pages, first=%uus last=%uus\n",
+            Flags, EntryCount, PageCount, First, Last);
+
+        ASSERT(Last <= 4 * First + 1000);
+    }
+    else
+        ASSERT(1 < PageCount);
+
+    memfs_stop(memfs);
+}
+
+void querydir_cursor_test(void)
+{
+    if (WinFspDiskTests)
+        querydir_cursor_dotest(MemfsDisk, 0, 2048, FALSE);
+    if (WinFspNetTests)
+        querydir_cursor_dotest(MemfsNet, L"\\\\memfs\\share", 2048, FALSE);
+}
+
+void querydir_cursor_large_test(void)
+{
+    if (WinFspDiskTests)
+        querydir_cursor_dotest(MemfsDisk, 0, 64 * 1024, TRUE);
+    if (WinFspNetTests)
+        querydir_cursor_dotest(MemfsNet, L"\\\\memfs\\share", 64 * 1024, TRUE);
+}
+
+#define QUERYDIR_PATCH_DOTEST_STABLE 200
+
+static volatile LONG querydir_patch_dotest_querydirectory_count;
+static volatile LONG querydir_patch_dotest_churn_done;
+
+static NTSTATUS querydir_patch_dotest_querydirectory(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    InterlockedIncrement(&querydir_patch_dotest_querydirectory_count);
+    return FspFileSystemOpQueryDirectory(FileSystem, Request, Response);
+}
+
+typedef struct
+{
+    PWSTR DirPath;
+    ULONG ListCount;
+    ULONG Latency[4096];
+} QUERYDIR_PATCH_DOTEST_DATA;
+
+static unsigned __stdcall querydir_patch_dotest_listthread(void *Data0)
+{
+    QUERYDIR_PATCH_DOTEST_DATA *Data = Data0;
+    WCHAR Pattern[MAX_PATH];
+    HANDLE Handle;
+    WIN32_FIND_DATAW FindData;
+    ULONG StableCount;
+    LARGE_INTEGER Frequency, Start, Stop;
+
+    QueryPerformanceFrequency(&Frequency);
+
+    StringCbPrintfW(Pattern, sizeof Pattern, L"%s\\*", Data->DirPath);
+
+    /* list the hot directory until the churn is over; the stable files must always be there */
+    while (!querydir_patch_dotest_churn_done &&
+        sizeof Data->Latency / sizeof Data->Latency[0] > Data->ListCount)
+    {
+        StableCount = 0;
+        QueryPerformanceCounter(&Start);
+        Handle = FindFirstFileW(Pattern, &FindData);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+        do
+        {
+            if (0 == wcsncmp(L"stable", FindData.cFileName, 6))
+                StableCount++;
+        } while (FindNextFileW(Handle, &FindData));
+        if (ERROR_NO_MORE_FILES != GetLastError())
+            return GetLastError();
+        FindClose(Handle);
+        QueryPerformanceCounter(&Stop);
+
+        if (QUERYDIR_PATCH_DOTEST_STABLE != StableCount)
+            return ERROR_FILE_NOT_FOUND;
+
+        Data->Latency[Data->ListCount++] =
+            (ULONG)((Stop.QuadPart - Start.QuadPart) * 1000000 / Frequency.QuadPart);
+    }
+
+    return 0;
+}
+
+static void querydir_patch_dotest_check(PWSTR DirPath, PWSTR ExtraName)
+{
+    WCHAR Pattern[MAX_PATH];
+    HANDLE Handle;
+    WIN32_FIND_DATAW FindData;
+    UINT8 Seen[QUERYDIR_PATCH_DOTEST_STABLE];
+    ULONG DotCount = 0, ExtraCount = 0, StableCount = 0, I;
+    PWSTR P;
+
+    memset(Seen, 0, sizeof Seen);
+
+    StringCbPrintfW(Pattern, sizeof Pattern, L"%s\\*", DirPath);
+
+    /* the listing must hold exactly ".", "..", the stable files and ExtraName */
+    Handle = FindFirstFileW(Pattern, &FindData);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    do
+    {
+        if (0 == wcscmp(FindData.cFileName, L".") || 0 == wcscmp(FindData.cFileName, L".."))
+            DotCount++;
+        else if (0 != ExtraName && 0 == wcscmp(FindData.cFileName, ExtraName))
+            ExtraCount++;
+        else
+        {
+            ASSERT(0 == wcsncmp(L"stable", FindData.cFileName, 6));
+            I = wcstoul(FindData.cFileName + 6, &P, 10);
+            ASSERT(L'\0' == *P);
+            ASSERT(QUERYDIR_PATCH_DOTEST_STABLE > I);
+            ASSERT(0 == Seen[I]);
+            Seen[I] = 1;
+            StableCount++;
+        }
+    } while (FindNextFileW(Handle, &FindData));
+    ASSERT(ERROR_NO_MORE_FILES == GetLastError());
+    FindClose(Handle);
+
+    ASSERT(2 == DotCount);
+    ASSERT((0 != ExtraName) == ExtraCount);
+    ASSERT(QUERYDIR_PATCH_DOTEST_STABLE == StableCount);
+}
+
+static unsigned __stdcall querydir_patch_dotest_churnthread(void *FilePath0)
+{
+    PWSTR FilePath = FilePath0;
+    WCHAR FileName[MAX_PATH], NewFileName[MAX_PATH];
+    HANDLE Handle;
+
+    /* create, rename and delete files in the hot directory */
+    for (ULONG I = 0; 500 > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"%s%u", FilePath, I);
+        StringCbPrintfW(NewFileName, sizeof NewFileName, L"%s%u.new", FilePath, I);
+        Handle = CreateFileW(FileName,
+            GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+        CloseHandle(Handle);
+        if (!MoveFileExW(FileName, NewFileName, 0))
+            return GetLastError();
+        if (!DeleteFileW(NewFileName))
+            return GetLastError();
+    }
+
+    return 0;
+}
+
+static void querydir_patch_dotest(ULONG Flags, PWSTR Prefix, BOOLEAN LatencyReport)
+{
+    /* FileInfoTimeout of 1000: directory listings are served from the DirInfo cache */
+    void *memfs = memfs_create(Flags, 1000, 1024, 1024 * 1024);
+
+    WCHAR DirPath[MAX_PATH], FilePath[4][MAX_PATH], NewFilePath[MAX_PATH];
+    static QUERYDIR_PATCH_DOTEST_DATA Data[4];
+    static ULONG Latency[4 * 4096];
+    HANDLE Threads[8], Handle;
+    DWORD ExitCode;
+    ULONG LatencyCount = 0;
+    BOOL Success;
+
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactQueryDirectoryKind,
+        querydir_patch_dotest_querydirectory);
+
+    memfs_start_dispatcher(memfs, 0);
+
+    StringCbPrintfW(DirPath, sizeof DirPath, L"%s%s\\dir",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    Success = CreateDirectoryW(DirPath, 0);
+    ASSERT(Success);
+
+    for (ULONG I = 0; QUERYDIR_PATCH_DOTEST_STABLE > I; I++)
+    {
+        StringCbPrintfW(FilePath[0], sizeof FilePath[0], L"%s\\stable%u", DirPath, I);
+        Handle = CreateFileW(FilePath[0],
+            GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+        CloseHandle(Handle);
+    }
+
+    /* create, rename and delete against a cached listing */
+    querydir_patch_dotest_check(DirPath, 0);
+    StringCbPrintfW(FilePath[0], sizeof FilePath[0], L"%s\\extra", DirPath);
+    StringCbPrintfW(NewFilePath, sizeof NewFilePath, L"%s\\Extra.new", DirPath);
+    Handle = CreateFileW(FilePath[0],
+        GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+    querydir_patch_dotest_check(DirPath, L"extra");
+    Success = MoveFileExW(FilePath[0], NewFilePath, 0);
+    ASSERT(Success);
+    querydir_patch_dotest_check(DirPath, L"Extra.new");
+    Success = DeleteFileW(NewFilePath);
+    ASSERT(Success);
+    querydir_patch_dotest_check(DirPath, 0);
+
+    querydir_patch_dotest_querydirectory_count = 0;
+    querydir_patch_dotest_churn_done = 0;
+
+    /* 4 threads list the directory while 4 threads churn its entries */
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        if (sizeof Data / sizeof Data[0] > I)
+        {
+            Data[I].DirPath = DirPath;
+            Data[I].ListCount = 0;
+            Threads[I] = (HANDLE)_beginthreadex(0, 0, querydir_patch_dotest_listthread, &Data[I], 0, 0);
+        }
+        else
+        {
+            StringCbPrintfW(FilePath[I - 4], sizeof FilePath[I - 4], L"%s\\churn%u_", DirPath, I - 4);
+            Threads[I] = (HANDLE)_beginthreadex(0, 0, querydir_patch_dotest_churnthread, FilePath[I - 4], 0, 0);
+        }
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 4; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(0 == ExitCode);
+    }
+    InterlockedExchange(&querydir_patch_dotest_churn_done, 1);
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(0 == ExitCode);
+
+        memcpy(Latency + LatencyCount, Data[I].Latency, Data[I].ListCount * sizeof Latency[0]);
+        LatencyCount += Data[I].ListCount;
+    }
+
+    ASSERT(0 != LatencyCount);
+
+    /* after the churn the listing must hold the stable files only */
+    querydir_patch_dotest_check(DirPath, 0);
+
+    if (LatencyReport)
+    {
+        ulong_sort(Latency, LatencyCount);
+
+        FspDebugLog(__FUNCTION__ "(Flags=%lx): %lu listings, %ld QueryDirectory requests, "
+            "p50=%uus p99=%uus\n",
+            Flags, LatencyCount, querydir_patch_dotest_querydirectory_count,
+            Latency[LatencyCount * 50 / 100],
+            Latency[LatencyCount * 99 / 100]);
+    }
+
+    memfs_stop(memfs);
+}
+
+void querydir_patch_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        querydir_patch_dotest(MemfsDisk, 0, FALSE);
+        querydir_patch_dotest(MemfsDisk | MemfsPatchDirInfo, 0, FALSE);
+    }
+    if (WinFspNetTests)
+    {
+        querydir_patch_dotest(MemfsNet, L"\\\\memfs\\share", FALSE);
+        querydir_patch_dotest(MemfsNet | MemfsPatchDirInfo, L"\\\\memfs\\share", FALSE);
+    }
+}
+
+void querydir_patch_latency_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        querydir_patch_dotest(MemfsDisk, 0, TRUE);
+        querydir_patch_dotest(MemfsDisk | MemfsPatchDirInfo, 0, TRUE);
+    }
+    if (WinFspNetTests)
+    {
+        querydir_patch_dotest(MemfsNet, L"\\\\memfs\\share", TRUE);
+        querydir_patch_dotest(MemfsNet | MemfsPatchDirInfo, L"\\\\memfs\\share", TRUE);
+    }
+}
+
+#define QUERYDIR_SEGMENT_DOTEST_PASSES 8
+
+typedef struct
+{
+    PWSTR FilePath;
+    ULONG Count;
+} QUERYDIR_SEGMENT_DOTEST_DATA;
+
+static unsigned __stdcall querydir_segment_dotest_thread(void *Data0)
+{
+    QUERYDIR_SEGMENT_DOTEST_DATA *Data = Data0;
+    WCHAR FileName[MAX_PATH];
+    HANDLE Handle;
+
+    for (ULONG I = 0; Data->Count > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"%s%u", Data->FilePath, I);
+        Handle = CreateFileW(FileName,
+            GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+        CloseHandle(Handle);
+    }
+
+    return 0;
+}
+
+static void querydir_segment_dotest(ULONG Flags, PWSTR Prefix, ULONG Count, BOOLEAN LatencyReport)
+{
+    /* FileInfoTimeout long enough for the DirInfo cache to outlive all passes */
+    void *memfs = memfs_create(Flags, 10000, Count + 1024, 1024 * 1024);
+
+    WCHAR DirPath[MAX_PATH], Pattern[MAX_PATH], FilePath[8][MAX_PATH];
+    QUERYDIR_SEGMENT_DOTEST_DATA Data[8];
+    HANDLE Threads[8], Handle;
+    DWORD ExitCode;
+    WIN32_FIND_DATAW FindData;
+    ULONG EntryCount, Latency[QUERYDIR_SEGMENT_DOTEST_PASSES], T, J;
+    PUINT8 Seen;
+    PWSTR EndP;
+    LONG RequestCount[QUERYDIR_SEGMENT_DOTEST_PASSES];
+    BOOL Success;
+    LARGE_INTEGER Frequency, Start, Stop;
+
+    ASSERT(0 == Count % 8);
+    Seen = malloc(Count);
+    ASSERT(0 != Seen);
+
+    QueryPerformanceFrequency(&Frequency);
+
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactQueryDirectoryKind,
+        querydir_patch_dotest_querydirectory);
+
+    memfs_start_dispatcher(memfs, 0);
+
+    StringCbPrintfW(DirPath, sizeof DirPath, L"%s%s\\dir",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    Success = CreateDirectoryW(DirPath, 0);
+    ASSERT(Success);
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        StringCbPrintfW(FilePath[I], sizeof FilePath[I], L"%s\\file%u_", DirPath, I);
+        Data[I].FilePath = FilePath[I];
+        Data[I].Count = Count / 8;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, querydir_segment_dotest_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(0 == ExitCode);
+    }
+
+    /* list the whole directory repeatedly; the first pass fills the DirInfo cache */
+    /* every pass must return every file exactly once */
+    StringCbPrintfW(Pattern, sizeof Pattern, L"%s\\*", DirPath);
+    for (ULONG P = 0; QUERYDIR_SEGMENT_DOTEST_PASSES > P; P++)
+    {
+        querydir_patch_dotest_querydirectory_count = 0;
+        EntryCount = 0;
+        memset(Seen, 0, Count);
+
+        QueryPerformanceCounter(&Start);
+        Handle = FindFirstFileW(Pattern, &FindData);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+        do
+        {
+            EntryCount++;
+            if (0 == wcscmp(FindData.cFileName, L".") || 0 == wcscmp(FindData.cFileName, L".."))
+                continue;
+            ASSERT(0 == wcsncmp(FindData.cFileName, L"file", 4));
+            T = wcstoul(FindData.cFileName + 4, &EndP, 10);
+            ASSERT(L'_' == *EndP);
+            J = wcstoul(EndP + 1, &EndP, 10);
+            ASSERT(L'\0' == *EndP);
+            ASSERT(8 > T && Count / 8 > J);
+            ASSERT(0 == Seen[T * (Count / 8) + J]);
+            Seen[T * (Count / 8) + J] = 1;
+        } while (FindNextFileW(Handle, &FindData));
+        ASSERT(ERROR_NO_MORE_FILES == GetLastError());
+        FindClose(Handle);
+        QueryPerformanceCounter(&Stop);
+
+        ASSERT(Count + 2 == EntryCount);
+
+        Latency[P] = (ULONG)((Stop.QuadPart - Start.QuadPart) * 1000 / Frequency.QuadPart);
+        RequestCount[P] = querydir_patch_dotest_querydirectory_count;
+    }
+
+    free(Seen);
+
+    if (LatencyReport)
+    {
+        ulong_sort(Latency + 1, QUERYDIR_SEGMENT_DOTEST_PASSES - 1);
+
+        FspDebugLog(__FUNCTION__ "(Flags=%lx, Count=%lu): "
+            "first pass %ums/%ld requests, other passes p50=%ums, last pass %ld requests\n",
+            Flags, Count,
+            Latency[0], RequestCount[0],
+            Latency[1 + (QUERYDIR_SEGMENT_DOTEST_PASSES - 1) / 2],
+            RequestCount[QUERYDIR_SEGMENT_DOTEST_PASSES - 1]);
+    }
+    else
+    {
+        /* a listing of a few segments is served from the cache after the first pass */
+        ASSERT(1 < RequestCount[0]);
+        for (ULONG P = 1; QUERYDIR_SEGMENT_DOTEST_PASSES > P; P++)
+            ASSERT(0 == RequestCount[P]);
+    }
+
+    memfs_stop(memfs);
+}
+
+void querydir_segment_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        querydir_segment_dotest(MemfsDisk, 0, 2048, FALSE);
+        querydir_segment_dotest(MemfsDisk | MemfsPatchDirInfo, 0, 2048, FALSE);
+    }
+    if (WinFspNetTests)
+    {
+        querydir_segment_dotest(MemfsNet, L"\\\\memfs\\share", 2048, FALSE);
+        querydir_segment_dotest(MemfsNet | MemfsPatchDirInfo, L"\\\\memfs\\share", 2048, FALSE);
+    }
+}
+
+void querydir_segment_large_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        querydir_segment_dotest(MemfsDisk, 0, 10000, TRUE);
+        querydir_segment_dotest(MemfsDisk | MemfsPatchDirInfo, 0, 10000, TRUE);
+        querydir_segment_dotest(MemfsDisk, 0, 100000, TRUE);
+        querydir_segment_dotest(MemfsDisk | MemfsPatchDirInfo, 0, 100000, TRUE);
+    }
+    if (WinFspNetTests)
+    {
+        querydir_segment_dotest(MemfsNet, L"\\\\memfs\\share", 10000, TRUE);
+        querydir_segment_dotest(MemfsNet | MemfsPatchDirInfo, L"\\\\memfs\\share", 10000, TRUE);
+    }
+}
+
+void querydir_segment_huge_test(void)
+{
+    /* 1M entries take a while to create */
+    if (WinFspDiskTests)
+    {
+        querydir_segment_dotest(MemfsDisk, 0, 1000000, TRUE);
+        querydir_segment_dotest(MemfsDisk | MemfsPatchDirInfo, 0, 1000000, TRUE);
+    }
+}
+
 void dirctl_tests(void)
 {
     TEST(querydir_test);
     TEST(querydir_expire_cache_test);
     TEST(dirnotify_test);
+    TEST(querydir_cursor_test);
+    TEST_OPT(querydir_cursor_large_test);
+    TEST(querydir_patch_test);
+    TEST_OPT(querydir_patch_latency_test);
+    TEST(querydir_segment_test);
+    TEST_OPT(querydir_segment_large_test);
+    TEST_OPT(querydir_segment_huge_test);
 }
@@ -0,0 +1,206 @@
+#include <winfsp/winfsp.h>
+#include <shared/dirinfo.h>
+#include <tlib/testsuite.h>
+
+#include "winfsp-tests.h"
+
+static INT dirinfo_compare(PCWSTR FileName0, ULONG FileNameLength0,
+    PCWSTR FileName1, ULONG FileNameLength1, BOOLEAN CaseInsensitive)
+{
+    /* same collation as RtlCompareUnicodeString: ordinal, upper case when case-insensitive */
+    return CompareStringOrdinal(
+        FileName0, FileNameLength0 / sizeof(WCHAR),
+        FileName1, FileNameLength1 / sizeof(WCHAR),
+        CaseInsensitive) - CSTR_EQUAL;
+}
+
+static ULONG dirinfo_build(PVOID Buffer, ULONG Length, PWSTR *FileNames, BOOLEAN Eof)
+{
+    UINT8 DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+    FSP_FSCTL_DIR_INFO *DirInfo = (PVOID)DirInfoBuf;
+    ULONG BytesTransferred = 0;
+
+    for (ULONG I = 0; 0 != FileNames[I]; I++)
+    {
+        memset(DirInfo, 0, sizeof *DirInfo);
+        DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + wcslen(FileNames[I]) * sizeof(WCHAR));
+        DirInfo->FileInfo.IndexNumber = DirInfo->NextOffset = I + 1;
+        memcpy(DirInfo->FileNameBuf, FileNames[I], DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+        ASSERT(FspFileSystemAddDirInfo(DirInfo, Buffer, Length, &BytesTransferred));
+    }
+    if (Eof)
+        ASSERT(FspFileSystemAddDirInfo(0, Buffer, Length, &BytesTransferred));
+
+    return BytesTransferred;
+}
+
+static void dirinfo_check(PVOID Buffer, ULONG Size, PWSTR *FileNames, BOOLEAN Eof)
+{
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    ULONG Offset = 0, I = 0;
+
+    for (; Offset + sizeof(DirInfo->Size) <= Size; Offset += FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size))
+    {
+        DirInfo = (PVOID)((PUINT8)Buffer + Offset);
+        if (sizeof(FSP_FSCTL_DIR_INFO) > DirInfo->Size)
+            break;
+        ASSERT(0 != FileNames[I]);
+        ASSERT(wcslen(FileNames[I]) * sizeof(WCHAR) == DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+        ASSERT(0 == memcmp(FileNames[I], DirInfo->FileNameBuf, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO)));
+        I++;
+    }
+    ASSERT(0 == FileNames[I]);
+    ASSERT(Eof == (Offset + sizeof(DirInfo->Size) <= Size));
+}
+
+static ULONG dirinfo_insert(PVOID Buffer, ULONG Size, PWSTR FileName, BOOLEAN CaseInsensitive,
+    PVOID NewBuffer, PBOOLEAN PSuccess)
+{
+    UINT8 DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
+    FSP_FSCTL_DIR_INFO *DirInfo = (PVOID)DirInfoBuf;
+    ULONG NewSize;
+
+    memset(DirInfo, 0, sizeof *DirInfo);
+    DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + wcslen(FileName) * sizeof(WCHAR));
+    DirInfo->FileInfo.IndexNumber = DirInfo->NextOffset = 1000;
+    memcpy(DirInfo->FileNameBuf, FileName, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+    *PSuccess = FspDirInfoBufferInsert(Buffer, Size, DirInfo, dirinfo_compare, CaseInsensitive,
+        NewBuffer, &NewSize);
+
+    return NewSize;
+}
+
+static ULONG dirinfo_remove(PVOID Buffer, ULONG Size, PWSTR FileName, BOOLEAN CaseInsensitive,
+    PVOID NewBuffer, PBOOLEAN PSuccess)
+{
+    ULONG NewSize;
+
+    *PSuccess = FspDirInfoBufferRemove(Buffer, Size,
+        FileName, (ULONG)(wcslen(FileName) * sizeof(WCHAR)), dirinfo_compare, CaseInsensitive,
+        NewBuffer, &NewSize);
+
+    return NewSize;
+}
+
+void dirinfo_insert_test(void)
+{
+    static UINT8 Buffer[4096], NewBuffer[4096], NewBuffer2[4096];
+    ULONG Size, NewSize;
+    BOOLEAN Success;
+
+    Size = dirinfo_build(Buffer, sizeof Buffer,
+        (PWSTR[]){ L".", L"..", L"b", L"d", L"f", 0 }, TRUE);
+
+    NewSize = dirinfo_insert(Buffer, Size, L"a", FALSE, NewBuffer, &Success);
+    ASSERT(Success);
+    ASSERT(Size < NewSize);
+    dirinfo_check(NewBuffer, NewSize,
+        (PWSTR[]){ L".", L"..", L"a", L"b", L"d", L"f", 0 }, TRUE);
+
+    NewSize = dirinfo_insert(Buffer, Size, L"e", FALSE, NewBuffer, &Success);
+    ASSERT(Success);
+    dirinfo_check(NewBuffer, NewSize,
+        (PWSTR[]){ L".", L"..", L"b", L"d", L"e", L"f", 0 }, TRUE);
+
+    NewSize = dirinfo_insert(NewBuffer, NewSize, L"long file name", FALSE, NewBuffer2, &Success);
+    ASSERT(Success);
+    dirinfo_check(NewBuffer2, NewSize,
+        (PWSTR[]){ L".", L"..", L"b", L"d", L"e", L"f", L"long file name", 0 }, TRUE);
+
+    /* an existing name cannot be inserted */
+    NewSize = dirinfo_insert(Buffer, Size, L"d", FALSE, NewBuffer, &Success);
+    ASSERT(!Success);
+
+    /* beyond the end of a partial listing: no change */
+    Size = dirinfo_build(Buffer, sizeof Buffer,
+        (PWSTR[]){ L".", L"..", L"b", L"d", 0 }, FALSE);
+    NewSize = dirinfo_insert(Buffer, Size, L"z", FALSE, NewBuffer, &Success);
+    ASSERT(Success);
+    ASSERT(0 == NewSize);
+    NewSize = dirinfo_insert(Buffer, Size, L"c", FALSE, NewBuffer, &Success);
+    ASSERT(Success);
+    dirinfo_check(NewBuffer, NewSize,
+        (PWSTR[]){ L".", L"..", L"b", L"c", L"d", 0 }, FALSE);
+
+    /* case sensitivity decides the position */
+    Size = dirinfo_build(Buffer, sizeof Buffer,
+        (PWSTR[]){ L".", L"..", L"B", L"d", 0 }, TRUE);
+    NewSize = dirinfo_insert(Buffer, Size, L"a", FALSE, NewBuffer, &Success);
+    ASSERT(Success);
+    dirinfo_check(NewBuffer, NewSize,
+        (PWSTR[]){ L".", L"..", L"B", L"a", L"d", 0 }, TRUE);
+    NewSize = dirinfo_insert(Buffer, Size, L"a", TRUE, NewBuffer, &Success);
+    ASSERT(Success);
+    dirinfo_check(NewBuffer, NewSize,
+        (PWSTR[]){ L".", L"..", L"a", L"B", L"d", 0 }, TRUE);
+    NewSize = dirinfo_insert(Buffer, Size, L"b", TRUE, NewBuffer, &Success);
+    ASSERT(!Success);
+
+    /* malformed buffer */
+    Size = dirinfo_build(Buffer, sizeof Buffer,
+        (PWSTR[]){ L".", L"..", L"b", L"d", 0 }, TRUE);
+    NewSize = dirinfo_insert(Buffer, Size - 12, L"c", FALSE, NewBuffer, &Success);
+    ASSERT(!Success);
+}
+
+void dirinfo_remove_test(void)
+{
+    static UINT8 Buffer[4096], NewBuffer[4096];
+    ULONG Size, NewSize;
+    BOOLEAN Success;
+
+    Size = dirinfo_build(Buffer, sizeof Buffer,
+        (PWSTR[]){ L".", L"..", L"b", L"d", L"f", 0 }, TRUE);
+
+    NewSize = dirinfo_remove(Buffer, Size, L"b", FALSE, NewBuffer, &Success);
+    ASSERT(Success);
+    ASSERT(Size > NewSize);
+    dirinfo_check(NewBuffer, NewSize,
+        (PWSTR[]){ L".", L"..", L"d", L"f", 0 }, TRUE);
+
+    NewSize = dirinfo_remove(Buffer, Size, L"f", FALSE, NewBuffer, &Success);
+    ASSERT(Success);
+    dirinfo_check(NewBuffer, NewSize,
+        (PWSTR[]){ L".", L"..", L"b", L"d", 0 }, TRUE);
+
+    /* a name that is not in a complete listing: the listing is stale */
+    NewSize = dirinfo_remove(Buffer, Size, L"..", FALSE, NewBuffer, &Success);
+    ASSERT(!Success);
+    NewSize = dirinfo_remove(Buffer, Size, L"c", FALSE, NewBuffer, &Success);
+    ASSERT(!Success);
+    NewSize = dirinfo_remove(Buffer, Size, L"D", FALSE, NewBuffer, &Success);
+    ASSERT(!Success);
+    NewSize = dirinfo_remove(Buffer, Size, L"z", FALSE, NewBuffer, &Success);
+    ASSERT(!Success);
+    NewSize = dirinfo_remove(Buffer, Size, L"D", TRUE, NewBuffer, &Success);
+    ASSERT(Success);
+    dirinfo_check(NewBuffer, NewSize,
+        (PWSTR[]){ L".", L"..", L"b", L"f", 0 }, TRUE);
+
+    /* partial listing */
+    Size = dirinfo_build(Buffer, sizeof Buffer,
+        (PWSTR[]){ L".", L"..", L"b", L"d", 0 }, FALSE);
+    NewSize = dirinfo_remove(Buffer, Size, L"d", FALSE, NewBuffer, &Success);
+    ASSERT(Success);
+    dirinfo_check(NewBuffer, NewSize,
+        (PWSTR[]){ L".", L"..", L"b", 0 }, FALSE);
+    NewSize = dirinfo_remove(Buffer, Size, L"z", FALSE, NewBuffer, &Success);
+    ASSERT(Success);
+    ASSERT(0 == NewSize);
+    NewSize = dirinfo_remove(Buffer, Size, L"c", FALSE, NewBuffer, &Success);
+    ASSERT(!Success);
+
+    /* upper case collation: "_" sorts after the letters */
+    Size = dirinfo_build(Buffer, sizeof Buffer,
+        (PWSTR[]){ L".", L"..", L"a", L"B", L"_", 0 }, TRUE);
+    NewSize = dirinfo_remove(Buffer, Size, L"_", TRUE, NewBuffer, &Success);
+    ASSERT(Success);
+    dirinfo_check(NewBuffer, NewSize,
+        (PWSTR[]){ L".", L"..", L"a", L"B", 0 }, TRUE);
+}
+
+void dirinfo_tests(void)
+{
+    TEST(dirinfo_insert_test);
+    TEST(dirinfo_remove_test);
+}
@@ -454,6 +454,102 @@ static void lock_overlapped_dotest(ULONG Flags, PWSTR VolPrefix, PWSTR Prefix, U
     memfs_stop(memfs);
 }
 
+static void lock_conflict_dotest(ULONG Flags, PWSTR Prefix, ULONG FileInfoTimeout)
+{
+    /* exercise the fast I/O lock checks and the IRP fallback of extending writes */
+
+    void *memfs = memfs_start_ex(Flags, FileInfoTimeout);
+
+    HANDLE Handle0, Handle1;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    UINT8 Buffer[2][4096];
+    DWORD BytesTransferred;
+    DWORD FilePointer;
+    FILE_STANDARD_INFO StandardInfo;
+    FILE_BASIC_INFO BasicInfo;
+
+    memset(Buffer[0], 'A', sizeof Buffer[0]);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle0 = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle0);
+
+    Success = WriteFile(Handle0, Buffer[0], sizeof Buffer[0], &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(sizeof Buffer[0] == BytesTransferred);
+
+    Handle1 = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle1);
+
+    /* prime the cache through the second handle */
+    Success = ReadFile(Handle1, Buffer[1], sizeof Buffer[1], &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(sizeof Buffer[1] == BytesTransferred);
+    ASSERT(0 == memcmp(Buffer[0], Buffer[1], BytesTransferred));
+
+    Success = LockFile(Handle0, 0, 0, 1024, 0);
+    ASSERT(Success);
+
+    FilePointer = SetFilePointer(Handle1, 512, 0, FILE_BEGIN);
+    ASSERT(512 == FilePointer);
+    Success = ReadFile(Handle1, Buffer[1], 1024, &BytesTransferred, 0);
+    ASSERT(!Success && ERROR_LOCK_VIOLATION == GetLastError());
+
+    FilePointer = SetFilePointer(Handle1, 512, 0, FILE_BEGIN);
+    ASSERT(512 == FilePointer);
+    Success = WriteFile(Handle1, Buffer[0], 1024, &BytesTransferred, 0);
+    ASSERT(!Success && ERROR_LOCK_VIOLATION == GetLastError());
+
+    /* unlocked region: served from the cache */
+    FilePointer = SetFilePointer(Handle1, 2048, 0, FILE_BEGIN);
+    ASSERT(2048 == FilePointer);
+    Success = ReadFile(Handle1, Buffer[1], 1024, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(1024 == BytesTransferred);
+    ASSERT(0 == memcmp(Buffer[0], Buffer[1], BytesTransferred));
+
+    /* extending write: must reach the file system */
+    FilePointer = SetFilePointer(Handle1, 3072, 0, FILE_BEGIN);
+    ASSERT(3072 == FilePointer);
+    Success = WriteFile(Handle1, Buffer[0], 4096, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(4096 == BytesTransferred);
+
+    Success = GetFileInformationByHandleEx(Handle0, FileStandardInfo, &StandardInfo, sizeof StandardInfo);
+    ASSERT(Success);
+    ASSERT(7168 == StandardInfo.EndOfFile.QuadPart);
+    ASSERT(!StandardInfo.Directory);
+
+    Success = GetFileInformationByHandleEx(Handle1, FileBasicInfo, &BasicInfo, sizeof BasicInfo);
+    ASSERT(Success);
+    ASSERT(0 == (FILE_ATTRIBUTE_DIRECTORY & BasicInfo.FileAttributes));
+
+    Success = UnlockFile(Handle0, 0, 0, 1024, 0);
+    ASSERT(Success);
+
+    FilePointer = SetFilePointer(Handle1, 512, 0, FILE_BEGIN);
+    ASSERT(512 == FilePointer);
+    Success = ReadFile(Handle1, Buffer[1], 1024, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(1024 == BytesTransferred);
+    ASSERT(0 == memcmp(Buffer[0], Buffer[1], BytesTransferred));
+
+    Success = CloseHandle(Handle0);
+    ASSERT(Success);
+
+    Success = CloseHandle(Handle1);
+    ASSERT(Success);
+
+    memfs_stop(memfs);
+}
+
 void lock_noncached_test(void)
 {
     if (NtfsTests)
@@ -534,10 +630,25 @@ void lock_cached_overlapped_test(void)
     }
 }
 
+void lock_conflict_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        lock_conflict_dotest(MemfsDisk, 0, 1000);
+        lock_conflict_dotest(MemfsDisk, 0, INFINITE);
+    }
+    if (WinFspNetTests)
+    {
+        lock_conflict_dotest(MemfsNet, L"\\\\memfs\\share", 1000);
+        lock_conflict_dotest(MemfsNet, L"\\\\memfs\\share", INFINITE);
+    }
+}
+
 void lock_tests(void)
 {
     TEST(lock_noncached_test);
     TEST(lock_noncached_overlapped_test);
     TEST(lock_cached_test);
     TEST(lock_cached_overlapped_test);
+    TEST(lock_conflict_test);
 }
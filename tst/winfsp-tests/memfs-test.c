@@ -1,27 +1,47 @@
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
 #include <process.h>
+#include <strsafe.h>
+#include <tlhelp32.h>
 #include "memfs.h"
 
 #include "winfsp-tests.h"
 
-void *memfs_start_ex(ULONG Flags, ULONG FileInfoTimeout)
+void *memfs_create(ULONG Flags, ULONG FileInfoTimeout, ULONG MaxFileNodes, ULONG MaxFileSize)
 {
-    if (-1 == Flags)
-        return 0;
-
     MEMFS *Memfs;
     NTSTATUS Result;
 
-    Result = MemfsCreate(Flags, FileInfoTimeout, 1024, 1024 * 1024,
-        MemfsNet == Flags ? L"\\memfs\\share" : 0, 0, &Memfs);
+    Result = MemfsCreate(Flags, FileInfoTimeout, MaxFileNodes, MaxFileSize,
+        (Flags & MemfsNet) ? L"\\memfs\\share" : 0, 0, &Memfs);
     ASSERT(NT_SUCCESS(Result));
     ASSERT(0 != Memfs);
 
-    Result = MemfsStart(Memfs);
+    return Memfs;
+}
+
+void memfs_start_dispatcher(void *data, PVOID DispatcherParams)
+{
+    MEMFS *Memfs = data;
+    NTSTATUS Result;
+
+    if (0 == DispatcherParams)
+        Result = MemfsStart(Memfs);
+    else
+        Result = FspFileSystemStartDispatcherEx(MemfsFileSystem(Memfs), DispatcherParams);
     ASSERT(NT_SUCCESS(Result));
+}
 
-    return Memfs;
+void *memfs_start_ex(ULONG Flags, ULONG FileInfoTimeout)
+{
+    if (-1 == Flags)
+        return 0;
+
+    void *memfs = memfs_create(Flags, FileInfoTimeout, 1024, 1024 * 1024);
+
+    memfs_start_dispatcher(memfs, 0);
+
+    return memfs;
 }
 
 void *memfs_start(ULONG Flags)
@@ -62,7 +82,646 @@ void memfs_test(void)
         memfs_dotest(MemfsNet);
 }
 
+static void *memfs_dotest_start(ULONG Flags, ULONG FileInfoTimeout,
+    ULONG Kind, FSP_FILE_SYSTEM_OPERATION *Operation,
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS *DispatcherParams)
+{
+    void *memfs = memfs_create(Flags, FileInfoTimeout, 1024, 1024 * 1024);
+
+    if (0 != Operation)
+        FspFileSystemSetOperation(MemfsFileSystem(memfs), Kind, Operation);
+
+    memfs_start_dispatcher(memfs, DispatcherParams);
+
+    return memfs;
+}
+
+static void memfs_dotest_rootpath(void *memfs, PWSTR Prefix, PWSTR RootPath, ULONG RootPathSize)
+{
+    StringCbPrintfW(RootPath, RootPathSize, L"%s%s",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+}
+
+static void memfs_dotest_join(HANDLE *Threads, ULONG Count)
+{
+    DWORD ExitCode;
+
+    for (ULONG I = 0; Count > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(0 == ExitCode);
+    }
+}
+
+static void memfs_dotest_disk_net(void (*dotest)(ULONG Flags, PWSTR Prefix))
+{
+    if (WinFspDiskTests)
+        dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+static unsigned __stdcall memfs_dotest_create_thread(void *FilePath0)
+{
+    PWSTR FilePath = FilePath0;
+    WCHAR FileName[MAX_PATH];
+    HANDLE Handle;
+
+    /* create and delete (on close) 100 files named FilePath0, FilePath1, ... */
+    for (ULONG I = 0; 100 > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"%s%u", FilePath, I);
+        Handle = CreateFileW(FileName,
+            GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+        CloseHandle(Handle);
+    }
+
+    return 0;
+}
+
+static volatile LONG memfs_dispatcher_dotest_create_count;
+static volatile LONG memfs_dispatcher_dotest_pending, memfs_dispatcher_dotest_pending_count;
+
+typedef struct
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    UINT8 ResponseBuf[FSP_FSCTL_TRANSACT_RSP_SIZEMAX];
+} MEMFS_DISPATCHER_DOTEST_RESPONSE;
+
+static DWORD WINAPI memfs_dispatcher_dotest_respond(PVOID Context)
+{
+    MEMFS_DISPATCHER_DOTEST_RESPONSE *Response = Context;
+
+    FspFileSystemSendResponse(Response->FileSystem, (PVOID)Response->ResponseBuf);
+    free(Response);
+
+    return 0;
+}
+
+static NTSTATUS memfs_dispatcher_dotest_create(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    MEMFS_DISPATCHER_DOTEST_RESPONSE *PendingResponse;
+    NTSTATUS Result;
+
+    InterlockedIncrement(&memfs_dispatcher_dotest_create_count);
+    Result = FspFileSystemOpCreate(FileSystem, Request, Response);
+    if (!memfs_dispatcher_dotest_pending || STATUS_PENDING == Result)
+        return Result;
+
+    /* answer from another thread with FspFileSystemSendResponse */
+    PendingResponse = malloc(sizeof *PendingResponse);
+    if (0 == PendingResponse)
+        return Result;
+    Response->IoStatus.Status = Result;
+    PendingResponse->FileSystem = FileSystem;
+    memcpy(PendingResponse->ResponseBuf, Response, Response->Size);
+    if (!QueueUserWorkItem(memfs_dispatcher_dotest_respond, PendingResponse, WT_EXECUTEDEFAULT))
+    {
+        free(PendingResponse);
+        return Result;
+    }
+    InterlockedIncrement(&memfs_dispatcher_dotest_pending_count);
+
+    return STATUS_PENDING;
+}
+
+static void memfs_dispatcher_dotest(ULONG Flags, PWSTR Prefix,
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS *DispatcherParams)
+{
+    void *memfs;
+
+    HANDLE Handle;
+    WCHAR RootPath[MAX_PATH], FilePath[8][MAX_PATH];
+    HANDLE Threads[8];
+
+    InterlockedExchange(&memfs_dispatcher_dotest_create_count, 0);
+    memfs = memfs_dotest_start(Flags, 1000,
+        FspFsctlTransactCreateKind, memfs_dispatcher_dotest_create, DispatcherParams);
+    memfs_dotest_rootpath(memfs, Prefix, RootPath, sizeof RootPath);
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        StringCbPrintfW(FilePath[I], sizeof FilePath[I], L"%s\\file%u_", RootPath, I);
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, memfs_dotest_create_thread, FilePath[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    memfs_dotest_join(Threads, sizeof Threads / sizeof Threads[0]);
+
+    /* every create was answered by the file system and every file was deleted on close */
+    ASSERT(sizeof Threads / sizeof Threads[0] * 100 <= (ULONG)memfs_dispatcher_dotest_create_count);
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        StringCbPrintfW(FilePath[I], sizeof FilePath[I], L"%s\\file%u_0", RootPath, I);
+        Handle = CreateFileW(FilePath[I],
+            GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        ASSERT(INVALID_HANDLE_VALUE == Handle);
+        ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+    }
+
+    memfs_stop(memfs);
+}
+
+void memfs_batch_dotest(ULONG Flags, PWSTR Prefix)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS DispatcherParams = { 0 };
+
+    memfs_dispatcher_dotest(Flags, Prefix, &DispatcherParams);
+
+    DispatcherParams.BatchCount = 16;
+    memfs_dispatcher_dotest(Flags, Prefix, &DispatcherParams);
+}
+
+void memfs_batch_test(void)
+{
+    memfs_dotest_disk_net(memfs_batch_dotest);
+}
+
+void memfs_ring_dotest(ULONG Flags, PWSTR Prefix)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS DispatcherParams = { 0 };
+
+    DispatcherParams.RingSlotCount = 64;
+    memfs_dispatcher_dotest(Flags, Prefix, &DispatcherParams);
+
+    /* a tiny ring keeps the response ring full and makes responders wait for space */
+    DispatcherParams.RingSlotCount = 2;
+    memfs_dispatcher_dotest(Flags, Prefix, &DispatcherParams);
+
+    /* creates answered later with FspFileSystemSendResponse go through the response ring */
+    InterlockedExchange(&memfs_dispatcher_dotest_pending, 1);
+    InterlockedExchange(&memfs_dispatcher_dotest_pending_count, 0);
+    DispatcherParams.RingSlotCount = 64;
+    memfs_dispatcher_dotest(Flags, Prefix, &DispatcherParams);
+    InterlockedExchange(&memfs_dispatcher_dotest_pending, 0);
+    ASSERT(0 != memfs_dispatcher_dotest_pending_count);
+}
+
+void memfs_ring_test(void)
+{
+    memfs_dotest_disk_net(memfs_ring_dotest);
+}
+
+static DWORD memfs_elastic_dotest_thread_ids[64];
+static volatile LONG memfs_elastic_dotest_thread_count;
+
+static NTSTATUS memfs_elastic_dotest_create(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    DWORD ThreadId = GetCurrentThreadId();
+    LONG Count = memfs_elastic_dotest_thread_count;
+    LONG Index;
+
+    /* remember every dispatcher thread that serviced a request; only a thread adds itself */
+    for (Index = 0;
+        Count > Index && sizeof memfs_elastic_dotest_thread_ids / sizeof memfs_elastic_dotest_thread_ids[0] > Index;
+        Index++)
+        if (ThreadId == memfs_elastic_dotest_thread_ids[Index])
+            break;
+    if (Count <= Index)
+    {
+        Index = InterlockedIncrement(&memfs_elastic_dotest_thread_count) - 1;
+        if (sizeof memfs_elastic_dotest_thread_ids / sizeof memfs_elastic_dotest_thread_ids[0] > Index)
+            memfs_elastic_dotest_thread_ids[Index] = ThreadId;
+    }
+
+    return FspFileSystemOpCreate(FileSystem, Request, Response);
+}
+
+static ULONG memfs_elastic_dotest_alivecount(void)
+{
+    HANDLE Snapshot;
+    THREADENTRY32 Entry;
+    LONG Count = memfs_elastic_dotest_thread_count;
+    ULONG AliveCount = 0;
+
+    Snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Snapshot);
+
+    Entry.dwSize = sizeof Entry;
+    if (Thread32First(Snapshot, &Entry))
+        do
+        {
+            if (GetCurrentProcessId() != Entry.th32OwnerProcessID)
+                continue;
+            for (LONG Index = 0; Count > Index; Index++)
+                if (Entry.th32ThreadID == memfs_elastic_dotest_thread_ids[Index])
+                {
+                    AliveCount++;
+                    break;
+                }
+        } while (Thread32Next(Snapshot, &Entry));
+
+    CloseHandle(Snapshot);
+
+    return AliveCount;
+}
+
+void memfs_elastic_dotest(ULONG Flags, PWSTR Prefix)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS DispatcherParams = { 0 };
+    void *memfs;
+
+    WCHAR RootPath[MAX_PATH], FilePath[16][MAX_PATH];
+    HANDLE Threads[16];
+
+    DispatcherParams.ThreadCount = 2;
+    DispatcherParams.ThreadCountMax = 16;
+    DispatcherParams.ThreadIdleTimeout = 1000;
+
+    memfs = memfs_dotest_start(Flags, 1000,
+        FspFsctlTransactCreateKind, memfs_elastic_dotest_create, &DispatcherParams);
+    memfs_dotest_rootpath(memfs, Prefix, RootPath, sizeof RootPath);
+
+    for (ULONG Burst = 0; 2 > Burst; Burst++)
+    {
+        InterlockedExchange(&memfs_elastic_dotest_thread_count, 0);
+
+        for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+        {
+            StringCbPrintfW(FilePath[I], sizeof FilePath[I], L"%s\\file%u_", RootPath, I);
+            Threads[I] = (HANDLE)_beginthreadex(0, 0, memfs_dotest_create_thread, FilePath[I], 0, 0);
+            ASSERT(0 != Threads[I]);
+        }
+        memfs_dotest_join(Threads, sizeof Threads / sizeof Threads[0]);
+
+        /* the burst grew the pool past its core threads but never past its maximum */
+        ASSERT(DispatcherParams.ThreadCount < (ULONG)memfs_elastic_dotest_thread_count);
+        ASSERT(DispatcherParams.ThreadCountMax >= (ULONG)memfs_elastic_dotest_thread_count);
+
+        /* once idle the elastic threads retire and only the core threads remain */
+        Sleep(3000);
+        ASSERT(DispatcherParams.ThreadCount >= memfs_elastic_dotest_alivecount());
+    }
+
+    memfs_stop(memfs);
+}
+
+void memfs_elastic_test(void)
+{
+    memfs_dotest_disk_net(memfs_elastic_dotest);
+}
+
+static volatile LONG memfs_priority_dotest_stop;
+
+static unsigned __stdcall memfs_priority_dotest_thread(void *FileName)
+{
+    HANDLE Handle;
+    PVOID Buffer;
+    DWORD BytesTransferred;
+    OVERLAPPED Overlapped = { 0 };
+
+    Handle = CreateFileW(FileName,
+        GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+
+    Buffer = VirtualAlloc(0, 64 * 1024, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (0 == Buffer)
+    {
+        CloseHandle(Handle);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    /* keep a backlog of non-cached (bulk) reads in the queue */
+    for (ULONG I = 0; !memfs_priority_dotest_stop; I++)
+    {
+        Overlapped.Offset = I % 16 * 64 * 1024;
+        if (!ReadFile(Handle, Buffer, 64 * 1024, &BytesTransferred, &Overlapped))
+            break;
+        if (64 * 1024 != BytesTransferred)
+        {
+            SetLastError(ERROR_HANDLE_EOF);
+            break;
+        }
+    }
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+    CloseHandle(Handle);
+
+    return memfs_priority_dotest_stop ? 0 : GetLastError();
+}
+
+void memfs_priority_dotest(ULONG Flags, PWSTR Prefix)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS DispatcherParams = { 0 };
+    void *memfs;
+
+    WCHAR RootPath[MAX_PATH], FileName[MAX_PATH], BigFileName[MAX_PATH];
+    static ULONG Latency[200];
+    HANDLE Threads[8];
+    HANDLE Handle;
+    DWORD BytesTransferred;
+    LARGE_INTEGER Frequency, Start, Stop;
+    static UINT8 Buffer[64 * 1024];
+
+    /* a single dispatcher thread makes the pending queue the bottleneck */
+    DispatcherParams.ThreadCount = 1;
+
+    memfs = memfs_dotest_start(Flags, 1000, 0, 0, &DispatcherParams);
+    memfs_dotest_rootpath(memfs, Prefix, RootPath, sizeof RootPath);
+
+    StringCbPrintfW(BigFileName, sizeof BigFileName, L"%s\\big", RootPath);
+    Handle = CreateFileW(BigFileName,
+        GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    for (ULONG I = 0; 16 > I; I++)
+        ASSERT(WriteFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0));
+    CloseHandle(Handle);
+
+    memfs_priority_dotest_stop = 0;
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, memfs_priority_dotest_thread, BigFileName, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    Sleep(100); /* let the read backlog build up */
+
+    QueryPerformanceFrequency(&Frequency);
+    for (ULONG I = 0; sizeof Latency / sizeof Latency[0] > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"%s\\file%u", RootPath, I);
+        QueryPerformanceCounter(&Start);
+        Handle = CreateFileW(FileName,
+            GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+        CloseHandle(Handle);
+        QueryPerformanceCounter(&Stop);
+        Latency[I] = (ULONG)((Stop.QuadPart - Start.QuadPart) * 1000000 / Frequency.QuadPart);
+    }
+
+    InterlockedExchange(&memfs_priority_dotest_stop, 1);
+    memfs_dotest_join(Threads, sizeof Threads / sizeof Threads[0]);
+
+    ulong_sort(Latency, sizeof Latency / sizeof Latency[0]);
+
+    FspDebugLog(__FUNCTION__ ": create/close behind read backlog: p50=%uus p99=%uus max=%uus\n",
+        Latency[sizeof Latency / sizeof Latency[0] * 50 / 100],
+        Latency[sizeof Latency / sizeof Latency[0] * 99 / 100],
+        Latency[sizeof Latency / sizeof Latency[0] - 1]);
+
+    memfs_stop(memfs);
+}
+
+void memfs_priority_test(void)
+{
+    memfs_dotest_disk_net(memfs_priority_dotest);
+}
+
+static HANDLE memfs_lanes_dotest_event;
+static volatile LONG memfs_lanes_dotest_block, memfs_lanes_dotest_blocked;
+
+static NTSTATUS memfs_lanes_dotest_read(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    if (memfs_lanes_dotest_block)
+    {
+        InterlockedIncrement(&memfs_lanes_dotest_blocked);
+        WaitForSingleObject(memfs_lanes_dotest_event, INFINITE);
+    }
+    return FspFileSystemOpRead(FileSystem, Request, Response);
+}
+
+typedef struct
+{
+    ULONG Kind, Offset;
+    HANDLE Handle;
+    WCHAR FilePath[MAX_PATH];
+    __declspec(align(4096)) UINT8 Buffer[4096];
+} MEMFS_LANES_DOTEST_DATA;
+
+static unsigned __stdcall memfs_lanes_dotest_thread(void *Data0)
+{
+    MEMFS_LANES_DOTEST_DATA *Data = Data0;
+    BY_HANDLE_FILE_INFORMATION FileInfo;
+    OVERLAPPED Overlapped = { 0 };
+    HANDLE Handle;
+    DWORD BytesTransferred;
+
+    switch (Data->Kind)
+    {
+    case 0:
+        /* non-cached read: bulk lane */
+        if (!ReadFile(Data->Handle, Data->Buffer, sizeof Data->Buffer, &BytesTransferred, 0))
+            return GetLastError();
+        break;
+    case 1:
+        /* query information: metadata lane */
+        if (!GetFileInformationByHandle(Data->Handle, &FileInfo))
+            return GetLastError();
+        break;
+    case 2:
+        /* create: metadata lane */
+        Handle = CreateFileW(Data->FilePath,
+            GENERIC_ALL, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+        CloseHandle(Handle);
+        break;
+    case 3:
+        /* cached read of data that is not in the cache: paging lane */
+        Overlapped.Offset = Data->Offset;
+        if (!ReadFile(Data->Handle, Data->Buffer, sizeof Data->Buffer, &BytesTransferred, &Overlapped))
+            return GetLastError();
+        break;
+    }
+
+    return 0;
+}
+
+static void memfs_lanes_dotest(ULONG Flags, PWSTR Prefix)
+{
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS DispatcherParams = { 0 };
+    void *memfs;
+
+    WCHAR RootPath[MAX_PATH], FilePath[MAX_PATH];
+    static MEMFS_LANES_DOTEST_DATA Data[2 + 4 * 4];
+    HANDLE Threads[2 + 4 * 4];
+    HANDLE Handle;
+    DWORD BytesTransferred, WaitResult;
+    static __declspec(align(4096)) UINT8 Buffer[64 * 1024];
+
+    /* two dispatcher threads that the first two reads will block */
+    DispatcherParams.ThreadCount = 2;
+
+    memfs_lanes_dotest_event = CreateEventW(0, TRUE, FALSE, 0);
+    ASSERT(0 != memfs_lanes_dotest_event);
+    memfs_lanes_dotest_block = 0;
+    memfs_lanes_dotest_blocked = 0;
+
+    memfs = memfs_dotest_start(Flags, 0,
+        FspFsctlTransactReadKind, memfs_lanes_dotest_read, &DispatcherParams);
+    memfs_dotest_rootpath(memfs, Prefix, RootPath, sizeof RootPath);
+
+    /* write without buffering so that neither file has any data in the cache */
+    for (ULONG I = 0; 2 > I; I++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file%u", RootPath, I);
+        Handle = CreateFileW(FilePath,
+            GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+        ASSERT(WriteFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0));
+        ASSERT(sizeof Buffer == BytesTransferred);
+        CloseHandle(Handle);
+    }
+
+    /* a synchronous file object serializes its I/O, so every thread gets its own handle */
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        Data[I].Kind = 2 > I ? 0 : (I - 2) % 4;
+        Data[I].Offset = I % 16 * 4096;
+        Data[I].Handle = INVALID_HANDLE_VALUE;
+        StringCbPrintfW(Data[I].FilePath, sizeof Data[I].FilePath, L"%s\\%s%u",
+            RootPath,
+            2 == Data[I].Kind ? L"new" : L"file",
+            2 == Data[I].Kind ? I : 3 == Data[I].Kind);
+        if (2 == Data[I].Kind)
+            continue;
+        Data[I].Handle = CreateFileW(Data[I].FilePath,
+            GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | (0 == Data[I].Kind ? FILE_FLAG_NO_BUFFERING : 0), 0);
+        ASSERT(INVALID_HANDLE_VALUE != Data[I].Handle);
+    }
+
+    /* occupy both dispatcher threads */
+    InterlockedExchange(&memfs_lanes_dotest_block, 1);
+    for (ULONG I = 0; 2 > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, memfs_lanes_dotest_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; 2 > memfs_lanes_dotest_blocked && 1000 > I; I++)
+        Sleep(10);
+    ASSERT(2 == memfs_lanes_dotest_blocked);
+
+    /* queue requests in the bulk, metadata and paging lanes */
+    for (ULONG I = 2; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, memfs_lanes_dotest_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    Sleep(1000);
+
+    /* race some cancellations with the stop; every pending request must still complete */
+    for (ULONG I = 2; sizeof Threads / sizeof Threads[0] > I; I += 3)
+        CancelSynchronousIo(Threads[I]);
+    FspFsctlStop(MemfsFileSystem(memfs)->VolumeHandle);
+
+    WaitResult = WaitForMultipleObjects(sizeof Threads / sizeof Threads[0] - 2, Threads + 2,
+        TRUE, 10000);
+    ASSERT(WAIT_OBJECT_0 == WaitResult);
+
+    SetEvent(memfs_lanes_dotest_event);
+    WaitResult = WaitForMultipleObjects(2, Threads, TRUE, INFINITE);
+    ASSERT(WAIT_OBJECT_0 == WaitResult);
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        CloseHandle(Threads[I]);
+        if (INVALID_HANDLE_VALUE != Data[I].Handle)
+            CloseHandle(Data[I].Handle);
+    }
+
+    memfs_stop(memfs);
+
+    CloseHandle(memfs_lanes_dotest_event);
+    memfs_lanes_dotest_event = 0;
+}
+
+void memfs_lanes_test(void)
+{
+    memfs_dotest_disk_net(memfs_lanes_dotest);
+}
+
+static unsigned __stdcall memfs_reqalloc_dotest_thread(void *FilePath0)
+{
+    PWSTR FilePath = FilePath0;
+    WCHAR FileName[MAX_PATH];
+    HANDLE Handle;
+    BY_HANDLE_FILE_INFORMATION FileInfo;
+
+    for (ULONG I = 0; 200 > I; I++)
+    {
+        /* file names of different lengths give Create requests of different sizes */
+        StringCbPrintfW(FileName, sizeof FileName, L"%s%.*s%u",
+            FilePath, (int)(I % 64), L"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", I % 7);
+        Handle = CreateFileW(FileName,
+            GENERIC_ALL, 0, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+        for (ULONG J = 0; 4 > J; J++)
+            if (!GetFileInformationByHandle(Handle, &FileInfo))
+                return GetLastError();
+        CloseHandle(Handle);
+    }
+
+    return 0;
+}
+
+static void memfs_reqalloc_dotest(ULONG Flags, PWSTR Prefix)
+{
+    /* FileInfoTimeout of 0: every query is a request to the file system */
+    void *memfs = memfs_start_ex(Flags, 0);
+
+    PWSTR DeviceName = MemfsNet == Flags ?
+        L"" FSP_FSCTL_NET_DEVICE_NAME : L"" FSP_FSCTL_DISK_DEVICE_NAME;
+    FSP_FSCTL_REQUEST_STATS Stats0, Stats1;
+    UINT64 Hits, Misses;
+    WCHAR RootPath[MAX_PATH], FilePath[8][MAX_PATH];
+    HANDLE Threads[8];
+    NTSTATUS Result;
+
+    memfs_dotest_rootpath(memfs, Prefix, RootPath, sizeof RootPath);
+
+    Result = FspFsctlGetRequestStats(DeviceName, &Stats0);
+    ASSERT(NT_SUCCESS(Result));
+
+    /* request allocation churn: many short lived requests of different sizes */
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        StringCbPrintfW(FilePath[I], sizeof FilePath[I], L"%s\\file%u_", RootPath, I);
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, memfs_reqalloc_dotest_thread, FilePath[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    memfs_dotest_join(Threads, sizeof Threads / sizeof Threads[0]);
+
+    Result = FspFsctlGetRequestStats(DeviceName, &Stats1);
+    ASSERT(NT_SUCCESS(Result));
+
+    /* the counts are driver wide and approximate; the churn must be served mostly by the lists */
+    Hits = Misses = 0;
+    for (ULONG I = 0; FSP_FSCTL_REQUEST_CLASS_COUNT > I; I++)
+    {
+        ASSERT(Stats0.Class[I].Size == Stats1.Class[I].Size);
+        Hits += Stats1.Class[I].Hits - Stats0.Class[I].Hits;
+        Misses += Stats1.Class[I].Misses - Stats0.Class[I].Misses;
+    }
+    ASSERT(Stats1.Class[0].Hits > Stats0.Class[0].Hits);
+    ASSERT(8 * 200 <= Hits + Misses);
+    ASSERT(Hits > Misses);
+
+    memfs_stop(memfs);
+}
+
+void memfs_reqalloc_test(void)
+{
+    memfs_dotest_disk_net(memfs_reqalloc_dotest);
+}
+
 void memfs_tests(void)
 {
     TEST(memfs_test);
+    TEST(memfs_batch_test);
+    TEST(memfs_ring_test);
+    TEST(memfs_elastic_test);
+    TEST_OPT(memfs_priority_test);
+    TEST(memfs_lanes_test);
+    TEST(memfs_reqalloc_test);
 }
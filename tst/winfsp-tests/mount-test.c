@@ -73,6 +73,47 @@ void mount_create_volume_test(void)
         mount_create_volume_dotest(L"WinFsp.Net");
 }
 
+void mount_create_volume_v0_dotest(PWSTR DeviceName)
+{
+    NTSTATUS Result;
+    BOOL Success;
+    FSP_FSCTL_VOLUME_PARAMS *VolumeParams;
+    PUINT8 Pages;
+    DWORD OldProtect;
+    WCHAR VolumeName[MAX_PATH];
+    HANDLE VolumeHandle;
+
+    /* a version 0 VolumeParams that ends right before an inaccessible page */
+    Pages = VirtualAlloc(0, 2 * 4096, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != Pages);
+    Success = VirtualProtect(Pages + 4096, 4096, PAGE_NOACCESS, &OldProtect);
+    ASSERT(Success);
+    VolumeParams = (PVOID)(Pages + 4096 - FSP_FSCTL_VOLUME_PARAMS_V0_SIZE);
+
+    VolumeParams->SectorSize = 16384;
+    VolumeParams->VolumeSerialNumber = 0x12345678;
+    wcscpy_s(VolumeParams->Prefix, sizeof VolumeParams->Prefix / sizeof(WCHAR), L"\\winfsp-tests\\share");
+    Result = FspFsctlCreateVolume(DeviceName, VolumeParams,
+        VolumeName, sizeof VolumeName, &VolumeHandle);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 == wcsncmp(L"\\Device\\Volume{", VolumeName, 15));
+    ASSERT(INVALID_HANDLE_VALUE != VolumeHandle);
+
+    Success = CloseHandle(VolumeHandle);
+    ASSERT(Success);
+
+    Success = VirtualFree(Pages, 0, MEM_RELEASE);
+    ASSERT(Success);
+}
+
+void mount_create_volume_v0_test(void)
+{
+    if (WinFspDiskTests)
+        mount_create_volume_v0_dotest(L"WinFsp.Disk");
+    if (WinFspNetTests)
+        mount_create_volume_v0_dotest(L"WinFsp.Net");
+}
+
 static unsigned __stdcall mount_volume_cancel_dotest_thread(void *FilePath)
 {
     FspDebugLog(__FUNCTION__ ": \"%S\"\n", FilePath);
@@ -255,11 +296,472 @@ void mount_volume_transact_test(void)
         mount_volume_transact_dotest(L"WinFsp.Net", L"\\\\winfsp-tests\\share");
 }
 
+static unsigned __stdcall mount_volume_transact_batch_dotest_thread(void *FilePath)
+{
+    HANDLE Handle;
+    Handle = CreateFileW(FilePath,
+        FILE_GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+    CloseHandle(Handle);
+    return 0;
+}
+
+void mount_volume_transact_batch_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    NTSTATUS Result;
+    BOOL Success;
+    FSP_FSCTL_VOLUME_PARAMS VolumeParams = { 0 };
+    WCHAR VolumeName[MAX_PATH];
+    WCHAR FilePath[16][MAX_PATH];
+    HANDLE VolumeHandle;
+    HANDLE Threads[16];
+    DWORD ExitCode;
+    ULONG CreateCount = 0, RequestCount = 0, TransactCount = 0;
+
+    VolumeParams.TransactTimeout = 10000; /* allow for longer transact timeout to handle MUP redir */
+    VolumeParams.SectorSize = 16384;
+    VolumeParams.VolumeSerialNumber = 0x12345678;
+    wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR), L"\\winfsp-tests\\share");
+    Result = FspFsctlCreateVolume(DeviceName, &VolumeParams,
+        VolumeName, sizeof VolumeName, &VolumeHandle);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(INVALID_HANDLE_VALUE != VolumeHandle);
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        StringCbPrintfW(FilePath[I], sizeof FilePath[I], L"%s%s\\file%u",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : VolumeName, I);
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, mount_volume_transact_batch_dotest_thread,
+            FilePath[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    Sleep(1000); /* give some time to the threads to queue their requests */
+
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 RequestBuf[FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN];
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 ResponseBuf[16 * FSP_FSCTL_TRANSACT_RSP_SIZEMAX];
+    UINT8 *RequestBufEnd;
+    UINT8 *ResponseBufEnd = ResponseBuf + sizeof ResponseBuf;
+    SIZE_T RequestBufSize;
+    SIZE_T ResponseBufSize = 0;
+    FSP_FSCTL_TRANSACT_REQ *Request, *NextRequest;
+    FSP_FSCTL_TRANSACT_RSP *Response = (PVOID)ResponseBuf;
+
+    while (sizeof Threads / sizeof Threads[0] > CreateCount)
+    {
+        RequestBufSize = sizeof RequestBuf;
+        Result = FspFsctlTransact(VolumeHandle,
+            ResponseBuf, ResponseBufSize, RequestBuf, &RequestBufSize, TRUE);
+        ASSERT(STATUS_SUCCESS == Result);
+        TransactCount++;
+
+        Response = (PVOID)ResponseBuf;
+        RequestBufEnd = RequestBuf + RequestBufSize;
+        for (Request = (PVOID)RequestBuf;
+            0 != (NextRequest = FspFsctlTransactConsumeRequest(Request, RequestBufEnd));
+            Request = NextRequest)
+        {
+            ASSERT(0 != Request->Hint);
+            ASSERT(FspFsctlTransactCreateKind == Request->Kind ||
+                FspFsctlTransactQueryVolumeInformationKind == Request->Kind);
+            if (FspFsctlTransactCreateKind == Request->Kind)
+                CreateCount++;
+            RequestCount++;
+
+            ASSERT(FspFsctlTransactCanProduceResponse(Response, ResponseBufEnd));
+
+            RtlZeroMemory(Response, sizeof *Response);
+            Response->Size = sizeof *Response;
+            Response->Hint = Request->Hint;
+            Response->Kind = Request->Kind;
+            Response->IoStatus.Status = STATUS_ACCESS_DENIED;
+            Response->IoStatus.Information = 0;
+
+            Response = FspFsctlTransactProduceResponse(Response, Response->Size);
+        }
+        ResponseBufSize = (PUINT8)Response - ResponseBuf;
+    }
+
+    /* send the final batch of responses without waiting for more requests */
+    RequestBufSize = 0;
+    Result = FspFsctlTransact(VolumeHandle, ResponseBuf, ResponseBufSize, 0, &RequestBufSize, TRUE);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    FspDebugLog(__FUNCTION__ ": %u requests in %u transacts\n", RequestCount, TransactCount);
+    ASSERT(sizeof Threads / sizeof Threads[0] <= RequestCount);
+    ASSERT(TransactCount < RequestCount);
+
+    Success = CloseHandle(VolumeHandle);
+    ASSERT(Success);
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(ERROR_ACCESS_DENIED == ExitCode || ERROR_OPERATION_ABORTED == ExitCode);
+    }
+}
+
+void mount_volume_transact_batch_test(void)
+{
+    if (WinFspDiskTests)
+        mount_volume_transact_batch_dotest(L"WinFsp.Disk", 0);
+    if (WinFspNetTests)
+        mount_volume_transact_batch_dotest(L"WinFsp.Net", L"\\\\winfsp-tests\\share");
+}
+
+void mount_volume_transact_shard_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    NTSTATUS Result;
+    BOOL Success;
+    FSP_FSCTL_VOLUME_PARAMS VolumeParams = { 0 };
+    WCHAR VolumeName[MAX_PATH];
+    WCHAR FilePath[16][MAX_PATH];
+    HANDLE VolumeHandle;
+    HANDLE Threads[16];
+    DWORD_PTR ProcessMask, SystemMask, ThreadMask;
+    DWORD ExitCode;
+    ULONG ProcessorCount = 0, CreateCount = 0;
+    BOOLEAN Wrapped = FALSE;
+
+    Success = GetProcessAffinityMask(GetCurrentProcess(), &ProcessMask, &SystemMask);
+    ASSERT(Success);
+
+    VolumeParams.TransactTimeout = 10000; /* allow for longer transact timeout to handle MUP redir */
+    VolumeParams.SectorSize = 16384;
+    VolumeParams.VolumeSerialNumber = 0x12345678;
+    wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR), L"\\winfsp-tests\\share");
+    Result = FspFsctlCreateVolume(DeviceName, &VolumeParams,
+        VolumeName, sizeof VolumeName, &VolumeHandle);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(INVALID_HANDLE_VALUE != VolumeHandle);
+
+    /*
+     * Pin each posting thread to a different processor so that its request is posted
+     * to a different pending queue shard. The dispatcher (this thread) is pinned to a
+     * single processor, so it only sees the requests if it looks at all other shards.
+     * This checks that no request is lost across shards; it does not measure contention.
+     */
+    ThreadMask = ProcessMask;
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        DWORD_PTR Mask = ThreadMask & (~ThreadMask + 1);
+        if (!Wrapped)
+            ProcessorCount++;
+        ThreadMask &= ~Mask;
+        if (0 == ThreadMask)
+        {
+            ThreadMask = ProcessMask;
+            Wrapped = TRUE;
+        }
+        if (0 == I)
+            SetThreadAffinityMask(GetCurrentThread(), Mask);
+
+        StringCbPrintfW(FilePath[I], sizeof FilePath[I], L"%s%s\\file%u",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : VolumeName, I);
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, mount_volume_transact_batch_dotest_thread,
+            FilePath[I], CREATE_SUSPENDED, 0);
+        ASSERT(0 != Threads[I]);
+        SetThreadAffinityMask(Threads[I], Mask);
+        ResumeThread(Threads[I]);
+    }
+
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 RequestBuf[FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN];
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 ResponseBuf[FSP_FSCTL_TRANSACT_RSP_SIZEMAX];
+    SIZE_T RequestBufSize;
+    SIZE_T ResponseBufSize = 0;
+    FSP_FSCTL_TRANSACT_REQ *Request = (PVOID)RequestBuf;
+    FSP_FSCTL_TRANSACT_RSP *Response = (PVOID)ResponseBuf;
+
+    while (sizeof Threads / sizeof Threads[0] > CreateCount)
+    {
+        RequestBufSize = sizeof RequestBuf;
+        Result = FspFsctlTransact(VolumeHandle,
+            ResponseBuf, ResponseBufSize, RequestBuf, &RequestBufSize, FALSE);
+        ASSERT(STATUS_SUCCESS == Result);
+
+        ResponseBufSize = 0;
+        if (0 == RequestBufSize)
+            continue;
+
+        ASSERT(0 != Request->Hint);
+        ASSERT(FspFsctlTransactCreateKind == Request->Kind ||
+            FspFsctlTransactQueryVolumeInformationKind == Request->Kind);
+        if (FspFsctlTransactCreateKind == Request->Kind)
+            CreateCount++;
+
+        RtlZeroMemory(Response, sizeof *Response);
+        Response->Size = sizeof *Response;
+        Response->Hint = Request->Hint;
+        Response->Kind = Request->Kind;
+        Response->IoStatus.Status = STATUS_ACCESS_DENIED;
+        Response->IoStatus.Information = 0;
+        ResponseBufSize = Response->Size;
+    }
+
+    RequestBufSize = 0;
+    Result = FspFsctlTransact(VolumeHandle, ResponseBuf, ResponseBufSize, 0, &RequestBufSize, FALSE);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    FspDebugLog(__FUNCTION__ ": %u creates from %u processors\n", CreateCount, ProcessorCount);
+
+    SetThreadAffinityMask(GetCurrentThread(), ProcessMask);
+
+    Success = CloseHandle(VolumeHandle);
+    ASSERT(Success);
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(ERROR_ACCESS_DENIED == ExitCode || ERROR_OPERATION_ABORTED == ExitCode);
+    }
+}
+
+void mount_volume_transact_shard_test(void)
+{
+    if (WinFspDiskTests)
+        mount_volume_transact_shard_dotest(L"WinFsp.Disk", 0);
+    if (WinFspNetTests)
+        mount_volume_transact_shard_dotest(L"WinFsp.Net", L"\\\\winfsp-tests\\share");
+}
+
+void mount_volume_transact_credit_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    NTSTATUS Result;
+    BOOL Success;
+    FSP_FSCTL_VOLUME_PARAMS VolumeParams = { 0 };
+    WCHAR VolumeName[MAX_PATH];
+    static WCHAR FilePath[150][MAX_PATH];
+    HANDLE VolumeHandle;
+    HANDLE Threads[150];
+    DWORD ExitCode;
+    ULONG CreateCount = 0, TransactCount = 0, MaxDepth = 0;
+
+    VolumeParams.TransactTimeout = 10000; /* allow for longer transact timeout to handle MUP redir */
+    VolumeParams.IrpCapacity = FspFsctlIrpCapacityMinimum;
+    VolumeParams.SectorSize = 16384;
+    VolumeParams.VolumeSerialNumber = 0x12345678;
+    wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR), L"\\winfsp-tests\\share");
+    Result = FspFsctlCreateVolume(DeviceName, &VolumeParams,
+        VolumeName, sizeof VolumeName, &VolumeHandle);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(INVALID_HANDLE_VALUE != VolumeHandle);
+
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 RequestBuf[FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN];
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 ResponseBuf[64 * FSP_FSCTL_TRANSACT_RSP_SIZEMAX];
+    UINT8 *RequestBufEnd;
+    UINT8 *ResponseBufEnd = ResponseBuf + sizeof ResponseBuf - sizeof(FSP_FSCTL_TRANSACT_RSP);
+    SIZE_T RequestBufSize;
+    SIZE_T ResponseBufSize;
+    FSP_FSCTL_TRANSACT_REQ *Request, *NextRequest;
+    FSP_FSCTL_TRANSACT_RSP *Response;
+
+    /* advertise more credits than the static IrpCapacity allows */
+    Response = FspFsctlTransactProduceCreditResponse((PVOID)ResponseBuf, 1000);
+    ResponseBufSize = (PUINT8)Response - ResponseBuf;
+    RequestBufSize = 0;
+    Result = FspFsctlTransact(VolumeHandle, ResponseBuf, ResponseBufSize, 0, &RequestBufSize, TRUE);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        StringCbPrintfW(FilePath[I], sizeof FilePath[I], L"%s%s\\file%u",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : VolumeName, I);
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, mount_volume_transact_batch_dotest_thread,
+            FilePath[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    Sleep(2000); /* slow consumer: let the requests queue up */
+
+    ResponseBufSize = 0;
+    while (sizeof Threads / sizeof Threads[0] > CreateCount)
+    {
+        RequestBufSize = sizeof RequestBuf;
+        Result = FspFsctlTransact(VolumeHandle,
+            ResponseBuf, ResponseBufSize, RequestBuf, &RequestBufSize, TRUE);
+        ASSERT(STATUS_SUCCESS == Result);
+        TransactCount++;
+
+        ULONG Depth = 0;
+        Response = (PVOID)ResponseBuf;
+        RequestBufEnd = RequestBuf + RequestBufSize;
+        for (Request = (PVOID)RequestBuf;
+            0 != (NextRequest = FspFsctlTransactConsumeRequest(Request, RequestBufEnd));
+            Request = NextRequest)
+        {
+            if (FspFsctlTransactCreateKind == Request->Kind)
+                CreateCount++;
+            Depth++;
+
+            ASSERT(FspFsctlTransactCanProduceResponse(Response, ResponseBufEnd));
+
+            RtlZeroMemory(Response, sizeof *Response);
+            Response->Size = sizeof *Response;
+            Response->Hint = Request->Hint;
+            Response->Kind = Request->Kind;
+            Response->IoStatus.Status = STATUS_ACCESS_DENIED;
+            Response->IoStatus.Information = 0;
+
+            Response = FspFsctlTransactProduceResponse(Response, Response->Size);
+        }
+        if (MaxDepth < Depth)
+            MaxDepth = Depth;
+        Response = FspFsctlTransactProduceCreditResponse(Response, 1000);
+        ResponseBufSize = (PUINT8)Response - ResponseBuf;
+    }
+
+    RequestBufSize = 0;
+    Result = FspFsctlTransact(VolumeHandle, ResponseBuf, ResponseBufSize, 0, &RequestBufSize, TRUE);
+    ASSERT(STATUS_SUCCESS == Result);
+
+    FspDebugLog(__FUNCTION__ ": %u creates in %u transacts (max %u requests per transact)\n",
+        CreateCount, TransactCount, MaxDepth);
+
+    Success = CloseHandle(VolumeHandle);
+    ASSERT(Success);
+
+    /* none of the requests was rejected, although there were more than IrpCapacity of them */
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(ERROR_ACCESS_DENIED == ExitCode);
+    }
+}
+
+void mount_volume_transact_credit_test(void)
+{
+    if (WinFspDiskTests)
+        mount_volume_transact_credit_dotest(L"WinFsp.Disk", 0);
+    if (WinFspNetTests)
+        mount_volume_transact_credit_dotest(L"WinFsp.Net", L"\\\\winfsp-tests\\share");
+}
+
+typedef struct
+{
+    FSP_FSCTL_TRANSACT_RING *Ring;
+    ULONG Index;
+    ULONG Count;
+    volatile LONG64 *PSum;
+    volatile LONG *PConsumed;
+} MOUNT_TRANSACT_RING_CONTEXT;
+
+static unsigned __stdcall mount_transact_ring_producer(void *Context0)
+{
+    MOUNT_TRANSACT_RING_CONTEXT *Context = Context0;
+    PVOID Buffer;
+    LONG64 Position;
+
+    for (ULONG I = 0; Context->Count > I; I++)
+    {
+        while (0 == (Buffer = FspFsctlTransactRingProduceBegin(Context->Ring,
+            Context->Ring->SlotCount, &Position)))
+            SwitchToThread();
+        *(PUINT64)Buffer = ((UINT64)Context->Index << 32) | I;
+        FspFsctlTransactRingProduceEnd(Context->Ring, Context->Ring->SlotCount, Position);
+    }
+
+    return 0;
+}
+
+static unsigned __stdcall mount_transact_ring_consumer(void *Context0)
+{
+    MOUNT_TRANSACT_RING_CONTEXT *Context = Context0;
+    PVOID Buffer;
+    LONG64 Position;
+    UINT64 Value;
+
+    for (;;)
+    {
+        while (0 == (Buffer = FspFsctlTransactRingConsumeBegin(Context->Ring,
+            Context->Ring->SlotCount, &Position)))
+        {
+            if (*Context->PConsumed >= (LONG)Context->Count)
+                return 0;
+            SwitchToThread();
+        }
+        Value = *(PUINT64)Buffer;
+        FspFsctlTransactRingConsumeEnd(Context->Ring, Context->Ring->SlotCount, Position);
+
+        InterlockedExchangeAdd64(Context->PSum, (LONG64)(Value & 0xffffffff));
+        InterlockedIncrement(Context->PConsumed);
+    }
+}
+
+void mount_transact_ring_test(void)
+{
+    const ULONG SlotCount = 64, ThreadCount = 4, ItemCount = 100000;
+    FSP_FSCTL_TRANSACT_RING *Ring;
+    MOUNT_TRANSACT_RING_CONTEXT Contexts[8];
+    HANDLE Threads[8];
+    volatile LONG64 Sum = 0;
+    volatile LONG Consumed = 0;
+    LONG64 ExpectedSum;
+    DWORD Ticks;
+
+    Ring = VirtualAlloc(0, FspFsctlTransactRingSize(SlotCount),
+        MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    ASSERT(0 != Ring);
+    FspFsctlTransactRingInitialize(Ring, SlotCount);
+
+    ASSERT(FspFsctlTransactRingCanProduce(Ring, SlotCount));
+    ASSERT(!FspFsctlTransactRingCanConsume(Ring, SlotCount));
+
+    Ticks = GetTickCount();
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        Contexts[I].Ring = Ring;
+        Contexts[I].Index = I;
+        Contexts[I].Count = ItemCount;
+        Contexts[I].PSum = &Sum;
+        Contexts[I].PConsumed = &Consumed;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, mount_transact_ring_producer, &Contexts[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+
+        Contexts[ThreadCount + I] = Contexts[I];
+        Contexts[ThreadCount + I].Count = ThreadCount * ItemCount;
+        Threads[ThreadCount + I] = (HANDLE)_beginthreadex(0, 0, mount_transact_ring_consumer,
+            &Contexts[ThreadCount + I], 0, 0);
+        ASSERT(0 != Threads[ThreadCount + I]);
+    }
+
+    for (ULONG I = 0; 2 * ThreadCount > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+    Ticks = GetTickCount() - Ticks;
+
+    FspDebugLog(__FUNCTION__ ": %u items in %u ms\n", ThreadCount * ItemCount, Ticks);
+
+    ExpectedSum = (LONG64)ThreadCount * ItemCount * (ItemCount - 1) / 2;
+    ASSERT((LONG)(ThreadCount * ItemCount) == Consumed);
+    ASSERT(ExpectedSum == Sum);
+    ASSERT(FspFsctlTransactRingCanProduce(Ring, SlotCount));
+    ASSERT(!FspFsctlTransactRingCanConsume(Ring, SlotCount));
+
+    VirtualFree(Ring, 0, MEM_RELEASE);
+}
+
 void mount_tests(void)
 {
     TEST(mount_invalid_test);
     TEST(mount_open_device_test);
     TEST(mount_create_volume_test);
+    TEST(mount_create_volume_v0_test);
     TEST(mount_volume_cancel_test);
     TEST(mount_volume_transact_test);
+    TEST(mount_volume_transact_batch_test);
+    TEST(mount_volume_transact_shard_test);
+    TEST(mount_volume_transact_credit_test);
+    TEST(mount_transact_ring_test);
 }
@@ -1,5 +1,6 @@
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
+#include <process.h>
 #include <strsafe.h>
 #include <time.h>
 #include <VersionHelpers.h>
@@ -1080,6 +1081,1007 @@ void rdwr_mixed_test(void)
     }
 }
 
+static volatile LONG rdwr_validation_dotest_read_count;
+static volatile LONG rdwr_validation_dotest_modify_on_query;
+static volatile LONG rdwr_validation_dotest_modify_on_open;
+
+static VOID rdwr_validation_dotest_modify(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, PVOID FileNode, UINT8 Fill, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    /* modify the file behind the FSD's back; this is what another client of a shared store does */
+    UINT8 Buffer[4096];
+    ULONG BytesTransferred;
+    FSP_FSCTL_FILE_INFO FileInfoBuf;
+    NTSTATUS Result;
+
+    memset(Buffer, Fill, sizeof Buffer);
+    Result = FileSystem->Interface->Write(FileSystem, Request, FileNode,
+        Buffer, 0, sizeof Buffer, FALSE, TRUE, &BytesTransferred, &FileInfoBuf);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(sizeof Buffer == BytesTransferred);
+
+    /* bump the version stamp */
+    Result = FileSystem->Interface->SetBasicInfo(FileSystem, Request, FileNode,
+        INVALID_FILE_ATTRIBUTES, 0, 0, FileInfoBuf.LastWriteTime + 10000000, FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+}
+
+static NTSTATUS rdwr_validation_dotest_create(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    NTSTATUS Result;
+    UINT8 Fill;
+
+    Result = FspFileSystemOpCreate(FileSystem, Request, Response);
+    if (STATUS_SUCCESS == Result &&
+        0 != (Fill = (UINT8)InterlockedExchange(&rdwr_validation_dotest_modify_on_open, 0)))
+        rdwr_validation_dotest_modify(FileSystem, Request,
+            (PVOID)(UINT_PTR)Response->Rsp.Create.Opened.UserContext, Fill,
+            &Response->Rsp.Create.Opened.FileInfo);
+
+    return Result;
+}
+
+static NTSTATUS rdwr_validation_dotest_query(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    FSP_FSCTL_FILE_INFO FileInfo;
+    UINT8 Fill;
+
+    if (0 != (Fill = (UINT8)InterlockedExchange(&rdwr_validation_dotest_modify_on_query, 0)))
+        rdwr_validation_dotest_modify(FileSystem, Request,
+            (PVOID)(UINT_PTR)Request->Req.QueryInformation.UserContext, Fill, &FileInfo);
+
+    return FspFileSystemOpQueryInformation(FileSystem, Request, Response);
+}
+
+static NTSTATUS rdwr_validation_dotest_read(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    InterlockedIncrement(&rdwr_validation_dotest_read_count);
+    return FspFileSystemOpRead(FileSystem, Request, Response);
+}
+
+static void rdwr_validation_dotest_check(HANDLE Handle, UINT8 Fill)
+{
+    __declspec(align(4096)) UINT8 Buffer[4096];
+    DWORD BytesTransferred;
+    BOOL Success;
+
+    ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+    memset(Buffer, 0, sizeof Buffer);
+    Success = ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(sizeof Buffer == BytesTransferred);
+    for (ULONG I = 0; sizeof Buffer > I; I++)
+        ASSERT(Fill == Buffer[I]);
+}
+
+static void rdwr_validation_dotest(ULONG Flags, PWSTR Prefix)
+{
+    /* FileInfoTimeout of 0: every cached read or write revalidates the cache */
+    void *memfs = memfs_start_ex(Flags | MemfsCacheValidation, 0);
+    HANDLE Handle, Handle2;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    __declspec(align(4096)) UINT8 Buffer[4096];
+    DWORD BytesTransferred;
+    LONG ReadCount;
+
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactCreateKind,
+        rdwr_validation_dotest_create);
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactQueryInformationKind,
+        rdwr_validation_dotest_query);
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactReadKind,
+        rdwr_validation_dotest_read);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    memset(Buffer, 'A', sizeof Buffer);
+    Success = WriteFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(sizeof Buffer == BytesTransferred);
+    Success = FlushFileBuffers(Handle);
+    ASSERT(Success);
+
+    /* matching stamp: the cached data are kept */
+    rdwr_validation_dotest_check(Handle, 'A');
+    ReadCount = rdwr_validation_dotest_read_count;
+    rdwr_validation_dotest_check(Handle, 'A');
+    ASSERT(ReadCount == rdwr_validation_dotest_read_count);
+
+    /* stale cache detected on revalidation */
+    InterlockedExchange(&rdwr_validation_dotest_modify_on_query, 'B');
+    rdwr_validation_dotest_check(Handle, 'B');
+    ASSERT(0 == rdwr_validation_dotest_modify_on_query);
+    ASSERT(ReadCount < rdwr_validation_dotest_read_count);
+
+    /* stale cache detected on open */
+    InterlockedExchange(&rdwr_validation_dotest_modify_on_open, 'C');
+    Handle2 = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle2);
+    ASSERT(0 == rdwr_validation_dotest_modify_on_open);
+    rdwr_validation_dotest_check(Handle, 'C');
+
+    /* concurrent writers through the FSD share the cache; their dirty data are not purged */
+    memset(Buffer, 'D', sizeof Buffer);
+    ASSERT(0 == SetFilePointer(Handle2, 0, 0, FILE_BEGIN));
+    Success = WriteFile(Handle2, Buffer, sizeof Buffer, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(sizeof Buffer == BytesTransferred);
+    rdwr_validation_dotest_check(Handle, 'D');
+    memset(Buffer, 'E', sizeof Buffer);
+    ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+    Success = WriteFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(sizeof Buffer == BytesTransferred);
+    rdwr_validation_dotest_check(Handle2, 'E');
+    Success = FlushFileBuffers(Handle2);
+    ASSERT(Success);
+    rdwr_validation_dotest_check(Handle2, 'E');
+    rdwr_validation_dotest_check(Handle, 'E');
+
+    /* lazy writer flush: our own paging writes must not make the cache look stale */
+    memset(Buffer, 'F', sizeof Buffer);
+    ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+    Success = WriteFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(sizeof Buffer == BytesTransferred);
+    Sleep(3000);
+    ReadCount = rdwr_validation_dotest_read_count;
+    rdwr_validation_dotest_check(Handle, 'F');
+    ASSERT(ReadCount == rdwr_validation_dotest_read_count);
+    memset(Buffer, 'G', sizeof Buffer);
+    Success = WriteFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(sizeof Buffer == BytesTransferred);
+
+    Success = CloseHandle(Handle2);
+    ASSERT(Success);
+
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    /* both writes made it to the file system */
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    rdwr_validation_dotest_check(Handle, 'F');
+    memset(Buffer, 0, sizeof Buffer);
+    Success = ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(sizeof Buffer == BytesTransferred);
+    for (ULONG I = 0; sizeof Buffer > I; I++)
+        ASSERT('G' == Buffer[I]);
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    Success = DeleteFileW(FilePath);
+    ASSERT(Success);
+
+    memfs_stop(memfs);
+}
+
+void rdwr_validation_test(void)
+{
+    if (WinFspDiskTests)
+        rdwr_validation_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        rdwr_validation_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+static void rdwr_iobuffers_dotest(ULONG Flags, PWSTR Prefix, BOOLEAN Register)
+{
+    void *memfs = memfs_create(Flags, INFINITE, 1024, 1024 * 1024);
+
+    NTSTATUS Result;
+    HANDLE Handle, FindHandle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    WIN32_FIND_DATAW FindData;
+    PUINT8 IoBuffers = 0, FileData, Buffer;
+    ULONG FileSize = 1024 * 1024, Length, Offset;
+    DWORD BytesTransferred;
+
+    if (Register)
+    {
+        IoBuffers = VirtualAlloc(0, 16 * 65536, MEM_COMMIT, PAGE_READWRITE);
+        ASSERT(0 != IoBuffers);
+        Result = FspFsctlRegisterIoBuffers(MemfsFileSystem(memfs)->VolumeHandle,
+            IoBuffers, 65536, 16);
+        ASSERT(NT_SUCCESS(Result));
+
+        /* buffers can only be registered once */
+        Result = FspFsctlRegisterIoBuffers(MemfsFileSystem(memfs)->VolumeHandle,
+            IoBuffers, 65536, 16);
+        ASSERT(!NT_SUCCESS(Result));
+    }
+
+    memfs_start_dispatcher(memfs, 0);
+
+    FileData = VirtualAlloc(0, FileSize, MEM_COMMIT, PAGE_READWRITE);
+    Buffer = VirtualAlloc(0, 65536, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != FileData && 0 != Buffer);
+
+    srand(GetTickCount());
+    for (ULONG I = 0; FileSize > I; I++)
+        FileData[I] = rand();
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    /* 128K writes do not fit in a slot and take the mapped path */
+    for (Offset = 0; FileSize > Offset; Offset += 131072)
+    {
+        Success = WriteFile(Handle, FileData + Offset, 131072, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(131072 == BytesTransferred);
+    }
+
+    for (ULONG I = 0; 512 > I; I++)
+    {
+        Length = 0 == I % 2 ? 4096 : 65536;
+        Offset = (rand() % ((FileSize - Length) / 4096)) * 4096;
+
+        ASSERT(INVALID_SET_FILE_POINTER != SetFilePointer(Handle, Offset, 0, FILE_BEGIN));
+        Success = ReadFile(Handle, Buffer, Length, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(Length == BytesTransferred);
+        ASSERT(0 == memcmp(FileData + Offset, Buffer, Length));
+
+        if (0 == I % 16)
+        {
+            /* overwrite a block through the slot path and read it back */
+            for (ULONG J = 0; 4096 > J; J++)
+                FileData[Offset + J] = rand();
+            ASSERT(INVALID_SET_FILE_POINTER != SetFilePointer(Handle, Offset, 0, FILE_BEGIN));
+            Success = WriteFile(Handle, FileData + Offset, 4096, &BytesTransferred, 0);
+            ASSERT(Success);
+            ASSERT(4096 == BytesTransferred);
+        }
+    }
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\*",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    FindHandle = FindFirstFileW(FilePath, &FindData);
+    ASSERT(INVALID_HANDLE_VALUE != FindHandle);
+    ASSERT(0 == wcscmp(FindData.cFileName, L"file0"));
+    ASSERT(!FindNextFileW(FindHandle, &FindData));
+    ASSERT(ERROR_NO_MORE_FILES == GetLastError());
+    FindClose(FindHandle);
+
+    CloseHandle(Handle);
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+    VirtualFree(FileData, 0, MEM_RELEASE);
+
+    memfs_stop(memfs);
+
+    /* the buffers are unlocked when the volume is deleted */
+    if (0 != IoBuffers)
+        VirtualFree(IoBuffers, 0, MEM_RELEASE);
+}
+
+void rdwr_iobuffers_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        rdwr_iobuffers_dotest(MemfsDisk, 0, FALSE);
+        rdwr_iobuffers_dotest(MemfsDisk, 0, TRUE);
+    }
+    if (WinFspNetTests)
+    {
+        rdwr_iobuffers_dotest(MemfsNet, L"\\\\memfs\\share", FALSE);
+        rdwr_iobuffers_dotest(MemfsNet, L"\\\\memfs\\share", TRUE);
+    }
+}
+
+static volatile LONG rdwr_splitio_dotest_read_count, rdwr_splitio_dotest_read_count_max;
+
+static NTSTATUS rdwr_splitio_dotest_read(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    NTSTATUS Result;
+    LONG Count, CountMax;
+
+    /* track how many reads the file system is serving at the same time */
+    Count = InterlockedIncrement(&rdwr_splitio_dotest_read_count);
+    while (Count > (CountMax = rdwr_splitio_dotest_read_count_max))
+        InterlockedCompareExchange(&rdwr_splitio_dotest_read_count_max, Count, CountMax);
+
+    /* inject backend latency proportional to the transfer size: 1ms per 64K */
+    Sleep(1 + Request->Req.Read.Length / 65536);
+    Result = FspFileSystemOpRead(FileSystem, Request, Response);
+
+    InterlockedDecrement(&rdwr_splitio_dotest_read_count);
+
+    return Result;
+}
+
+static void rdwr_splitio_dotest(ULONG Flags, PWSTR Prefix)
+{
+    void *memfs = memfs_create(Flags, INFINITE, 1024, 16 * 1024 * 1024);
+    FSP_FILE_SYSTEM_DISPATCHER_PARAMS DispatcherParams = { 0 };
+
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    PUINT8 FileData, Buffer;
+    ULONG FileSize = 8 * 1024 * 1024;
+    DWORD BytesTransferred;
+
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactReadKind,
+        rdwr_splitio_dotest_read);
+    rdwr_splitio_dotest_read_count = 0;
+    rdwr_splitio_dotest_read_count_max = 0;
+
+    /* enough dispatcher threads to serve all chunks of a split read concurrently */
+    DispatcherParams.ThreadCount = 2 * FspFsctlSplitIoFanOutDefault;
+    memfs_start_dispatcher(memfs, &DispatcherParams);
+
+    FileData = VirtualAlloc(0, FileSize, MEM_COMMIT, PAGE_READWRITE);
+    Buffer = VirtualAlloc(0, FileSize, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != FileData && 0 != Buffer);
+
+    srand(GetTickCount());
+    for (ULONG I = 0; FileSize > I; I++)
+        FileData[I] = rand();
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    Success = WriteFile(Handle, FileData, FileSize, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(FileSize == BytesTransferred);
+
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+        memset(Buffer, 0, FileSize);
+        Success = ReadFile(Handle, Buffer, FileSize, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(FileSize == BytesTransferred);
+        ASSERT(FileSize == SetFilePointer(Handle, 0, 0, FILE_CURRENT));
+        ASSERT(0 == memcmp(FileData, Buffer, FileSize));
+    }
+
+    /* the chunks of a split read are served concurrently; an unsplit read is served whole */
+    if (Flags & MemfsSplitIo)
+        ASSERT(1 < rdwr_splitio_dotest_read_count_max);
+    else
+        ASSERT(1 == rdwr_splitio_dotest_read_count_max);
+
+    /* a read that crosses the end of file is short; one past the end fails */
+    ASSERT(FileSize - 512 * 1024 == SetFilePointer(Handle, FileSize - 512 * 1024, 0, FILE_BEGIN));
+    Success = ReadFile(Handle, Buffer, 1024 * 1024, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(512 * 1024 == BytesTransferred);
+    ASSERT(0 == memcmp(FileData + FileSize - 512 * 1024, Buffer, 512 * 1024));
+    Success = ReadFile(Handle, Buffer, 1024 * 1024, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(0 == BytesTransferred);
+
+    CloseHandle(Handle);
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+    VirtualFree(FileData, 0, MEM_RELEASE);
+
+    memfs_stop(memfs);
+}
+
+void rdwr_splitio_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        rdwr_splitio_dotest(MemfsDisk, 0);
+        rdwr_splitio_dotest(MemfsDisk | MemfsSplitIo, 0);
+    }
+    if (WinFspNetTests)
+    {
+        rdwr_splitio_dotest(MemfsNet, L"\\\\memfs\\share");
+        rdwr_splitio_dotest(MemfsNet | MemfsSplitIo, L"\\\\memfs\\share");
+    }
+}
+
+#define RDWR_IOVEC_DOTEST_CHUNKSIZE    (64 * 1024)
+
+static const FSP_FILE_SYSTEM_INTERFACE *rdwr_iovec_dotest_memfs_interface;
+static FSP_FILE_SYSTEM_INTERFACE rdwr_iovec_dotest_interface;
+static volatile LONG rdwr_iovec_dotest_copy_count;
+
+static NTSTATUS rdwr_iovec_dotest_fetch(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, PVOID FileNode, UINT64 Offset, PVOID Buffer,
+    PULONG PBytesTransferred)
+{
+    /* a chunked backend: data can only be fetched one whole chunk at a time */
+    NTSTATUS Result;
+
+    InterlockedIncrement(&rdwr_iovec_dotest_copy_count);
+    Result = rdwr_iovec_dotest_memfs_interface->Read(FileSystem, Request, FileNode,
+        Buffer, Offset - Offset % RDWR_IOVEC_DOTEST_CHUNKSIZE, RDWR_IOVEC_DOTEST_CHUNKSIZE,
+        PBytesTransferred);
+    return STATUS_END_OF_FILE == Result ? (*PBytesTransferred = 0, STATUS_SUCCESS) : Result;
+}
+
+static NTSTATUS rdwr_iovec_dotest_fetch_staged(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, PVOID FileNode, UINT64 Offset, PVOID Buffer, ULONG Length,
+    PULONG PBytesTransferred)
+{
+    /* fetch the chunk that contains Offset into a staging buffer and copy the requested part */
+    PUINT8 Chunk;
+    ULONG ChunkOffset = (ULONG)(Offset % RDWR_IOVEC_DOTEST_CHUNKSIZE);
+    ULONG BytesTransferred;
+    NTSTATUS Result;
+
+    *PBytesTransferred = 0;
+
+    Chunk = malloc(RDWR_IOVEC_DOTEST_CHUNKSIZE);
+    if (0 == Chunk)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    Result = rdwr_iovec_dotest_fetch(FileSystem, Request, FileNode, Offset, Chunk,
+        &BytesTransferred);
+    if (NT_SUCCESS(Result) && ChunkOffset < BytesTransferred)
+    {
+        if (Length > BytesTransferred - ChunkOffset)
+            Length = BytesTransferred - ChunkOffset;
+        InterlockedIncrement(&rdwr_iovec_dotest_copy_count);
+        memcpy(Buffer, Chunk + ChunkOffset, Length);
+        *PBytesTransferred = Length;
+    }
+
+    free(Chunk);
+
+    return Result;
+}
+
+static NTSTATUS rdwr_iovec_dotest_read(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, PVOID Buffer, UINT64 Offset, ULONG Length,
+    PULONG PBytesTransferred)
+{
+    /* without an I/O vector every chunk is gathered through the staging buffer */
+    ULONG SegmentLength, BytesTransferred;
+    NTSTATUS Result = STATUS_SUCCESS;
+
+    *PBytesTransferred = 0;
+    while (0 < Length)
+    {
+        SegmentLength = RDWR_IOVEC_DOTEST_CHUNKSIZE - (ULONG)(Offset % RDWR_IOVEC_DOTEST_CHUNKSIZE);
+        if (SegmentLength > Length)
+            SegmentLength = Length;
+        Result = rdwr_iovec_dotest_fetch_staged(FileSystem, Request, FileNode,
+            Offset, Buffer, SegmentLength, &BytesTransferred);
+        if (!NT_SUCCESS(Result))
+            break;
+        *PBytesTransferred += BytesTransferred;
+        if (SegmentLength > BytesTransferred)
+            break;
+        Buffer = (PUINT8)Buffer + SegmentLength;
+        Offset += SegmentLength;
+        Length -= SegmentLength;
+    }
+
+    return 0 == *PBytesTransferred && NT_SUCCESS(Result) ? STATUS_END_OF_FILE : Result;
+}
+
+static NTSTATUS rdwr_iovec_dotest_readex(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, FSP_FILE_SYSTEM_IOVEC *IoVec, ULONG IoVecCount,
+    PULONG PBytesTransferred)
+{
+    /* segments that cover a whole chunk are fetched directly into place */
+    ULONG BytesTransferred;
+    NTSTATUS Result = STATUS_SUCCESS;
+
+    *PBytesTransferred = 0;
+    for (ULONG I = 0; IoVecCount > I; I++)
+    {
+        ASSERT(1 == IoVecCount || RDWR_IOVEC_DOTEST_CHUNKSIZE >=
+            IoVec[I].Offset % RDWR_IOVEC_DOTEST_CHUNKSIZE + IoVec[I].Length);
+        ASSERT(0 == I || IoVec[I - 1].Offset + IoVec[I - 1].Length == IoVec[I].Offset);
+
+        if (RDWR_IOVEC_DOTEST_CHUNKSIZE == IoVec[I].Length)
+            Result = rdwr_iovec_dotest_fetch(FileSystem, Request, FileNode,
+                IoVec[I].Offset, IoVec[I].Buffer, &BytesTransferred);
+        else
+            Result = rdwr_iovec_dotest_fetch_staged(FileSystem, Request, FileNode,
+                IoVec[I].Offset, IoVec[I].Buffer, IoVec[I].Length, &BytesTransferred);
+        if (!NT_SUCCESS(Result))
+            break;
+        *PBytesTransferred += BytesTransferred;
+        if (IoVec[I].Length > BytesTransferred)
+            break;
+    }
+
+    return 0 == *PBytesTransferred && NT_SUCCESS(Result) ? STATUS_END_OF_FILE : Result;
+}
+
+static NTSTATUS rdwr_iovec_dotest_writeex(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, FSP_FILE_SYSTEM_IOVEC *IoVec, ULONG IoVecCount,
+    BOOLEAN WriteToEndOfFile, BOOLEAN ConstrainedIo,
+    PULONG PBytesTransferred, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    ULONG BytesTransferred;
+    NTSTATUS Result = STATUS_SUCCESS;
+
+    ASSERT(!WriteToEndOfFile || 1 == IoVecCount);
+
+    *PBytesTransferred = 0;
+    for (ULONG I = 0; IoVecCount > I; I++)
+    {
+        Result = rdwr_iovec_dotest_memfs_interface->Write(FileSystem, Request, FileNode,
+            IoVec[I].Buffer, IoVec[I].Offset, IoVec[I].Length,
+            WriteToEndOfFile, ConstrainedIo,
+            &BytesTransferred, FileInfo);
+        if (!NT_SUCCESS(Result))
+            break;
+        *PBytesTransferred += BytesTransferred;
+        if (IoVec[I].Length > BytesTransferred)
+            break;
+    }
+
+    return Result;
+}
+
+static LONG rdwr_iovec_dotest(ULONG Flags, PWSTR Prefix, BOOLEAN IoVec)
+{
+    void *memfs = memfs_start_ex(Flags, INFINITE);
+
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    PUINT8 FileData, Buffer;
+    ULONG FileSize = 1024 * 1024;
+    DWORD BytesTransferred;
+    LONG CopyCount;
+
+    rdwr_iovec_dotest_memfs_interface = MemfsFileSystem(memfs)->Interface;
+    rdwr_iovec_dotest_interface = *rdwr_iovec_dotest_memfs_interface;
+    if (IoVec)
+    {
+        rdwr_iovec_dotest_interface.ReadEx = rdwr_iovec_dotest_readex;
+        rdwr_iovec_dotest_interface.WriteEx = rdwr_iovec_dotest_writeex;
+        FspFileSystemSetIoVecChunkSize(MemfsFileSystem(memfs), RDWR_IOVEC_DOTEST_CHUNKSIZE);
+    }
+    else
+        rdwr_iovec_dotest_interface.Read = rdwr_iovec_dotest_read;
+    MemfsFileSystem(memfs)->Interface = &rdwr_iovec_dotest_interface;
+
+    FileData = VirtualAlloc(0, FileSize, MEM_COMMIT, PAGE_READWRITE);
+    Buffer = VirtualAlloc(0, FileSize, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != FileData && 0 != Buffer);
+
+    srand(GetTickCount());
+    for (ULONG I = 0; FileSize > I; I++)
+        FileData[I] = rand();
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    /* unaligned writes: segments start and end mid-chunk */
+    Success = WriteFile(Handle, FileData, 4096, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(4096 == BytesTransferred);
+    Success = WriteFile(Handle, FileData + 4096, FileSize - 4096, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(FileSize - 4096 == BytesTransferred);
+
+    InterlockedExchange(&rdwr_iovec_dotest_copy_count, 0);
+
+    /* chunk aligned reads */
+    for (ULONG I = 0; 2 > I; I++)
+    {
+        ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+        memset(Buffer, 0, FileSize);
+        Success = ReadFile(Handle, Buffer, FileSize, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(FileSize == BytesTransferred);
+        ASSERT(0 == memcmp(FileData, Buffer, FileSize));
+    }
+
+    /* an unaligned read */
+    ASSERT(512 == SetFilePointer(Handle, 512, 0, FILE_BEGIN));
+    memset(Buffer, 0, FileSize);
+    Success = ReadFile(Handle, Buffer, 3 * RDWR_IOVEC_DOTEST_CHUNKSIZE, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(3 * RDWR_IOVEC_DOTEST_CHUNKSIZE == BytesTransferred);
+    ASSERT(0 == memcmp(FileData + 512, Buffer, 3 * RDWR_IOVEC_DOTEST_CHUNKSIZE));
+
+    CopyCount = rdwr_iovec_dotest_copy_count;
+
+    CloseHandle(Handle);
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+    VirtualFree(FileData, 0, MEM_RELEASE);
+
+    memfs_stop(memfs);
+
+    return CopyCount;
+}
+
+void rdwr_iovec_test(void)
+{
+    if (WinFspDiskTests)
+        ASSERT(rdwr_iovec_dotest(MemfsDisk, 0, TRUE) < rdwr_iovec_dotest(MemfsDisk, 0, FALSE));
+    if (WinFspNetTests)
+        ASSERT(rdwr_iovec_dotest(MemfsNet, L"\\\\memfs\\share", TRUE) <
+            rdwr_iovec_dotest(MemfsNet, L"\\\\memfs\\share", FALSE));
+}
+
+static const FSP_FILE_SYSTEM_INTERFACE *rdwr_readahead_dotest_memfs_interface;
+static FSP_FILE_SYSTEM_INTERFACE rdwr_readahead_dotest_interface;
+static UINT64 rdwr_readahead_dotest_hint_offset;
+static ULONG rdwr_readahead_dotest_hint_length;
+static UINT64 rdwr_readahead_dotest_prefetch_begin, rdwr_readahead_dotest_prefetch_end;
+static ULONG rdwr_readahead_dotest_prefetch_hits;
+
+static NTSTATUS rdwr_readahead_dotest_readahead(FSP_FILE_SYSTEM *FileSystem,
+    PVOID FileNode, UINT64 Offset, ULONG Length)
+{
+    rdwr_readahead_dotest_hint_offset = Offset;
+    rdwr_readahead_dotest_hint_length = Length;
+
+    /* pretend that the predicted range is fetched in the background */
+    if (rdwr_readahead_dotest_prefetch_begin <= Offset && Offset <= rdwr_readahead_dotest_prefetch_end)
+    {
+        if (rdwr_readahead_dotest_prefetch_end < Offset + Length)
+            rdwr_readahead_dotest_prefetch_end = Offset + Length;
+    }
+    else
+    {
+        rdwr_readahead_dotest_prefetch_begin = Offset;
+        rdwr_readahead_dotest_prefetch_end = Offset + Length;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS rdwr_readahead_dotest_read(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, PVOID Buffer, UINT64 Offset, ULONG Length,
+    PULONG PBytesTransferred)
+{
+    /* inject backend latency unless the range has been prefetched */
+    if (rdwr_readahead_dotest_prefetch_begin <= Offset &&
+        Offset + Length <= rdwr_readahead_dotest_prefetch_end)
+        rdwr_readahead_dotest_prefetch_hits++;
+    else
+        Sleep(2);
+
+    return rdwr_readahead_dotest_memfs_interface->Read(FileSystem, Request, FileNode,
+        Buffer, Offset, Length, PBytesTransferred);
+}
+
+static void rdwr_readahead_dotest(ULONG Flags, PWSTR Prefix, BOOLEAN ReadAhead)
+{
+    void *memfs = memfs_start_ex(Flags, INFINITE);
+
+    static struct
+    {
+        ULONG Offset, Length;
+        ULONG HintOffset, HintLength;
+    } Trace[] =
+    {
+        { 0, 65536, 0, 0 },                     /* first read: no history */
+        { 65536, 65536, 131072, 131072 },       /* sequential: hint the next range */
+        { 131072, 65536, 196608, 262144 },      /* window doubles */
+        { 196608, 4096, 200704, 524288 },       /* a short read still grows the window */
+        { 524288, 65536, 0, 0 },                /* forward seek: new run */
+        { 589824, 65536, 655360, 131072 },
+        { 4096, 4096, 0, 0 },                   /* backward seek: new run */
+        { 0, 4096, 0, 0 },                      /* re-read */
+        { 4096, 4096, 8192, 8192 },
+        { 4096, 4096, 0, 0 },                   /* same range again */
+    };
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    PUINT8 FileData, Buffer;
+    ULONG FileSize = 4 * 1024 * 1024;
+    DWORD BytesTransferred;
+
+    rdwr_readahead_dotest_memfs_interface = MemfsFileSystem(memfs)->Interface;
+    rdwr_readahead_dotest_interface = *rdwr_readahead_dotest_memfs_interface;
+    rdwr_readahead_dotest_interface.Read = rdwr_readahead_dotest_read;
+    if (ReadAhead)
+        rdwr_readahead_dotest_interface.ReadAhead = rdwr_readahead_dotest_readahead;
+    MemfsFileSystem(memfs)->Interface = &rdwr_readahead_dotest_interface;
+
+    FileData = VirtualAlloc(0, FileSize, MEM_COMMIT, PAGE_READWRITE);
+    Buffer = VirtualAlloc(0, FileSize, MEM_COMMIT, PAGE_READWRITE);
+    ASSERT(0 != FileData && 0 != Buffer);
+
+    srand(GetTickCount());
+    for (ULONG I = 0; FileSize > I; I++)
+        FileData[I] = rand();
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    Success = WriteFile(Handle, FileData, FileSize, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(FileSize == BytesTransferred);
+
+    if (ReadAhead)
+    {
+        /* replay the trace on a fresh handle and check the hints */
+        HANDLE Handle2 = CreateFileW(FilePath,
+            GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle2);
+
+        for (ULONG I = 0; sizeof Trace / sizeof Trace[0] > I; I++)
+        {
+            rdwr_readahead_dotest_hint_offset = 0;
+            rdwr_readahead_dotest_hint_length = 0;
+            ASSERT(Trace[I].Offset == SetFilePointer(Handle2, Trace[I].Offset, 0, FILE_BEGIN));
+            Success = ReadFile(Handle2, Buffer, Trace[I].Length, &BytesTransferred, 0);
+            ASSERT(Success);
+            ASSERT(Trace[I].Length == BytesTransferred);
+            ASSERT(0 == memcmp(FileData + Trace[I].Offset, Buffer, Trace[I].Length));
+            ASSERT(Trace[I].HintOffset == rdwr_readahead_dotest_hint_offset);
+            ASSERT(Trace[I].HintLength == rdwr_readahead_dotest_hint_length);
+        }
+
+        CloseHandle(Handle2);
+    }
+
+    /* latency-injected sequential scan */
+    rdwr_readahead_dotest_prefetch_begin = rdwr_readahead_dotest_prefetch_end = 0;
+    rdwr_readahead_dotest_prefetch_hits = 0;
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+        for (ULONG Offset = 0; FileSize > Offset; Offset += 65536)
+        {
+            Success = ReadFile(Handle, Buffer + Offset, 65536, &BytesTransferred, 0);
+            ASSERT(Success);
+            ASSERT(65536 == BytesTransferred);
+        }
+        ASSERT(0 == memcmp(FileData, Buffer, FileSize));
+    }
+
+    /* the hint window is capped */
+    if (ReadAhead)
+    {
+        ASSERT(FileSize == rdwr_readahead_dotest_hint_offset);
+        ASSERT(4 * 1024 * 1024 == rdwr_readahead_dotest_hint_length);
+        ASSERT(0 < rdwr_readahead_dotest_prefetch_hits);
+    }
+    else
+        ASSERT(0 == rdwr_readahead_dotest_prefetch_hits);
+
+    CloseHandle(Handle);
+
+    VirtualFree(Buffer, 0, MEM_RELEASE);
+    VirtualFree(FileData, 0, MEM_RELEASE);
+
+    memfs_stop(memfs);
+}
+
+void rdwr_readahead_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        rdwr_readahead_dotest(MemfsDisk, 0, TRUE);
+        rdwr_readahead_dotest(MemfsDisk, 0, FALSE);
+    }
+    if (WinFspNetTests)
+    {
+        rdwr_readahead_dotest(MemfsNet, L"\\\\memfs\\share", TRUE);
+        rdwr_readahead_dotest(MemfsNet, L"\\\\memfs\\share", FALSE);
+    }
+}
+
+typedef struct
+{
+    PWSTR FilePath;
+    ULONG Latency[200];
+    UINT8 Buffer[16 * 4096];
+    UINT8 ReadBuffer[4096];
+} RDWR_WORKQUEUE_DOTEST_DATA;
+
+static unsigned __stdcall rdwr_workqueue_dotest_iothread(void *Data0)
+{
+    RDWR_WORKQUEUE_DOTEST_DATA *Data = Data0;
+    HANDLE Handle, Event;
+    OVERLAPPED Overlapped;
+    PUINT8 Buffer = Data->Buffer;
+    DWORD BytesTransferred, Error = 0;
+    LARGE_INTEGER Frequency, Start, Stop;
+
+    QueryPerformanceFrequency(&Frequency);
+
+    /* overlapped I/O cannot wait in the FSD and goes through IRP work items */
+    Handle = CreateFileW(Data->FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+    Event = CreateEventW(0, TRUE, FALSE, 0);
+    if (0 == Event)
+    {
+        Error = GetLastError();
+        CloseHandle(Handle);
+        return Error;
+    }
+
+    for (ULONG I = 0; sizeof Data->Latency / sizeof Data->Latency[0] > I; I++)
+    {
+        /* first pass writes the whole file; afterwards alternate reads and writes */
+        BOOL Success, IsWrite = sizeof Data->Buffer / 4096 > I || 0 == I % 2;
+        if (IsWrite)
+            Buffer[(I % (sizeof Data->Buffer / 4096)) * 4096] = (UINT8)I;
+        memset(&Overlapped, 0, sizeof Overlapped);
+        Overlapped.Offset = (I % (sizeof Data->Buffer / 4096)) * 4096;
+        Overlapped.hEvent = Event;
+        QueryPerformanceCounter(&Start);
+        Success = IsWrite ?
+            WriteFile(Handle, Buffer + Overlapped.Offset, 4096, 0, &Overlapped) :
+            ReadFile(Handle, Data->ReadBuffer, 4096, 0, &Overlapped);
+        if (!Success && ERROR_IO_PENDING != GetLastError())
+        {
+            Error = GetLastError();
+            break;
+        }
+        if (!GetOverlappedResult(Handle, &Overlapped, &BytesTransferred, TRUE))
+        {
+            Error = GetLastError();
+            break;
+        }
+        QueryPerformanceCounter(&Stop);
+        if (4096 != BytesTransferred)
+        {
+            Error = ERROR_HANDLE_EOF;
+            break;
+        }
+        /* a read must see the last write to its block */
+        if (!IsWrite && 0 != memcmp(Data->ReadBuffer, Buffer + Overlapped.Offset, 4096))
+        {
+            Error = ERROR_INVALID_DATA;
+            break;
+        }
+        Data->Latency[I] = (ULONG)((Stop.QuadPart - Start.QuadPart) * 1000000 / Frequency.QuadPart);
+    }
+
+    CloseHandle(Event);
+    CloseHandle(Handle);
+
+    return Error;
+}
+
+static unsigned __stdcall rdwr_workqueue_dotest_mdthread(void *FilePath0)
+{
+    PWSTR FilePath = FilePath0;
+    WCHAR FileName[MAX_PATH];
+    HANDLE Handle;
+    BY_HANDLE_FILE_INFORMATION FileInfo;
+
+    /* synchronous metadata load that competes with the overlapped I/O */
+    for (ULONG I = 0; 1000 > I; I++)
+    {
+        StringCbPrintfW(FileName, sizeof FileName, L"%s%u", FilePath, I % 16);
+        Handle = CreateFileW(FileName,
+            GENERIC_ALL, 0, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, 0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+        if (!GetFileInformationByHandle(Handle, &FileInfo))
+            return GetLastError();
+        CloseHandle(Handle);
+    }
+
+    return 0;
+}
+
+static void rdwr_workqueue_dotest(ULONG Flags, PWSTR Prefix, BOOLEAN LatencyReport)
+{
+    void *memfs = memfs_start_ex(Flags, 1000);
+
+    WCHAR FilePath[8][MAX_PATH];
+    static RDWR_WORKQUEUE_DOTEST_DATA Data[4];
+    static ULONG Latency[4 * 200];
+    HANDLE Threads[8];
+    DWORD ExitCode;
+
+    /* mixed load: 4 threads of overlapped I/O and 4 threads of metadata operations */
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        StringCbPrintfW(FilePath[I], sizeof FilePath[I], L"%s%s\\file%u_",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs), I);
+        if (sizeof Data / sizeof Data[0] > I)
+        {
+            Data[I].FilePath = FilePath[I];
+            for (ULONG J = 0; sizeof Data[I].Buffer > J; J++)
+                Data[I].Buffer[J] = (UINT8)(rand() ^ I);
+            Threads[I] = (HANDLE)_beginthreadex(0, 0, rdwr_workqueue_dotest_iothread, &Data[I], 0, 0);
+        }
+        else
+            Threads[I] = (HANDLE)_beginthreadex(0, 0, rdwr_workqueue_dotest_mdthread, FilePath[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(0 == ExitCode);
+
+        if (sizeof Data / sizeof Data[0] > I)
+            memcpy(Latency + I * 200, Data[I].Latency, sizeof Data[I].Latency);
+    }
+
+    if (LatencyReport)
+    {
+        ulong_sort(Latency, sizeof Latency / sizeof Latency[0]);
+
+        FspDebugLog(__FUNCTION__ "(Flags=%lx): overlapped I/O p50=%uus p99=%uus max=%uus\n",
+            Flags,
+            Latency[sizeof Latency / sizeof Latency[0] * 50 / 100],
+            Latency[sizeof Latency / sizeof Latency[0] * 99 / 100],
+            Latency[sizeof Latency / sizeof Latency[0] - 1]);
+    }
+
+    memfs_stop(memfs);
+}
+
+void rdwr_workqueue_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        rdwr_workqueue_dotest(MemfsDisk, 0, FALSE);
+        rdwr_workqueue_dotest(MemfsDisk | MemfsWorkerThreads, 0, FALSE);
+    }
+    if (WinFspNetTests)
+    {
+        rdwr_workqueue_dotest(MemfsNet, L"\\\\memfs\\share", FALSE);
+        rdwr_workqueue_dotest(MemfsNet | MemfsWorkerThreads, L"\\\\memfs\\share", FALSE);
+    }
+}
+
+void rdwr_workqueue_latency_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        rdwr_workqueue_dotest(MemfsDisk, 0, TRUE);
+        rdwr_workqueue_dotest(MemfsDisk | MemfsWorkerThreads, 0, TRUE);
+    }
+    if (WinFspNetTests)
+    {
+        rdwr_workqueue_dotest(MemfsNet, L"\\\\memfs\\share", TRUE);
+        rdwr_workqueue_dotest(MemfsNet | MemfsWorkerThreads, L"\\\\memfs\\share", TRUE);
+    }
+}
+
 void rdwr_tests(void)
 {
     TEST(rdwr_noncached_test);
@@ -1099,4 +2101,11 @@ void rdwr_tests(void)
     TEST(rdwr_writethru_overlapped_test);
     TEST(rdwr_mmap_test);
     TEST(rdwr_mixed_test);
+    TEST(rdwr_validation_test);
+    TEST(rdwr_iobuffers_test);
+    TEST(rdwr_splitio_test);
+    TEST(rdwr_iovec_test);
+    TEST(rdwr_readahead_test);
+    TEST(rdwr_workqueue_test);
+    TEST_OPT(rdwr_workqueue_latency_test);
 }
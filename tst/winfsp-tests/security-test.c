@@ -1,5 +1,6 @@
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
+#include <process.h>
 #include <sddl.h>
 #include <strsafe.h>
 #include "memfs.h"
@@ -240,8 +241,277 @@ void setsecurity_test(void)
     }
 }
 
+void setsecurity_shared_dotest(ULONG Flags, PWSTR Prefix, ULONG FileInfoTimeout)
+{
+    void *memfs = memfs_start_ex(Flags, FileInfoTimeout);
+
+    static PWSTR Sddl = L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;WD)";
+    static PWSTR Sddl2 = L"D:P(A;;GA;;;SY)(A;;GA;;;BA)";
+    PWSTR ConvertedSddl;
+    PSECURITY_DESCRIPTOR SecurityDescriptor, FileSecurityDescriptor;
+    SECURITY_ATTRIBUTES SecurityAttributes = { 0 };
+    DWORD Length;
+    HANDLE Handles[16];
+    BOOLEAN Success;
+    WCHAR FilePath[MAX_PATH];
+
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl, SDDL_REVISION_1, &SecurityDescriptor, 0);
+    ASSERT(Success);
+
+    SecurityAttributes.nLength = sizeof SecurityAttributes;
+    SecurityAttributes.lpSecurityDescriptor = SecurityDescriptor;
+
+    /* many files with the same security descriptor; the FSD may share a single copy */
+    for (ULONG I = 0; sizeof Handles / sizeof Handles[0] > I; I++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file%u",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs), I);
+
+        Handles[I] = CreateFileW(FilePath,
+            GENERIC_READ | GENERIC_WRITE | WRITE_DAC, FILE_SHARE_READ | FILE_SHARE_WRITE, &SecurityAttributes,
+            CREATE_NEW, FILE_FLAG_DELETE_ON_CLOSE, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handles[I]);
+
+        Success = GetKernelObjectSecurity(Handles[I], DACL_SECURITY_INFORMATION,
+            0, 0, &Length);
+        ASSERT(!Success);
+        ASSERT(ERROR_INSUFFICIENT_BUFFER == GetLastError());
+        FileSecurityDescriptor = malloc(Length);
+        Success = GetKernelObjectSecurity(Handles[I], DACL_SECURITY_INFORMATION,
+            FileSecurityDescriptor, Length, &Length);
+        ASSERT(Success);
+        free(FileSecurityDescriptor);
+    }
+
+    LocalFree(SecurityDescriptor);
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl2, SDDL_REVISION_1, &SecurityDescriptor, 0);
+    ASSERT(Success);
+
+    /* changing the security of one file must not affect the others */
+    Success = SetKernelObjectSecurity(Handles[0], DACL_SECURITY_INFORMATION, SecurityDescriptor);
+    ASSERT(Success);
+
+    for (ULONG I = 0; sizeof Handles / sizeof Handles[0] > I; I++)
+    {
+        Success = GetKernelObjectSecurity(Handles[I], DACL_SECURITY_INFORMATION,
+            0, 0, &Length);
+        ASSERT(!Success);
+        ASSERT(ERROR_INSUFFICIENT_BUFFER == GetLastError());
+        FileSecurityDescriptor = malloc(Length);
+        Success = GetKernelObjectSecurity(Handles[I], DACL_SECURITY_INFORMATION,
+            FileSecurityDescriptor, Length, &Length);
+        ASSERT(Success);
+        ASSERT(ConvertSecurityDescriptorToStringSecurityDescriptorW(FileSecurityDescriptor, SDDL_REVISION_1,
+            DACL_SECURITY_INFORMATION, &ConvertedSddl, 0));
+        ASSERT(0 == wcscmp(0 == I ?
+            L"D:P(A;;FA;;;SY)(A;;FA;;;BA)" : L"D:P(A;;FA;;;SY)(A;;FA;;;BA)(A;;FA;;;WD)",
+            ConvertedSddl));
+        LocalFree(ConvertedSddl);
+        free(FileSecurityDescriptor);
+    }
+
+    for (ULONG I = 0; sizeof Handles / sizeof Handles[0] > I; I++)
+        CloseHandle(Handles[I]);
+
+    LocalFree(SecurityDescriptor);
+
+    memfs_stop(memfs);
+}
+
+void setsecurity_shared_test(void)
+{
+    if (NtfsTests)
+    {
+        WCHAR DirBuf[MAX_PATH] = L"\\\\?\\";
+        GetCurrentDirectoryW(MAX_PATH - 4, DirBuf + 4);
+        setsecurity_shared_dotest(-1, DirBuf, 0);
+    }
+    if (WinFspDiskTests)
+    {
+        setsecurity_shared_dotest(MemfsDisk, 0, 0);
+        setsecurity_shared_dotest(MemfsDisk, 0, 1000);
+    }
+    if (WinFspNetTests)
+    {
+        setsecurity_shared_dotest(MemfsNet, L"\\\\memfs\\share", 0);
+        setsecurity_shared_dotest(MemfsNet, L"\\\\memfs\\share", 1000);
+    }
+}
+
+static volatile LONG security_metacache_dotest_query_count;
+
+static NTSTATUS security_metacache_dotest_query(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    InterlockedIncrement(&security_metacache_dotest_query_count);
+    return FspFileSystemOpQuerySecurity(FileSystem, Request, Response);
+}
+
+static ULONG security_metacache_dotest_acecount(HANDLE Handle)
+{
+    static __declspec(thread) UINT8 Buffer[8192];
+    PSECURITY_DESCRIPTOR FileSecurityDescriptor = (PVOID)Buffer;
+    ACL_SIZE_INFORMATION AclSizeInfo;
+    PACL Dacl;
+    BOOL DaclPresent, DaclDefaulted;
+    DWORD Length;
+
+    if (!GetKernelObjectSecurity(Handle, DACL_SECURITY_INFORMATION,
+        FileSecurityDescriptor, sizeof Buffer, &Length))
+        return 0;
+    if (!GetSecurityDescriptorDacl(FileSecurityDescriptor, &DaclPresent, &Dacl, &DaclDefaulted) ||
+        !DaclPresent || 0 == Dacl)
+        return 0;
+    if (!GetAclInformation(Dacl, &AclSizeInfo, sizeof AclSizeInfo, AclSizeInformation))
+        return 0;
+    return AclSizeInfo.AceCount;
+}
+
+typedef struct
+{
+    HANDLE Handle;
+    ULONG AceCount;
+    volatile LONG Stop;
+} SECURITY_METACACHE_DOTEST_DATA;
+
+static unsigned __stdcall security_metacache_dotest_thread(void *Data0)
+{
+    SECURITY_METACACHE_DOTEST_DATA *Data = Data0;
+
+    while (!Data->Stop)
+        if (Data->AceCount != security_metacache_dotest_acecount(Data->Handle))
+            return ERROR_INVALID_SECURITY_DESCR;
+
+    return 0;
+}
+
+static void security_metacache_dotest(ULONG Flags, PWSTR Prefix, ULONG AceCount, ULONG FileCount)
+{
+    void *memfs = memfs_create(Flags, 60000, 1024, 1024 * 1024);
+
+    PWSTR Sddl;
+    ULONG SddlSize;
+    PSECURITY_DESCRIPTOR SecurityDescriptor;
+    SECURITY_ATTRIBUTES SecurityAttributes = { 0 };
+    static HANDLE Handles[256];
+    HANDLE Threads[4];
+    static SECURITY_METACACHE_DOTEST_DATA Data;
+    BOOLEAN Success;
+    WCHAR FilePath[MAX_PATH];
+    DWORD ExitCode;
+    LONG QueryCount;
+
+    ASSERT(sizeof Handles / sizeof Handles[0] >= FileCount);
+
+    FspFileSystemSetOperation(MemfsFileSystem(memfs), FspFsctlTransactQuerySecurityKind,
+        security_metacache_dotest_query);
+    InterlockedExchange(&security_metacache_dotest_query_count, 0);
+
+    memfs_start_dispatcher(memfs, 0);
+
+    /* the first ACE lets us in; the others only make the descriptor larger */
+    SddlSize = (AceCount + 1) * 64 * sizeof(WCHAR);
+    Sddl = malloc(SddlSize);
+    ASSERT(0 != Sddl);
+    StringCbCopyW(Sddl, SddlSize, L"D:P(A;;GA;;;WD)");
+    for (ULONG I = 1; AceCount > I; I++)
+    {
+        WCHAR Ace[64];
+        StringCbPrintfW(Ace, sizeof Ace, L"(A;;GR;;;S-1-5-21-1-2-3-%u)", I);
+        StringCbCatW(Sddl, SddlSize, Ace);
+    }
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl, SDDL_REVISION_1, &SecurityDescriptor, 0);
+    ASSERT(Success);
+    free(Sddl);
+
+    SecurityAttributes.nLength = sizeof SecurityAttributes;
+    SecurityAttributes.lpSecurityDescriptor = SecurityDescriptor;
+
+    for (ULONG I = 0; FileCount > I; I++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file%u",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs), I);
+
+        Handles[I] = CreateFileW(FilePath,
+            GENERIC_READ | GENERIC_WRITE | WRITE_DAC, FILE_SHARE_READ | FILE_SHARE_WRITE, &SecurityAttributes,
+            CREATE_NEW, FILE_FLAG_DELETE_ON_CLOSE, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handles[I]);
+    }
+
+    /* fill the cache past its limit; keep file0 recently used while doing so */
+    for (ULONG I = 0; FileCount > I; I++)
+    {
+        ASSERT(AceCount == security_metacache_dotest_acecount(Handles[I]));
+        ASSERT(AceCount == security_metacache_dotest_acecount(Handles[0]));
+    }
+    ASSERT(FileCount == (ULONG)security_metacache_dotest_query_count);
+
+    /* the recently used items are still cached */
+    QueryCount = security_metacache_dotest_query_count;
+    ASSERT(AceCount == security_metacache_dotest_acecount(Handles[0]));
+    ASSERT(AceCount == security_metacache_dotest_acecount(Handles[FileCount - 1]));
+    ASSERT(QueryCount == security_metacache_dotest_query_count);
+
+    /* the least recently used item was evicted */
+    ASSERT(AceCount == security_metacache_dotest_acecount(Handles[1]));
+    ASSERT(QueryCount + 1 == security_metacache_dotest_query_count);
+
+    /* items must remain usable by queries in flight while they are evicted or replaced */
+    Data.Handle = Handles[0];
+    Data.AceCount = AceCount;
+    Data.Stop = 0;
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, security_metacache_dotest_thread, &Data, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    for (ULONG Loop = 0; 10 > Loop; Loop++)
+    {
+        for (ULONG I = 1; FileCount > I; I++)
+            ASSERT(AceCount == security_metacache_dotest_acecount(Handles[I]));
+        Success = SetKernelObjectSecurity(Handles[0], DACL_SECURITY_INFORMATION, SecurityDescriptor);
+        ASSERT(Success);
+    }
+    InterlockedExchange(&Data.Stop, 1);
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(0 == ExitCode);
+    }
+
+    for (ULONG I = 0; FileCount > I; I++)
+        CloseHandle(Handles[I]);
+
+    LocalFree(SecurityDescriptor);
+
+    memfs_stop(memfs);
+}
+
+void security_metacache_test(void)
+{
+    /*
+     * The security cache holds at most 100 items and 64K of item buffers.
+     * Small descriptors overflow the item limit; large ones overflow the byte limit.
+     */
+    if (WinFspDiskTests)
+    {
+        security_metacache_dotest(MemfsDisk, 0, 3, 150);
+        security_metacache_dotest(MemfsDisk, 0, 60, 40);
+    }
+    if (WinFspNetTests)
+    {
+        security_metacache_dotest(MemfsNet, L"\\\\memfs\\share", 3, 150);
+        security_metacache_dotest(MemfsNet, L"\\\\memfs\\share", 60, 40);
+    }
+}
+
 void security_tests(void)
 {
     TEST(getsecurity_test);
     TEST(setsecurity_test);
+    TEST(setsecurity_shared_test);
+    TEST(security_metacache_test);
 }
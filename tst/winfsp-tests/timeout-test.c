@@ -132,6 +132,84 @@ void timeout_pending_test(void)
         timeout_pending_dotest(L"WinFsp.Net", L"\\\\winfsp-tests\\share");
 }
 
+typedef struct
+{
+    WCHAR FilePath[MAX_PATH];
+    ULONG Delay;
+    ULONG Elapsed;
+} TIMEOUT_PENDING_MANY_DATA;
+
+static unsigned __stdcall timeout_pending_many_dotest_thread(void *Data0)
+{
+    TIMEOUT_PENDING_MANY_DATA *Data = Data0;
+    HANDLE Handle;
+    DWORD Ticks;
+
+    Sleep(Data->Delay);
+
+    Ticks = GetTickCount();
+    Handle = CreateFileW(Data->FilePath,
+        FILE_GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    Data->Elapsed = GetTickCount() - Ticks;
+    if (INVALID_HANDLE_VALUE == Handle)
+        return GetLastError();
+    CloseHandle(Handle);
+    return 0;
+}
+
+void timeout_pending_many_dotest(PWSTR DeviceName, PWSTR Prefix)
+{
+    NTSTATUS Result;
+    BOOL Success;
+    FSP_FSCTL_VOLUME_PARAMS VolumeParams = { 0 };
+    WCHAR VolumeName[MAX_PATH];
+    HANDLE VolumeHandle;
+    static TIMEOUT_PENDING_MANY_DATA Data[32];
+    HANDLE Threads[32];
+    DWORD ExitCode;
+
+    VolumeParams.TransactTimeout = 10000; /* allow for longer transact timeout to handle MUP redir */
+    VolumeParams.IrpTimeout = FspFsctlIrpTimeoutDebug;
+    VolumeParams.SectorSize = 16384;
+    VolumeParams.VolumeSerialNumber = 0x12345678;
+    wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR), L"\\winfsp-tests\\share");
+    Result = FspFsctlCreateVolume(DeviceName, &VolumeParams,
+        VolumeName, sizeof VolumeName, &VolumeHandle);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(INVALID_HANDLE_VALUE != VolumeHandle);
+
+    /* stagger the requests so that they expire from different timer wheel slots */
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        StringCbPrintfW(Data[I].FilePath, sizeof Data[I].FilePath, L"%s%s\\file%u",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : VolumeName, I);
+        Data[I].Delay = I * 100;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, timeout_pending_many_dotest_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(ERROR_OPERATION_ABORTED == ExitCode);
+        ASSERT(10000 > Data[I].Elapsed);
+    }
+
+    Success = CloseHandle(VolumeHandle);
+    ASSERT(Success);
+}
+
+void timeout_pending_many_test(void)
+{
+    if (WinFspDiskTests)
+        timeout_pending_many_dotest(L"WinFsp.Disk", 0);
+    if (WinFspNetTests)
+        timeout_pending_many_dotest(L"WinFsp.Net", L"\\\\winfsp-tests\\share");
+}
+
 static unsigned __stdcall timeout_transact_dotest_thread(void *FilePath)
 {
     FspDebugLog(__FUNCTION__ ": \"%S\"\n", FilePath);
@@ -246,5 +324,6 @@ void timeout_transact_test(void)
 void timeout_tests(void)
 {
     TEST(timeout_pending_test);
+    TEST(timeout_pending_many_test);
     TEST(timeout_transact_test);
 }
@@ -1,4 +1,5 @@
 #include <tlib/testsuite.h>
+#include <stdlib.h>
 
 #include "winfsp-tests.h"
 
@@ -6,12 +7,24 @@ int NtfsTests = 0;
 int WinFspDiskTests = 1;
 int WinFspNetTests = 1;
 
+static int ulong_compare(const void *p0, const void *p1)
+{
+    ULONG v0 = *(const ULONG *)p0, v1 = *(const ULONG *)p1;
+    return v0 < v1 ? -1 : v0 > v1 ? +1 : 0;
+}
+
+void ulong_sort(PULONG Array, ULONG Count)
+{
+    qsort(Array, Count, sizeof Array[0], ulong_compare);
+}
+
 int main(int argc, char *argv[])
 {
     TESTSUITE(fuse_opt_tests);
     TESTSUITE(posix_tests);
     TESTSUITE(eventlog_tests);
     TESTSUITE(path_tests);
+    TESTSUITE(dirinfo_tests);
     TESTSUITE(mount_tests);
     TESTSUITE(timeout_tests);
     TESTSUITE(memfs_tests);
@@ -1,5 +1,7 @@
 #include <windows.h>
 
+void *memfs_create(ULONG Flags, ULONG FileInfoTimeout, ULONG MaxFileNodes, ULONG MaxFileSize);
+void memfs_start_dispatcher(void *data, PVOID DispatcherParams);
 void *memfs_start_ex(ULONG Flags, ULONG FileInfoTimeout);
 void *memfs_start(ULONG Flags);
 void memfs_stop(void *data);
@@ -9,6 +11,8 @@ extern int NtfsTests;
 extern int WinFspDiskTests;
 extern int WinFspNetTests;
 
+void ulong_sort(PULONG Array, ULONG Count);
+
 //#define CreateFileW HookCreateFileW
 HANDLE HookCreateFileW(
     LPCWSTR lpFileName,